@@ -28,16 +28,19 @@
  * Since fd_set is large on some platforms (8K on AIX 5.2), this probably
  * shouldn't be allocated in automatic storage.  Define USE_POLL and
  * MAX_POLLFDS in the consumer of this header file to use poll state instead of
- * select state.
+ * select state.  In poll state, each fd keeps the slot it was added in until
+ * it is removed, so that it can be found without searching; removed slots are
+ * left in place with a negative fd, which poll ignores.
  */
 struct select_state {
 #ifdef USE_POLL
     struct pollfd fds[MAX_POLLFDS];
+    int nslots;                 /* slots used in fds, including removed ones */
 #else
     int max;
     fd_set rfds, wfds, xfds;
 #endif
-    int nfds;
+    int nfds;                   /* fds currently being watched */
     struct timeval end_time;    /* magic: tv_sec==0 => never time out */
 };
 
@@ -68,6 +71,7 @@ struct conn_state {
     krb5_error_code err;
     enum conn_states state;
     unsigned int is_udp : 1;
+    unsigned int reused : 1;    /* fd came from the context's TCP cache */
     int (*service)(krb5_context context, struct conn_state *,
                    struct select_state *, int);
     int socktype;
@@ -85,6 +89,8 @@ struct conn_state {
     } x;
     krb5_data callback_buffer;
     size_t server_index;
+    struct timeval start_time;  /* When we first contacted it, or zero */
+    int sel_slot;               /* poll state slot of fd, if it is watched */
     struct conn_state *next;
 };
 
@@ -214,6 +214,7 @@ typedef INT64_TYPE krb5_int64;
 #define KRB5_CONF_ENABLE_ONLY                 "enable_only"
 #define KRB5_CONF_EXTRA_ADDRESSES             "extra_addresses"
 #define KRB5_CONF_FORWARDABLE                 "forwardable"
+#define KRB5_CONF_HASH_RCACHE_SYNC            "hash_rcache_sync"
 #define KRB5_CONF_HOST_BASED_SERVICES         "host_based_services"
 #define KRB5_CONF_IGNORE_ACCEPTOR_HOSTNAME    "ignore_acceptor_hostname"
 #define KRB5_CONF_IPROP_ENABLE                "iprop_enable"
@@ -229,10 +230,18 @@ typedef INT64_TYPE krb5_int64;
 #define KRB5_CONF_KDCDEFAULTS                 "kdcdefaults"
 #define KRB5_CONF_KDC_PORTS                   "kdc_ports"
 #define KRB5_CONF_KDC_TCP_PORTS               "kdc_tcp_ports"
+#define KRB5_CONF_KDC_TCP_REUSE               "kdc_tcp_reuse"
 #define KRB5_CONF_MAX_DGRAM_REPLY_SIZE        "kdc_max_dgram_reply_size"
 #define KRB5_CONF_KDC_DEFAULT_OPTIONS         "kdc_default_options"
+#define KRB5_CONF_KDC_KEY_CACHE_ENTRIES       "kdc_key_cache_entries"
+#define KRB5_CONF_KDC_LOOKASIDE_MAX_ENTRIES   "kdc_lookaside_max_entries"
+#define KRB5_CONF_KDC_LOOKASIDE_MAX_SIZE      "kdc_lookaside_max_size"
+#define KRB5_CONF_KDC_LOOKASIDE_SHARED_ENTRIES "kdc_lookaside_shared_entries"
+#define KRB5_CONF_KDC_PRINCIPAL_CACHE_ENTRIES "kdc_principal_cache_entries"
+#define KRB5_CONF_KDC_PRINCIPAL_CACHE_LIFETIME "kdc_principal_cache_lifetime"
 #define KRB5_CONF_KDC_TIMESYNC                "kdc_timesync"
 #define KRB5_CONF_KDC_REQ_CHECKSUM_TYPE       "kdc_req_checksum_type"
+#define KRB5_CONF_KDC_WORKER_REUSEPORT        "kdc_worker_reuseport"
 #define KRB5_CONF_KEY_STASH_FILE              "key_stash_file"
 #define KRB5_CONF_KPASSWD_PORT                "kpasswd_port"
 #define KRB5_CONF_KPASSWD_SERVER              "kpasswd_server"
@@ -244,6 +253,8 @@ typedef INT64_TYPE krb5_int64;
 #define KRB5_CONF_LDAP_SERVERS                "ldap_servers"
 #define KRB5_CONF_LDAP_SERVICE_PASSWORD_FILE  "ldap_service_password_file"
 #define KRB5_CONF_LIBDEFAULTS                 "libdefaults"
+#define KRB5_CONF_LOCKOUT_FLUSH_INTERVAL      "lockout_flush_interval"
+#define KRB5_CONF_LOCKOUT_TABLE_ENTRIES       "lockout_table_entries"
 #define KRB5_CONF_LOGGING                     "logging"
 #define KRB5_CONF_MASTER_KEY_NAME             "master_key_name"
 #define KRB5_CONF_MASTER_KEY_TYPE             "master_key_type"
@@ -265,6 +276,7 @@ typedef INT64_TYPE krb5_int64;
 #define KRB5_CONF_RENEW_LIFETIME              "renew_lifetime"
 #define KRB5_CONF_RESTRICT_ANONYMOUS_TO_TGT   "restrict_anonymous_to_tgt"
 #define KRB5_CONF_SAFE_CHECKSUM_TYPE          "safe_checksum_type"
+#define KRB5_CONF_SHM_RCACHE_ENTRIES          "shm_rcache_entries"
 #define KRB5_CONF_SUPPORTED_ENCTYPES          "supported_enctypes"
 #define KRB5_CONF_TICKET_LIFETIME             "ticket_lifetime"
 #define KRB5_CONF_UDP_PREFERENCE_LIMIT        "udp_preference_limit"
@@ -657,12 +669,18 @@ krb5_encrypt_keyhelper(krb5_context context, krb5_key key,
  * End "los-proto.h"
  */
 
+struct k5_dns_cache;
+struct k5_kdc_prefs;
+struct k5_kdc_conns;
 typedef struct _krb5_os_context {
     krb5_magic              magic;
     krb5_int32              time_offset;
     krb5_int32              usec_offset;
     krb5_int32              os_flags;
     char *                  default_ccname;
+    struct k5_dns_cache *   dns_cache;      /* see lib/krb5/os/dnscache.c */
+    struct k5_kdc_prefs *   kdc_prefs;      /* see lib/krb5/os/kdcpref.c */
+    struct k5_kdc_conns *   kdc_conns;      /* see lib/krb5/os/sendto_kdc.c */
 } *krb5_os_context;
 
 /*
@@ -1935,7 +1953,8 @@ krb5_error_code
 krb5int_make_srv_query_realm(const krb5_data *realm,
                              const char *service,
                              const char *protocol,
-                             struct srv_dns_entry **answers);
+                             struct srv_dns_entry **answers,
+                             int *ttl_out);
 void krb5int_free_srv_dns_data(struct srv_dns_entry *);
 #endif
 
@@ -2552,6 +2571,42 @@ k5alloc(size_t len, krb5_error_code *code)
     return ptr;
 }
 
+/*
+ * FNV-1a hashing, for hash tables keyed by names or principals.  Start with
+ * K5_FNV_INIT and fold data into the hash with the functions below.
+ */
+#define K5_FNV_INIT 2166136261U
+
+static inline krb5_ui_4
+k5_fnv_bytes(krb5_ui_4 h, const void *ptr, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)ptr;
+
+    for (; len > 0; len--)
+        h = (h ^ *p++) * 16777619U;
+    return h;
+}
+
+/* Fold in d and then a separator, so that "a/bc" and "ab/c" differ. */
+static inline krb5_ui_4
+k5_fnv_data(krb5_ui_4 h, const krb5_data *d)
+{
+    h = k5_fnv_bytes(h, d->data, d->length);
+    return (h ^ 0xff) * 16777619U;
+}
+
+/* Fold in the realm and each component of princ. */
+static inline krb5_ui_4
+k5_fnv_princ(krb5_ui_4 h, krb5_const_principal princ)
+{
+    krb5_int32 i;
+
+    h = k5_fnv_data(h, &princ->realm);
+    for (i = 0; i < princ->length; i++)
+        h = k5_fnv_data(h, &princ->data[i]);
+    return h;
+}
+
 krb5_error_code KRB5_CALLCONV
 krb5_get_credentials_for_user(krb5_context context, krb5_flags options,
                               krb5_ccache ccache,
@@ -141,6 +141,11 @@
     TRACE(c, (c, "ccselect choosing default cache {ccache} for server " \
               "principal {princ}", cache, server))
 
+#define TRACE_DNS_SRV_CACHED(c, name)                                   \
+    TRACE(c, (c, "Using cached DNS SRV records for {str}", name))
+#define TRACE_DNS_SRV_CACHED_NONE(c, name)                              \
+    TRACE(c, (c, "Cached DNS lookup found no SRV records for {str}", name))
+
 #define TRACE_FAST_ARMOR_CCACHE(c, ccache_name)                 \
     TRACE(c, (c, "FAST armor ccache: {str}", ccache_name))
 #define TRACE_FAST_ARMOR_CCACHE_KEY(c, keyblock)                        \
@@ -285,6 +290,12 @@
               rlm, (master) ? " (master)" : "", (tcp) ? " (tcp only)" : ""))
 #define TRACE_SENDTO_KDC_MASTER(c, master)                              \
     TRACE(c, (c, "Response was{str} from master KDC", (master) ? "" : " not"))
+#define TRACE_SENDTO_KDC_NO_ANSWER(c, conn)                             \
+    TRACE(c, (c, "No answer from {connstate}; trying other KDCs first", conn))
+#define TRACE_SENDTO_KDC_REORDER(c)                                     \
+    TRACE(c, (c, "Reordering KDCs by recent responsiveness"))
+#define TRACE_SENDTO_KDC_RESOLVE_CACHED(c, hostname)                   \
+    TRACE(c, (c, "Using cached addresses for hostname {str}", hostname))
 #define TRACE_SENDTO_KDC_RESOLVING(c, hostname)         \
     TRACE(c, (c, "Resolving hostname {str}", hostname))
 #define TRACE_SENDTO_KDC_RESPONSE(c, conn)                      \
@@ -293,6 +304,13 @@
     TRACE(c, (c, "Initiating TCP connection to {connstate}", conn))
 #define TRACE_SENDTO_KDC_TCP_DISCONNECT(c, conn)                        \
     TRACE(c, (c, "Terminating TCP connection to {connstate}", conn))
+#define TRACE_SENDTO_KDC_TCP_CACHE(c, conn)                             \
+    TRACE(c, (c, "Keeping TCP connection to {connstate} for reuse", conn))
+#define TRACE_SENDTO_KDC_TCP_REUSE(c, conn)                             \
+    TRACE(c, (c, "Reusing TCP connection to {connstate}", conn))
+#define TRACE_SENDTO_KDC_TCP_RETRY(c, conn)                             \
+    TRACE(c, (c, "Reused TCP connection to {connstate} failed; "        \
+              "reconnecting", conn))
 #define TRACE_SENDTO_KDC_TCP_ERROR_CONNECT(c, conn, err)                \
     TRACE(c, (c, "TCP error connecting to {connstate}: {errno}", conn, err))
 #define TRACE_SENDTO_KDC_TCP_ERROR_RECV(c, conn, err)                   \
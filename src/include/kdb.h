@@ -358,6 +358,19 @@ krb5_error_code krb5_db_get_principal ( krb5_context kcontext,
                                         unsigned int flags,
                                         krb5_db_entry **entry );
 void krb5_db_free_principal ( krb5_context kcontext, krb5_db_entry *entry );
+
+/*
+ * Cache up to max_entries principal entries returned by
+ * krb5_db_get_principal() for up to ttl seconds each.  Cached entries are
+ * discarded when they are modified through kcontext or when the database age
+ * changes.  Intended for read-mostly callers such as the KDC.
+ */
+krb5_error_code krb5_db_enable_principal_cache(krb5_context kcontext,
+                                               unsigned int max_entries,
+                                               krb5_deltat ttl);
+void krb5_db_principal_cache_stats(krb5_context kcontext,
+                                   unsigned long *hits, unsigned long *misses,
+                                   unsigned int *entries);
 krb5_error_code krb5_db_put_principal ( krb5_context kcontext,
                                         krb5_db_entry *entry );
 krb5_error_code krb5_db_delete_principal ( krb5_context kcontext,
@@ -815,6 +828,7 @@ krb5_dbe_free_string(krb5_context, char *);
 
 typedef struct _kdb_vftabl {
     short int maj_ver;
+    /* Methods added after the module's minor version are treated as NULL. */
     short int min_ver;
 
     /*
@@ -1314,6 +1328,19 @@ typedef struct _kdb_vftabl {
                                                  krb5_const_principal client,
                                                  const krb5_db_entry *server,
                                                  krb5_const_principal proxy);
+
+    /* End of minor version 0. */
+
+    /*
+     * Optional: Set *gen to a value which changes whenever the database is
+     * modified, by this process or any other.  The KDB library calls this on
+     * each cached principal lookup to decide whether its cached entries are
+     * still current, so it should be cheap.  Return KRB5_PLUGIN_OP_NOTSUPP if
+     * no such value is available.
+     */
+    krb5_error_code (*get_generation)(krb5_context kcontext, krb5_ui_4 *gen);
+
+    /* End of minor version 1. */
 } kdb_vftabl;
 
 #endif /* !defined(_WIN32) */
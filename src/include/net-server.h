@@ -45,6 +45,7 @@ krb5_error_code loop_add_udp_port(int port);
 krb5_error_code loop_add_tcp_port(int port);
 krb5_error_code loop_add_rpc_service(int port, u_long prognum, u_long versnum,
                                      void (*dispatch)());
+krb5_error_code loop_set_reuseport(int value);
 krb5_error_code loop_setup_routing_socket(verto_ctx *ctx, void *handle,
                                           const char *progname);
 krb5_error_code loop_setup_network(verto_ctx *ctx, void *handle,
@@ -53,6 +54,25 @@ krb5_error_code loop_setup_signals(verto_ctx *ctx, void *handle,
                                    void (*reset)());
 void loop_free(verto_ctx *ctx);
 
+/*
+ * exported from loop-sendto.c
+ *
+ * Send message to a KDC for realm as krb5_sendto_kdc does, without blocking
+ * for replies.  If the exchange begins successfully, callback is later
+ * invoked from ctx with the result; on success, reply is the KDC reply, which
+ * the callback must free, and use_master is set as by krb5_sendto_kdc.
+ * This is for servers within the krb5 tree; other programs can drive the
+ * public krb5_sendto_kdc_async functions it is built on from their own event
+ * loops.
+ */
+typedef void (*loop_sendto_fn)(void *arg, krb5_error_code code,
+                               krb5_data *reply, int use_master);
+krb5_error_code loop_sendto_kdc(verto_ctx *ctx, krb5_context context,
+                                const krb5_data *message,
+                                const krb5_data *realm, int use_master,
+                                int tcp_only, loop_sendto_fn callback,
+                                void *arg);
+
 /* to be supplied by the server application */
 
 /*
@@ -32,7 +32,7 @@
 #include <arpa/inet.h>
 #include <string.h>
 
-static krb5_int32 last_usec = 0, last_os_random = 0;
+static KDC_THREAD_LOCAL krb5_int32 last_usec = 0, last_os_random = 0;
 
 static krb5_error_code make_too_big_error (krb5_data **out);
 
@@ -71,14 +71,12 @@ finish_dispatch_cache(void *arg, krb5_error_code code, krb5_data *response)
     struct dispatch_state *state = arg;
 
 #ifndef NOCACHE
-    /* Remove the null cache entry unless we actually want to discard this
-     * request. */
-    if (code != KRB5KDC_ERR_DISCARD)
-        kdc_remove_lookaside(kdc_context, state->request);
-
-    /* Put the response into the lookaside buffer (if we produced one). */
+    /* Replace the null cache entry with the response if we produced one;
+     * otherwise remove it unless we actually want to discard this request. */
     if (code == 0 && response != NULL)
         kdc_insert_lookaside(state->request, response);
+    else if (code != KRB5KDC_ERR_DISCARD)
+        kdc_remove_lookaside(kdc_context, state->request);
 #endif
 
     finish_dispatch(state, code, response);
@@ -88,6 +86,20 @@ void
 dispatch(void *cb, struct sockaddr *local_saddr,
          const krb5_fulladdr *from, krb5_data *pkt, int is_tcp,
          verto_ctx *vctx, loop_respond_fn respond, void *arg)
+{
+    /* If we have request threads, let one of them process the request. */
+    if (kdc_threads_running()) {
+        kdc_queue_request(local_saddr, from, pkt, is_tcp, respond, arg);
+        return;
+    }
+    kdc_dispatch(local_saddr, from, pkt, is_tcp, vctx, respond, arg);
+}
+
+/* Process a request, in the main loop or in a request thread. */
+void
+kdc_dispatch(struct sockaddr *local_saddr, const krb5_fulladdr *from,
+             krb5_data *pkt, int is_tcp, verto_ctx *vctx,
+             loop_respond_fn respond, void *arg)
 {
     krb5_error_code retval;
     krb5_kdc_req *as_req;
@@ -108,7 +120,8 @@ dispatch(void *cb, struct sockaddr *local_saddr,
     /* decode incoming packet, and dispatch */
 
 #ifndef NOCACHE
-    /* try the replay lookaside buffer */
+    /* Try the replay lookaside buffer.  On a miss, this inserts a NULL entry
+     * to indicate that this request is currently being processed. */
     if (kdc_check_lookaside(pkt, &response)) {
         /* a hit! */
         const char *name = 0;
@@ -131,10 +144,6 @@ dispatch(void *cb, struct sockaddr *local_saddr,
         finish_dispatch(state, response ? 0 : KRB5KDC_ERR_DISCARD, response);
         return;
     }
-
-    /* Insert a NULL entry into the lookaside to indicate that this request
-     * is currently being processed. */
-    kdc_insert_lookaside(pkt, NULL);
 #endif
 
     retval = krb5_crypto_us_timeofday(&now, &now_usec);
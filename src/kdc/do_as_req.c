@@ -106,6 +106,7 @@ struct as_req_state {
     krb5_enc_tkt_part enc_tkt_reply;
     krb5_enc_kdc_rep_part reply_encpart;
     krb5_ticket ticket_reply;
+    krb5_key ticket_key;
     krb5_keyblock server_keyblock;
     krb5_keyblock client_keyblock;
     krb5_db_entry *client;
@@ -178,10 +179,14 @@ finish_process_as_req(struct as_req_state *state, krb5_error_code errcode)
      *
      *  server_keyblock is later used to generate auth data signatures
      */
-    if ((errcode = krb5_dbe_decrypt_key_data(kdc_context, NULL,
-                                             server_key,
-                                             &state->server_keyblock,
-                                             NULL))) {
+    if ((errcode = kdc_get_key(kdc_context, state->server, server_key,
+                               &state->ticket_key))) {
+        state->status = "DECRYPT_SERVER_KEY";
+        goto egress;
+    }
+    if ((errcode = krb5_copy_keyblock_contents(kdc_context,
+                                               &state->ticket_key->keyblock,
+                                               &state->server_keyblock))) {
         state->status = "DECRYPT_SERVER_KEY";
         goto egress;
     }
@@ -210,10 +215,8 @@ finish_process_as_req(struct as_req_state *state, krb5_error_code errcode)
     state->rock.client_key = client_key;
 
     /* convert client.key_data into a real key */
-    if ((errcode = krb5_dbe_decrypt_key_data(kdc_context, NULL,
-                                             client_key,
-                                             &state->client_keyblock,
-                                             NULL))) {
+    if ((errcode = kdc_get_keyblock(kdc_context, state->client, client_key,
+                                    &state->client_keyblock))) {
         state->status = "DECRYPT_CLIENT_KEY";
         goto egress;
     }
@@ -281,8 +284,7 @@ finish_process_as_req(struct as_req_state *state, krb5_error_code errcode)
         goto egress;
     }
 
-    errcode = krb5_encrypt_tkt_part(kdc_context, &state->server_keyblock,
-                                    &state->ticket_reply);
+    errcode = kdc_encrypt_tkt_part(state->ticket_key, &state->ticket_reply);
     if (errcode) {
         state->status = "ENCRYPTING_TICKET";
         goto egress;
@@ -375,6 +377,7 @@ egress:
     if (state->enc_tkt_reply.authorization_data != NULL)
         krb5_free_authdata(kdc_context,
                            state->enc_tkt_reply.authorization_data);
+    krb5_k_free_key(kdc_context, state->ticket_key);
     if (state->server_keyblock.contents != NULL)
         krb5_free_keyblock_contents(kdc_context, &state->server_keyblock);
     if (state->client_keyblock.contents != NULL)
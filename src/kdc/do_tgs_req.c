@@ -96,6 +96,7 @@ process_tgs_req(krb5_data *pkt, const krb5_fulladdr *from,
     int newtransited = 0;
     krb5_error_code retval = 0;
     krb5_keyblock encrypting_key;
+    krb5_key ticket_key = NULL;
     krb5_timestamp kdc_time, authtime = 0;
     krb5_keyblock session_key;
     krb5_timestamp rtime;
@@ -607,6 +608,11 @@ tgt_again:
     if (isflagset(request->kdc_options, KDC_OPT_ENC_TKT_IN_SKEY)) {
         krb5_enc_tkt_part *t2enc = request->second_ticket[st_idx]->enc_part2;
         encrypting_key = *(t2enc->session);
+        if ((errcode = krb5_k_create_key(kdc_context, &encrypting_key,
+                                         &ticket_key))) {
+            status = "CREATE_SESSION_KEY";
+            goto cleanup;
+        }
     } else {
         /*
          * Find the server key
@@ -624,9 +630,14 @@ tgt_again:
          * Convert server.key into a real key
          * (it may be encrypted in the database)
          */
-        if ((errcode = krb5_dbe_decrypt_key_data(kdc_context, NULL,
-                                                 server_key, &encrypting_key,
-                                                 NULL))) {
+        if ((errcode = kdc_get_key(kdc_context, server, server_key,
+                                   &ticket_key))) {
+            status = "DECRYPT_SERVER_KEY";
+            goto cleanup;
+        }
+        if ((errcode = krb5_copy_keyblock_contents(kdc_context,
+                                                   &ticket_key->keyblock,
+                                                   &encrypting_key))) {
             status = "DECRYPT_SERVER_KEY";
             goto cleanup;
         }
@@ -810,8 +821,7 @@ tgt_again:
         ticket_kvno = server_key->key_data_kvno;
     }
 
-    errcode = krb5_encrypt_tkt_part(kdc_context, &encrypting_key,
-                                    &ticket_reply);
+    errcode = kdc_encrypt_tkt_part(ticket_key, &ticket_reply);
     if (!isflagset(request->kdc_options, KDC_OPT_ENC_TKT_IN_SKEY))
         krb5_free_keyblock_contents(kdc_context, &encrypting_key);
     if (errcode) {
@@ -908,6 +918,7 @@ cleanup:
     assert(status != NULL);
     if (reply_key)
         krb5_free_keyblock(kdc_context, reply_key);
+    krb5_k_free_key(kdc_context, ticket_key);
     if (errcode)
         emsg = krb5_get_error_message (kdc_context, errcode);
     log_tgs_req(from, request, &reply, cname, sname, altcname, authtime,
@@ -1078,7 +1089,7 @@ find_alternate_tgs(krb5_kdc_req *request, krb5_db_entry **server_ptr)
         krb5_princ_set_realm(kdc_context, *pl2,
                              krb5_princ_realm(kdc_context, tgs_server));
         retval = krb5_db_get_principal(kdc_context, *pl2, 0, &server);
-        krb5_princ_set_realm(kdc_context, *pl2, &tmp);
+         krb5_princ_set_realm(kdc_context, *pl2, &tmp);
         if (retval == KRB5_KDB_NOENTRY)
             continue;
         else if (retval)
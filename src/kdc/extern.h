@@ -47,6 +47,7 @@ typedef struct __kdc_realm_data {
      * Database per-realm data.
      */
     char *              realm_stash;    /* Stash file name for realm        */
+    char **             realm_db_args;  /* Database module arguments        */
     char *              realm_mpname;   /* Master principal name for realm  */
     krb5_principal      realm_mprinc;   /* Master principal for realm       */
     /*
@@ -72,9 +73,10 @@ typedef struct __kdc_realm_data {
     krb5_boolean        realm_restrict_anon;  /* Anon to local TGT only */
 } kdc_realm_t;
 
-extern kdc_realm_t      **kdc_realmlist;
-extern int              kdc_numrealms;
-extern kdc_realm_t      *kdc_active_realm;
+/* Each request thread has its own realm data. */
+extern KDC_THREAD_LOCAL kdc_realm_t     **kdc_realmlist;
+extern KDC_THREAD_LOCAL int             kdc_numrealms;
+extern KDC_THREAD_LOCAL kdc_realm_t     *kdc_active_realm;
 
 kdc_realm_t *find_realm_data (char *, krb5_ui_4);
 
@@ -518,8 +518,7 @@ client_keys(krb5_context context, krb5_kdcpreauth_rock rock,
         if (krb5_dbe_find_enctype(context, client, request->ktype[i],
                                   -1, 0, &entry_key) != 0)
             continue;
-        if (krb5_dbe_decrypt_key_data(context, NULL, entry_key,
-                                      &key, NULL) != 0)
+        if (kdc_get_keyblock(context, client, entry_key, &key) != 0)
             continue;
         keys[k++] = key;
     }
@@ -77,8 +77,8 @@ enc_ts_verify(krb5_context context, krb5_data *req_pkt, krb5_kdc_req *request,
                                               -1, 0, &client_key)))
             goto cleanup;
 
-        if ((retval = krb5_dbe_decrypt_key_data(context, NULL, client_key,
-                                                &key, NULL)))
+        if ((retval = kdc_get_keyblock(context, rock->client, client_key,
+                                       &key)))
             goto cleanup;
 
         key.enctype = enc_data->enctype;
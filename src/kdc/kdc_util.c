@@ -404,11 +404,17 @@ kdc_get_server_key(krb5_ticket *ticket, unsigned int flags,
         retval = KRB5KDC_ERR_S_PRINCIPAL_UNKNOWN;
         goto errout;
     }
-    if ((*key = (krb5_keyblock *)malloc(sizeof **key))) {
-        retval = krb5_dbe_decrypt_key_data(kdc_context, NULL, server_key,
-                                           *key, NULL);
-    } else
+    *key = malloc(sizeof(**key));
+    if (*key == NULL) {
         retval = ENOMEM;
+        goto errout;
+    }
+    retval = kdc_get_keyblock(kdc_context, server, server_key, *key);
+    if (retval) {
+        free(*key);
+        *key = NULL;
+        goto errout;
+    }
     retval = krb5_c_enctype_compare(kdc_context, ticket->enc_part.enctype,
                                     (*key)->enctype, &similar);
     if (retval)
@@ -426,6 +432,41 @@ errout:
     return retval;
 }
 
+/*
+ * Like krb5_encrypt_tkt_part(), but using a krb5_key, so that derived keys
+ * cached in long-term keys from the key cache are reused.
+ */
+krb5_error_code
+kdc_encrypt_tkt_part(krb5_key key, krb5_ticket *ticket)
+{
+    krb5_error_code retval;
+    krb5_data *scratch;
+    size_t enclen;
+
+    retval = encode_krb5_enc_tkt_part(ticket->enc_part2, &scratch);
+    if (retval)
+        return retval;
+    retval = krb5_c_encrypt_length(kdc_context, key->keyblock.enctype,
+                                   scratch->length, &enclen);
+    if (retval)
+        goto cleanup;
+    ticket->enc_part.ciphertext.data = k5alloc(enclen, &retval);
+    if (ticket->enc_part.ciphertext.data == NULL)
+        goto cleanup;
+    ticket->enc_part.ciphertext.length = enclen;
+    retval = krb5_k_encrypt(kdc_context, key, KRB5_KEYUSAGE_KDC_REP_TICKET, 0,
+                            scratch, &ticket->enc_part);
+    if (retval) {
+        free(ticket->enc_part.ciphertext.data);
+        ticket->enc_part.ciphertext.data = NULL;
+    }
+
+cleanup:
+    zap(scratch->data, scratch->length);
+    krb5_free_data(kdc_context, scratch);
+    return retval;
+}
+
 /* This probably wants to be updated if you support last_req stuff */
 
 static krb5_last_req_entry nolrentry = { KV5M_LAST_REQ_ENTRY, KRB5_LRQ_NONE, 0 };
@@ -2533,4 +2574,6 @@ void reset_for_hangup()
 
     for (k = 0; k < kdc_numrealms; k++)
         krb5_db_refresh_config(kdc_realmlist[k]->realm_context);
+    /* Request threads have their own realm data. */
+    kdc_threads_hangup();
 }
@@ -71,6 +71,9 @@ kdc_get_server_key (krb5_ticket *, unsigned int,
                     krb5_boolean match_enctype,
                     krb5_db_entry **, krb5_keyblock **, krb5_kvno *);
 
+krb5_error_code
+kdc_encrypt_tkt_part(krb5_key, krb5_ticket *);
+
 int
 validate_as_request (krb5_kdc_req *, krb5_db_entry,
                      krb5_db_entry, krb5_timestamp,
@@ -134,6 +137,10 @@ dispatch (void *,
           verto_ctx *,
           loop_respond_fn,
           void *);
+void
+kdc_dispatch(struct sockaddr *local_saddr, const krb5_fulladdr *from,
+             krb5_data *pkt, int is_tcp, verto_ctx *vctx,
+             loop_respond_fn respond, void *arg);
 
 krb5_error_code
 setup_server_realm (krb5_principal);
@@ -231,11 +238,51 @@ handle_authdata (krb5_context context,
                  krb5_enc_tkt_part *enc_tkt_reply);
 
 /* replay.c */
+krb5_error_code kdc_init_lookaside(krb5_context context,
+                                   krb5_int32 max_entries,
+                                   krb5_int32 max_size,
+                                   krb5_int32 shared_entries);
 krb5_boolean kdc_check_lookaside (krb5_data *, krb5_data **);
 void kdc_insert_lookaside (krb5_data *, krb5_data *);
 void kdc_remove_lookaside (krb5_context kcontext, krb5_data *);
+void kdc_lookaside_stats(void);
 void kdc_free_lookaside(krb5_context);
 
+/* keycache.c */
+krb5_error_code kdc_init_keycache(krb5_context context,
+                                  unsigned int max_entries);
+krb5_error_code kdc_get_key(krb5_context context, krb5_db_entry *entry,
+                            krb5_key_data *key_data, krb5_key *key_out);
+krb5_error_code kdc_get_keyblock(krb5_context context, krb5_db_entry *entry,
+                                 krb5_key_data *key_data,
+                                 krb5_keyblock *keyblock_out);
+void kdc_keycache_stats(void);
+void kdc_free_keycache(krb5_context context);
+
+/* threads.c */
+
+/*
+ * Request threads are available if we have thread-local storage for the
+ * per-thread parts of the KDC's state, which are declared KDC_THREAD_LOCAL.
+ */
+#if defined(ENABLE_THREADS) && defined(HAVE_PTHREAD) && defined(HAVE___THREAD)
+#define KDC_REQUEST_THREADS
+#define KDC_THREAD_LOCAL __thread
+#else
+#define KDC_THREAD_LOCAL
+#endif
+
+struct __kdc_realm_data;
+krb5_boolean kdc_threads_running(void);
+krb5_error_code kdc_start_threads(verto_ctx *ctx, int num,
+                                  struct __kdc_realm_data ***realms,
+                                  int nrealms);
+void kdc_stop_threads(void);
+void kdc_queue_request(struct sockaddr *local_addr,
+                       const krb5_fulladdr *from, krb5_data *request,
+                       int is_tcp, loop_respond_fn respond, void *arg);
+void kdc_threads_hangup(void);
+
 /* kdc_util.c */
 void reset_for_hangup(void);
 
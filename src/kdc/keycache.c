@@ -0,0 +1,347 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* kdc/keycache.c - Cache of decrypted long-term keys for the KDC */
+/*
+ * Copyright (C) 2012 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Export of this software from the United States of America may
+ *   require a specific license from the United States Government.
+ *   It is the responsibility of any person or organization contemplating
+ *   export to obtain such a license before exporting.
+ *
+ * WITHIN THAT CONSTRAINT, permission to use, copy, modify, and
+ * distribute this software and its documentation for any purpose and
+ * without fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright notice and
+ * this permission notice appear in supporting documentation, and that
+ * the name of M.I.T. not be used in advertising or publicity pertaining
+ * to distribution of the software without specific, written prior
+ * permission.  Furthermore if you modify this software you must label
+ * your software as modified software and not distribute it in such a
+ * fashion that it might be confused with the original M.I.T. software.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is" without express
+ * or implied warranty.
+ */
+
+/*
+ * The KDC decrypts the same few long-term keys (the local krbtgt key above
+ * all) with the master key for nearly every request.  This file keeps the
+ * decrypted keys around as krb5_key objects, so that both the master key
+ * decryption and the derived keys which the crypto library caches inside each
+ * krb5_key are reused across requests.
+ *
+ * Entries are keyed on the principal name, kvno and enctype of the key data,
+ * and also remember the encrypted key data they were made from.  Since the
+ * KDC has to look up the principal entry for every request anyway, a key
+ * which was changed in the database (or re-encrypted under a new master key)
+ * is noticed by comparing against the encrypted key data and replaced.  The
+ * least recently used entry is evicted when the cache is full.
+ *
+ * Decrypted key contents are moved to pages of their own and locked into
+ * memory where the platform allows it.  They are unlocked when the entry is
+ * discarded, and zeroed by krb5_k_free_key() when the last reference goes
+ * away.
+ *
+ * A krb5_key, including the derived keys cached inside it, must not be used by
+ * more than one thread at a time.  So rather than sharing one cache, each
+ * request thread (see threads.c) owns a cache of its own, created on first
+ * use; so does the main thread when there are no request threads, and each
+ * worker process.  The caches need no locking, except for gathering their
+ * statistics when they are freed.
+ */
+
+#include "k5-int.h"
+#include <syslog.h>
+#include "kdc_util.h"
+#include "adm_proto.h"
+#include <sys/mman.h>
+#ifdef KDC_REQUEST_THREADS
+#include <pthread.h>
+#endif
+
+struct keycache_entry {
+    struct keycache_entry *hash_next;
+    struct keycache_entry *lru_prev;    /* more recently used */
+    struct keycache_entry *lru_next;    /* less recently used */
+    unsigned int hash;
+    krb5_principal princ;
+    krb5_kvno kvno;
+    krb5_enctype enctype;
+    krb5_data enc_key;                  /* encrypted key data */
+    krb5_key key;
+    size_t locked_len;                  /* length of locked key pages */
+};
+
+/* The size of each thread's cache; 0 means the cache is disabled. */
+static unsigned int max_entries;
+
+/* The calling thread's cache. */
+static KDC_THREAD_LOCAL struct keycache_entry **hash_table;
+static KDC_THREAD_LOCAL unsigned int nbuckets;
+static KDC_THREAD_LOCAL unsigned int num_entries;
+static KDC_THREAD_LOCAL struct keycache_entry *lru_head, *lru_tail;
+
+/* Statistics, reported by kdc_keycache_stats().  The totals include the
+ * caches which have been freed. */
+static KDC_THREAD_LOCAL unsigned long hits = 0;
+static KDC_THREAD_LOCAL unsigned long misses = 0;
+static unsigned long total_hits = 0;
+static unsigned long total_misses = 0;
+static unsigned int total_entries = 0;
+#ifdef KDC_REQUEST_THREADS
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Hash a principal name, kvno and enctype. */
+static unsigned int
+hash_key(krb5_const_principal princ, krb5_kvno kvno, krb5_enctype enctype)
+{
+    unsigned char buf[8];
+
+    store_32_be(kvno, buf);
+    store_32_be(enctype, buf + 4);
+    return k5_fnv_bytes(k5_fnv_princ(K5_FNV_INIT, princ), buf, sizeof(buf));
+}
+
+static void
+lru_unlink(struct keycache_entry *e)
+{
+    if (e->lru_prev != NULL)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        lru_head = e->lru_next;
+    if (e->lru_next != NULL)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void
+lru_push(struct keycache_entry *e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = lru_head;
+    if (lru_head != NULL)
+        lru_head->lru_prev = e;
+    lru_head = e;
+    if (lru_tail == NULL)
+        lru_tail = e;
+}
+
+/* Unlink e from the hash table and LRU list and free it. */
+static void
+discard_entry(krb5_context context, struct keycache_entry *e)
+{
+    struct keycache_entry **ep;
+
+    for (ep = &hash_table[e->hash & (nbuckets - 1)]; *ep != e;
+         ep = &(*ep)->hash_next);
+    *ep = e->hash_next;
+    lru_unlink(e);
+    krb5_free_principal(context, e->princ);
+    free(e->enc_key.data);
+    /* Other requests may still hold the key, but need not keep it locked. */
+    if (e->locked_len > 0)
+        (void)munlock(e->key->keyblock.contents, e->locked_len);
+    krb5_k_free_key(context, e->key);
+    free(e);
+    num_entries--;
+}
+
+/*
+ * Try to lock the contents of e's decrypted key into memory.  The contents are
+ * first moved to pages of their own, so that no other allocation is affected
+ * when they are unlocked; krb5_k_free_key() zeroes and frees them as usual.
+ */
+static void
+lock_key(struct keycache_entry *e)
+{
+    krb5_keyblock *kb = &e->key->keyblock;
+    long pagesize = sysconf(_SC_PAGESIZE);
+    size_t len;
+    void *p;
+
+    if (kb->length == 0 || pagesize <= 0)
+        return;
+    len = (kb->length + pagesize - 1) / pagesize * pagesize;
+    if (posix_memalign(&p, pagesize, len) != 0)
+        return;
+    if (mlock(p, len) != 0) {
+        free(p);
+        return;
+    }
+    memcpy(p, kb->contents, kb->length);
+    zapfree(kb->contents, kb->length);
+    kb->contents = p;
+    e->locked_len = len;
+}
+
+/* Decrypt key_data with the master key and wrap it in a krb5_key. */
+static krb5_error_code
+decrypt_key(krb5_context context, krb5_key_data *key_data, krb5_key *key_out)
+{
+    krb5_error_code ret;
+    krb5_keyblock kb;
+
+    ret = krb5_dbe_decrypt_key_data(context, NULL, key_data, &kb, NULL);
+    if (ret)
+        return ret;
+    ret = krb5_k_create_key(context, &kb, key_out);
+    krb5_free_keyblock_contents(context, &kb);
+    return ret;
+}
+
+/* Set the size of the key caches, which are created on first use. */
+krb5_error_code
+kdc_init_keycache(krb5_context context, unsigned int entries)
+{
+    max_entries = entries;
+    return 0;
+}
+
+/* Create the calling thread's cache. */
+static krb5_error_code
+create_table(void)
+{
+    unsigned int n;
+
+    for (n = 1; n < max_entries; n <<= 1);
+    hash_table = calloc(n, sizeof(*hash_table));
+    if (hash_table == NULL)
+        return ENOMEM;
+    nbuckets = n;
+    return 0;
+}
+
+/*
+ * Get a reference to the decrypted form of key_data, which must belong to
+ * entry.  The caller must release the key with krb5_k_free_key().
+ */
+krb5_error_code
+kdc_get_key(krb5_context context, krb5_db_entry *entry,
+            krb5_key_data *key_data, krb5_key *key_out)
+{
+    krb5_error_code ret;
+    struct keycache_entry *e;
+    krb5_kvno kvno = key_data->key_data_kvno;
+    krb5_enctype enctype = key_data->key_data_type[0];
+    krb5_data enc_key = make_data(key_data->key_data_contents[0],
+                                  key_data->key_data_length[0]);
+    unsigned int hash;
+
+    *key_out = NULL;
+    if (max_entries == 0 || (hash_table == NULL && create_table() != 0))
+        return decrypt_key(context, key_data, key_out);
+
+    hash = hash_key(entry->princ, kvno, enctype);
+    for (e = hash_table[hash & (nbuckets - 1)]; e != NULL; e = e->hash_next) {
+        if (e->hash == hash && e->kvno == kvno && e->enctype == enctype &&
+            krb5_principal_compare(context, e->princ, entry->princ))
+            break;
+    }
+    if (e != NULL) {
+        if (data_eq(e->enc_key, enc_key)) {
+            hits++;
+            lru_unlink(e);
+            lru_push(e);
+            krb5_k_reference_key(context, e->key);
+            *key_out = e->key;
+            return 0;
+        }
+        /* The key changed in the database; replace it. */
+        discard_entry(context, e);
+    }
+    misses++;
+
+    e = k5alloc(sizeof(*e), &ret);
+    if (e == NULL)
+        return ret;
+    e->hash = hash;
+    e->kvno = kvno;
+    e->enctype = enctype;
+    e->enc_key.data = k5alloc(enc_key.length ? enc_key.length : 1, &ret);
+    if (e->enc_key.data == NULL)
+        goto error;
+    memcpy(e->enc_key.data, enc_key.data, enc_key.length);
+    e->enc_key.length = enc_key.length;
+    ret = krb5_copy_principal(context, entry->princ, &e->princ);
+    if (ret)
+        goto error;
+    ret = decrypt_key(context, key_data, &e->key);
+    if (ret)
+        goto error;
+    lock_key(e);
+
+    if (num_entries >= max_entries)
+        discard_entry(context, lru_tail);
+    e->hash_next = hash_table[hash & (nbuckets - 1)];
+    hash_table[hash & (nbuckets - 1)] = e;
+    lru_push(e);
+    num_entries++;
+
+    krb5_k_reference_key(context, e->key);
+    *key_out = e->key;
+    return 0;
+
+error:
+    krb5_free_principal(context, e->princ);
+    free(e->enc_key.data);
+    free(e);
+    return ret;
+}
+
+/*
+ * Get a copy of the decrypted form of key_data, which must belong to entry,
+ * as a keyblock.  The caller must free the contents.
+ */
+krb5_error_code
+kdc_get_keyblock(krb5_context context, krb5_db_entry *entry,
+                 krb5_key_data *key_data, krb5_keyblock *keyblock_out)
+{
+    krb5_error_code ret;
+    krb5_key key;
+
+    ret = kdc_get_key(context, entry, key_data, &key);
+    if (ret)
+        return ret;
+    ret = krb5_copy_keyblock_contents(context, &key->keyblock, keyblock_out);
+    krb5_k_free_key(context, key);
+    return ret;
+}
+
+/* Log the statistics of the calling thread's cache and of all caches freed so
+ * far; call after request threads have been stopped. */
+void
+kdc_keycache_stats(void)
+{
+    unsigned long h = total_hits + hits, m = total_misses + misses;
+
+    if (max_entries == 0 || h + m == 0)
+        return;
+    krb5_klog_syslog(LOG_INFO, _("key cache: %lu hits, %lu misses, "
+                                 "%u entries"), h, m,
+                     total_entries + num_entries);
+}
+
+/* Free the calling thread's cache, adding its statistics to the totals. */
+void
+kdc_free_keycache(krb5_context context)
+{
+#ifdef KDC_REQUEST_THREADS
+    pthread_mutex_lock(&stats_lock);
+#endif
+    total_hits += hits;
+    total_misses += misses;
+    total_entries += num_entries;
+#ifdef KDC_REQUEST_THREADS
+    pthread_mutex_unlock(&stats_lock);
+#endif
+    hits = misses = 0;
+    while (lru_head != NULL)
+        discard_entry(context, lru_head);
+    free(hash_table);
+    hash_table = NULL;
+    nbuckets = 0;
+}
@@ -84,8 +84,20 @@ static void initialize_realms (krb5_context, int, char **);
 
 static void finish_realms (void);
 
+#define DEFAULT_PRINC_CACHE_LIFETIME 60
+#define DEFAULT_KEY_CACHE_ENTRIES 1024
+
 static int nofork = 0;
 static int workers = 0;
+static int threads = 0;
+static kdc_realm_t ***thread_realms;
+static krb5_int32 lookaside_max_entries = 0;
+static krb5_int32 lookaside_max_size = 0;
+static krb5_int32 lookaside_shared_entries = 0;
+static krb5_int32 princ_cache_entries = 0;
+static krb5_deltat princ_cache_lifetime = DEFAULT_PRINC_CACHE_LIFETIME;
+static krb5_int32 key_cache_entries = DEFAULT_KEY_CACHE_ENTRIES;
+static krb5_boolean worker_reuseport = FALSE;
 static const char *pid_file = NULL;
 static int rkey_init_done = 0;
 static volatile int signal_received = 0;
@@ -155,12 +167,19 @@ setup_server_realm(krb5_principal sprinc)
 static void
 finish_realm(kdc_realm_t *rdp)
 {
+    int i;
+
     if (rdp->realm_name)
         free(rdp->realm_name);
     if (rdp->realm_mpname)
         free(rdp->realm_mpname);
     if (rdp->realm_stash)
         free(rdp->realm_stash);
+    if (rdp->realm_db_args) {
+        for (i = 0; rdp->realm_db_args[i] != NULL; i++)
+            free(rdp->realm_db_args[i]);
+        free(rdp->realm_db_args);
+    }
     if (rdp->realm_ports)
         free(rdp->realm_ports);
     if (rdp->realm_tcp_ports)
@@ -258,6 +277,31 @@ handle_referral_params(krb5_realm_params *rparams,
     return retval;
 }
 
+/* Make a copy of a null-terminated list of database arguments. */
+static krb5_error_code
+copy_db_args(char **db_args, char ***args_out)
+{
+    char **args;
+    int i, n;
+
+    *args_out = NULL;
+    for (n = 0; db_args != NULL && db_args[n] != NULL; n++);
+    args = calloc(n + 1, sizeof(*args));
+    if (args == NULL)
+        return ENOMEM;
+    for (i = 0; i < n; i++) {
+        args[i] = strdup(db_args[i]);
+        if (args[i] == NULL) {
+            while (--i >= 0)
+                free(args[i]);
+            free(args);
+            return ENOMEM;
+        }
+    }
+    *args_out = args;
+    return 0;
+}
+
 /*
  * Initialize a realm control structure from the alternate profile or from
  * the specified defaults.
@@ -394,12 +438,26 @@ init_realm(kdc_realm_t *rdp, char *realm, char *def_mpname,
     }
 
     /* first open the database  before doing anything */
+    kret = copy_db_args(db_args, &rdp->realm_db_args);
+    if (kret)
+        goto whoops;
     kdb_open_flags = KRB5_KDB_OPEN_RW | KRB5_KDB_SRV_TYPE_KDC;
     if ((kret = krb5_db_open(rdp->realm_context, db_args, kdb_open_flags))) {
         kdc_err(rdp->realm_context, kret,
                 _("while initializing database for realm %s"), realm);
         goto whoops;
     }
+    if (princ_cache_entries > 0) {
+        kret = krb5_db_enable_principal_cache(rdp->realm_context,
+                                              princ_cache_entries,
+                                              princ_cache_lifetime);
+        if (kret) {
+            kdc_err(rdp->realm_context, kret,
+                    _("while initializing principal cache for realm %s"),
+                    realm);
+            goto whoops;
+        }
+    }
 
     /* Assemble and parse the master key name */
     if ((kret = krb5_db_setup_mkey_name(rdp->realm_context, rdp->realm_mpname,
@@ -476,6 +534,113 @@ whoops:
     return(kret);
 }
 
+/* Duplicate a string which may be null. */
+static krb5_error_code
+dup_optional(const char *str, char **out)
+{
+    *out = NULL;
+    if (str == NULL)
+        return 0;
+    *out = strdup(str);
+    return (*out == NULL) ? ENOMEM : 0;
+}
+
+/*
+ * Make a copy of an initialized realm with its own library context and
+ * database handle, for use by a request thread.  The master key is copied
+ * rather than fetched again, so that it is not prompted for.
+ */
+static krb5_error_code
+clone_realm(kdc_realm_t *src, kdc_realm_t **rdp_out)
+{
+    krb5_error_code kret;
+    kdc_realm_t *rdp;
+    const char *realm = src->realm_name;
+
+    *rdp_out = NULL;
+    rdp = calloc(1, sizeof(*rdp));
+    if (rdp == NULL)
+        return ENOMEM;
+    rdp->realm_maxlife = src->realm_maxlife;
+    rdp->realm_maxrlife = src->realm_maxrlife;
+    rdp->realm_reject_bad_transit = src->realm_reject_bad_transit;
+    rdp->realm_restrict_anon = src->realm_restrict_anon;
+    if ((kret = dup_optional(src->realm_name, &rdp->realm_name)) ||
+        (kret = dup_optional(src->realm_profile, &rdp->realm_profile)) ||
+        (kret = dup_optional(src->realm_mpname, &rdp->realm_mpname)) ||
+        (kret = dup_optional(src->realm_stash, &rdp->realm_stash)) ||
+        (kret = dup_optional(src->realm_ports, &rdp->realm_ports)) ||
+        (kret = dup_optional(src->realm_tcp_ports, &rdp->realm_tcp_ports)) ||
+        (kret = dup_optional(src->realm_host_based_services,
+                             &rdp->realm_host_based_services)) ||
+        (kret = dup_optional(src->realm_no_host_referral,
+                             &rdp->realm_no_host_referral)))
+        goto whoops;
+
+    kret = krb5int_init_context_kdc(&rdp->realm_context);
+    if (kret) {
+        kdc_err(NULL, kret, _("while getting context for realm %s"), realm);
+        goto whoops;
+    }
+    kret = krb5_set_default_realm(rdp->realm_context, realm);
+    if (kret) {
+        kdc_err(rdp->realm_context, kret,
+                _("while setting default realm to %s"), realm);
+        goto whoops;
+    }
+    kret = krb5_db_open(rdp->realm_context, src->realm_db_args,
+                        KRB5_KDB_OPEN_RW | KRB5_KDB_SRV_TYPE_KDC);
+    if (kret) {
+        kdc_err(rdp->realm_context, kret,
+                _("while initializing database for realm %s"), realm);
+        goto whoops;
+    }
+    if (princ_cache_entries > 0) {
+        kret = krb5_db_enable_principal_cache(rdp->realm_context,
+                                              princ_cache_entries,
+                                              princ_cache_lifetime);
+        if (kret) {
+            kdc_err(rdp->realm_context, kret,
+                    _("while initializing principal cache for realm %s"),
+                    realm);
+            goto whoops;
+        }
+    }
+
+    kret = krb5_copy_principal(rdp->realm_context, src->realm_mprinc,
+                               &rdp->realm_mprinc);
+    if (kret)
+        goto whoops;
+    kret = krb5_copy_keyblock_contents(rdp->realm_context, &src->realm_mkey,
+                                       &rdp->realm_mkey);
+    if (kret)
+        goto whoops;
+    kret = krb5_db_fetch_mkey_list(rdp->realm_context, rdp->realm_mprinc,
+                                   &rdp->realm_mkey);
+    if (kret) {
+        kdc_err(rdp->realm_context, kret,
+                _("while fetching master keys list for realm %s"), realm);
+        goto whoops;
+    }
+    kret = krb5_ktkdb_resolve(rdp->realm_context, NULL, &rdp->realm_keytab);
+    if (kret) {
+        kdc_err(rdp->realm_context, kret,
+                _("while resolving kdb keytab for realm %s"), realm);
+        goto whoops;
+    }
+    kret = krb5_copy_principal(rdp->realm_context, src->realm_tgsprinc,
+                               &rdp->realm_tgsprinc);
+    if (kret)
+        goto whoops;
+
+    *rdp_out = rdp;
+    return 0;
+
+whoops:
+    finish_realm(rdp);
+    return kret;
+}
+
 static krb5_sigtype
 on_monitor_signal(int signo)
 {
@@ -586,6 +751,20 @@ create_workers(verto_ctx *ctx, int num)
             if (signal_received)
                 exit(0);
 
+            /*
+             * If requested, replace the listener sockets we inherited with
+             * our own, so that the kernel distributes traffic among the
+             * workers instead of waking all of them for each packet.
+             */
+            if (worker_reuseport) {
+                retval = loop_setup_network(ctx, NULL, kdc_progname);
+                if (retval) {
+                    krb5_klog_syslog(LOG_ERR, _("Unable to set up listener "
+                                                "sockets in worker process"));
+                    return retval;
+                }
+            }
+
             /* Return control to main() in the new worker process. */
             free(pids);
             return 0;
@@ -640,6 +819,59 @@ create_workers(verto_ctx *ctx, int num)
     exit(0);
 }
 
+static void
+free_thread_realms()
+{
+    int i, j;
+
+    if (thread_realms == NULL)
+        return;
+    for (i = 0; i < threads; i++) {
+        if (thread_realms[i] == NULL)
+            continue;
+        for (j = 0; j < kdc_numrealms; j++) {
+            if (thread_realms[i][j] != NULL)
+                finish_realm(thread_realms[i][j]);
+        }
+        free(thread_realms[i]);
+    }
+    free(thread_realms);
+    thread_realms = NULL;
+}
+
+/*
+ * Give each of the request threads its own copy of the realm data, and start
+ * them.
+ */
+static krb5_error_code
+start_request_threads(verto_ctx *ctx)
+{
+    krb5_error_code retval;
+    int i, j;
+
+    thread_realms = calloc(threads, sizeof(*thread_realms));
+    if (thread_realms == NULL)
+        return ENOMEM;
+    for (i = 0; i < threads; i++) {
+        thread_realms[i] = calloc(kdc_numrealms, sizeof(kdc_realm_t *));
+        if (thread_realms[i] == NULL) {
+            retval = ENOMEM;
+            goto cleanup;
+        }
+        for (j = 0; j < kdc_numrealms; j++) {
+            retval = clone_realm(kdc_realmlist[j], &thread_realms[i][j]);
+            if (retval)
+                goto cleanup;
+        }
+    }
+    retval = kdc_start_threads(ctx, threads, thread_realms, kdc_numrealms);
+
+cleanup:
+    if (retval)
+        free_thread_realms();
+    return retval;
+}
+
 static krb5_error_code
 setup_sam(void)
 {
@@ -653,7 +885,7 @@ usage(char *name)
             _("usage: %s [-x db_args]* [-d dbpathname] [-r dbrealmname]\n"
               "\t\t[-R replaycachename] [-m] [-k masterenctype]\n"
               "\t\t[-M masterkeyname] [-p port] [-P pid_file]\n"
-              "\t\t[-n] [-w numworkers] [/]\n\n"
+              "\t\t[-n] [-w numworkers] [-t numthreads] [/]\n\n"
               "where,\n"
               "\t[-x db_args]* - Any number of database specific arguments.\n"
               "\t\t\tLook at each database module documentation for "
@@ -698,6 +930,31 @@ initialize_realms(krb5_context kcontext, int argc, char **argv)
         hierarchy[1] = KRB5_CONF_MAX_DGRAM_REPLY_SIZE;
         if (krb5_aprof_get_int32(aprof, hierarchy, TRUE, &max_dgram_reply_size))
             max_dgram_reply_size = MAX_DGRAM_SIZE;
+        hierarchy[1] = KRB5_CONF_KDC_LOOKASIDE_MAX_ENTRIES;
+        if (krb5_aprof_get_int32(aprof, hierarchy, TRUE,
+                                 &lookaside_max_entries))
+            lookaside_max_entries = 0;
+        hierarchy[1] = KRB5_CONF_KDC_LOOKASIDE_MAX_SIZE;
+        if (krb5_aprof_get_int32(aprof, hierarchy, TRUE, &lookaside_max_size))
+            lookaside_max_size = 0;
+        hierarchy[1] = KRB5_CONF_KDC_LOOKASIDE_SHARED_ENTRIES;
+        if (krb5_aprof_get_int32(aprof, hierarchy, TRUE,
+                                 &lookaside_shared_entries))
+            lookaside_shared_entries = 0;
+        hierarchy[1] = KRB5_CONF_KDC_PRINCIPAL_CACHE_ENTRIES;
+        if (krb5_aprof_get_int32(aprof, hierarchy, TRUE,
+                                 &princ_cache_entries))
+            princ_cache_entries = 0;
+        hierarchy[1] = KRB5_CONF_KDC_PRINCIPAL_CACHE_LIFETIME;
+        if (krb5_aprof_get_deltat(aprof, hierarchy, TRUE,
+                                  &princ_cache_lifetime))
+            princ_cache_lifetime = DEFAULT_PRINC_CACHE_LIFETIME;
+        hierarchy[1] = KRB5_CONF_KDC_KEY_CACHE_ENTRIES;
+        if (krb5_aprof_get_int32(aprof, hierarchy, TRUE, &key_cache_entries))
+            key_cache_entries = DEFAULT_KEY_CACHE_ENTRIES;
+        hierarchy[1] = KRB5_CONF_KDC_WORKER_REUSEPORT;
+        if (krb5_aprof_get_boolean(aprof, hierarchy, TRUE, &worker_reuseport))
+            worker_reuseport = FALSE;
         hierarchy[1] = KRB5_CONF_RESTRICT_ANONYMOUS_TO_TGT;
         if (krb5_aprof_get_boolean(aprof, hierarchy, TRUE, &def_restrict_anon))
             def_restrict_anon = FALSE;
@@ -733,7 +990,7 @@ initialize_realms(krb5_context kcontext, int argc, char **argv)
      * Loop through the option list.  Each time we encounter a realm name,
      * use the previously scanned options to fill in for defaults.
      */
-    while ((c = getopt(argc, argv, "x:r:d:mM:k:R:e:P:p:s:nw:4:X3")) != -1) {
+    while ((c = getopt(argc, argv, "x:r:d:mM:k:R:e:P:p:s:nw:t:4:X3")) != -1) {
         switch(c) {
         case 'x':
             db_args_size++;
@@ -820,6 +1077,11 @@ initialize_realms(krb5_context kcontext, int argc, char **argv)
             if (workers <= 0)
                 usage(argv[0]);
             break;
+        case 't':                       /* process requests in threads */
+            threads = atoi(optarg);
+            if (threads <= 0)
+                usage(argv[0]);
+            break;
         case 'k':                       /* enctype for master key */
             if (krb5_string_to_enctype(optarg, &menctype))
                 com_err(argv[0], 0, _("invalid enctype %s"), optarg);
@@ -855,6 +1117,9 @@ initialize_realms(krb5_context kcontext, int argc, char **argv)
         }
     }
 
+    if (workers > 0 && threads > 0)
+        usage(argv[0]);
+
     /*
      * Check to see if we processed any realms.
      */
@@ -916,6 +1181,35 @@ write_pid_file(const char *path)
     return 0;
 }
 
+/* Log principal cache statistics for each realm which uses the cache,
+ * including the caches of the request threads' copies of the realm. */
+static void
+log_princ_cache_stats()
+{
+    unsigned long hits, misses, thits, tmisses;
+    unsigned int entries, tentries;
+    int i, j;
+
+    for (i = 0; i < kdc_numrealms; i++) {
+        krb5_db_principal_cache_stats(kdc_realmlist[i]->realm_context, &hits,
+                                      &misses, &entries);
+        for (j = 0; thread_realms != NULL && j < threads; j++) {
+            if (thread_realms[j] == NULL || thread_realms[j][i] == NULL)
+                continue;
+            krb5_db_principal_cache_stats(thread_realms[j][i]->realm_context,
+                                          &thits, &tmisses, &tentries);
+            hits += thits;
+            misses += tmisses;
+            entries += tentries;
+        }
+        if (hits + misses == 0)
+            continue;
+        krb5_klog_syslog(LOG_INFO, _("principal cache for realm %s: %lu hits, "
+                                     "%lu misses, %u entries"),
+                         kdc_realmlist[i]->realm_name, hits, misses, entries);
+    }
+}
+
 static void
 finish_realms()
 {
@@ -1017,6 +1311,25 @@ int main(int argc, char **argv)
         return 1;
     }
 
+#ifndef NOCACHE
+    retval = kdc_init_lookaside(kcontext, lookaside_max_entries,
+                                lookaside_max_size,
+                                (workers > 0) ? lookaside_shared_entries : 0);
+    if (retval) {
+        kdc_err(kcontext, retval, _("while initializing lookaside cache"));
+        finish_realms();
+        return 1;
+    }
+#endif
+
+    retval = kdc_init_keycache(kcontext, (key_cache_entries > 0) ?
+                               key_cache_entries : 0);
+    if (retval) {
+        kdc_err(kcontext, retval, _("while initializing key cache"));
+        finish_realms();
+        return 1;
+    }
+
     /* Handle each realm's ports */
     for (i=0; i<kdc_numrealms; i++) {
         char *cp = kdc_realmlist[i]->realm_ports;
@@ -1069,6 +1382,14 @@ int main(int argc, char **argv)
             return 1;
         }
     }
+    if (workers > 0 && worker_reuseport) {
+        retval = loop_set_reuseport(1);
+        if (retval) {
+            kdc_err(kcontext, retval, _("while enabling SO_REUSEPORT"));
+            finish_realms();
+            return 1;
+        }
+    }
     if ((retval = loop_setup_network(ctx, NULL, kdc_progname))) {
     net_init_error:
         kdc_err(kcontext, retval, _("while initializing network"));
@@ -1098,16 +1419,32 @@ int main(int argc, char **argv)
         /* We get here only in a worker child process; re-initialize realms. */
         initialize_realms(kcontext, argc, argv);
     }
+    if (threads > 0) {
+        retval = start_request_threads(ctx);
+        if (retval) {
+            kdc_err(kcontext, retval, _("while starting request threads"));
+            finish_realms();
+            return 1;
+        }
+    }
     krb5_klog_syslog(LOG_INFO, _("commencing operation"));
     if (nofork)
         fprintf(stderr, _("%s: starting...\n"), kdc_progname);
 
     verto_run(ctx);
+    kdc_stop_threads();
     loop_free(ctx);
     krb5_klog_syslog(LOG_INFO, _("shutting down"));
+#ifndef NOCACHE
+    kdc_lookaside_stats();
+#endif
+    log_princ_cache_stats();
+    free_thread_realms();
+    kdc_keycache_stats();
     unload_preauth_plugins(kcontext);
     unload_authdata_plugins(kcontext);
     krb5_klog_close(kdc_context);
+    kdc_free_keycache(kcontext);
     finish_realms();
     if (kdc_realmlist)
         free(kdc_realmlist);
@@ -25,162 +25,642 @@
  */
 
 #include "k5-int.h"
+#include <syslog.h>
 #include "kdc_util.h"
 #include "extern.h"
+#include "adm_proto.h"
+#include <sys/mman.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 #ifndef NOCACHE
 
-typedef struct _krb5_kdc_replay_ent {
-    struct _krb5_kdc_replay_ent *next;
+#if defined(ENABLE_THREADS) && defined(HAVE_PTHREAD) && \
+    defined(_POSIX_THREAD_PROCESS_SHARED) && defined(MAP_ANONYMOUS)
+#include <pthread.h>
+#include <signal.h>
+#define SHARED_LOOKASIDE
+#endif
+
+#ifdef KDC_REQUEST_THREADS
+#include <pthread.h>
+/* Protects the local cache, which all request threads share. */
+static pthread_mutex_t lookaside_lock = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK_LOOKASIDE() pthread_mutex_lock(&lookaside_lock)
+#define UNLOCK_LOOKASIDE() pthread_mutex_unlock(&lookaside_lock)
+#else
+#define LOCK_LOOKASIDE()
+#define UNLOCK_LOOKASIDE()
+#endif
+
+/*
+ * The lookaside cache is a hash table keyed on a seeded hash of the request
+ * packet, plus an expiration queue holding the same entries in insertion
+ * order.  Since entries are never refreshed, the head of the queue is always
+ * the oldest (and thus least recently inserted) entry, so both stale entries
+ * and entries evicted to honor the configured limits are taken from there.
+ */
+
+struct entry {
+    struct entry *hash_next;    /* next entry in the same hash bucket */
+    struct entry **hash_pprev;  /* link pointing to this entry */
+    struct entry *queue_next;   /* next (newer) entry in expiration queue */
+    struct entry *queue_prev;   /* previous (older) entry */
     int num_hits;
-    krb5_int32 timein;
-    krb5_data *req_packet;
-    krb5_data *reply_packet;
-} krb5_kdc_replay_ent;
+    krb5_timestamp timein;
+    krb5_data req_packet;
+    krb5_data reply_packet;     /* length 0 while request is in progress */
+    int has_reply;
+};
 
-static krb5_kdc_replay_ent root_ptr = {0};
+#define DEFAULT_LOOKASIDE_HASH_SIZE 16384
+#define DEFAULT_LOOKASIDE_MAX_SIZE (10 * 1024 * 1024)
 
-static int hits = 0;
-static int calls = 0;
+static struct entry **hash_table;
+static unsigned int hash_mask;
+static krb5_ui_4 hash_seed;
+static struct entry *queue_head, *queue_tail;
+
+static size_t max_size = DEFAULT_LOOKASIDE_MAX_SIZE;
+static unsigned int max_entries;        /* 0 means no entry limit */
+
+/* Statistics, reported by kdc_lookaside_stats(). */
+static unsigned long hits = 0;
+static unsigned long calls = 0;
+static unsigned long expirations = 0;
+static unsigned long evictions = 0;
+static unsigned long shared_hits = 0;
 static int max_hits_per_entry = 0;
-static int num_entries = 0;
+static unsigned int num_entries = 0;
+static size_t total_size = 0;
 
-#define STALE_TIME      2*60            /* two minutes */
-#define STALE(ptr) (abs((ptr)->timein - timenow) >= STALE_TIME)
+#define STALE_TIME      (2*60)            /* two minutes */
+#define STALE(ptr, now) (abs((ptr)->timein - (now)) >= STALE_TIME)
 
-#define MATCH(ptr) (((ptr)->req_packet->length == inpkt->length) &&     \
-                    !memcmp((ptr)->req_packet->data, inpkt->data,       \
-                            inpkt->length))
-/* XXX
-   Todo:  quench the size of the queue...
-*/
+/* Return the size of an entry holding the given request and reply. */
+static size_t
+entry_size(const krb5_data *req, const krb5_data *rep)
+{
+    return sizeof(struct entry) + req->length +
+        ((rep == NULL) ? 0 : rep->length);
+}
 
-/* Removes the most recent cache entry for a given packet. */
-void
-kdc_remove_lookaside(krb5_context kcontext, krb5_data *inpkt)
+/* Hash a request packet.  This is the 32-bit variant of MurmurHash3, with a
+ * random seed chosen at startup so that chains can't be forced by a remote
+ * party. */
+static krb5_ui_4
+hash_packet(const krb5_data *pkt)
 {
-    register krb5_kdc_replay_ent *eptr, *last;
+    const unsigned char *p = (unsigned char *)pkt->data;
+    unsigned int len = pkt->length, i;
+    krb5_ui_4 h = hash_seed, k;
+    const krb5_ui_4 c1 = 0xcc9e2d51, c2 = 0x1b873593;
 
-    if (!root_ptr.next)
-        return;
+#define ROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+    for (i = 0; i + 4 <= len; i += 4) {
+        k = load_32_le(p + i);
+        k *= c1;
+        k = ROTL32(k, 15);
+        k *= c2;
+        h ^= k;
+        h = ROTL32(h, 13);
+        h = h * 5 + 0xe6546b64;
+    }
 
-    for (last = &root_ptr, eptr = root_ptr.next;
-         eptr;
-         last = eptr, eptr = eptr->next) {
-        if (!MATCH(eptr))
-            continue;
+    k = 0;
+    switch (len & 3) {
+    case 3:
+        k ^= p[i + 2] << 16;
+        /* fall through */
+    case 2:
+        k ^= p[i + 1] << 8;
+        /* fall through */
+    case 1:
+        k ^= p[i];
+        k *= c1;
+        k = ROTL32(k, 15);
+        k *= c2;
+        h ^= k;
+    }
+#undef ROTL32
 
-        last->next = eptr->next;
-        krb5_free_data(kcontext, eptr->req_packet);
-        krb5_free_data(kcontext, eptr->reply_packet);
-        free(eptr);
-        return;
+    h ^= len;
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+/* Return the entry matching inpkt, or NULL if there isn't one. */
+static struct entry *
+find_entry(const krb5_data *inpkt)
+{
+    struct entry *e;
+
+    for (e = hash_table[hash_packet(inpkt) & hash_mask]; e != NULL;
+         e = e->hash_next) {
+        if (data_eq(e->req_packet, *inpkt))
+            return e;
     }
+    return NULL;
 }
 
-/* return TRUE if outpkt is filled in with a packet to reply with,
-   FALSE if the caller should do the work */
+/* Unlink an entry from the hash table and expiration queue and free it. */
+static void
+discard_entry(struct entry *e)
+{
+    *e->hash_pprev = e->hash_next;
+    if (e->hash_next != NULL)
+        e->hash_next->hash_pprev = e->hash_pprev;
 
-krb5_boolean
-kdc_check_lookaside(krb5_data *inpkt, krb5_data **outpkt)
+    if (e->queue_prev != NULL)
+        e->queue_prev->queue_next = e->queue_next;
+    else
+        queue_head = e->queue_next;
+    if (e->queue_next != NULL)
+        e->queue_next->queue_prev = e->queue_prev;
+    else
+        queue_tail = e->queue_prev;
+
+    max_hits_per_entry = max(max_hits_per_entry, e->num_hits);
+    total_size -= entry_size(&e->req_packet, &e->reply_packet);
+    num_entries--;
+    free(e);
+}
+
+#ifdef SHARED_LOOKASIDE
+
+/*
+ * The optional shared lookaside segment is an anonymous shared mapping
+ * created before the KDC forks its worker processes, so that a retransmit
+ * can be answered by whichever worker receives it.  It is organized as a
+ * set-associative table of fixed-size slots, each set protected by its own
+ * process-shared mutex.  Pointers aren't meaningful across processes, so
+ * slots hold the request and reply inline; pairs which don't fit in a slot
+ * are kept only in the per-process cache.  A slot for a request in progress
+ * records the worker handling it, so that retransmits aren't dropped until
+ * the slot goes stale if that worker dies before replying.
+ */
+
+#define SHM_WAYS 4
+#define SHM_SLOT_DATA 8192
+
+struct shm_slot {
+    int in_use;
+    int has_reply;
+    pid_t owner;                /* process handling the request */
+    krb5_ui_4 hash;
+    krb5_timestamp timein;
+    unsigned int req_len;
+    unsigned int reply_len;
+    char data[SHM_SLOT_DATA];
+};
+
+struct shm_set {
+    pthread_mutex_t lock;
+    struct shm_slot slots[SHM_WAYS];
+};
+
+static struct shm_set *shm_sets;
+static unsigned int shm_nsets;
+static size_t shm_len;
+
+/* Create the shared segment with room for at least nentries entries. */
+static krb5_error_code
+shm_init(unsigned int nentries)
 {
-    krb5_int32 timenow;
-    register krb5_kdc_replay_ent *eptr, *last, *hold;
+    pthread_mutexattr_t attr;
+    unsigned int i, nsets;
+    void *addr;
+    size_t len;
 
-    if (krb5_timeofday(kdc_context, &timenow))
+    for (nsets = 1; nsets * SHM_WAYS < nentries && nsets < (1U << 20);
+         nsets <<= 1);
+    len = nsets * sizeof(struct shm_set);
+
+    addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                -1, 0);
+    if (addr == MAP_FAILED)
+        return errno;
+
+    if (pthread_mutexattr_init(&attr) != 0)
+        goto error;
+    if (pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) != 0) {
+        pthread_mutexattr_destroy(&attr);
+        goto error;
+    }
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETROBUST
+    /* Don't let a worker which dies holding a set lock wedge the others. */
+    if (pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) != 0) {
+        pthread_mutexattr_destroy(&attr);
+        goto error;
+    }
+#endif
+    shm_sets = addr;
+    for (i = 0; i < nsets; i++)
+        pthread_mutex_init(&shm_sets[i].lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    shm_nsets = nsets;
+    shm_len = len;
+    return 0;
+
+error:
+    munmap(addr, len);
+    shm_sets = NULL;
+    return ENOTSUP;
+}
+
+/* Lock set.  If the previous holder died, it may have left a slot half
+ * written, so empty the set before using it. */
+static void
+shm_lock(struct shm_set *set)
+{
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETROBUST
+    int i;
+
+    if (pthread_mutex_lock(&set->lock) == EOWNERDEAD) {
+        for (i = 0; i < SHM_WAYS; i++)
+            set->slots[i].in_use = 0;
+        pthread_mutex_consistent(&set->lock);
+    }
+#else
+    pthread_mutex_lock(&set->lock);
+#endif
+}
+
+/* Return the slot in set matching inpkt, or NULL.  Call with the set
+ * locked. */
+static struct shm_slot *
+shm_find(struct shm_set *set, krb5_ui_4 h, const krb5_data *inpkt)
+{
+    struct shm_slot *slot;
+    int i;
+
+    for (i = 0; i < SHM_WAYS; i++) {
+        slot = &set->slots[i];
+        if (slot->in_use && slot->hash == h &&
+            slot->req_len == inpkt->length &&
+            memcmp(slot->data, inpkt->data, inpkt->length) == 0)
+            return slot;
+    }
+    return NULL;
+}
+
+/* Return true if slot holds a request in progress whose worker has died, so
+ * that no reply will ever be stored for it. */
+static krb5_boolean
+shm_orphaned(const struct shm_slot *slot)
+{
+    return !slot->has_reply && slot->owner != getpid() &&
+        kill(slot->owner, 0) != 0 && errno == ESRCH;
+}
+
+/* Look for inpkt in the shared segment.  Return TRUE and set *outpkt (or
+ * leave it NULL for a request in progress) if found. */
+static krb5_boolean
+shm_check(krb5_context context, const krb5_data *inpkt, krb5_data **outpkt)
+{
+    struct shm_set *set;
+    struct shm_slot *slot;
+    krb5_data d;
+    krb5_timestamp now;
+    krb5_ui_4 h;
+    krb5_boolean found = FALSE;
+
+    if (krb5_timeofday(context, &now))
         return FALSE;
+    h = hash_packet(inpkt);
+    set = &shm_sets[h & (shm_nsets - 1)];
+    shm_lock(set);
+    slot = shm_find(set, h, inpkt);
+    if (slot != NULL && (STALE(slot, now) || shm_orphaned(slot))) {
+        slot->in_use = 0;
+    } else if (slot != NULL) {
+        found = TRUE;
+        if (slot->has_reply) {
+            d = make_data(slot->data + slot->req_len, slot->reply_len);
+            if (krb5_copy_data(context, &d, outpkt) != 0)
+                found = FALSE;
+        }
+    }
+    pthread_mutex_unlock(&set->lock);
+    return found;
+}
 
-    calls++;
+/* Store inpkt and outpkt (which may be NULL) in the shared segment,
+ * replacing any existing entry for inpkt. */
+static void
+shm_insert(krb5_context context, const krb5_data *inpkt,
+           const krb5_data *outpkt)
+{
+    struct shm_set *set;
+    struct shm_slot *slot, *victim = NULL;
+    krb5_timestamp now;
+    krb5_ui_4 h;
+    unsigned int rlen = (outpkt == NULL) ? 0 : outpkt->length;
+    int i;
+
+    if (inpkt->length + rlen > SHM_SLOT_DATA ||
+        krb5_timeofday(context, &now))
+        return;
+    h = hash_packet(inpkt);
+    set = &shm_sets[h & (shm_nsets - 1)];
+    shm_lock(set);
 
-    /* search for a replay entry in the queue, possibly removing
-       stale entries while we're here */
-
-    if (root_ptr.next) {
-        for (last = &root_ptr, eptr = root_ptr.next;
-             eptr;
-             eptr = eptr->next) {
-            if (MATCH(eptr)) {
-                eptr->num_hits++;
-                hits++;
-
-                if (krb5_copy_data(kdc_context, eptr->reply_packet, outpkt))
-                    return FALSE;
-                else
-                    return TRUE;
-                /* return here, don't bother flushing even if it is stale.
-                   if we just matched, we may get another retransmit... */
-            }
-            if (STALE(eptr)) {
-                /* flush it and collect stats */
-                max_hits_per_entry = max(max_hits_per_entry, eptr->num_hits);
-                krb5_free_data(kdc_context, eptr->req_packet);
-                krb5_free_data(kdc_context, eptr->reply_packet);
-                hold = eptr;
-                last->next = eptr->next;
-                eptr = last;
-                free(hold);
-            } else {
-                /* this isn't it, just move along */
-                last = eptr;
-            }
+    /* Reuse a matching slot, else an empty or stale one, else the oldest. */
+    victim = shm_find(set, h, inpkt);
+    for (i = 0; victim == NULL && i < SHM_WAYS; i++) {
+        slot = &set->slots[i];
+        if (!slot->in_use || STALE(slot, now))
+            victim = slot;
+    }
+    if (victim == NULL) {
+        victim = &set->slots[0];
+        for (i = 1; i < SHM_WAYS; i++) {
+            if (set->slots[i].timein < victim->timein)
+                victim = &set->slots[i];
         }
     }
-    return FALSE;
+
+    victim->in_use = 1;
+    victim->hash = h;
+    victim->timein = now;
+    victim->req_len = inpkt->length;
+    memcpy(victim->data, inpkt->data, inpkt->length);
+    victim->has_reply = (outpkt != NULL);
+    victim->owner = getpid();
+    victim->reply_len = rlen;
+    if (outpkt != NULL)
+        memcpy(victim->data + inpkt->length, outpkt->data, rlen);
+    pthread_mutex_unlock(&set->lock);
 }
 
-/* insert a request & reply into the lookaside queue.  assumes it's not
-   already there, and can fail softly due to other weird errors. */
+/* Remove any shared entry for inpkt. */
+static void
+shm_remove(const krb5_data *inpkt)
+{
+    struct shm_set *set;
+    struct shm_slot *slot;
+    krb5_ui_4 h;
 
-void
-kdc_insert_lookaside(krb5_data *inpkt, krb5_data *outpkt)
+    h = hash_packet(inpkt);
+    set = &shm_sets[h & (shm_nsets - 1)];
+    shm_lock(set);
+    slot = shm_find(set, h, inpkt);
+    if (slot != NULL)
+        slot->in_use = 0;
+    pthread_mutex_unlock(&set->lock);
+}
+
+#endif /* SHARED_LOOKASIDE */
+
+/*
+ * Set up the lookaside cache, limiting it to max_entries_in entries (if
+ * nonzero) and max_size_in bytes (or a default limit if zero).  If
+ * shared_entries is positive, also create a shared segment with room for
+ * that many entries, which will be inherited by worker processes.  If this is
+ * not called, the lookaside cache is disabled.
+ */
+krb5_error_code
+kdc_init_lookaside(krb5_context context, krb5_int32 max_entries_in,
+                   krb5_int32 max_size_in, krb5_int32 shared_entries)
+{
+    krb5_error_code ret;
+    krb5_data seed;
+    unsigned int nbuckets;
+
+    if (hash_table != NULL)
+        return 0;
+
+    max_entries = (max_entries_in > 0) ? max_entries_in : 0;
+    max_size = (max_size_in > 0) ? (size_t)max_size_in :
+        DEFAULT_LOOKASIDE_MAX_SIZE;
+
+    /* Use a power of two number of buckets, aiming for short chains. */
+    nbuckets = DEFAULT_LOOKASIDE_HASH_SIZE;
+    if (max_entries > 0) {
+        for (nbuckets = 256; nbuckets < max_entries && nbuckets < (1U << 24);
+             nbuckets <<= 1);
+    }
+
+    seed = make_data(&hash_seed, sizeof(hash_seed));
+    ret = krb5_c_random_make_octets(context, &seed);
+    if (ret)
+        return ret;
+
+    if (shared_entries > 0) {
+#ifdef SHARED_LOOKASIDE
+        ret = shm_init(shared_entries);
+        if (ret)
+            return ret;
+#else
+        krb5_klog_syslog(LOG_WARNING, _("shared lookaside cache not supported "
+                                        "on this platform; ignoring %s"),
+                         KRB5_CONF_KDC_LOOKASIDE_SHARED_ENTRIES);
+#endif
+    }
+
+    hash_table = calloc(nbuckets, sizeof(*hash_table));
+    if (hash_table == NULL)
+        return ENOMEM;
+    hash_mask = nbuckets - 1;
+    return 0;
+}
+
+/* Remove the local and shared entries for inpkt.  Call with the lookaside
+ * lock held. */
+static void
+remove_entry(krb5_data *inpkt)
 {
-    register krb5_kdc_replay_ent *eptr;
-    krb5_int32 timenow;
+    struct entry *e;
+
+    e = find_entry(inpkt);
+    if (e != NULL)
+        discard_entry(e);
+
+#ifdef SHARED_LOOKASIDE
+    if (shm_sets != NULL)
+        shm_remove(inpkt);
+#endif
+}
+
+/* Insert a request and reply (NULL for a request in progress), replacing any
+ * existing entry for the request.  Fails softly due to other weird errors.
+ * Call with the lookaside lock held. */
+static void
+insert_entry(krb5_data *inpkt, krb5_data *outpkt)
+{
+    struct entry *e, **bucket;
+    krb5_timestamp timenow;
+    size_t esize = entry_size(inpkt, outpkt);
 
     if (krb5_timeofday(kdc_context, &timenow))
         return;
 
-    /* this is a new entry */
-    eptr = (krb5_kdc_replay_ent *)calloc(1, sizeof(*eptr));
-    if (!eptr)
-        return;
-    eptr->timein = timenow;
-    /*
-     * This is going to hurt a lot malloc()-wise due to the need to
-     * allocate memory for the krb5_data and krb5_address elements.
-     * ARGH!
-     */
-    if (krb5_copy_data(kdc_context, inpkt, &eptr->req_packet)) {
-        free(eptr);
+    e = find_entry(inpkt);
+    if (e != NULL)
+        discard_entry(e);
+
+#ifdef SHARED_LOOKASIDE
+    if (shm_sets != NULL)
+        shm_insert(kdc_context, inpkt, outpkt);
+#endif
+
+    /* Don't evict other entries to make room for one which can't fit. */
+    if (esize > max_size)
         return;
+
+    /* Purge stale entries and enforce the configured limits, oldest first. */
+    while (queue_head != NULL &&
+           (STALE(queue_head, timenow) || total_size + esize > max_size ||
+            (max_entries > 0 && num_entries >= max_entries))) {
+        if (STALE(queue_head, timenow))
+            expirations++;
+        else
+            evictions++;
+        discard_entry(queue_head);
     }
-    if (krb5_copy_data(kdc_context, outpkt, &eptr->reply_packet)) {
-        krb5_free_data(kdc_context, eptr->req_packet);
-        free(eptr);
+
+    /* Allocate the entry and both packets in one block. */
+    e = calloc(1, esize);
+    if (e == NULL)
         return;
+    e->timein = timenow;
+    e->req_packet = make_data((char *)(e + 1), inpkt->length);
+    memcpy(e->req_packet.data, inpkt->data, inpkt->length);
+    if (outpkt != NULL) {
+        e->reply_packet = make_data(e->req_packet.data + inpkt->length,
+                                    outpkt->length);
+        memcpy(e->reply_packet.data, outpkt->data, outpkt->length);
+        e->has_reply = 1;
     }
-    eptr->next = root_ptr.next;
-    root_ptr.next = eptr;
+
+    bucket = &hash_table[hash_packet(inpkt) & hash_mask];
+    e->hash_next = *bucket;
+    if (*bucket != NULL)
+        (*bucket)->hash_pprev = &e->hash_next;
+    e->hash_pprev = bucket;
+    *bucket = e;
+
+    e->queue_prev = queue_tail;
+    if (queue_tail != NULL)
+        queue_tail->queue_next = e;
+    else
+        queue_head = e;
+    queue_tail = e;
+
     num_entries++;
-    return;
+    total_size += esize;
 }
 
-/* frees memory associated with the lookaside queue for memory profiling */
+/* Removes the most recent cache entry for a given packet. */
 void
-kdc_free_lookaside(krb5_context kcontext)
+kdc_remove_lookaside(krb5_context kcontext, krb5_data *inpkt)
 {
-    register krb5_kdc_replay_ent *eptr, *last, *hold;
-    if (root_ptr.next) {
-        for (last = &root_ptr, eptr = root_ptr.next;
-             eptr; eptr = eptr->next) {
-            krb5_free_data(kcontext, eptr->req_packet);
-            krb5_free_data(kcontext, eptr->reply_packet);
-            hold = eptr;
-            last->next = eptr->next;
-            eptr = last;
-            free(hold);
+    if (hash_table == NULL)
+        return;
+
+    LOCK_LOOKASIDE();
+    remove_entry(inpkt);
+    UNLOCK_LOOKASIDE();
+}
+
+/*
+ * Return TRUE if outpkt is filled in with a packet to reply with (or left
+ * NULL if the request is still being processed).  Otherwise record that the
+ * request is in progress, so that retransmits of it are dropped, and return
+ * FALSE to tell the caller to do the work.  Both happen under one lock, so
+ * that only one request thread processes a request.
+ */
+krb5_boolean
+kdc_check_lookaside(krb5_data *inpkt, krb5_data **outpkt)
+{
+    struct entry *e;
+    krb5_boolean found = TRUE;
+
+    *outpkt = NULL;
+    if (hash_table == NULL)
+        return FALSE;
+
+    LOCK_LOOKASIDE();
+    calls++;
+
+    /* Don't bother checking for staleness here; stale entries are flushed
+     * on insertion, and if we just matched we may get another retransmit. */
+    e = find_entry(inpkt);
+    if (e == NULL) {
+#ifdef SHARED_LOOKASIDE
+        /* Another worker process may have seen this request. */
+        if (shm_sets != NULL && shm_check(kdc_context, inpkt, outpkt)) {
+            hits++;
+            shared_hits++;
+            UNLOCK_LOOKASIDE();
+            return TRUE;
         }
+#endif
+        insert_entry(inpkt, NULL);
+        UNLOCK_LOOKASIDE();
+        return FALSE;
     }
+
+    e->num_hits++;
+    hits++;
+
+    /* Leave *outpkt NULL for an entry whose request is in progress. */
+    if (e->has_reply &&
+        krb5_copy_data(kdc_context, &e->reply_packet, outpkt) != 0)
+        found = FALSE;
+    UNLOCK_LOOKASIDE();
+    return found;
+}
+
+/* Insert a request and its reply into the lookaside cache, replacing the
+ * entry made for it while it was in progress. */
+void
+kdc_insert_lookaside(krb5_data *inpkt, krb5_data *outpkt)
+{
+    if (hash_table == NULL)
+        return;
+
+    LOCK_LOOKASIDE();
+    insert_entry(inpkt, outpkt);
+    UNLOCK_LOOKASIDE();
+}
+
+/* Log statistics for the lookaside cache. */
+void
+kdc_lookaside_stats(void)
+{
+    if (hash_table == NULL)
+        return;
+    krb5_klog_syslog(LOG_INFO, _("lookaside cache: %lu hits (%lu shared) in "
+                                 "%lu calls, %u entries (%lu bytes), "
+                                 "%lu expired, %lu evicted, "
+                                 "max %d hits per entry"),
+                     hits, shared_hits, calls, num_entries,
+                     (unsigned long)total_size, expirations, evictions,
+                     max_hits_per_entry);
+}
+
+/* frees memory associated with the lookaside queue for memory profiling */
+void
+kdc_free_lookaside(krb5_context kcontext)
+{
+    while (queue_head != NULL)
+        discard_entry(queue_head);
+    free(hash_table);
+    hash_table = NULL;
+
+#ifdef SHARED_LOOKASIDE
+    /* Only unmap; other worker processes may still be using the mutexes. */
+    if (shm_sets != NULL)
+        munmap(shm_sets, shm_len);
+    shm_sets = NULL;
+#endif
 }
 
 #endif /* NOCACHE */
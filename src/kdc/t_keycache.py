@@ -0,0 +1,40 @@
+#!/usr/bin/python
+from k5test import *
+import re
+
+# The key cache is enabled by default.  Make sure the KDC notices when a
+# cached key is replaced by a new key with the same kvno.
+realm = K5Realm(start_kadmind=False)
+realm.run_as_client([kvno, '-k', realm.keytab, realm.host_princ])
+realm.run_kadminl('delprinc -force %s' % realm.host_princ)
+realm.addprinc(realm.host_princ)
+keytab2 = os.path.join(realm.testdir, 'keytab2')
+realm.extract_keytab(realm.host_princ, keytab2)
+realm.kinit(realm.user_princ, password('user'))
+realm.run_as_client([kvno, '-k', keytab2, realm.host_princ])
+realm.stop()
+
+# Use a cache with room for a single key, so that keys are evicted in
+# every exchange.
+conf = {'all': {'kdcdefaults': {'kdc_key_cache_entries': '1'}}}
+realm = K5Realm(start_kadmind=False, kdc_conf=conf)
+realm.run_as_client([kvno, '-k', realm.keytab, realm.host_princ])
+realm.kinit(realm.user_princ, password('user'))
+realm.run_as_client([kvno, '-k', realm.keytab, realm.host_princ])
+realm.stop()
+
+# With request threads, each thread has its own cache.  The statistics
+# of all of them must be logged when the KDC exits.
+realm = K5Realm(start_kdc=False, start_kadmind=False)
+realm.start_kdc(['-t', '2'])
+for i in range(4):
+    realm.kinit(realm.user_princ, password('user'))
+realm.stop_kdc()
+f = open(os.path.join(realm.testdir, 'kdc.log'))
+log = f.read()
+f.close()
+m = re.search(r'key cache: (\d+) hits, (\d+) misses', log)
+if not m or int(m.group(1)) + int(m.group(2)) < 8:
+    fail('Key cache statistics of request threads not logged')
+
+success('KDC key cache')
@@ -1,8 +1,162 @@
 #!/usr/bin/python
 from k5test import *
+import re
+import socket
 
 realm = K5Realm(start_kdc=False, start_kadmind=False, create_host=False)
 realm.start_kdc(['-w', '3'])
 realm.kinit(realm.user_princ, password('user'))
 realm.klist(realm.user_princ)
-success('KDC worker processes')
+realm.stop()
+
+# Run the workers with a shared lookaside cache.
+conf = {'all': {'kdcdefaults': {'kdc_lookaside_shared_entries': '1024'}}}
+realm = K5Realm(start_kdc=False, start_kadmind=False, create_host=False,
+                kdc_conf=conf)
+realm.start_kdc(['-w', '3'])
+realm.kinit(realm.user_princ, password('user'))
+realm.klist(realm.user_princ)
+realm.run_as_client([kvno, realm.krbtgt_princ])
+realm.stop()
+
+# Run the workers with their own SO_REUSEPORT listener sockets.
+conf = {'all': {'kdcdefaults': {'kdc_worker_reuseport': 'true'}}}
+realm = K5Realm(start_kdc=False, start_kadmind=False, create_host=False,
+                kdc_conf=conf)
+realm.start_kdc(['-w', '3'])
+for i in range(10):
+    realm.kinit(realm.user_princ, password('user'))
+    realm.run_as_client([kvno, realm.krbtgt_princ])
+realm.klist(realm.user_princ)
+realm.stop()
+
+# Encode a minimal AS-REQ for the user principal, so that we can send the
+# same request packet from several source ports.
+def der(tag, body):
+    n = len(body)
+    if n < 128:
+        return chr(tag) + chr(n) + body
+    lenbytes = ''
+    while n > 0:
+        lenbytes = chr(n & 0xff) + lenbytes
+        n >>= 8
+    return chr(tag) + chr(0x80 | len(lenbytes)) + lenbytes + body
+
+def der_int(v):
+    b = chr(v & 0xff)
+    v >>= 8
+    while v > 0:
+        b = chr(v & 0xff) + b
+        v >>= 8
+    if ord(b[0]) & 0x80:
+        b = '\0' + b
+    return der(0x02, b)
+
+def der_seq(*items):
+    return der(0x30, ''.join(items))
+
+def der_ctx(n, body):
+    return der(0xa0 + n, body)
+
+def der_princ(nametype, *components):
+    names = [der(0x1b, c) for c in components]
+    return der_seq(der_ctx(0, der_int(nametype)), der_ctx(1, der_seq(*names)))
+
+def as_req(realmname, nonce=12345):
+    body = der_seq(der_ctx(0, der(0x03, '\0\0\0\0\0')),
+                   der_ctx(1, der_princ(1, 'user')),
+                   der_ctx(2, der(0x1b, realmname)),
+                   der_ctx(3, der_princ(2, 'krbtgt', realmname)),
+                   der_ctx(5, der(0x18, '20370101000000Z')),
+                   der_ctx(7, der_int(nonce)),
+                   der_ctx(8, der_seq(der_int(18), der_int(17))))
+    return der(0x6a, der_seq(der_ctx(1, der_int(5)), der_ctx(2, der_int(10)),
+                             der_ctx(4, body)))
+
+# Send num different AS requests from different sockets, each repeat times,
+# in one burst without waiting for replies.  Return the list of replies
+# received on each socket.
+def udp_burst(realm, num, repeat):
+    socks = []
+    for i in range(num):
+        s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        s.settimeout(5)
+        socks.append(s)
+    for attempt in range(repeat):
+        for i, s in enumerate(socks):
+            s.sendto(as_req(realm.realm, 1000 + i),
+                     ('127.0.0.1', realm.portbase))
+    result = []
+    for s in socks:
+        replies = [s.recv(4096)]
+        s.settimeout(0.2)
+        try:
+            while True:
+                replies.append(s.recv(4096))
+        except socket.timeout:
+            pass
+        s.close()
+        result.append(replies)
+    return result
+
+# Several datagrams are waiting when a single-process KDC wakes up for a
+# burst, so the network code receives them in batches (with recvmmsg()
+# where available).  Every request must be answered.
+realm = K5Realm(start_kdc=False, start_kadmind=False, create_host=False)
+realm.start_kdc()
+for replies in udp_burst(realm, 50, 1):
+    if len(replies) != 1:
+        fail('Expected one reply to each request in a burst')
+realm.stop()
+
+# With a shared lookaside cache and per-worker SO_REUSEPORT sockets,
+# retransmits arriving from different source ports are spread across the
+# workers, so some of them must be answered from an entry inserted by a
+# different worker.
+conf = {'all': {'kdcdefaults': {'kdc_lookaside_shared_entries': '1024',
+                                'kdc_worker_reuseport': 'true'}}}
+realm = K5Realm(start_kdc=False, start_kadmind=False, create_host=False,
+                kdc_conf=conf)
+realm.start_kdc(['-w', '3'])
+pkt = as_req(realm.realm)
+replies = []
+for i in range(30):
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.settimeout(1)
+    # Retransmit like a client would, in case the packet was queued on a
+    # supervisor socket just before it was closed.
+    for attempt in range(5):
+        s.sendto(pkt, ('127.0.0.1', realm.portbase))
+        try:
+            replies.append(s.recv(4096))
+            break
+        except socket.timeout:
+            pass
+    s.close()
+if len(replies) != 30 or len(set(replies)) != 1:
+    fail('Retransmitted request received different replies')
+realm.stop()
+f = open(os.path.join(realm.testdir, 'kdc.log'))
+log = f.read()
+f.close()
+shared = [int(n) for n in re.findall(r'hits \((\d+) shared\)', log)]
+if len(shared) != 3 or sum(shared) == 0:
+    fail('Lookaside hit from another worker not seen')
+
+# Process requests in threads within one KDC process.
+conf = {'all': {'kdcdefaults': {'kdc_principal_cache_entries': '100'}}}
+realm = K5Realm(start_kdc=False, start_kadmind=False, create_host=False,
+                kdc_conf=conf)
+realm.start_kdc(['-t', '4'])
+for i in range(10):
+    realm.kinit(realm.user_princ, password('user'))
+    realm.run_as_client([kvno, realm.user_princ])
+realm.klist(realm.user_princ)
+
+# Send a burst of different requests, each several times, so that the
+# threads process them concurrently.  Each request must be answered, and
+# retransmits of it must get the same reply or none.
+for replies in udp_burst(realm, 20, 3):
+    if len(set(replies)) != 1:
+        fail('Concurrent retransmits received different replies')
+success('KDC worker processes and threads')
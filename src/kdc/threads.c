@@ -0,0 +1,393 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* kdc/threads.c - Request processing threads for the KDC */
+/*
+ * Copyright (C) 2012 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Export of this software from the United States of America may
+ *   require a specific license from the United States Government.
+ *   It is the responsibility of any person or organization contemplating
+ *   export to obtain such a license before exporting.
+ *
+ * WITHIN THAT CONSTRAINT, permission to use, copy, modify, and
+ * distribute this software and its documentation for any purpose and
+ * without fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright notice and
+ * this permission notice appear in supporting documentation, and that
+ * the name of M.I.T. not be used in advertising or publicity pertaining
+ * to distribution of the software without specific, written prior
+ * permission.  Furthermore if you modify this software you must label
+ * your software as modified software and not distribute it in such a
+ * fashion that it might be confused with the original M.I.T. software.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is" without express
+ * or implied warranty.
+ */
+
+/*
+ * When the KDC is started with request threads, the main loop thread only
+ * does network I/O.  dispatch() places each request on a queue, a request
+ * thread processes it, and the reply is handed back to the main loop through
+ * a pipe.
+ *
+ * Requests are processed concurrently.  The realm globals (kdc_realmlist,
+ * kdc_active_realm) are thread-local, and each request thread has its own
+ * copy of the realm data, with its own library context and database handle,
+ * so database lookups in different threads do not contend.  The key cache is
+ * also per-thread.  The lookaside cache is shared and has its own lock.
+ * Preauth and authdata modules are loaded once and may be called from several
+ * threads at once, so a module must protect any module data it modifies while
+ * processing requests.
+ */
+
+#include "k5-int.h"
+#include <syslog.h>
+#include "kdc_util.h"
+#include "extern.h"
+#include "adm_proto.h"
+
+#ifdef KDC_REQUEST_THREADS
+
+#include <pthread.h>
+#include <signal.h>
+
+struct request_thread {
+    pthread_t tid;
+    verto_ctx *vctx;                    /* for asynchronous preauth */
+    kdc_realm_t **realms;
+    int nrealms;
+    unsigned int hangup_count;          /* last hangup seen by this thread */
+    int done;                           /* current request has been answered */
+};
+
+struct request_job {
+    struct request_job *next;
+    struct sockaddr *local_addr;
+    const krb5_fulladdr *from;
+    krb5_data *request;
+    int is_tcp;
+    loop_respond_fn respond;
+    void *arg;
+    struct request_thread *thread;
+    krb5_error_code code;
+    krb5_data *response;
+};
+
+/* Requests waiting for a thread, and the number of SIGHUPs received. */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct request_job *queue_head, *queue_tail;
+static int stopping;
+static unsigned int hangup_count;
+
+/* Answered requests waiting for the main loop. */
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct request_job *done_head, *done_tail;
+static int done_pipe[2] = { -1, -1 };
+static verto_ev *done_ev;
+
+static struct request_thread *threads;
+static int nthreads;
+
+static void
+append_job(struct request_job **head, struct request_job **tail,
+           struct request_job *job)
+{
+    job->next = NULL;
+    if (*tail != NULL)
+        (*tail)->next = job;
+    else
+        *head = job;
+    *tail = job;
+}
+
+/* Respond callback for a request processed by a thread.  Pass the reply to
+ * the main loop. */
+static void
+finish_job(void *arg, krb5_error_code code, krb5_data *response)
+{
+    struct request_job *job = arg;
+
+    job->code = code;
+    job->response = response;
+    job->thread->done = 1;
+
+    pthread_mutex_lock(&done_lock);
+    append_job(&done_head, &done_tail, job);
+    pthread_mutex_unlock(&done_lock);
+    /* If the pipe is full, the main loop has a wakeup pending anyway. */
+    (void)write(done_pipe[1], "", 1);
+}
+
+static void *
+request_thread_main(void *ptr)
+{
+    struct request_thread *t = ptr;
+    struct request_job *job;
+    unsigned int hangups;
+    int i;
+
+    kdc_realmlist = t->realms;
+    kdc_numrealms = t->nrealms;
+    kdc_active_realm = t->realms[0];
+
+    for (;;) {
+        pthread_mutex_lock(&queue_lock);
+        while (queue_head == NULL && !stopping)
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        if (stopping) {
+            pthread_mutex_unlock(&queue_lock);
+            break;
+        }
+        job = queue_head;
+        queue_head = job->next;
+        if (queue_head == NULL)
+            queue_tail = NULL;
+        hangups = hangup_count;
+        pthread_mutex_unlock(&queue_lock);
+
+        if (t->hangup_count != hangups) {
+            for (i = 0; i < t->nrealms; i++)
+                krb5_db_refresh_config(t->realms[i]->realm_context);
+            t->hangup_count = hangups;
+        }
+
+        job->thread = t;
+        t->done = 0;
+        kdc_dispatch(job->local_addr, job->from, job->request, job->is_tcp,
+                     t->vctx, finish_job, job);
+        /* A preauth module may complete the request asynchronously using
+         * events in our verto context.  Run it until the reply is ready. */
+        while (!t->done)
+            verto_run_once(t->vctx);
+    }
+    kdc_free_keycache(t->realms[0]->realm_context);
+    return NULL;
+}
+
+/* Deliver the replies from request threads in the main loop. */
+static void
+process_done(verto_ctx *ctx, verto_ev *ev)
+{
+    struct request_job *list, *job;
+    char buf[256];
+
+    while (read(done_pipe[0], buf, sizeof(buf)) > 0);
+    pthread_mutex_lock(&done_lock);
+    list = done_head;
+    done_head = done_tail = NULL;
+    pthread_mutex_unlock(&done_lock);
+
+    while ((job = list) != NULL) {
+        list = job->next;
+        (*job->respond)(job->arg, job->code, job->response);
+        free(job);
+    }
+}
+
+static void
+free_jobs(struct request_job *list)
+{
+    struct request_job *job;
+
+    while ((job = list) != NULL) {
+        list = job->next;
+        if (job->response != NULL)
+            krb5_free_data(NULL, job->response);
+        free(job);
+    }
+}
+
+krb5_boolean
+kdc_threads_running()
+{
+    return nthreads > 0;
+}
+
+/*
+ * Start num request threads.  realms[i] is the realm list (of nrealms entries)
+ * to be used by thread i; it must not be used by any other thread until
+ * kdc_stop_threads() is called.
+ */
+krb5_error_code
+kdc_start_threads(verto_ctx *ctx, int num, kdc_realm_t ***realms,
+                  int nrealms)
+{
+    krb5_error_code ret = 0;
+    sigset_t all, old;
+    struct request_thread *t;
+    int i;
+
+    if (pipe(done_pipe) != 0)
+        return errno;
+    for (i = 0; i < 2; i++) {
+        set_cloexec_fd(done_pipe[i]);
+        if (fcntl(done_pipe[i], F_SETFL, O_NONBLOCK) != 0) {
+            ret = errno;
+            goto error;
+        }
+    }
+    done_ev = verto_add_io(ctx, VERTO_EV_FLAG_PERSIST | VERTO_EV_FLAG_IO_READ,
+                           process_done, done_pipe[0]);
+    if (done_ev == NULL) {
+        ret = ENOMEM;
+        goto error;
+    }
+
+    threads = calloc(num, sizeof(*threads));
+    if (threads == NULL) {
+        ret = ENOMEM;
+        goto error;
+    }
+    for (i = 0; i < num; i++) {
+        t = &threads[i];
+        t->vctx = verto_new(NULL, VERTO_EV_TYPE_IO | VERTO_EV_TYPE_TIMEOUT);
+        if (t->vctx == NULL) {
+            ret = ENOMEM;
+            goto error;
+        }
+        t->realms = realms[i];
+        t->nrealms = nrealms;
+    }
+
+    /* Leave signal handling to the main loop thread. */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (i = 0; i < num; i++) {
+        ret = pthread_create(&threads[i].tid, NULL, request_thread_main,
+                             &threads[i]);
+        if (ret)
+            break;
+        nthreads++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (ret) {
+        kdc_stop_threads();
+        return ret;
+    }
+    krb5_klog_syslog(LOG_INFO, _("started %d request threads"), num);
+    return 0;
+
+error:
+    for (i = 0; threads != NULL && i < num; i++) {
+        if (threads[i].vctx != NULL)
+            verto_free(threads[i].vctx);
+    }
+    free(threads);
+    threads = NULL;
+    if (done_ev != NULL)
+        verto_del(done_ev);
+    done_ev = NULL;
+    close(done_pipe[0]);
+    close(done_pipe[1]);
+    done_pipe[0] = done_pipe[1] = -1;
+    return ret;
+}
+
+/*
+ * Stop the request threads.  Requests which have not been answered yet are
+ * discarded, since this happens only when the KDC is shutting down.
+ */
+void
+kdc_stop_threads()
+{
+    int i;
+
+    if (threads == NULL)
+        return;
+
+    pthread_mutex_lock(&queue_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i].tid, NULL);
+
+    free_jobs(queue_head);
+    queue_head = queue_tail = NULL;
+    free_jobs(done_head);
+    done_head = done_tail = NULL;
+
+    verto_del(done_ev);
+    done_ev = NULL;
+    close(done_pipe[0]);
+    close(done_pipe[1]);
+    done_pipe[0] = done_pipe[1] = -1;
+
+    for (i = 0; i < nthreads; i++)
+        verto_free(threads[i].vctx);
+    free(threads);
+    threads = NULL;
+    nthreads = 0;
+    stopping = 0;
+}
+
+/* Queue a request for processing by a request thread. */
+void
+kdc_queue_request(struct sockaddr *local_addr, const krb5_fulladdr *from,
+                  krb5_data *request, int is_tcp, loop_respond_fn respond,
+                  void *arg)
+{
+    struct request_job *job;
+
+    job = calloc(1, sizeof(*job));
+    if (job == NULL) {
+        (*respond)(arg, ENOMEM, NULL);
+        return;
+    }
+    job->local_addr = local_addr;
+    job->from = from;
+    job->request = request;
+    job->is_tcp = is_tcp;
+    job->respond = respond;
+    job->arg = arg;
+
+    pthread_mutex_lock(&queue_lock);
+    append_job(&queue_head, &queue_tail, job);
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/* Ask the request threads to refresh their database configuration. */
+void
+kdc_threads_hangup()
+{
+    pthread_mutex_lock(&queue_lock);
+    hangup_count++;
+    pthread_mutex_unlock(&queue_lock);
+}
+
+#else /* not threaded */
+
+krb5_boolean
+kdc_threads_running()
+{
+    return FALSE;
+}
+
+krb5_error_code
+kdc_start_threads(verto_ctx *ctx, int num, kdc_realm_t ***realms,
+                  int nrealms)
+{
+    return ENOTSUP;
+}
+
+void
+kdc_stop_threads()
+{
+}
+
+void
+kdc_queue_request(struct sockaddr *local_addr, const krb5_fulladdr *from,
+                  krb5_data *request, int is_tcp, loop_respond_fn respond,
+                  void *arg)
+{
+    abort();
+}
+
+void
+kdc_threads_hangup()
+{
+}
+
+#endif /* not threaded */
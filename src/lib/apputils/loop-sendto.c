@@ -0,0 +1,219 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* lib/apputils/loop-sendto.c - KDC exchanges driven by a verto loop */
+/*
+ * Copyright (C) 2012 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Export of this software from the United States of America may
+ *   require a specific license from the United States Government.
+ *   It is the responsibility of any person or organization contemplating
+ *   export to obtain such a license before exporting.
+ *
+ * WITHIN THAT CONSTRAINT, permission to use, copy, modify, and
+ * distribute this software and its documentation for any purpose and
+ * without fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright notice and
+ * this permission notice appear in supporting documentation, and that
+ * the name of M.I.T. not be used in advertising or publicity pertaining
+ * to distribution of the software without specific, written prior
+ * permission.  Furthermore if you modify this software you must label
+ * your software as modified software and not distribute it in such a
+ * fashion that it might be confused with the original M.I.T. software.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is" without express
+ * or implied warranty.
+ */
+
+/*
+ * This file adapts the krb5_sendto_kdc_async interface to a verto event loop,
+ * so that a single thread can have many KDC requests in flight.  Each exchange
+ * keeps one persistent io event per socket and condition it is waiting for,
+ * plus a timeout event for the current wait.  The io events are only replaced
+ * when the set of sockets the library is waiting for changes.
+ */
+
+#include "k5-int.h"
+#include "net-server.h"
+
+struct sendto_req {
+    krb5_context context;
+    verto_ctx *ctx;
+    krb5_sendto_kdc_async_context as;
+    loop_sendto_fn callback;
+    void *arg;
+
+    /* What we are currently waiting for. */
+    krb5_sendto_fd *fds;
+    size_t nfds;
+    verto_ev **evs;             /* Two per entry in fds, possibly null */
+    verto_ev *timer;
+};
+
+static void process_io(verto_ctx *ctx, verto_ev *ev);
+static void process_timeout(verto_ctx *ctx, verto_ev *ev);
+
+static void
+del_events(struct sendto_req *req)
+{
+    size_t i;
+
+    for (i = 0; i < req->nfds * 2; i++) {
+        if (req->evs[i] != NULL)
+            verto_del(req->evs[i]);
+    }
+    free(req->evs);
+    req->evs = NULL;
+    free(req->fds);
+    req->fds = NULL;
+    req->nfds = 0;
+    if (req->timer != NULL)
+        verto_del(req->timer);
+    req->timer = NULL;
+}
+
+static void
+free_req(struct sendto_req *req)
+{
+    del_events(req);
+    krb5_sendto_kdc_async_free(req->context, req->as);
+    free(req);
+}
+
+static verto_ev *
+add_io(struct sendto_req *req, int fd, verto_ev_flag cond)
+{
+    verto_ev *ev;
+
+    ev = verto_add_io(req->ctx, VERTO_EV_FLAG_PERSIST | cond, process_io, fd);
+    if (ev != NULL)
+        verto_set_private(ev, req, NULL);
+    return ev;
+}
+
+/* Bring req's events up to date with the sockets and timeout the library is
+ * waiting for. */
+static krb5_error_code
+update_events(struct sendto_req *req)
+{
+    krb5_error_code ret;
+    const krb5_sendto_fd *fds;
+    size_t nfds, i;
+    int timeout;
+
+    ret = krb5_sendto_kdc_async_fds(req->context, req->as, &fds, &nfds,
+                                    &timeout);
+    if (ret)
+        return ret;
+
+    if (nfds != req->nfds ||
+        memcmp(fds, req->fds, nfds * sizeof(*fds)) != 0) {
+        del_events(req);
+        req->fds = k5alloc(nfds * sizeof(*fds), &ret);
+        if (req->fds == NULL)
+            return ret;
+        req->evs = k5alloc(nfds * 2 * sizeof(*req->evs), &ret);
+        if (req->evs == NULL)
+            return ret;
+        memcpy(req->fds, fds, nfds * sizeof(*fds));
+        req->nfds = nfds;
+        for (i = 0; i < nfds; i++) {
+            if (fds[i].flags & KRB5_SENDTO_READ) {
+                req->evs[i * 2] = add_io(req, fds[i].fd,
+                                         VERTO_EV_FLAG_IO_READ);
+                if (req->evs[i * 2] == NULL)
+                    return ENOMEM;
+            }
+            if (fds[i].flags & KRB5_SENDTO_WRITE) {
+                req->evs[i * 2 + 1] = add_io(req, fds[i].fd,
+                                             VERTO_EV_FLAG_IO_WRITE);
+                if (req->evs[i * 2 + 1] == NULL)
+                    return ENOMEM;
+            }
+        }
+    }
+
+    if (req->timer != NULL)
+        verto_del(req->timer);
+    req->timer = verto_add_timeout(req->ctx, VERTO_EV_FLAG_NONE,
+                                   process_timeout, timeout);
+    if (req->timer == NULL)
+        return ENOMEM;
+    verto_set_private(req->timer, req, NULL);
+    return 0;
+}
+
+/* Report an event to the library, and either wait for the next one or finish
+ * the exchange. */
+static void
+step(struct sendto_req *req, int fd, unsigned int flags)
+{
+    krb5_error_code ret;
+    krb5_data reply = empty_data();
+    krb5_boolean done;
+    int use_master = 0;
+
+    ret = krb5_sendto_kdc_async_step(req->context, req->as, fd, flags,
+                                     &reply, &use_master, &done);
+    if (ret == 0 && !done) {
+        ret = update_events(req);
+        if (ret == 0)
+            return;
+    }
+
+    /* Free our events before the callback, so that it can end the loop. */
+    del_events(req);
+    req->callback(req->arg, ret, (ret == 0) ? &reply : NULL, use_master);
+    free_req(req);
+}
+
+static void
+process_io(verto_ctx *ctx, verto_ev *ev)
+{
+    struct sendto_req *req = verto_get_private(ev);
+    unsigned int flags;
+
+    flags = (verto_get_flags(ev) & VERTO_EV_FLAG_IO_WRITE) ?
+        KRB5_SENDTO_WRITE : KRB5_SENDTO_READ;
+    step(req, verto_get_fd(ev), flags);
+}
+
+static void
+process_timeout(verto_ctx *ctx, verto_ev *ev)
+{
+    struct sendto_req *req = verto_get_private(ev);
+
+    /* Non-persistent events are freed by verto after the callback. */
+    req->timer = NULL;
+    step(req, -1, 0);
+}
+
+krb5_error_code
+loop_sendto_kdc(verto_ctx *ctx, krb5_context context,
+                const krb5_data *message, const krb5_data *realm,
+                int use_master, int tcp_only, loop_sendto_fn callback,
+                void *arg)
+{
+    krb5_error_code ret;
+    struct sendto_req *req;
+
+    req = k5alloc(sizeof(*req), &ret);
+    if (req == NULL)
+        return ret;
+    req->context = context;
+    req->ctx = ctx;
+    req->callback = callback;
+    req->arg = arg;
+
+    ret = krb5_sendto_kdc_async_begin(context, message, realm, use_master,
+                                      tcp_only, &req->as);
+    if (ret)
+        goto error;
+    ret = update_events(req);
+    if (ret)
+        goto error;
+    return 0;
+
+error:
+    free_req(req);
+    return ret;
+}
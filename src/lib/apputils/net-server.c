@@ -23,6 +23,8 @@
  * or implied warranty.
  */
 
+/* For recvmmsg() and sendmmsg() with glibc. */
+#define _GNU_SOURCE
 #include "k5-int.h"
 #include "adm_proto.h"
 #include <sys/ioctl.h>
@@ -108,6 +110,14 @@ setreuseaddr(int sock, int value)
     return setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value));
 }
 
+#ifdef SO_REUSEPORT
+static int
+setreuseport(int sock, int value)
+{
+    return setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(value));
+}
+#endif
+
 #if defined(IPV6_V6ONLY)
 static int
 setv6only(int sock, int value)
@@ -263,6 +273,9 @@ static SET(unsigned short) udp_port_data, tcp_port_data;
 static SET(struct rpc_svc_data) rpc_svc_data;
 static SET(verto_ev *) events;
 
+/* If set, listener sockets are created with SO_REUSEPORT. */
+static int reuseport;
+
 verto_ctx *
 loop_init(verto_ev_type types)
 {
@@ -411,6 +424,23 @@ struct socksetup {
 #define UDP_DO_IPV6 2
 };
 
+/*
+ * Request that listener sockets be created with SO_REUSEPORT, so that several
+ * processes can each open their own sockets on the same ports and have the
+ * kernel spread incoming traffic across them.  Returns ENOTSUP if the platform
+ * lacks the option.
+ */
+krb5_error_code
+loop_set_reuseport(int value)
+{
+#ifdef SO_REUSEPORT
+    reuseport = value;
+    return 0;
+#else
+    return value ? ENOTSUP : 0;
+#endif
+}
+
 static void
 free_connection(struct connection *conn)
 {
@@ -605,6 +635,16 @@ create_server_socket(struct socksetup *data, struct sockaddr *addr, int type)
                 _("Cannot enable SO_REUSEADDR on fd %d"), sock);
     }
 
+#ifdef SO_REUSEPORT
+    if (reuseport && setreuseport(sock, 1) < 0) {
+        data->retval = errno;
+        com_err(data->prog, errno,
+                _("Cannot enable SO_REUSEPORT on fd %d"), sock);
+        close(sock);
+        return -1;
+    }
+#endif
+
     if (addr->sa_family == AF_INET6) {
 #ifdef IPV6_V6ONLY
         if (setv6only(sock, 1))
@@ -1312,56 +1352,24 @@ union aux_addressing_info {
     int ipv6_ifindex;
 };
 
-static int
-recv_from_to(int s, void *buf, size_t len, int flags,
-             struct sockaddr *from, socklen_t *fromlen,
-             struct sockaddr *to, socklen_t *tolen,
+#if (defined(IP_PKTINFO) || defined(IPV6_PKTINFO)) && defined(CMSG_SPACE)
+/*
+ * Extract the destination address of a datagram received with msg into to,
+ * or set *tolen to 0 if msg does not contain it.  to must have already been
+ * clobbered by the caller.
+ */
+static void
+get_msg_dest(struct msghdr *msg, struct sockaddr *to, socklen_t *tolen,
              union aux_addressing_info *auxaddr)
 {
-#if (!defined(IP_PKTINFO) && !defined(IPV6_PKTINFO)) || !defined(CMSG_SPACE)
-    if (to && tolen) {
-        /* Clobber with something recognizeable in case we try to use
-           the address.  */
-        memset(to, 0x40, *tolen);
-        *tolen = 0;
-    }
-
-    return recvfrom(s, buf, len, flags, from, fromlen);
-#else
-    int r;
-    struct iovec iov;
-    char cmsg[CMSG_SPACE(sizeof(union pktinfo))];
     struct cmsghdr *cmsgptr;
-    struct msghdr msg;
-
-    if (!to || !tolen)
-        return recvfrom(s, buf, len, flags, from, fromlen);
-
-    /* Clobber with something recognizeable in case we can't extract
-       the address but try to use it anyways.  */
-    memset(to, 0x40, *tolen);
-
-    iov.iov_base = buf;
-    iov.iov_len = len;
-    memset(&msg, 0, sizeof(msg));
-    msg.msg_name = from;
-    msg.msg_namelen = *fromlen;
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
-    msg.msg_control = cmsg;
-    msg.msg_controllen = sizeof(cmsg);
-
-    r = recvmsg(s, &msg, flags);
-    if (r < 0)
-        return r;
-    *fromlen = msg.msg_namelen;
 
     /* On Darwin (and presumably all *BSD with KAME stacks),
        CMSG_FIRSTHDR doesn't check for a non-zero controllen.  RFC
        3542 recommends making this check, even though the (new) spec
        for CMSG_FIRSTHDR says it's supposed to do the check.  */
-    if (msg.msg_controllen) {
-        cmsgptr = CMSG_FIRSTHDR(&msg);
+    if (msg->msg_controllen) {
+        cmsgptr = CMSG_FIRSTHDR(msg);
         while (cmsgptr) {
 #ifdef IP_PKTINFO
             if (cmsgptr->cmsg_level == IPPROTO_IP
@@ -1373,7 +1381,7 @@ recv_from_to(int s, void *buf, size_t len, int flags,
                 ((struct sockaddr_in *)to)->sin_addr = pktinfo->ipi_addr;
                 ((struct sockaddr_in *)to)->sin_family = AF_INET;
                 *tolen = sizeof(struct sockaddr_in);
-                return r;
+                return;
             }
 #endif
 #if defined(IPV6_PKTINFO) && defined(HAVE_STRUCT_IN6_PKTINFO)
@@ -1387,60 +1395,56 @@ recv_from_to(int s, void *buf, size_t len, int flags,
                 ((struct sockaddr_in6 *)to)->sin6_family = AF_INET6;
                 *tolen = sizeof(struct sockaddr_in6);
                 auxaddr->ipv6_ifindex = pktinfo->ipi6_ifindex;
-                return r;
+                return;
             }
 #endif
-            cmsgptr = CMSG_NXTHDR(&msg, cmsgptr);
+            cmsgptr = CMSG_NXTHDR(msg, cmsgptr);
         }
     }
     /* No info about destination addr was available.  */
     *tolen = 0;
-    return r;
-#endif
 }
 
-static int
-send_to_from(int s, void *buf, size_t len, int flags,
-             const struct sockaddr *to, socklen_t tolen,
-             const struct sockaddr *from, socklen_t fromlen,
-             union aux_addressing_info *auxaddr)
+/*
+ * Set up msg to send len bytes of buf to the address to, from the local
+ * address from if possible.  cbuf must point to CMSG_SPACE(sizeof(union
+ * pktinfo)) bytes.
+ */
+static void
+init_send_msg(struct msghdr *msg, struct iovec *iov, char *cbuf,
+              void *buf, size_t len,
+              const struct sockaddr *to, socklen_t tolen,
+              const struct sockaddr *from, socklen_t fromlen,
+              union aux_addressing_info *auxaddr)
 {
-#if (!defined(IP_PKTINFO) && !defined(IPV6_PKTINFO)) || !defined(CMSG_SPACE)
-    return sendto(s, buf, len, flags, to, tolen);
-#else
-    struct iovec iov;
-    struct msghdr msg;
     struct cmsghdr *cmsgptr;
-    char cbuf[CMSG_SPACE(sizeof(union pktinfo))];
 
-    if (from == 0 || fromlen == 0 || from->sa_family != to->sa_family) {
-    use_sendto:
-        return sendto(s, buf, len, flags, to, tolen);
-    }
-
-    iov.iov_base = buf;
-    iov.iov_len = len;
-    /* Truncation?  */
-    if (iov.iov_len != len)
-        return EINVAL;
-    memset(cbuf, 0, sizeof(cbuf));
-    memset(&msg, 0, sizeof(msg));
-    msg.msg_name = (void *) to;
-    msg.msg_namelen = tolen;
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
-    msg.msg_control = cbuf;
+    iov->iov_base = buf;
+    iov->iov_len = len;
+    memset(cbuf, 0, CMSG_SPACE(sizeof(union pktinfo)));
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_name = (void *) to;
+    msg->msg_namelen = tolen;
+    msg->msg_iov = iov;
+    msg->msg_iovlen = 1;
+    msg->msg_control = cbuf;
     /* CMSG_FIRSTHDR needs a non-zero controllen, or it'll return NULL
        on Linux.  */
-    msg.msg_controllen = sizeof(cbuf);
-    cmsgptr = CMSG_FIRSTHDR(&msg);
-    msg.msg_controllen = 0;
+    msg->msg_controllen = CMSG_SPACE(sizeof(union pktinfo));
+    cmsgptr = CMSG_FIRSTHDR(msg);
+    msg->msg_controllen = 0;
+
+    /* With no control data, the message is sent as by sendto(). */
+    if (from == 0 || fromlen == 0 || from->sa_family != to->sa_family) {
+        msg->msg_control = NULL;
+        return;
+    }
 
     switch (from->sa_family) {
 #if defined(IP_PKTINFO)
     case AF_INET:
         if (fromlen != sizeof(struct sockaddr_in))
-            goto use_sendto;
+            break;
         cmsgptr->cmsg_level = IPPROTO_IP;
         cmsgptr->cmsg_type = IP_PKTINFO;
         cmsgptr->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
@@ -1449,13 +1453,13 @@ send_to_from(int s, void *buf, size_t len, int flags,
             const struct sockaddr_in *from4 = (const struct sockaddr_in *)from;
             p->ipi_spec_dst = from4->sin_addr;
         }
-        msg.msg_controllen = CMSG_SPACE(sizeof(struct in_pktinfo));
+        msg->msg_controllen = CMSG_SPACE(sizeof(struct in_pktinfo));
         break;
 #endif
 #if defined(IPV6_PKTINFO) && defined(HAVE_STRUCT_IN6_PKTINFO)
     case AF_INET6:
         if (fromlen != sizeof(struct sockaddr_in6))
-            goto use_sendto;
+            break;
         cmsgptr->cmsg_level = IPPROTO_IPV6;
         cmsgptr->cmsg_type = IPV6_PKTINFO;
         cmsgptr->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
@@ -1476,17 +1480,100 @@ send_to_from(int s, void *buf, size_t len, int flags,
                 p->ipi6_ifindex = auxaddr->ipv6_ifindex;
             /* otherwise, already zero */
         }
-        msg.msg_controllen = CMSG_SPACE(sizeof(struct in6_pktinfo));
+        msg->msg_controllen = CMSG_SPACE(sizeof(struct in6_pktinfo));
         break;
 #endif
-    default:
-        goto use_sendto;
     }
+    if (msg->msg_controllen == 0)
+        msg->msg_control = NULL;
+}
+#endif
+
+/*
+ * Where the platform supports it, we receive up to UDP_BATCH_SIZE datagrams
+ * per wakeup with recvmmsg(), and send the replies which are ready once the
+ * batch has been dispatched with sendmmsg().  Replies which complete later
+ * (because of asynchronous processing) are sent individually.
+ */
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) &&                 \
+    defined(CMSG_SPACE) && defined(HAVE_STRUCT_CMSGHDR) &&             \
+    (defined(IP_PKTINFO) || defined(IPV6_PKTINFO))
+#define BATCH_UDP
+#endif
+#define UDP_BATCH_SIZE 32
+
+#ifndef BATCH_UDP
+/* Without BATCH_UDP, process_packet() receives one datagram at a time. */
+static int
+recv_from_to(int s, void *buf, size_t len, int flags,
+             struct sockaddr *from, socklen_t *fromlen,
+             struct sockaddr *to, socklen_t *tolen,
+             union aux_addressing_info *auxaddr)
+{
+#if (!defined(IP_PKTINFO) && !defined(IPV6_PKTINFO)) || !defined(CMSG_SPACE)
+    if (to && tolen) {
+        /* Clobber with something recognizeable in case we try to use
+           the address.  */
+        memset(to, 0x40, *tolen);
+        *tolen = 0;
+    }
+
+    return recvfrom(s, buf, len, flags, from, fromlen);
+#else
+    int r;
+    struct iovec iov;
+    char cmsg[CMSG_SPACE(sizeof(union pktinfo))];
+    struct msghdr msg;
+
+    if (!to || !tolen)
+        return recvfrom(s, buf, len, flags, from, fromlen);
+
+    /* Clobber with something recognizeable in case we can't extract
+       the address but try to use it anyways.  */
+    memset(to, 0x40, *tolen);
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = from;
+    msg.msg_namelen = *fromlen;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg;
+    msg.msg_controllen = sizeof(cmsg);
+
+    r = recvmsg(s, &msg, flags);
+    if (r < 0)
+        return r;
+    *fromlen = msg.msg_namelen;
+    get_msg_dest(&msg, to, tolen, auxaddr);
+    return r;
+#endif
+}
+
+#endif /* not BATCH_UDP */
+
+static int
+send_to_from(int s, void *buf, size_t len, int flags,
+             const struct sockaddr *to, socklen_t tolen,
+             const struct sockaddr *from, socklen_t fromlen,
+             union aux_addressing_info *auxaddr)
+{
+#if (!defined(IP_PKTINFO) && !defined(IPV6_PKTINFO)) || !defined(CMSG_SPACE)
+    return sendto(s, buf, len, flags, to, tolen);
+#else
+    struct iovec iov;
+    struct msghdr msg;
+    char cbuf[CMSG_SPACE(sizeof(union pktinfo))];
+
+    init_send_msg(&msg, &iov, cbuf, buf, len, to, tolen, from, fromlen,
+                  auxaddr);
     return sendmsg(s, &msg, flags);
 #endif
 }
 
 struct udp_dispatch_state {
+    struct udp_dispatch_state *next;    /* free list link */
     void *handle;
     const char *prog;
     int port_fd;
@@ -1498,32 +1585,72 @@ struct udp_dispatch_state {
     struct sockaddr_storage daddr;
     union aux_addressing_info auxaddr;
     krb5_data request;
+    krb5_data *response;
     char pktbuf[MAX_DGRAM_SIZE];
 };
 
+/*
+ * Dispatch states are kept on a free list when not in use, so that we don't
+ * allocate one per packet.  We keep up to UDP_STATE_POOL_MAX of them.
+ */
+#define UDP_STATE_POOL_MAX (4 * UDP_BATCH_SIZE)
+static struct udp_dispatch_state *udp_state_pool;
+static int udp_state_pool_size;
+
+#ifdef BATCH_UDP
+/* Replies queued while dispatching a batch of requests. */
+static int udp_batching;
+static struct udp_dispatch_state *udp_reply_queue[UDP_BATCH_SIZE];
+static int udp_reply_queue_len;
+#endif
+
+static struct udp_dispatch_state *
+alloc_udp_state(void)
+{
+    struct udp_dispatch_state *state;
+
+    state = udp_state_pool;
+    if (state != NULL) {
+        udp_state_pool = state->next;
+        udp_state_pool_size--;
+        return state;
+    }
+    return malloc(sizeof(*state));
+}
+
 static void
-process_packet_response(void *arg, krb5_error_code code, krb5_data *response)
+free_udp_state(struct udp_dispatch_state *state)
 {
-    struct udp_dispatch_state *state = arg;
-    int cc;
+    if (udp_state_pool_size >= UDP_STATE_POOL_MAX) {
+        free(state);
+        return;
+    }
+    state->next = udp_state_pool;
+    udp_state_pool = state;
+    udp_state_pool_size++;
+}
 
-    if (code)
-        com_err(state->prog ? state->prog : NULL, code,
-                _("while dispatching (udp)"));
-    if (code || response == NULL)
-        goto out;
+static void
+free_udp_state_pool(void)
+{
+    struct udp_dispatch_state *state;
 
-    cc = send_to_from(state->port_fd, response->data,
-                      (socklen_t) response->length, 0,
-                      (struct sockaddr *)&state->saddr, state->saddr_len,
-                      (struct sockaddr *)&state->daddr, state->daddr_len,
-                      &state->auxaddr);
+    while ((state = udp_state_pool) != NULL) {
+        udp_state_pool = state->next;
+        free(state);
+    }
+    udp_state_pool_size = 0;
+}
+
+/* Log the result cc (with errno value e) of sending state's reply. */
+static void
+check_udp_send(struct udp_dispatch_state *state, int cc, int e)
+{
     if (cc == -1) {
         /* Note that the local address (daddr*) has no port number
          * info associated with it. */
         char saddrbuf[NI_MAXHOST], sportbuf[NI_MAXSERV];
         char daddrbuf[NI_MAXHOST];
-        int e = errno;
 
         if (getnameinfo((struct sockaddr *)&state->daddr, state->daddr_len,
                         daddrbuf, sizeof(daddrbuf), 0, 0,
@@ -1540,60 +1667,122 @@ process_packet_response(void *arg, krb5_error_code code, krb5_data *response)
 
         com_err(state->prog, e, _("while sending reply to %s/%s from %s"),
                 saddrbuf, sportbuf, daddrbuf);
-        goto out;
+        return;
     }
-    if ((size_t)cc != response->length) {
+    if ((size_t)cc != state->response->length) {
         com_err(state->prog, 0, _("short reply write %d vs %d\n"),
-                response->length, cc);
+                state->response->length, cc);
     }
+}
 
-out:
-    krb5_free_data(get_context(state->handle), response);
-    free(state);
+static void
+finish_udp_state(struct udp_dispatch_state *state)
+{
+    krb5_free_data(get_context(state->handle), state->response);
+    free_udp_state(state);
 }
 
+#ifdef BATCH_UDP
+/* Send the replies queued while dispatching a batch, with one sendmmsg() call
+ * for each run of replies on the same socket. */
 static void
-process_packet(verto_ctx *ctx, verto_ev *ev)
+flush_udp_replies(void)
 {
-    int cc;
-    struct connection *conn;
+    struct mmsghdr msgs[UDP_BATCH_SIZE];
+    struct iovec iovs[UDP_BATCH_SIZE];
+    char cbufs[UDP_BATCH_SIZE][CMSG_SPACE(sizeof(union pktinfo))];
     struct udp_dispatch_state *state;
+    int i, j, run, r;
+
+    for (i = 0; i < udp_reply_queue_len; i++) {
+        state = udp_reply_queue[i];
+        init_send_msg(&msgs[i].msg_hdr, &iovs[i], cbufs[i],
+                      state->response->data, state->response->length,
+                      ss2sa(&state->saddr), state->saddr_len,
+                      ss2sa(&state->daddr), state->daddr_len,
+                      &state->auxaddr);
+        msgs[i].msg_len = 0;
+    }
 
-    conn = verto_get_private(ev);
-
-    state = malloc(sizeof(*state));
-    if (!state) {
-        com_err(conn->prog, ENOMEM, _("while dispatching (udp)"));
-        return;
+    i = 0;
+    while (i < udp_reply_queue_len) {
+        state = udp_reply_queue[i];
+        for (run = 1; i + run < udp_reply_queue_len; run++) {
+            if (udp_reply_queue[i + run]->port_fd != state->port_fd)
+                break;
+        }
+        r = sendmmsg(state->port_fd, &msgs[i], run, 0);
+        if (r <= 0) {
+            /* The first message failed; report it and go on to the rest. */
+            check_udp_send(state, -1, errno);
+            finish_udp_state(state);
+            i++;
+            continue;
+        }
+        for (j = i; j < i + r; j++) {
+            check_udp_send(udp_reply_queue[j], msgs[j].msg_len, 0);
+            finish_udp_state(udp_reply_queue[j]);
+        }
+        i += r;
     }
+    udp_reply_queue_len = 0;
+}
+#endif
 
-    state->handle = conn->handle;
-    state->prog = conn->prog;
-    state->port_fd = verto_get_fd(ev);
-    assert(state->port_fd >= 0);
+static void
+process_packet_response(void *arg, krb5_error_code code, krb5_data *response)
+{
+    struct udp_dispatch_state *state = arg;
+    int cc;
 
-    state->saddr_len = sizeof(state->saddr);
-    state->daddr_len = sizeof(state->daddr);
-    memset(&state->auxaddr, 0, sizeof(state->auxaddr));
-    cc = recv_from_to(state->port_fd, state->pktbuf, sizeof(state->pktbuf), 0,
-                      (struct sockaddr *)&state->saddr, &state->saddr_len,
-                      (struct sockaddr *)&state->daddr, &state->daddr_len,
-                      &state->auxaddr);
-    if (cc == -1) {
-        if (errno != EINTR && errno != EAGAIN
-            /*
-             * This is how Linux indicates that a previous transmission was
-             * refused, e.g., if the client timed out before getting the
-             * response packet.
-             */
-            && errno != ECONNREFUSED
-        )
-            com_err(conn->prog, errno, _("while receiving from network"));
-        free(state);
+    state->response = response;
+    if (code)
+        com_err(state->prog ? state->prog : NULL, code,
+                _("while dispatching (udp)"));
+    if (code || response == NULL)
+        goto out;
+
+#ifdef BATCH_UDP
+    /* Queue the reply if we are dispatching a batch of requests. */
+    if (udp_batching && udp_reply_queue_len < UDP_BATCH_SIZE) {
+        udp_reply_queue[udp_reply_queue_len++] = state;
         return;
     }
+#endif
+
+    cc = send_to_from(state->port_fd, response->data,
+                      (socklen_t) response->length, 0,
+                      (struct sockaddr *)&state->saddr, state->saddr_len,
+                      (struct sockaddr *)&state->daddr, state->daddr_len,
+                      &state->auxaddr);
+    check_udp_send(state, cc, errno);
+
+out:
+    finish_udp_state(state);
+}
+
+/* Log a failure to receive a packet, unless the error is uninteresting. */
+static void
+check_udp_recv_error(struct connection *conn, int e)
+{
+    if (e != EINTR && e != EAGAIN
+        /*
+         * This is how Linux indicates that a previous transmission was
+         * refused, e.g., if the client timed out before getting the
+         * response packet.
+         */
+        && e != ECONNREFUSED
+    )
+        com_err(conn->prog, e, _("while receiving from network"));
+}
+
+/* Dispatch the request of length cc received into state. */
+static void
+dispatch_udp_request(verto_ctx *ctx, struct connection *conn,
+                     struct udp_dispatch_state *state, int cc)
+{
     if (!cc) { /* zero-length packet? */
-        free(state);
+        free_udp_state(state);
         return;
     }
 
@@ -1623,6 +1812,7 @@ process_packet(verto_ctx *ctx, verto_ev *ev)
 
     state->request.length = cc;
     state->request.data = state->pktbuf;
+    state->response = NULL;
     state->faddr.address = &state->addr;
     init_addr(&state->faddr, ss2sa(&state->saddr));
     /* This address is in net order. */
@@ -1630,6 +1820,115 @@ process_packet(verto_ctx *ctx, verto_ev *ev)
              &state->request, 0, ctx, process_packet_response, state);
 }
 
+static void
+init_udp_state(struct udp_dispatch_state *state, struct connection *conn,
+               int port_fd)
+{
+    state->handle = conn->handle;
+    state->prog = conn->prog;
+    state->port_fd = port_fd;
+    state->saddr_len = sizeof(state->saddr);
+    state->daddr_len = sizeof(state->daddr);
+    memset(&state->auxaddr, 0, sizeof(state->auxaddr));
+}
+
+#ifdef BATCH_UDP
+
+static void
+process_packet(verto_ctx *ctx, verto_ev *ev)
+{
+    struct connection *conn;
+    struct udp_dispatch_state *states[UDP_BATCH_SIZE], *state;
+    struct mmsghdr msgs[UDP_BATCH_SIZE];
+    struct iovec iovs[UDP_BATCH_SIZE];
+    char cbufs[UDP_BATCH_SIZE][CMSG_SPACE(sizeof(union pktinfo))];
+    struct msghdr *msg;
+    int port_fd, i, n, cc;
+
+    conn = verto_get_private(ev);
+    port_fd = verto_get_fd(ev);
+    assert(port_fd >= 0);
+
+    for (n = 0; n < UDP_BATCH_SIZE; n++) {
+        state = alloc_udp_state();
+        if (state == NULL)
+            break;
+        init_udp_state(state, conn, port_fd);
+        /* Clobber with something recognizeable in case we can't extract
+           the address but try to use it anyways.  */
+        memset(&state->daddr, 0x40, state->daddr_len);
+        states[n] = state;
+        iovs[n].iov_base = state->pktbuf;
+        iovs[n].iov_len = sizeof(state->pktbuf);
+        msg = &msgs[n].msg_hdr;
+        memset(msg, 0, sizeof(*msg));
+        msg->msg_name = &state->saddr;
+        msg->msg_namelen = state->saddr_len;
+        msg->msg_iov = &iovs[n];
+        msg->msg_iovlen = 1;
+        msg->msg_control = cbufs[n];
+        msg->msg_controllen = sizeof(cbufs[n]);
+    }
+    if (n == 0) {
+        com_err(conn->prog, ENOMEM, _("while dispatching (udp)"));
+        return;
+    }
+
+    cc = recvmmsg(port_fd, msgs, n, MSG_DONTWAIT, NULL);
+    if (cc == -1)
+        check_udp_recv_error(conn, errno);
+
+    /* Dispatch the received requests, queueing the replies. */
+    udp_batching = 1;
+    for (i = 0; i < cc; i++) {
+        state = states[i];
+        msg = &msgs[i].msg_hdr;
+        state->saddr_len = msg->msg_namelen;
+        get_msg_dest(msg, ss2sa(&state->daddr), &state->daddr_len,
+                     &state->auxaddr);
+        dispatch_udp_request(ctx, conn, state, msgs[i].msg_len);
+    }
+    udp_batching = 0;
+    flush_udp_replies();
+
+    for (i = (cc > 0) ? cc : 0; i < n; i++)
+        free_udp_state(states[i]);
+}
+
+#else /* not BATCH_UDP */
+
+static void
+process_packet(verto_ctx *ctx, verto_ev *ev)
+{
+    int cc;
+    struct connection *conn;
+    struct udp_dispatch_state *state;
+
+    conn = verto_get_private(ev);
+
+    state = alloc_udp_state();
+    if (!state) {
+        com_err(conn->prog, ENOMEM, _("while dispatching (udp)"));
+        return;
+    }
+
+    init_udp_state(state, conn, verto_get_fd(ev));
+    assert(state->port_fd >= 0);
+
+    cc = recv_from_to(state->port_fd, state->pktbuf, sizeof(state->pktbuf), 0,
+                      (struct sockaddr *)&state->saddr, &state->saddr_len,
+                      (struct sockaddr *)&state->daddr, &state->daddr_len,
+                      &state->auxaddr);
+    if (cc == -1) {
+        check_udp_recv_error(conn, errno);
+        free_udp_state(state);
+        return;
+    }
+    dispatch_udp_request(ctx, conn, state, cc);
+}
+
+#endif /* not BATCH_UDP */
+
 static int
 kill_lru_tcp_or_rpc_connection(void *handle, verto_ev *newev)
 {
@@ -1914,37 +2213,61 @@ process_tcp_connection_write(verto_ctx *ctx, verto_ev *ev)
     SOCKET_WRITEV_TEMP tmp;
     ssize_t nwrote;
     int sock;
+    verto_ev *newev;
 
     conn = verto_get_private(ev);
     sock = verto_get_fd(ev);
 
     nwrote = SOCKET_WRITEV(sock, conn->sgp,
                            conn->sgnum, tmp);
-    if (nwrote > 0) { /* non-error and non-eof */
-        while (nwrote) {
-            sg_buf *sgp = conn->sgp;
-            if ((size_t)nwrote < SG_LEN(sgp)) {
-                SG_ADVANCE(sgp, (size_t)nwrote);
-                nwrote = 0;
-            } else {
-                nwrote -= SG_LEN(sgp);
-                conn->sgp++;
-                conn->sgnum--;
-                if (conn->sgnum == 0 && nwrote != 0)
-                    abort();
-            }
+    if (nwrote <= 0) { /* error or eof */
+        verto_del(ev);
+        return;
+    }
+    while (nwrote) {
+        sg_buf *sgp = conn->sgp;
+        if ((size_t)nwrote < SG_LEN(sgp)) {
+            SG_ADVANCE(sgp, (size_t)nwrote);
+            nwrote = 0;
+        } else {
+            nwrote -= SG_LEN(sgp);
+            conn->sgp++;
+            conn->sgnum--;
+            if (conn->sgnum == 0 && nwrote != 0)
+                abort();
         }
+    }
 
-        /* If we still have more data to send, just return so that
-         * the main loop can call this function again when the socket
-         * is ready for more writing. */
-        if (conn->sgnum > 0)
-            return;
+    /* If we still have more data to send, just return so that
+     * the main loop can call this function again when the socket
+     * is ready for more writing. */
+    if (conn->sgnum > 0)
+        return;
+
+    /* Finished sending.  If we sent a FIELD_TOOLONG error, RFC 4120 says we
+     * have to close the TCP stream, and we haven't read the rest of the
+     * request anyway. */
+    if (conn->msglen > conn->bufsiz - 4) {
+        verto_del(ev);
+        return;
     }
 
-    /* Finished sending.  We should go back to reading, though if we
-     * sent a FIELD_TOOLONG error in reply to a length with the high
-     * bit set, RFC 4120 says we have to close the TCP stream. */
+    /* Go back to reading, so that the client can send more requests on this
+     * connection.  Count it as new for the purpose of dropping the oldest
+     * connections. */
+    krb5_free_data(get_context(conn->handle), conn->response);
+    conn->response = NULL;
+    conn->offset = 0;
+    conn->msglen = 0;
+    conn->start_time = time(0);
+    newev = make_event(ctx, VERTO_EV_FLAG_IO_READ | VERTO_EV_FLAG_PERSIST,
+                       process_tcp_connection_read, sock, conn, 1);
+    if (newev == NULL) {
+        verto_del(ev);
+        return;
+    }
+    verto_set_private(ev, NULL, NULL); /* Don't close the fd or free conn! */
+    remove_event_from_set(ev);
     verto_del(ev);
 }
 
@@ -1956,6 +2279,7 @@ loop_free(verto_ctx *ctx)
     FREE_SET_DATA(udp_port_data);
     FREE_SET_DATA(tcp_port_data);
     FREE_SET_DATA(rpc_svc_data);
+    free_udp_state_pool();
 }
 
 static int
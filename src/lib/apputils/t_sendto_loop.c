@@ -0,0 +1,154 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* lib/apputils/t_sendto_loop.c - Test harness for loop_sendto_kdc */
+/*
+ * Copyright (C) 2012 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Export of this software from the United States of America may
+ *   require a specific license from the United States Government.
+ *   It is the responsibility of any person or organization contemplating
+ *   export to obtain such a license before exporting.
+ *
+ * WITHIN THAT CONSTRAINT, permission to use, copy, modify, and
+ * distribute this software and its documentation for any purpose and
+ * without fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright notice and
+ * this permission notice appear in supporting documentation, and that
+ * the name of M.I.T. not be used in advertising or publicity pertaining
+ * to distribution of the software without specific, written prior
+ * permission.  Furthermore if you modify this software you must label
+ * your software as modified software and not distribute it in such a
+ * fashion that it might be confused with the original M.I.T. software.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is" without express
+ * or implied warranty.
+ */
+
+/*
+ * Usage: t_sendto_loop count princ password
+ *
+ * Runs count initial credential exchanges for princ at once, all from one
+ * thread using a verto loop, and reports how many succeeded.
+ */
+
+#include "k5-int.h"
+#include "net-server.h"
+#ifdef INTERNAL_VERTO
+#include "verto-k5ev.h"
+#endif
+
+static krb5_context context;
+static verto_ctx *vctx;
+static int pending, succeeded;
+
+struct exchange {
+    krb5_init_creds_context icc;
+};
+
+static void
+check(krb5_error_code code)
+{
+    if (code != 0) {
+        com_err("t_sendto_loop", code, NULL);
+        exit(1);
+    }
+}
+
+static void
+finish(struct exchange *ex, krb5_error_code code)
+{
+    if (code == 0)
+        succeeded++;
+    else
+        com_err("t_sendto_loop", code, NULL);
+    if (--pending == 0)
+        verto_break(vctx);
+}
+
+static void got_reply(void *arg, krb5_error_code code, krb5_data *reply,
+                      int use_master);
+
+/* Process in (if any) and send the next request, or finish the exchange. */
+static void
+next_step(struct exchange *ex, krb5_data *in)
+{
+    krb5_error_code ret;
+    krb5_data out = empty_data(), realm = empty_data();
+    unsigned int flags = 0;
+
+    ret = krb5_init_creds_step(context, ex->icc, in, &out, &realm, &flags);
+    if (ret == 0 && (flags & KRB5_INIT_CREDS_STEP_FLAG_CONTINUE)) {
+        ret = loop_sendto_kdc(vctx, context, &out, &realm, 0, 0, got_reply,
+                              ex);
+        krb5_free_data_contents(context, &out);
+        krb5_free_data_contents(context, &realm);
+        if (ret == 0)
+            return;
+    }
+    finish(ex, ret);
+}
+
+static void
+got_reply(void *arg, krb5_error_code code, krb5_data *reply, int use_master)
+{
+    struct exchange *ex = arg;
+
+    if (code != 0) {
+        finish(ex, code);
+        return;
+    }
+    next_step(ex, reply);
+    krb5_free_data_contents(context, reply);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct exchange *exchanges;
+    krb5_principal princ;
+    krb5_data empty = empty_data();
+    int i, count;
+
+    if (argc != 4) {
+        fprintf(stderr, "Usage: %s count princ password\n", argv[0]);
+        return 1;
+    }
+    count = atoi(argv[1]);
+
+    check(krb5_init_context(&context));
+    check(krb5_parse_name(context, argv[2], &princ));
+#ifdef INTERNAL_VERTO
+    vctx = verto_default_k5ev();
+#else
+    vctx = verto_default(NULL, VERTO_EV_TYPE_IO | VERTO_EV_TYPE_TIMEOUT);
+#endif
+    if (vctx == NULL)
+        check(ENOMEM);
+
+    exchanges = calloc(count, sizeof(*exchanges));
+    if (exchanges == NULL)
+        check(ENOMEM);
+    for (i = 0; i < count; i++) {
+        check(krb5_init_creds_init(context, princ, NULL, NULL, 0, NULL,
+                                   &exchanges[i].icc));
+        check(krb5_init_creds_set_password(context, exchanges[i].icc,
+                                           argv[3]));
+    }
+
+    /* Start every exchange before running the loop. */
+    pending = count;
+    for (i = 0; i < count; i++)
+        next_step(&exchanges[i], &empty);
+    if (pending > 0)
+        verto_run(vctx);
+
+    printf("%d of %d exchanges succeeded\n", succeeded, count);
+
+    for (i = 0; i < count; i++)
+        krb5_init_creds_free(context, exchanges[i].icc);
+    free(exchanges);
+    verto_free(vctx);
+    krb5_free_principal(context, princ);
+    krb5_free_context(context);
+    return 0;
+}
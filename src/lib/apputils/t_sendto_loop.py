@@ -0,0 +1,26 @@
+#!/usr/bin/python
+from k5test import *
+
+# Point a second realm at a port with no KDC listening.
+conf = {'client': {'realms': {'NOWHERE.TEST': {'kdc': '127.0.0.1:9'}}}}
+realm = K5Realm(krb5_conf=conf, create_host=False, get_creds=False,
+                start_kadmind=False)
+
+# Many exchanges can be in flight at once from one thread.
+out = realm.run_as_client(['./t_sendto_loop', '50', realm.user_princ,
+                           password('user')])
+if '50 of 50 exchanges succeeded' not in out:
+    fail('Expected all exchanges to succeed: ' + out)
+
+# A bad password shows up as the result of the exchange.
+out = realm.run_as_client(['./t_sendto_loop', '5', realm.user_princ, 'bad'])
+if '0 of 5 exchanges succeeded' not in out:
+    fail('Expected all exchanges to fail: ' + out)
+
+# Unreachable KDCs are reported through the callback.
+out = realm.run_as_client(['./t_sendto_loop', '3', 'user@NOWHERE.TEST',
+                           'pw'])
+if 'Cannot contact any KDC' not in out or '0 of 3' not in out:
+    fail('Expected unreachable KDC errors: ' + out)
+
+success('Event loop KDC exchange tests')
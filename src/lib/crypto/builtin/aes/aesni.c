@@ -0,0 +1,323 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* lib/crypto/builtin/aes/aesni.c - AES-NI block operations */
+/*
+ * Copyright (C) 2012 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Export of this software from the United States of America may
+ *   require a specific license from the United States Government.
+ *   It is the responsibility of any person or organization contemplating
+ *   export to obtain such a license before exporting.
+ *
+ * WITHIN THAT CONSTRAINT, permission to use, copy, modify, and
+ * distribute this software and its documentation for any purpose and
+ * without fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright notice and
+ * this permission notice appear in supporting documentation, and that
+ * the name of M.I.T. not be used in advertising or publicity pertaining
+ * to distribution of the software without specific, written prior
+ * permission.  Furthermore if you modify this software you must label
+ * your software as modified software and not distribute it in such a
+ * fashion that it might be confused with the original M.I.T. software.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is" without express
+ * or implied warranty.
+ */
+
+
+#include "aesni.h"
+
+#ifdef K5_AESNI
+
+#include <wmmintrin.h>
+
+#define TARGET __attribute__((target("aes,sse2")))
+
+/* Mix the previous round key with the output of aeskeygenassist, as selected
+ * by the shuffle already applied to assist. */
+static inline TARGET __m128i
+mix_key(__m128i key, __m128i assist)
+{
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, assist);
+}
+
+#define ASSIST_HI(k, rcon) \
+    _mm_shuffle_epi32(_mm_aeskeygenassist_si128(k, rcon), 0xff)
+#define ASSIST_LO(k) \
+    _mm_shuffle_epi32(_mm_aeskeygenassist_si128(k, 0), 0xaa)
+
+static TARGET void
+expand_128(const unsigned char *key, __m128i *ks)
+{
+    __m128i k = _mm_loadu_si128((const __m128i *)key);
+
+    ks[0] = k;
+    ks[1] = k = mix_key(k, ASSIST_HI(k, 0x01));
+    ks[2] = k = mix_key(k, ASSIST_HI(k, 0x02));
+    ks[3] = k = mix_key(k, ASSIST_HI(k, 0x04));
+    ks[4] = k = mix_key(k, ASSIST_HI(k, 0x08));
+    ks[5] = k = mix_key(k, ASSIST_HI(k, 0x10));
+    ks[6] = k = mix_key(k, ASSIST_HI(k, 0x20));
+    ks[7] = k = mix_key(k, ASSIST_HI(k, 0x40));
+    ks[8] = k = mix_key(k, ASSIST_HI(k, 0x80));
+    ks[9] = k = mix_key(k, ASSIST_HI(k, 0x1b));
+    ks[10] = mix_key(k, ASSIST_HI(k, 0x36));
+}
+
+static TARGET void
+expand_256(const unsigned char *key, __m128i *ks)
+{
+    __m128i a = _mm_loadu_si128((const __m128i *)key);
+    __m128i b = _mm_loadu_si128((const __m128i *)(key + 16));
+
+    ks[0] = a;
+    ks[1] = b;
+    ks[2] = a = mix_key(a, ASSIST_HI(b, 0x01));
+    ks[3] = b = mix_key(b, ASSIST_LO(a));
+    ks[4] = a = mix_key(a, ASSIST_HI(b, 0x02));
+    ks[5] = b = mix_key(b, ASSIST_LO(a));
+    ks[6] = a = mix_key(a, ASSIST_HI(b, 0x04));
+    ks[7] = b = mix_key(b, ASSIST_LO(a));
+    ks[8] = a = mix_key(a, ASSIST_HI(b, 0x08));
+    ks[9] = b = mix_key(b, ASSIST_LO(a));
+    ks[10] = a = mix_key(a, ASSIST_HI(b, 0x10));
+    ks[11] = b = mix_key(b, ASSIST_LO(a));
+    ks[12] = a = mix_key(a, ASSIST_HI(b, 0x20));
+    ks[13] = b = mix_key(b, ASSIST_LO(a));
+    ks[14] = mix_key(a, ASSIST_HI(b, 0x40));
+}
+
+int TARGET
+aesni_expand_key(const unsigned char *key, size_t len, struct aesni_key *k)
+{
+    __m128i ks[15];
+    int i, nr;
+
+    if (len == 16) {
+        nr = 10;
+        expand_128(key, ks);
+    } else if (len == 32) {
+        nr = 14;
+        expand_256(key, ks);
+    } else {
+        k->nrounds = 0;
+        return 0;
+    }
+
+    /* The decryption schedule runs backwards, with InvMixColumns applied to
+     * the inner round keys for use with aesdec. */
+    for (i = 0; i <= nr; i++)
+        _mm_storeu_si128((__m128i *)k->enc[i], ks[i]);
+    _mm_storeu_si128((__m128i *)k->dec[0], ks[nr]);
+    for (i = 1; i < nr; i++)
+        _mm_storeu_si128((__m128i *)k->dec[i], _mm_aesimc_si128(ks[nr - i]));
+    _mm_storeu_si128((__m128i *)k->dec[nr], ks[0]);
+    k->nrounds = nr;
+    return 1;
+}
+
+#define RK(sched, i) _mm_loadu_si128((const __m128i *)(sched)[i])
+
+static inline TARGET __m128i
+encrypt1(const struct aesni_key *k, __m128i b)
+{
+    int i;
+
+    b = _mm_xor_si128(b, RK(k->enc, 0));
+    for (i = 1; i < k->nrounds; i++)
+        b = _mm_aesenc_si128(b, RK(k->enc, i));
+    return _mm_aesenclast_si128(b, RK(k->enc, k->nrounds));
+}
+
+static inline TARGET __m128i
+decrypt1(const struct aesni_key *k, __m128i b)
+{
+    int i;
+
+    b = _mm_xor_si128(b, RK(k->dec, 0));
+    for (i = 1; i < k->nrounds; i++)
+        b = _mm_aesdec_si128(b, RK(k->dec, i));
+    return _mm_aesdeclast_si128(b, RK(k->dec, k->nrounds));
+}
+
+void TARGET
+aesni_enc_block(const struct aesni_key *k, const unsigned char *in,
+                unsigned char *out)
+{
+    __m128i b = _mm_loadu_si128((const __m128i *)in);
+
+    _mm_storeu_si128((__m128i *)out, encrypt1(k, b));
+}
+
+void TARGET
+aesni_dec_block(const struct aesni_key *k, const unsigned char *in,
+                unsigned char *out)
+{
+    __m128i b = _mm_loadu_si128((const __m128i *)in);
+
+    _mm_storeu_si128((__m128i *)out, decrypt1(k, b));
+}
+
+void TARGET
+aesni_cbc_enc(const struct aesni_key *k, unsigned char *iv,
+              unsigned char *data, size_t nblocks)
+{
+    __m128i *p = (__m128i *)data;
+    __m128i c = _mm_loadu_si128((const __m128i *)iv);
+    size_t i;
+
+    /* Each block depends on the last, so there is no parallelism here. */
+    for (i = 0; i < nblocks; i++) {
+        c = encrypt1(k, _mm_xor_si128(c, _mm_loadu_si128(p + i)));
+        _mm_storeu_si128(p + i, c);
+    }
+    _mm_storeu_si128((__m128i *)iv, c);
+}
+
+void TARGET
+aesni_cbc_dec(const struct aesni_key *k, unsigned char *iv,
+              unsigned char *data, size_t nblocks)
+{
+    __m128i *p = (__m128i *)data;
+    __m128i prev = _mm_loadu_si128((const __m128i *)iv);
+    __m128i c0, c1, c2, c3, b0, b1, b2, b3, rk;
+    size_t i = 0;
+    int r, nr = k->nrounds;
+
+    /* Decrypt four blocks at a time, so that the rounds of independent blocks
+     * overlap in the pipeline. */
+    for (; i + 4 <= nblocks; i += 4) {
+        c0 = _mm_loadu_si128(p + i);
+        c1 = _mm_loadu_si128(p + i + 1);
+        c2 = _mm_loadu_si128(p + i + 2);
+        c3 = _mm_loadu_si128(p + i + 3);
+        rk = RK(k->dec, 0);
+        b0 = _mm_xor_si128(c0, rk);
+        b1 = _mm_xor_si128(c1, rk);
+        b2 = _mm_xor_si128(c2, rk);
+        b3 = _mm_xor_si128(c3, rk);
+        for (r = 1; r < nr; r++) {
+            rk = RK(k->dec, r);
+            b0 = _mm_aesdec_si128(b0, rk);
+            b1 = _mm_aesdec_si128(b1, rk);
+            b2 = _mm_aesdec_si128(b2, rk);
+            b3 = _mm_aesdec_si128(b3, rk);
+        }
+        rk = RK(k->dec, nr);
+        b0 = _mm_aesdeclast_si128(b0, rk);
+        b1 = _mm_aesdeclast_si128(b1, rk);
+        b2 = _mm_aesdeclast_si128(b2, rk);
+        b3 = _mm_aesdeclast_si128(b3, rk);
+        _mm_storeu_si128(p + i, _mm_xor_si128(b0, prev));
+        _mm_storeu_si128(p + i + 1, _mm_xor_si128(b1, c0));
+        _mm_storeu_si128(p + i + 2, _mm_xor_si128(b2, c1));
+        _mm_storeu_si128(p + i + 3, _mm_xor_si128(b3, c2));
+        prev = c3;
+    }
+    for (; i < nblocks; i++) {
+        c0 = _mm_loadu_si128(p + i);
+        _mm_storeu_si128(p + i, _mm_xor_si128(decrypt1(k, c0), prev));
+        prev = c0;
+    }
+    _mm_storeu_si128((__m128i *)iv, prev);
+}
+
+/* Encrypt nblocks blocks in each of four streams, interleaving the rounds of
+ * the four chains.  The keys must all have the same number of rounds. */
+static TARGET void
+cbc_enc4(struct aesni_stream **lane, size_t nblocks)
+{
+    const struct aesni_key *k0 = lane[0]->key, *k1 = lane[1]->key;
+    const struct aesni_key *k2 = lane[2]->key, *k3 = lane[3]->key;
+    __m128i *p0 = (__m128i *)lane[0]->data, *p1 = (__m128i *)lane[1]->data;
+    __m128i *p2 = (__m128i *)lane[2]->data, *p3 = (__m128i *)lane[3]->data;
+    __m128i c0, c1, c2, c3;
+    size_t i;
+    int r, nr = k0->nrounds;
+
+    c0 = _mm_loadu_si128((const __m128i *)lane[0]->iv);
+    c1 = _mm_loadu_si128((const __m128i *)lane[1]->iv);
+    c2 = _mm_loadu_si128((const __m128i *)lane[2]->iv);
+    c3 = _mm_loadu_si128((const __m128i *)lane[3]->iv);
+    for (i = 0; i < nblocks; i++) {
+        c0 = _mm_xor_si128(c0, _mm_loadu_si128(p0 + i));
+        c1 = _mm_xor_si128(c1, _mm_loadu_si128(p1 + i));
+        c2 = _mm_xor_si128(c2, _mm_loadu_si128(p2 + i));
+        c3 = _mm_xor_si128(c3, _mm_loadu_si128(p3 + i));
+        c0 = _mm_xor_si128(c0, RK(k0->enc, 0));
+        c1 = _mm_xor_si128(c1, RK(k1->enc, 0));
+        c2 = _mm_xor_si128(c2, RK(k2->enc, 0));
+        c3 = _mm_xor_si128(c3, RK(k3->enc, 0));
+        for (r = 1; r < nr; r++) {
+            c0 = _mm_aesenc_si128(c0, RK(k0->enc, r));
+            c1 = _mm_aesenc_si128(c1, RK(k1->enc, r));
+            c2 = _mm_aesenc_si128(c2, RK(k2->enc, r));
+            c3 = _mm_aesenc_si128(c3, RK(k3->enc, r));
+        }
+        c0 = _mm_aesenclast_si128(c0, RK(k0->enc, nr));
+        c1 = _mm_aesenclast_si128(c1, RK(k1->enc, nr));
+        c2 = _mm_aesenclast_si128(c2, RK(k2->enc, nr));
+        c3 = _mm_aesenclast_si128(c3, RK(k3->enc, nr));
+        _mm_storeu_si128(p0 + i, c0);
+        _mm_storeu_si128(p1 + i, c1);
+        _mm_storeu_si128(p2 + i, c2);
+        _mm_storeu_si128(p3 + i, c3);
+    }
+    _mm_storeu_si128((__m128i *)lane[0]->iv, c0);
+    _mm_storeu_si128((__m128i *)lane[1]->iv, c1);
+    _mm_storeu_si128((__m128i *)lane[2]->iv, c2);
+    _mm_storeu_si128((__m128i *)lane[3]->iv, c3);
+}
+
+void
+aesni_cbc_enc_multi(struct aesni_stream *s, size_t nstreams)
+{
+    struct aesni_stream *lane[4] = { NULL, NULL, NULL, NULL };
+    size_t next = 0, n;
+    int l;
+
+    /* A single CBC chain is limited by the latency of aesenc; keep four
+     * independent chains in flight, refilling each lane from the remaining
+     * streams as its stream finishes. */
+    for (;;) {
+        for (l = 0; l < 4; l++) {
+            while ((lane[l] == NULL || lane[l]->nblocks == 0) &&
+                   next < nstreams)
+                lane[l] = &s[next++];
+            if (lane[l] == NULL || lane[l]->nblocks == 0)
+                break;
+        }
+        if (l < 4)
+            break;
+
+        n = lane[0]->nblocks;
+        for (l = 1; l < 4; l++) {
+            if (lane[l]->nblocks < n)
+                n = lane[l]->nblocks;
+        }
+        if (lane[1]->key->nrounds == lane[0]->key->nrounds &&
+            lane[2]->key->nrounds == lane[0]->key->nrounds &&
+            lane[3]->key->nrounds == lane[0]->key->nrounds) {
+            cbc_enc4(lane, n);
+        } else {
+            for (l = 0; l < 4; l++)
+                aesni_cbc_enc(lane[l]->key, lane[l]->iv, lane[l]->data, n);
+        }
+        for (l = 0; l < 4; l++) {
+            lane[l]->data += n * 16;
+            lane[l]->nblocks -= n;
+        }
+    }
+
+    /* Fewer than four streams are left; finish them one at a time. */
+    for (l = 0; l < 4; l++) {
+        if (lane[l] != NULL && lane[l]->nblocks > 0)
+            aesni_cbc_enc(lane[l]->key, lane[l]->iv, lane[l]->data,
+                          lane[l]->nblocks);
+    }
+}
+
+#endif /* K5_AESNI */
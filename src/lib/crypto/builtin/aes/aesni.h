@@ -0,0 +1,97 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* lib/crypto/builtin/aes/aesni.h - AES-NI block operations */
+/*
+ * Copyright (C) 2012 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Export of this software from the United States of America may
+ *   require a specific license from the United States Government.
+ *   It is the responsibility of any person or organization contemplating
+ *   export to obtain such a license before exporting.
+ *
+ * WITHIN THAT CONSTRAINT, permission to use, copy, modify, and
+ * distribute this software and its documentation for any purpose and
+ * without fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright notice and
+ * this permission notice appear in supporting documentation, and that
+ * the name of M.I.T. not be used in advertising or publicity pertaining
+ * to distribution of the software without specific, written prior
+ * permission.  Furthermore if you modify this software you must label
+ * your software as modified software and not distribute it in such a
+ * fashion that it might be confused with the original M.I.T. software.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is" without express
+ * or implied warranty.
+ */
+
+
+/*
+ * AES encryption and decryption using the x86-64 AES-NI instructions, for use
+ * by the builtin AES enc_provider when aesni_supported() says the CPU has
+ * them.
+ */
+
+#ifndef AESNI_H
+#define AESNI_H
+
+#include "autoconf.h"
+#include "x86cpu.h"
+#include <stddef.h>
+
+#ifdef K5_X86_ACCEL
+#define K5_AESNI 1
+#endif
+
+#ifdef K5_AESNI
+
+/* Expanded encryption and decryption round keys. */
+struct aesni_key {
+    unsigned char enc[15][16];
+    unsigned char dec[15][16];
+    int nrounds;                /* 0 if not expanded */
+};
+
+/* One independent CBC encryption for aesni_cbc_enc_multi(). */
+struct aesni_stream {
+    const struct aesni_key *key;
+    unsigned char *iv;
+    unsigned char *data;
+    size_t nblocks;
+};
+
+#define aesni_expand_key        krb5int_aesni_expand_key
+#define aesni_enc_block         krb5int_aesni_enc_block
+#define aesni_dec_block         krb5int_aesni_dec_block
+#define aesni_cbc_enc           krb5int_aesni_cbc_enc
+#define aesni_cbc_dec           krb5int_aesni_cbc_dec
+#define aesni_cbc_enc_multi     krb5int_aesni_cbc_enc_multi
+
+/* Return true if the CPU supports the AES-NI instructions. */
+#define aesni_supported() ((k5_x86_features() & K5_X86_AES) != 0)
+
+/* Expand a 16- or 32-byte key into k.  Return 0 (leaving k->nrounds 0) for
+ * any other length. */
+int aesni_expand_key(const unsigned char *key, size_t len,
+                     struct aesni_key *k);
+
+/* Encrypt or decrypt one block from in to out, which may be the same. */
+void aesni_enc_block(const struct aesni_key *k, const unsigned char *in,
+                     unsigned char *out);
+void aesni_dec_block(const struct aesni_key *k, const unsigned char *in,
+                     unsigned char *out);
+
+/* Encrypt or decrypt nblocks blocks of data in place in CBC mode, chaining
+ * from iv and leaving the last ciphertext block in iv. */
+void aesni_cbc_enc(const struct aesni_key *k, unsigned char *iv,
+                   unsigned char *data, size_t nblocks);
+void aesni_cbc_dec(const struct aesni_key *k, unsigned char *iv,
+                   unsigned char *data, size_t nblocks);
+
+/* Perform the CBC encryptions described by the nstreams entries of s, as
+ * aesni_cbc_enc() would, interleaving up to four streams at a time.  The data
+ * and nblocks fields of each stream are used as cursors. */
+void aesni_cbc_enc_multi(struct aesni_stream *s, size_t nstreams);
+
+#endif /* K5_AESNI */
+
+#endif /* AESNI_H */
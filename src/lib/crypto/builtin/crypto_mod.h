@@ -36,4 +36,7 @@
 #include <aes/aes.h>
 #include <sha2/sha2.h>
 
+/* pbkdf2.c computes PBKDF2 requests in parallel SHA-1 lanes. */
+#define K5_PBKDF2_HMAC_SHA1_BATCH
+
 #endif /* CRYPTO_MOD_H */
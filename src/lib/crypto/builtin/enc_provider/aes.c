@@ -25,21 +25,21 @@
  */
 
 #include "crypto_int.h"
-#include "aes.h"
+#include "keycache.h"
 
 #define CHECK_SIZES 0
 
-/*
- * Private per-key data to cache after first generation.  We don't
- * want to mess with the imported AES implementation too much, so
- * we'll just use two copies of its context, one for encryption and
- * one for decryption, and use the #rounds field as a flag for whether
- * we've initialized each half.
- */
-struct aes_key_info_cache {
-    aes_ctx enc_ctx, dec_ctx;
-};
-#define CACHE(X) ((struct aes_key_info_cache *)((X)->cache))
+/* How many CBC blocks to process at a time. */
+#define CHUNK_BLOCKS 16
+
+/* The AES key schedules in key X's cache (see keycache.h). */
+#define CACHE(X) (&((struct k5_builtin_cache *)(X)->cache)->sched.aes)
+
+#ifdef K5_AESNI
+#define USE_NI(c) ((c)->ni.nrounds != 0)
+#else
+#define USE_NI(c) 0
+#endif
 
 static inline void
 enc(unsigned char *out, const unsigned char *in, aes_ctx *ctx)
@@ -80,27 +80,120 @@ xorblock(unsigned char *out, const unsigned char *in)
     }
 }
 
+/* Set up key's cache for encryption, or for decryption if decrypt is true. */
+static krb5_error_code
+init_key_cache(krb5_key key, krb5_boolean decrypt)
+{
+    struct aes_key_info_cache *c;
+
+    if (k5_builtin_get_cache(key) == NULL)
+        return ENOMEM;
+    c = CACHE(key);
+#ifdef K5_AESNI
+    if (!c->ni_checked) {
+        if (aesni_supported()) {
+            (void)aesni_expand_key(key->keyblock.contents,
+                                   key->keyblock.length, &c->ni);
+        }
+        c->ni_checked = TRUE;
+    }
+#endif
+    if (USE_NI(c))
+        return 0;
+    if (!decrypt && c->enc_ctx.n_rnd == 0) {
+        if (aes_enc_key(key->keyblock.contents, key->keyblock.length,
+                        &c->enc_ctx) != aes_good)
+            abort();
+    }
+    if (decrypt && c->dec_ctx.n_rnd == 0) {
+        if (aes_dec_key(key->keyblock.contents, key->keyblock.length,
+                        &c->dec_ctx) != aes_good)
+            abort();
+    }
+    return 0;
+}
+
+static void
+enc_block(struct aes_key_info_cache *c, unsigned char *out,
+          const unsigned char *in)
+{
+#ifdef K5_AESNI
+    if (USE_NI(c)) {
+        aesni_enc_block(&c->ni, in, out);
+        return;
+    }
+#endif
+    enc(out, in, &c->enc_ctx);
+}
+
+static void
+dec_block(struct aes_key_info_cache *c, unsigned char *out,
+          const unsigned char *in)
+{
+#ifdef K5_AESNI
+    if (USE_NI(c)) {
+        aesni_dec_block(&c->ni, in, out);
+        return;
+    }
+#endif
+    dec(out, in, &c->dec_ctx);
+}
+
+/* CBC-encrypt nblocks blocks of data in place, chaining through iv. */
+static void
+cbc_enc(struct aes_key_info_cache *c, unsigned char *iv, unsigned char *data,
+        size_t nblocks)
+{
+#ifdef K5_AESNI
+    if (USE_NI(c)) {
+        aesni_cbc_enc(&c->ni, iv, data, nblocks);
+        return;
+    }
+#endif
+    for (; nblocks > 0; nblocks--, data += BLOCK_SIZE) {
+        xorblock(iv, data);
+        enc(data, iv, &c->enc_ctx);
+        memcpy(iv, data, BLOCK_SIZE);
+    }
+}
+
+/* CBC-decrypt nblocks blocks of data in place, chaining through iv. */
+static void
+cbc_dec(struct aes_key_info_cache *c, unsigned char *iv, unsigned char *data,
+        size_t nblocks)
+{
+    unsigned char tmp[BLOCK_SIZE];
+
+#ifdef K5_AESNI
+    if (USE_NI(c)) {
+        aesni_cbc_dec(&c->ni, iv, data, nblocks);
+        return;
+    }
+#endif
+    for (; nblocks > 0; nblocks--, data += BLOCK_SIZE) {
+        memcpy(tmp, data, BLOCK_SIZE);
+        dec(data, data, &c->dec_ctx);
+        xorblock(data, iv);
+        memcpy(iv, tmp, BLOCK_SIZE);
+    }
+}
+
 krb5_error_code
 krb5int_aes_encrypt(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
                     size_t num_data)
 {
+    krb5_error_code ret;
+    struct aes_key_info_cache *c;
     unsigned char tmp[BLOCK_SIZE], tmp2[BLOCK_SIZE];
-    int nblocks = 0, blockno;
-    size_t input_length, i;
+    unsigned char chunk[CHUNK_BLOCKS * BLOCK_SIZE], *p;
+    size_t input_length, nblocks, blockno, n, i;
     struct iov_block_state input_pos, output_pos;
 
-    if (key->cache == NULL) {
-        key->cache = malloc(sizeof(struct aes_key_info_cache));
-        if (key->cache == NULL)
-            return ENOMEM;
-        CACHE(key)->enc_ctx.n_rnd = CACHE(key)->dec_ctx.n_rnd = 0;
-    }
-    if (CACHE(key)->enc_ctx.n_rnd == 0) {
-        if (aes_enc_key(key->keyblock.contents, key->keyblock.length,
-                        &CACHE(key)->enc_ctx)
-            != aes_good)
-            abort();
-    }
+    ret = init_key_cache(key, FALSE);
+    if (ret)
+        return ret;
+    c = CACHE(key);
+
     if (ivec != NULL)
         memcpy(tmp, ivec->data, BLOCK_SIZE);
     else
@@ -119,24 +212,23 @@ krb5int_aes_encrypt(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
     nblocks = (input_length + BLOCK_SIZE - 1) / BLOCK_SIZE;
     if (nblocks == 1) {
         krb5int_c_iov_get_block(tmp, BLOCK_SIZE, data, num_data, &input_pos);
-        enc(tmp2, tmp, &CACHE(key)->enc_ctx);
+        enc_block(c, tmp2, tmp);
         krb5int_c_iov_put_block(data, num_data, tmp2, BLOCK_SIZE, &output_pos);
     } else if (nblocks > 1) {
         unsigned char blockN2[BLOCK_SIZE];   /* second last */
         unsigned char blockN1[BLOCK_SIZE];   /* last block */
 
-        for (blockno = 0; blockno < nblocks - 2; blockno++) {
-            unsigned char blockN[BLOCK_SIZE], *block;
-
-            krb5int_c_iov_get_block_nocopy(blockN, BLOCK_SIZE,
-                                           data, num_data, &input_pos, &block);
-            xorblock(tmp, block);
-            enc(block, tmp, &CACHE(key)->enc_ctx);
-            krb5int_c_iov_put_block_nocopy(data, num_data, blockN, BLOCK_SIZE,
-                                           &output_pos, block);
-
-            /* Set up for next block.  */
-            memcpy(tmp, block, BLOCK_SIZE);
+        /* CBC-encrypt all but the last two blocks, a chunk at a time,
+         * in place if a chunk lies within a single buffer. */
+        for (blockno = 0; blockno < nblocks - 2; blockno += n) {
+            n = nblocks - 2 - blockno;
+            if (n > CHUNK_BLOCKS)
+                n = CHUNK_BLOCKS;
+            krb5int_c_iov_get_block_nocopy(chunk, n * BLOCK_SIZE, data,
+                                           num_data, &input_pos, &p);
+            cbc_enc(c, tmp, p, n);
+            krb5int_c_iov_put_block_nocopy(data, num_data, chunk,
+                                           n * BLOCK_SIZE, &output_pos, p);
         }
 
         /* Do final CTS step for last two blocks (the second of which
@@ -151,13 +243,13 @@ krb5int_aes_encrypt(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
 
         /* Encrypt second last block */
         xorblock(tmp, blockN2);
-        enc(tmp2, tmp, &CACHE(key)->enc_ctx);
+        enc_block(c, tmp2, tmp);
         memcpy(blockN2, tmp2, BLOCK_SIZE); /* blockN2 now contains first block */
         memcpy(tmp, tmp2, BLOCK_SIZE);
 
         /* Encrypt last block */
         xorblock(tmp, blockN1);
-        enc(tmp2, tmp, &CACHE(key)->enc_ctx);
+        enc_block(c, tmp2, tmp);
         memcpy(blockN1, tmp2, BLOCK_SIZE);
 
         /* Put the last two blocks back into the iovec (reverse order) */
@@ -177,25 +269,19 @@ krb5_error_code
 krb5int_aes_decrypt(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
                     size_t num_data)
 {
+    krb5_error_code ret;
+    struct aes_key_info_cache *c;
     unsigned char tmp[BLOCK_SIZE], tmp2[BLOCK_SIZE], tmp3[BLOCK_SIZE];
-    int nblocks = 0, blockno;
-    unsigned int i;
-    size_t input_length;
+    unsigned char chunk[CHUNK_BLOCKS * BLOCK_SIZE], *p;
+    size_t input_length, nblocks, blockno, n, i;
     struct iov_block_state input_pos, output_pos;
 
     CHECK_SIZES;
 
-    if (key->cache == NULL) {
-        key->cache = malloc(sizeof(struct aes_key_info_cache));
-        if (key->cache == NULL)
-            return ENOMEM;
-        CACHE(key)->enc_ctx.n_rnd = CACHE(key)->dec_ctx.n_rnd = 0;
-    }
-    if (CACHE(key)->dec_ctx.n_rnd == 0) {
-        if (aes_dec_key(key->keyblock.contents, key->keyblock.length,
-                        &CACHE(key)->dec_ctx) != aes_good)
-            abort();
-    }
+    ret = init_key_cache(key, TRUE);
+    if (ret)
+        return ret;
+    c = CACHE(key);
 
     if (ivec != NULL)
         memcpy(tmp, ivec->data, BLOCK_SIZE);
@@ -215,23 +301,23 @@ krb5int_aes_decrypt(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
     nblocks = (input_length + BLOCK_SIZE - 1) / BLOCK_SIZE;
     if (nblocks == 1) {
         krb5int_c_iov_get_block(tmp, BLOCK_SIZE, data, num_data, &input_pos);
-        dec(tmp2, tmp, &CACHE(key)->dec_ctx);
+        dec_block(c, tmp2, tmp);
         krb5int_c_iov_put_block(data, num_data, tmp2, BLOCK_SIZE, &output_pos);
     } else if (nblocks > 1) {
         unsigned char blockN2[BLOCK_SIZE];   /* second last */
         unsigned char blockN1[BLOCK_SIZE];   /* last block */
 
-        for (blockno = 0; blockno < nblocks - 2; blockno++) {
-            unsigned char blockN[BLOCK_SIZE], *block;
-
-            krb5int_c_iov_get_block_nocopy(blockN, BLOCK_SIZE,
-                                           data, num_data, &input_pos, &block);
-            memcpy(tmp2, block, BLOCK_SIZE);
-            dec(block, block, &CACHE(key)->dec_ctx);
-            xorblock(block, tmp);
-            memcpy(tmp, tmp2, BLOCK_SIZE);
-            krb5int_c_iov_put_block_nocopy(data, num_data, blockN, BLOCK_SIZE,
-                                           &output_pos, block);
+        /* CBC-decrypt all but the last two blocks, a chunk at a time,
+         * in place if a chunk lies within a single buffer. */
+        for (blockno = 0; blockno < nblocks - 2; blockno += n) {
+            n = nblocks - 2 - blockno;
+            if (n > CHUNK_BLOCKS)
+                n = CHUNK_BLOCKS;
+            krb5int_c_iov_get_block_nocopy(chunk, n * BLOCK_SIZE, data,
+                                           num_data, &input_pos, &p);
+            cbc_dec(c, tmp, p, n);
+            krb5int_c_iov_put_block_nocopy(data, num_data, chunk,
+                                           n * BLOCK_SIZE, &output_pos, p);
         }
 
         /* Do last two blocks, the second of which (next-to-last block
@@ -248,7 +334,7 @@ krb5int_aes_decrypt(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
             memcpy(ivec->data, blockN2, BLOCK_SIZE);
 
         /* Decrypt second last block */
-        dec(tmp2, blockN2, &CACHE(key)->dec_ctx);
+        dec_block(c, tmp2, blockN2);
         /* Set tmp2 to last (possibly partial) plaintext block, and
            save it.  */
         xorblock(tmp2, blockN1);
@@ -258,7 +344,7 @@ krb5int_aes_decrypt(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
            ciphertext block.  */
         input_length %= BLOCK_SIZE;
         memcpy(tmp2, blockN1, input_length ? input_length : BLOCK_SIZE);
-        dec(tmp3, tmp2, &CACHE(key)->dec_ctx);
+        dec_block(c, tmp3, tmp2);
         xorblock(tmp3, tmp);
         memcpy(blockN1, tmp3, BLOCK_SIZE);
 
@@ -272,6 +358,113 @@ krb5int_aes_decrypt(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
     return 0;
 }
 
+#ifdef K5_AESNI
+
+static size_t
+encrypt_length(const krb5_crypto_iov *data, size_t num_data)
+{
+    size_t i, len = 0;
+
+    for (i = 0; i < num_data; i++) {
+        if (ENCRYPT_IOV(&data[i]))
+            len += data[i].data.length;
+    }
+    return len;
+}
+
+/*
+ * Encrypt a batch of messages.  CTS encryption is CBC encryption of the
+ * zero-padded message followed by a swap of the last two blocks, so we copy
+ * each message of two or more blocks into a contiguous buffer and let
+ * aesni_cbc_enc_multi interleave their CBC chains.  Other messages are
+ * encrypted individually.
+ */
+static void
+aes_encrypt_batch(krb5_crypto_msg *msgs, size_t num_msgs)
+{
+    struct aesni_stream *s = NULL;
+    krb5_crypto_msg *m, **bm = NULL;
+    struct iov_block_state pos;
+    unsigned char *buf = NULL, *p, tmp[BLOCK_SIZE];
+    size_t i, n, len, nblocks, total = 0;
+
+    s = calloc(num_msgs, sizeof(*s));
+    bm = calloc(num_msgs, sizeof(*bm));
+
+    /* Find the messages we can interleave and the space they need. */
+    for (i = 0, n = 0; i < num_msgs; i++) {
+        m = &msgs[i];
+        m->code = init_key_cache(m->key, FALSE);
+        if (m->code != 0)
+            continue;
+        len = encrypt_length(m->data, m->num_data);
+        if (s == NULL || bm == NULL || len <= BLOCK_SIZE ||
+            !USE_NI(CACHE(m->key))) {
+            m->code = krb5int_aes_encrypt(m->key, m->cipher_state, m->data,
+                                          m->num_data);
+            continue;
+        }
+        bm[n++] = m;
+        total += BLOCK_SIZE + (len + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    }
+    if (n == 0)
+        goto cleanup;
+
+    buf = calloc(1, total);
+    if (buf == NULL) {
+        for (i = 0; i < n; i++) {
+            m = bm[i];
+            m->code = krb5int_aes_encrypt(m->key, m->cipher_state, m->data,
+                                          m->num_data);
+        }
+        goto cleanup;
+    }
+
+    /* Gather each message's IV and zero-padded plaintext. */
+    for (i = 0, p = buf; i < n; i++) {
+        m = bm[i];
+        len = encrypt_length(m->data, m->num_data);
+        nblocks = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (m->cipher_state != NULL)
+            memcpy(p, m->cipher_state->data, BLOCK_SIZE);
+        IOV_BLOCK_STATE_INIT(&pos);
+        krb5int_c_iov_get_block(p + BLOCK_SIZE, len, m->data, m->num_data,
+                                &pos);
+        s[i].key = &CACHE(m->key)->ni;
+        s[i].iv = p;
+        s[i].data = p + BLOCK_SIZE;
+        s[i].nblocks = nblocks;
+        p += BLOCK_SIZE + nblocks * BLOCK_SIZE;
+    }
+
+    aesni_cbc_enc_multi(s, n);
+
+    /* Swap the last two ciphertext blocks and scatter the results. */
+    for (i = 0, p = buf; i < n; i++) {
+        m = bm[i];
+        len = encrypt_length(m->data, m->num_data);
+        nblocks = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (m->cipher_state != NULL)
+            memcpy(m->cipher_state->data, p, BLOCK_SIZE);
+        p += BLOCK_SIZE + (nblocks - 2) * BLOCK_SIZE;
+        memcpy(tmp, p, BLOCK_SIZE);
+        memcpy(p, p + BLOCK_SIZE, BLOCK_SIZE);
+        memcpy(p + BLOCK_SIZE, tmp, BLOCK_SIZE);
+        p += 2 * BLOCK_SIZE;
+        IOV_BLOCK_STATE_INIT(&pos);
+        krb5int_c_iov_put_block(m->data, m->num_data,
+                                p - nblocks * BLOCK_SIZE, len, &pos);
+        m->code = 0;
+    }
+
+cleanup:
+    zapfree(buf, total);
+    free(s);
+    free(bm);
+}
+
+#endif /* K5_AESNI */
+
 static krb5_error_code
 aes_init_state(const krb5_keyblock *key, krb5_keyusage usage,
                krb5_data *state)
@@ -284,12 +477,6 @@ aes_init_state(const krb5_keyblock *key, krb5_keyusage usage,
     return 0;
 }
 
-static void
-aes_key_cleanup(krb5_key key)
-{
-    zapfree(key->cache, sizeof(struct aes_key_info_cache));
-}
-
 const struct krb5_enc_provider krb5int_enc_aes128 = {
     16,
     16, 16,
@@ -298,7 +485,12 @@ const struct krb5_enc_provider krb5int_enc_aes128 = {
     NULL,
     aes_init_state,
     krb5int_default_free_state,
-    aes_key_cleanup
+    k5_builtin_key_cleanup,
+#ifdef K5_AESNI
+    aes_encrypt_batch
+#else
+    NULL
+#endif
 };
 
 const struct krb5_enc_provider krb5int_enc_aes256 = {
@@ -309,5 +501,10 @@ const struct krb5_enc_provider krb5int_enc_aes256 = {
     NULL,
     aes_init_state,
     krb5int_default_free_state,
-    aes_key_cleanup
+    k5_builtin_key_cleanup,
+#ifdef K5_AESNI
+    aes_encrypt_batch
+#else
+    NULL
+#endif
 };
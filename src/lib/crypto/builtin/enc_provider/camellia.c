@@ -25,20 +25,12 @@
  */
 
 #include "crypto_int.h"
-#include "camellia.h"
+#include "keycache.h"
 
 #ifdef CAMELLIA
 
-/*
- * Private per-key data to cache after first generation.  We don't want to mess
- * with the imported Cemallia implementation too much, so we'll just use two
- * copies of its context, one for encryption and one for decryption, and use
- * the #rounds field as a flag for whether we've initialized each half.
- */
-struct camellia_key_info_cache {
-    camellia_ctx enc_ctx, dec_ctx;
-};
-#define CACHE(X) ((struct camellia_key_info_cache *)((X)->cache))
+/* The Camellia key schedules in key X's cache (see keycache.h). */
+#define CACHE(X) (&((struct k5_builtin_cache *)(X)->cache)->sched.camellia)
 
 static inline void
 enc(unsigned char *out, const unsigned char *in, camellia_ctx *ctx)
@@ -88,12 +80,8 @@ krb5int_camellia_encrypt(krb5_key key, const krb5_data *ivec,
     size_t input_length, i;
     struct iov_block_state input_pos, output_pos;
 
-    if (key->cache == NULL) {
-        key->cache = malloc(sizeof(struct camellia_key_info_cache));
-        if (key->cache == NULL)
-            return ENOMEM;
-        CACHE(key)->enc_ctx.keybitlen = CACHE(key)->dec_ctx.keybitlen = 0;
-    }
+    if (k5_builtin_get_cache(key) == NULL)
+        return ENOMEM;
     if (CACHE(key)->enc_ctx.keybitlen == 0) {
         if (camellia_enc_key(key->keyblock.contents, key->keyblock.length,
                              &CACHE(key)->enc_ctx) != camellia_good)
@@ -181,12 +169,8 @@ krb5int_camellia_decrypt(krb5_key key, const krb5_data *ivec,
     size_t input_length;
     struct iov_block_state input_pos, output_pos;
 
-    if (key->cache == NULL) {
-        key->cache = malloc(sizeof(struct camellia_key_info_cache));
-        if (key->cache == NULL)
-            return ENOMEM;
-        CACHE(key)->enc_ctx.keybitlen = CACHE(key)->dec_ctx.keybitlen = 0;
-    }
+    if (k5_builtin_get_cache(key) == NULL)
+        return ENOMEM;
     if (CACHE(key)->dec_ctx.keybitlen == 0) {
         if (camellia_dec_key(key->keyblock.contents, key->keyblock.length,
                              &CACHE(key)->dec_ctx) != camellia_good)
@@ -328,6 +312,7 @@ const struct krb5_enc_provider krb5int_enc_camellia128 = {
     krb5int_camellia_cbc_mac,
     camellia_init_state,
     krb5int_default_free_state,
+    k5_builtin_key_cleanup
 };
 
 const struct krb5_enc_provider krb5int_enc_camellia256 = {
@@ -337,7 +322,8 @@ const struct krb5_enc_provider krb5int_enc_camellia256 = {
     krb5int_camellia_decrypt,
     krb5int_camellia_cbc_mac,
     camellia_init_state,
-    krb5int_default_free_state
+    krb5int_default_free_state,
+    k5_builtin_key_cleanup
 };
 
 #else /* CAMELLIA */
@@ -27,6 +27,7 @@
 
 #include "crypto_int.h"
 #include "des_int.h"
+#include "keycache.h"
 
 static krb5_error_code
 validate_and_schedule(krb5_key key, const krb5_data *ivec,
@@ -110,5 +111,6 @@ const struct krb5_enc_provider krb5int_enc_des3 = {
     k5_des3_decrypt,
     NULL,
     krb5int_des_init_state,
-    krb5int_default_free_state
+    krb5int_default_free_state,
+    k5_builtin_key_cleanup
 };
@@ -8,6 +8,7 @@
  */
 
 #include "crypto_int.h"
+#include "keycache.h"
 
 typedef struct
 {
@@ -188,5 +189,6 @@ const struct krb5_enc_provider krb5int_enc_arcfour = {
     k5_arcfour_docrypt,
     NULL,
     k5_arcfour_init_state, /*xxx not implemented yet*/
-    krb5int_default_free_state
+    krb5int_default_free_state,
+    k5_builtin_key_cleanup
 };
@@ -26,6 +26,7 @@
  */
 
 #include "crypto_int.h"
+#include "keycache.h"
 
 /*
  * Because our built-in HMAC implementation doesn't need to invoke any
@@ -111,10 +112,86 @@ cleanup:
     return ret;
 }
 
+/*
+ * For HMAC-SHA1, which the DK enctypes use for every message, we cache the
+ * SHA-1 states after the inner and outer padded keys in the key's cache (see
+ * keycache.h), so that each operation only hashes the data and the inner hash
+ * value.
+ */
+static void
+sha1_pads_init(const krb5_keyblock *keyblock, struct k5_builtin_cache *c)
+{
+    unsigned char xorkey[SHS_DATASIZE];
+    unsigned int i;
+
+    memset(xorkey, 0x36, SHS_DATASIZE);
+    for (i = 0; i < keyblock->length; i++)
+        xorkey[i] ^= keyblock->contents[i];
+    shsInit(&c->sha1_inner);
+    shsUpdate(&c->sha1_inner, xorkey, SHS_DATASIZE);
+
+    memset(xorkey, 0x5c, SHS_DATASIZE);
+    for (i = 0; i < keyblock->length; i++)
+        xorkey[i] ^= keyblock->contents[i];
+    shsInit(&c->sha1_outer);
+    shsUpdate(&c->sha1_outer, xorkey, SHS_DATASIZE);
+    c->sha1_init = TRUE;
+
+    zap(xorkey, SHS_DATASIZE);
+}
+
+static krb5_error_code
+hmac_sha1(krb5_key key, const krb5_crypto_iov *data, size_t num_data,
+          krb5_data *output)
+{
+    struct k5_builtin_cache *c;
+    SHS_INFO ctx;
+    unsigned char ihash[SHS_DIGESTSIZE];
+    size_t i;
+
+    if (output->length < SHS_DIGESTSIZE)
+        return KRB5_BAD_MSIZE;
+
+    c = k5_builtin_get_cache(key);
+    if (c == NULL)
+        return ENOMEM;
+    if (!c->sha1_init)
+        sha1_pads_init(&key->keyblock, c);
+
+    /* Compute the inner hash, continuing from the inner padded key. */
+    ctx = c->sha1_inner;
+    for (i = 0; i < num_data; i++) {
+        const krb5_crypto_iov *iov = &data[i];
+
+        if (SIGN_IOV(iov)) {
+            shsUpdate(&ctx, (unsigned char *)iov->data.data,
+                      iov->data.length);
+        }
+    }
+    shsFinal(&ctx);
+    for (i = 0; i < 5; i++)
+        store_32_be(ctx.digest[i], ihash + i * 4);
+
+    /* Compute the outer hash, continuing from the outer padded key. */
+    ctx = c->sha1_outer;
+    shsUpdate(&ctx, ihash, SHS_DIGESTSIZE);
+    shsFinal(&ctx);
+    output->length = SHS_DIGESTSIZE;
+    for (i = 0; i < 5; i++)
+        store_32_be(ctx.digest[i], (unsigned char *)output->data + i * 4);
+
+    zap(&ctx, sizeof(ctx));
+    zap(ihash, sizeof(ihash));
+    return 0;
+}
+
 krb5_error_code
 krb5int_hmac(const struct krb5_hash_provider *hash, krb5_key key,
              const krb5_crypto_iov *data, size_t num_data,
              krb5_data *output)
 {
+    if (hash == &krb5int_hash_sha1 &&
+        key->keyblock.length <= SHS_DATASIZE)
+        return hmac_sha1(key, data, num_data, output);
     return krb5int_hmac_keyblock(hash, &key->keyblock, data, num_data, output);
 }
@@ -0,0 +1,44 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* lib/crypto/builtin/keycache.c - Per-key state cached by the builtin back end */
+/*
+ * Copyright (C) 2012 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Export of this software from the United States of America may
+ *   require a specific license from the United States Government.
+ *   It is the responsibility of any person or organization contemplating
+ *   export to obtain such a license before exporting.
+ *
+ * WITHIN THAT CONSTRAINT, permission to use, copy, modify, and
+ * distribute this software and its documentation for any purpose and
+ * without fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright notice and
+ * this permission notice appear in supporting documentation, and that
+ * the name of M.I.T. not be used in advertising or publicity pertaining
+ * to distribution of the software without specific, written prior
+ * permission.  Furthermore if you modify this software you must label
+ * your software as modified software and not distribute it in such a
+ * fashion that it might be confused with the original M.I.T. software.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is" without express
+ * or implied warranty.
+ */
+
+
+#include "crypto_int.h"
+#include "keycache.h"
+
+struct k5_builtin_cache *
+k5_builtin_get_cache(krb5_key key)
+{
+    if (key->cache == NULL)
+        key->cache = calloc(1, sizeof(struct k5_builtin_cache));
+    return key->cache;
+}
+
+void
+k5_builtin_key_cleanup(krb5_key key)
+{
+    zapfree(key->cache, sizeof(struct k5_builtin_cache));
+    key->cache = NULL;
+}
@@ -0,0 +1,79 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* lib/crypto/builtin/keycache.h - Per-key state cached by the builtin back end */
+/*
+ * Copyright (C) 2012 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Export of this software from the United States of America may
+ *   require a specific license from the United States Government.
+ *   It is the responsibility of any person or organization contemplating
+ *   export to obtain such a license before exporting.
+ *
+ * WITHIN THAT CONSTRAINT, permission to use, copy, modify, and
+ * distribute this software and its documentation for any purpose and
+ * without fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright notice and
+ * this permission notice appear in supporting documentation, and that
+ * the name of M.I.T. not be used in advertising or publicity pertaining
+ * to distribution of the software without specific, written prior
+ * permission.  Furthermore if you modify this software you must label
+ * your software as modified software and not distribute it in such a
+ * fashion that it might be confused with the original M.I.T. software.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is" without express
+ * or implied warranty.
+ */
+
+/*
+ * The builtin cipher providers and HMAC-SHA1 keep their per-key state in a
+ * single structure in the krb5_key cache field, as the OpenSSL back end does,
+ * so that a key used both to encrypt and to compute HMACs has one owner and
+ * one cleanup method.  Each part is set up on first use.
+ */
+
+#ifndef KEYCACHE_H
+#define KEYCACHE_H
+
+#include "aes.h"
+#include "aesni.h"
+#include "camellia.h"
+#include "shs.h"
+
+/*
+ * Two copies of the AES context, one for encryption and one for decryption,
+ * using the #rounds field as a flag for whether each has been initialized.
+ * If the CPU has AES-NI instructions, only the ni schedule is expanded.
+ */
+struct aes_key_info_cache {
+    aes_ctx enc_ctx, dec_ctx;
+#ifdef K5_AESNI
+    krb5_boolean ni_checked;
+    struct aesni_key ni;
+#endif
+};
+
+/* As for AES, using the keybitlen field as the flag. */
+struct camellia_key_info_cache {
+    camellia_ctx enc_ctx, dec_ctx;
+};
+
+struct k5_builtin_cache {
+    /* Key schedules for the key's enctype. */
+    union {
+        struct aes_key_info_cache aes;
+        struct camellia_key_info_cache camellia;
+    } sched;
+
+    /* SHA-1 states after the inner and outer padded keys, for HMAC-SHA1. */
+    krb5_boolean sha1_init;
+    SHS_INFO sha1_inner, sha1_outer;
+};
+
+/* Return key's cache, allocating it if necessary.  Return NULL if out of
+ * memory. */
+struct k5_builtin_cache *k5_builtin_get_cache(krb5_key key);
+
+/* The key_cleanup method of the builtin enc providers. */
+void k5_builtin_key_cleanup(krb5_key key);
+
+#endif /* KEYCACHE_H */
@@ -24,242 +24,148 @@
  * or implied warranty.
  */
 
-#include <ctype.h>
 #include "crypto_int.h"
+#include "shs.h"
 
 /*
- * RFC 2898 specifies PBKDF2 in terms of an underlying pseudo-random
- * function with two arguments (password and salt||blockindex).  Right
- * now we only use PBKDF2 with the hmac-sha1 PRF, also specified in
- * RFC 2898, which invokes HMAC with the password as the key and the
- * second argument as the text.  (HMAC accepts any key size up to the
- * block size; the password is pre-hashed with unkeyed SHA1 if it is
- * longer than the block size.)
- *
- * For efficiency, it is better to generate the key from the password
- * once at the beginning, so we specify prf_fn in terms of a
- * krb5_key first argument.  That might not be convenient for a PRF
- * which uses the password in some other way, so this might need to be
- * adjusted in the future.
+ * PBKDF2-HMAC-SHA1 (RFC 2898) computes each 20-byte output block as the XOR
+ * of count chained HMAC values.  Every HMAC after the first one in a block
+ * hashes a single digest under the same key, so rather than going through
+ * the general HMAC code we compute the SHA-1 states after the inner and outer
+ * key blocks once per password, and let shsPBKDF2 run the iterations on the
+ * compression function directly.  Output blocks are independent, so every
+ * block of every request in a batch becomes a separate lane, which shsPBKDF2
+ * can compute in parallel.
  */
 
-typedef krb5_error_code (*prf_fn)(krb5_key pass, krb5_data *salt,
-                                  krb5_data *out);
-
-/* Not exported, for now.  */
-static krb5_error_code
-krb5int_pbkdf2 (prf_fn prf, size_t hlen, krb5_key pass,
-                const krb5_data *salt, unsigned long count,
-                const krb5_data *output);
-
-static int debug_hmac = 0;
-
-static void printd (const char *descr, krb5_data *d) {
-    unsigned int i, j;
-    const int r = 16;
-
-    printf("%s:", descr);
-
-    for (i = 0; i < d->length; i += r) {
-        printf("\n  %04x: ", i);
-        for (j = i; j < i + r && j < d->length; j++)
-            printf(" %02x", 0xff & d->data[j]);
-        for (; j < i + r; j++)
-            printf("   ");
-        printf("   ");
-        for (j = i; j < i + r && j < d->length; j++) {
-            int c = 0xff & d->data[j];
-            printf("%c", isprint(c) ? c : '.');
-        }
+/* Set ictx and octx to the SHA-1 states after the HMAC inner and outer key
+ * blocks for pass.  (The password is pre-hashed with unkeyed SHA-1 if it is
+ * longer than the block size.) */
+static void
+hmac_init(const krb5_data *pass, SHS_INFO *ictx, SHS_INFO *octx)
+{
+    unsigned char pad[SHS_DATASIZE], digest[SHS_DIGESTSIZE];
+    const unsigned char *key = (unsigned char *)pass->data;
+    unsigned int i, keylen = pass->length;
+    SHS_INFO ctx;
+
+    if (keylen > SHS_DATASIZE) {
+        shsInit(&ctx);
+        shsUpdate(&ctx, key, keylen);
+        shsFinal(&ctx);
+        for (i = 0; i < 5; i++)
+            store_32_be(ctx.digest[i], digest + i * 4);
+        key = digest;
+        keylen = SHS_DIGESTSIZE;
     }
-    printf("\n");
+
+    memset(pad, 0x36, SHS_DATASIZE);
+    for (i = 0; i < keylen; i++)
+        pad[i] ^= key[i];
+    shsInit(ictx);
+    shsUpdate(ictx, pad, SHS_DATASIZE);
+
+    memset(pad, 0x5c, SHS_DATASIZE);
+    for (i = 0; i < keylen; i++)
+        pad[i] ^= key[i];
+    shsInit(octx);
+    shsUpdate(octx, pad, SHS_DATASIZE);
+
+    zap(pad, sizeof(pad));
+    zap(digest, sizeof(digest));
+    zap(&ctx, sizeof(ctx));
 }
 
-static krb5_error_code
-F(char *output, char *u_tmp1, char *u_tmp2, prf_fn prf, size_t hlen,
-  krb5_key pass, const krb5_data *salt, unsigned long count, int i)
+/* Set up lane to compute output block number blockno (counting from 1) of
+ * req, by computing U_1 = HMAC(password, salt || INT(blockno)). */
+static void
+init_lane(SHS_PBKDF2_LANE *lane, const struct pbkdf2_req *req,
+          const SHS_INFO *ictx, const SHS_INFO *octx, unsigned long blockno)
 {
-    unsigned char ibytes[4];
-    size_t tlen;
-    unsigned int j, k;
-    krb5_data sdata;
-    krb5_data out;
-    krb5_error_code err;
-
-#if 0
-    printf("F(i=%d, count=%lu, pass=%d:%s)\n", i, count,
-           pass->length, pass->data);
-#endif
-
-    /* Compute U_1.  */
-    store_32_be(i, ibytes);
-
-    tlen = salt->length;
-    memcpy(u_tmp2, salt->data, tlen);
-    memcpy(u_tmp2 + tlen, ibytes, 4);
-    tlen += 4;
-    sdata.data = u_tmp2;
-    sdata.length = tlen;
-
-#if 0
-    printd("initial salt", &sdata);
-#endif
-
-    out.data = u_tmp1;
-    out.length = hlen;
-
-#if 0
-    printf("F: computing hmac #1 (U_1) with %s\n", pdata.contents);
-#endif
-    err = (*prf)(pass, &sdata, &out);
-    if (err)
-        return err;
-#if 0
-    printd("F: prf return value", &out);
-#endif
-    memcpy(output, u_tmp1, hlen);
-
-    /* Compute U_2, .. U_c.  */
-    sdata.length = hlen;
-    for (j = 2; j <= count; j++) {
-#if 0
-        printf("F: computing hmac #%d (U_%d)\n", j, j);
-#endif
-        memcpy(u_tmp2, u_tmp1, hlen);
-        err = (*prf)(pass, &sdata, &out);
-        if (err)
-            return err;
-#if 0
-        printd("F: prf return value", &out);
-#endif
-        /* And xor them together.  */
-        for (k = 0; k < hlen; k++)
-            output[k] ^= u_tmp1[k];
-#if 0
-        printf("F: xor result:\n");
-        for (k = 0; k < hlen; k++)
-            printf(" %02x", 0xff & output[k]);
-        printf("\n");
-#endif
-    }
-    return 0;
+    unsigned char ibytes[4], digest[SHS_DIGESTSIZE];
+    SHS_INFO ctx;
+    int i;
+
+    store_32_be(blockno, ibytes);
+    ctx = *ictx;
+    shsUpdate(&ctx, (unsigned char *)req->salt.data, req->salt.length);
+    shsUpdate(&ctx, ibytes, 4);
+    shsFinal(&ctx);
+    for (i = 0; i < 5; i++)
+        store_32_be(ctx.digest[i], digest + i * 4);
+
+    ctx = *octx;
+    shsUpdate(&ctx, digest, SHS_DIGESTSIZE);
+    shsFinal(&ctx);
+
+    memcpy(lane->inner, ictx->digest, sizeof(lane->inner));
+    memcpy(lane->outer, octx->digest, sizeof(lane->outer));
+    memcpy(lane->u, ctx.digest, sizeof(lane->u));
+    memcpy(lane->t, ctx.digest, sizeof(lane->t));
+    lane->count = (req->count > 1) ? req->count - 1 : 0;
+
+    zap(digest, sizeof(digest));
+    zap(&ctx, sizeof(ctx));
 }
 
-static krb5_error_code
-krb5int_pbkdf2 (prf_fn prf, size_t hlen, krb5_key pass,
-                const krb5_data *salt, unsigned long count,
-                const krb5_data *output)
+krb5_error_code
+krb5int_pbkdf2_hmac_sha1_batch(const struct pbkdf2_req *reqs, size_t nreqs)
 {
-    int l, i;
-    char *utmp1, *utmp2;
-    char utmp3[20];             /* XXX length shouldn't be hardcoded! */
-
-    if (output->length == 0 || hlen == 0)
-        abort();
-    /* Step 1 & 2.  */
-    if (output->length / hlen > 0xffffffff)
-        abort();
-    /* Step 2.  */
-    l = (output->length + hlen - 1) / hlen;
-
-    utmp1 = /*output + dklen; */ malloc(hlen);
-    if (utmp1 == NULL)
-        return ENOMEM;
-    utmp2 = /*utmp1 + hlen; */ malloc(salt->length + 4 + hlen);
-    if (utmp2 == NULL) {
-        free(utmp1);
-        return ENOMEM;
+    SHS_PBKDF2_LANE *lanes, *lane;
+    SHS_INFO ictx, octx;
+    unsigned char block[SHS_DIGESTSIZE];
+    size_t i, nlanes, len, pos;
+    unsigned long b, nblocks;
+    krb5_error_code ret;
+    int j;
+
+    for (i = 0, nlanes = 0; i < nreqs; i++) {
+        if (reqs[i].out.length == 0)
+            abort();
+        nlanes += (reqs[i].out.length + SHS_DIGESTSIZE - 1) / SHS_DIGESTSIZE;
+    }
+    lanes = k5alloc(nlanes * sizeof(*lanes), &ret);
+    if (lanes == NULL)
+        return ret;
+
+    /* Compute U_1 for every output block. */
+    for (i = 0, lane = lanes; i < nreqs; i++) {
+        hmac_init(&reqs[i].pass, &ictx, &octx);
+        nblocks = (reqs[i].out.length + SHS_DIGESTSIZE - 1) / SHS_DIGESTSIZE;
+        for (b = 1; b <= nblocks; b++)
+            init_lane(lane++, &reqs[i], &ictx, &octx, b);
     }
 
-    /* Step 3.  */
-    for (i = 1; i <= l; i++) {
-#if 0
-        int j;
-#endif
-        krb5_error_code err;
-        char *out;
-
-        if (i == l)
-            out = utmp3;
-        else
-            out = output->data + (i-1) * hlen;
-        err = F(out, utmp1, utmp2, prf, hlen, pass, salt, count, i);
-        if (err) {
-            free(utmp1);
-            free(utmp2);
-            return err;
+    shsPBKDF2(lanes, nlanes);
+
+    /* Concatenate each request's output blocks, truncating the last. */
+    for (i = 0, lane = lanes; i < nreqs; i++) {
+        for (pos = 0; pos < reqs[i].out.length; pos += len, lane++) {
+            for (j = 0; j < 5; j++)
+                store_32_be(lane->t[j], block + j * 4);
+            len = reqs[i].out.length - pos;
+            if (len > SHS_DIGESTSIZE)
+                len = SHS_DIGESTSIZE;
+            memcpy(reqs[i].out.data + pos, block, len);
         }
-        if (i == l)
-            memcpy(output->data + (i-1) * hlen, utmp3,
-                   output->length - (i-1) * hlen);
-
-#if 0
-        printf("after F(%d), @%p:\n", i, output->data);
-        for (j = (i-1) * hlen; j < i * hlen; j++)
-            printf(" %02x", 0xff & output->data[j]);
-        printf ("\n");
-#endif
     }
-    free(utmp1);
-    free(utmp2);
-    return 0;
-}
 
-/*
- * Implements the hmac-sha1 PRF.  pass has been pre-hashed (if
- * necessary) and converted to a key already; salt has had the block
- * index appended to the original salt.
- */
-static krb5_error_code
-hmac_sha1(krb5_key pass, krb5_data *salt, krb5_data *out)
-{
-    const struct krb5_hash_provider *h = &krb5int_hash_sha1;
-    krb5_error_code err;
-    krb5_crypto_iov iov;
-
-    if (debug_hmac)
-        printd(" hmac input", salt);
-    iov.flags = KRB5_CRYPTO_TYPE_DATA;
-    iov.data = *salt;
-    err = krb5int_hmac(h, pass, &iov, 1, out);
-    if (err == 0 && debug_hmac)
-        printd(" hmac output", out);
-    return err;
+    zap(block, sizeof(block));
+    zap(&ictx, sizeof(ictx));
+    zap(&octx, sizeof(octx));
+    zapfree(lanes, nlanes * sizeof(*lanes));
+    return 0;
 }
 
 krb5_error_code
 krb5int_pbkdf2_hmac_sha1(const krb5_data *out, unsigned long count,
                          const krb5_data *pass, const krb5_data *salt)
 {
-    const struct krb5_hash_provider *h = &krb5int_hash_sha1;
-    krb5_keyblock keyblock;
-    krb5_key key;
-    char tmp[40];
-    krb5_data d;
-    krb5_crypto_iov iov;
-    krb5_error_code err;
-
-    assert(h->hashsize <= sizeof(tmp));
-    if (pass->length > h->blocksize) {
-        d = make_data(tmp, h->hashsize);
-        iov.flags = KRB5_CRYPTO_TYPE_DATA;
-        iov.data = *pass;
-        err = h->hash(&iov, 1, &d);
-        if (err)
-            return err;
-        keyblock.length = d.length;
-        keyblock.contents = (krb5_octet *) d.data;
-    } else {
-        keyblock.length = pass->length;
-        keyblock.contents = (krb5_octet *) pass->data;
-    }
-    keyblock.enctype = ENCTYPE_NULL;
-
-    err = krb5_k_create_key(NULL, &keyblock, &key);
-    if (err)
-        return err;
+    struct pbkdf2_req req;
 
-    err = krb5int_pbkdf2(hmac_sha1, 20, key, salt, count, out);
-    krb5_k_free_key(NULL, key);
-    return err;
+    req.out = *out;
+    req.count = count;
+    req.pass = *pass;
+    req.salt = *salt;
+    return krb5int_pbkdf2_hmac_sha1_batch(&req, 1);
 }
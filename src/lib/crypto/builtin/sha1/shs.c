@@ -1,5 +1,6 @@
 /* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
 #include "shs.h"
+#include "x86cpu.h"
 #ifdef HAVE_SYS_TYPES_H
 #include <sys/types.h>
 #endif
@@ -90,6 +91,295 @@ void shsInit(SHS_INFO *shsInfo)
     shsInfo->countLo = shsInfo->countHi = 0;
 }
 
+/* On x86-64, use the SHA extensions when the CPU has them. */
+
+#ifdef K5_X86_ACCEL
+#define K5_SHANI 1
+#endif
+
+#ifdef K5_SHANI
+
+#include <immintrin.h>
+
+#define TARGET __attribute__((target("sha,sse4.1,ssse3")))
+
+#define shaniSupported() ((k5_x86_features() & K5_X86_SHA) != 0)
+
+/* Four rounds of group g (0-19), using message words m0 and advancing the
+   message schedule held in m1-m3.  e1 receives the E value for the next
+   group. */
+#define niRounds(g, e0, e1, m0, m1, m2, m3)                             \
+    e0 = (g == 0) ? _mm_add_epi32(e0, m0) : _mm_sha1nexte_epu32(e0, m0); \
+    e1 = abcd;                                                          \
+    if (g >= 3 && g <= 18)                                              \
+        m1 = _mm_sha1msg2_epu32(m1, m0);                                \
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, g / 5);                        \
+    if (g >= 1 && g <= 16)                                              \
+        m3 = _mm_sha1msg1_epu32(m3, m0);                                \
+    if (g >= 2 && g <= 17)                                              \
+        m2 = _mm_xor_si128(m2, m0)
+
+/* All eighty rounds of the block in m0-m3.  The E value for the
+   feed-forward is left in e0. */
+#define niBlock()                                                       \
+    niRounds(0, e0, e1, m0, m1, m2, m3);                                \
+    niRounds(1, e1, e0, m1, m2, m3, m0);                                \
+    niRounds(2, e0, e1, m2, m3, m0, m1);                                \
+    niRounds(3, e1, e0, m3, m0, m1, m2);                                \
+    niRounds(4, e0, e1, m0, m1, m2, m3);                                \
+    niRounds(5, e1, e0, m1, m2, m3, m0);                                \
+    niRounds(6, e0, e1, m2, m3, m0, m1);                                \
+    niRounds(7, e1, e0, m3, m0, m1, m2);                                \
+    niRounds(8, e0, e1, m0, m1, m2, m3);                                \
+    niRounds(9, e1, e0, m1, m2, m3, m0);                                \
+    niRounds(10, e0, e1, m2, m3, m0, m1);                               \
+    niRounds(11, e1, e0, m3, m0, m1, m2);                               \
+    niRounds(12, e0, e1, m0, m1, m2, m3);                               \
+    niRounds(13, e1, e0, m1, m2, m3, m0);                               \
+    niRounds(14, e0, e1, m2, m3, m0, m1);                               \
+    niRounds(15, e1, e0, m3, m0, m1, m2);                               \
+    niRounds(16, e0, e1, m0, m1, m2, m3);                               \
+    niRounds(17, e1, e0, m1, m2, m3, m0);                               \
+    niRounds(18, e0, e1, m2, m3, m0, m1);                               \
+    niRounds(19, e1, e0, m3, m0, m1, m2)
+
+/* Transform nblocks 64-byte blocks of input.  If words is true, in holds
+   the block as SHS_LONG values in host order, as in shsInfo->data;
+   otherwise it holds the message bytes. */
+static TARGET void SHSTransformNI(SHS_LONG *digest, const void *in,
+                                  size_t nblocks, int words)
+{
+    const __m128i *p = in;
+    __m128i abcd, e0, e1, abcd_save, e_save, m0, m1, m2, m3, mask;
+
+    /* Either way, the word order within each 16 bytes must be reversed. */
+    if (words)
+        mask = _mm_set_epi64x(0x0302010007060504LL, 0x0b0a09080f0e0d0cLL);
+    else
+        mask = _mm_set_epi64x(0x0001020304050607LL, 0x08090a0b0c0d0e0fLL);
+
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *)digest), 0x1b);
+    e0 = _mm_set_epi32(digest[4], 0, 0, 0);
+
+    for (; nblocks > 0; nblocks--, p += 4) {
+        abcd_save = abcd;
+        e_save = e0;
+        m0 = _mm_shuffle_epi8(_mm_loadu_si128(p), mask);
+        m1 = _mm_shuffle_epi8(_mm_loadu_si128(p + 1), mask);
+        m2 = _mm_shuffle_epi8(_mm_loadu_si128(p + 2), mask);
+        m3 = _mm_shuffle_epi8(_mm_loadu_si128(p + 3), mask);
+
+        niBlock();
+
+        e0 = _mm_sha1nexte_epu32(e0, e_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+
+    _mm_storeu_si128((__m128i *)digest, _mm_shuffle_epi32(abcd, 0x1b));
+    digest[4] = _mm_extract_epi32(e0, 3);
+}
+
+/* Run a PBKDF2 lane's iterations (see shsPBKDF2) with all of the state held
+   in registers.  The hashed value is always a digest following a key block,
+   so the message is the digest in m0 and the top word of m1, plus constant
+   padding and length. */
+static TARGET void SHSPBKDF2NI(SHS_PBKDF2_LANE *lane)
+{
+    __m128i abcd, e0, e1, m0, m1, m2, m3, pad, len;
+    __m128i iabcd, ie, oabcd, oe, uabcd, ue, tabcd, te;
+    unsigned long n;
+
+    pad = _mm_set_epi32(0, 0x80000000, 0, 0);
+    len = _mm_set_epi32(0, 0, 0, (SHS_DATASIZE + SHS_DIGESTSIZE) * 8);
+    iabcd = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *)lane->inner), 0x1b);
+    ie = _mm_set_epi32(lane->inner[4], 0, 0, 0);
+    oabcd = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *)lane->outer), 0x1b);
+    oe = _mm_set_epi32(lane->outer[4], 0, 0, 0);
+    uabcd = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *)lane->u), 0x1b);
+    ue = _mm_set_epi32(lane->u[4], 0, 0, 0);
+    tabcd = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *)lane->t), 0x1b);
+    te = _mm_set_epi32(lane->t[4], 0, 0, 0);
+
+    for (n = lane->count; n > 0; n--) {
+        /* Inner hash of U. */
+        abcd = iabcd;
+        e0 = ie;
+        m0 = uabcd;
+        m1 = _mm_or_si128(ue, pad);
+        m2 = _mm_setzero_si128();
+        m3 = len;
+        niBlock();
+
+        /* Outer hash of the inner digest. */
+        m0 = _mm_add_epi32(abcd, iabcd);
+        m1 = _mm_or_si128(_mm_sha1nexte_epu32(e0, ie), pad);
+        m2 = _mm_setzero_si128();
+        m3 = len;
+        abcd = oabcd;
+        e0 = oe;
+        niBlock();
+
+        uabcd = _mm_add_epi32(abcd, oabcd);
+        ue = _mm_sha1nexte_epu32(e0, oe);
+        tabcd = _mm_xor_si128(tabcd, uabcd);
+        te = _mm_xor_si128(te, ue);
+    }
+
+    _mm_storeu_si128((__m128i *)lane->u, _mm_shuffle_epi32(uabcd, 0x1b));
+    lane->u[4] = _mm_extract_epi32(ue, 3);
+    _mm_storeu_si128((__m128i *)lane->t, _mm_shuffle_epi32(tabcd, 0x1b));
+    lane->t[4] = _mm_extract_epi32(te, 3);
+    lane->count = 0;
+}
+
+#endif /* K5_SHANI */
+
+/* Without the SHA extensions, PBKDF2 lanes can still be computed four at a
+   time by holding a word of each of four lanes in the elements of a vector,
+   and performing the SHS operations on vectors.  SSE2 is part of the x86-64
+   baseline, so there is no need to check the CPU. */
+
+#ifdef __SSE2__
+
+#include <emmintrin.h>
+
+#define vADD(x, y)      _mm_add_epi32(x, y)
+#define vXOR(x, y)      _mm_xor_si128(x, y)
+#define vROTL(n, x)     _mm_or_si128(_mm_slli_epi32(x, n),             \
+                                     _mm_srli_epi32(x, 32 - (n)))
+
+#define vf1(x, y, z)    vXOR(z, _mm_and_si128(x, vXOR(y, z)))
+#define vf2(x, y, z)    vXOR(vXOR(x, y), z)
+#define vf3(x, y, z)    _mm_or_si128(_mm_and_si128(x, y),              \
+                                     _mm_and_si128(z, _mm_or_si128(x, y)))
+#define vf4(x, y, z)    vXOR(vXOR(x, y), z)
+
+#define vexpand(W, i)                                                   \
+    (W[(i) & 15] = vROTL(1, vXOR(vXOR(W[(i) & 15], W[((i) - 14) & 15]),  \
+                                 vXOR(W[((i) - 8) & 15], W[((i) - 3) & 15]))))
+
+/* Five rounds starting at i, renaming the variables as in SHSTransform.  i
+   is a constant, so the choice of W[i] or expand(W, i) is made at compile
+   time. */
+#define vW(i)           (((i) < 16) ? W[(i) & 15] : vexpand(W, i))
+#define vSubRound(a, b, c, d, e, f, k, data)                            \
+    (e = vADD(vADD(e, vROTL(5, a)), vADD(f(b, c, d), vADD(k, data))),   \
+     b = vROTL(30, b))
+#define vRounds(i, f, k)                                                \
+    vSubRound(A, B, C, D, E, f, k, vW(i));                              \
+    vSubRound(E, A, B, C, D, f, k, vW(i + 1));                          \
+    vSubRound(D, E, A, B, C, f, k, vW(i + 2));                          \
+    vSubRound(C, D, E, A, B, f, k, vW(i + 3));                          \
+    vSubRound(B, C, D, E, A, f, k, vW(i + 4))
+
+/* Compress the four-lane block W into the four-lane digest.  This corrupts
+   W. */
+static void SHSTransformSSE2(__m128i *digest, __m128i *W)
+{
+    __m128i A, B, C, D, E;
+    const __m128i k1 = _mm_set1_epi32((int)K1), k2 = _mm_set1_epi32((int)K2);
+    const __m128i k3 = _mm_set1_epi32((int)K3), k4 = _mm_set1_epi32((int)K4);
+
+    A = digest[0];
+    B = digest[1];
+    C = digest[2];
+    D = digest[3];
+    E = digest[4];
+
+    vRounds(0, vf1, k1);
+    vRounds(5, vf1, k1);
+    vRounds(10, vf1, k1);
+    vRounds(15, vf1, k1);
+    vRounds(20, vf2, k2);
+    vRounds(25, vf2, k2);
+    vRounds(30, vf2, k2);
+    vRounds(35, vf2, k2);
+    vRounds(40, vf3, k3);
+    vRounds(45, vf3, k3);
+    vRounds(50, vf3, k3);
+    vRounds(55, vf3, k3);
+    vRounds(60, vf4, k4);
+    vRounds(65, vf4, k4);
+    vRounds(70, vf4, k4);
+    vRounds(75, vf4, k4);
+
+    digest[0] = vADD(digest[0], A);
+    digest[1] = vADD(digest[1], B);
+    digest[2] = vADD(digest[2], C);
+    digest[3] = vADD(digest[3], D);
+    digest[4] = vADD(digest[4], E);
+}
+
+/* Run the iterations that all of the first n (at most four) lanes have left,
+   computing the lanes together. */
+static void SHSPBKDF2SSE2(SHS_PBKDF2_LANE *lanes, size_t n)
+{
+    __m128i inner[5], outer[5], u[5], t[5], digest[5], W[16];
+    SHS_PBKDF2_LANE *l[4];
+    SHS_LONG words[4];
+    unsigned long count, c;
+    int i, j;
+
+    /* Fill any unused vector elements with copies of the first lane. */
+    for (i = 0; i < 4; i++)
+        l[i] = &lanes[((size_t)i < n) ? i : 0];
+    count = l[0]->count;
+    for (i = 1; i < 4; i++) {
+        if (l[i]->count < count)
+            count = l[i]->count;
+    }
+    for (j = 0; j < 5; j++) {
+        inner[j] = _mm_set_epi32(l[3]->inner[j], l[2]->inner[j],
+                                 l[1]->inner[j], l[0]->inner[j]);
+        outer[j] = _mm_set_epi32(l[3]->outer[j], l[2]->outer[j],
+                                 l[1]->outer[j], l[0]->outer[j]);
+        u[j] = _mm_set_epi32(l[3]->u[j], l[2]->u[j], l[1]->u[j], l[0]->u[j]);
+        t[j] = _mm_set_epi32(l[3]->t[j], l[2]->t[j], l[1]->t[j], l[0]->t[j]);
+    }
+
+    for (c = count; c > 0; c--) {
+        /* Inner hash of U. */
+        for (j = 0; j < 5; j++) {
+            W[j] = u[j];
+            digest[j] = inner[j];
+        }
+        for (j = 5; j < 16; j++)
+            W[j] = _mm_setzero_si128();
+        W[5] = _mm_set1_epi32((int)0x80000000);
+        W[15] = _mm_set1_epi32((SHS_DATASIZE + SHS_DIGESTSIZE) * 8);
+        SHSTransformSSE2(digest, W);
+
+        /* Outer hash of the inner digest. */
+        for (j = 0; j < 5; j++) {
+            W[j] = digest[j];
+            u[j] = outer[j];
+        }
+        for (j = 5; j < 16; j++)
+            W[j] = _mm_setzero_si128();
+        W[5] = _mm_set1_epi32((int)0x80000000);
+        W[15] = _mm_set1_epi32((SHS_DATASIZE + SHS_DIGESTSIZE) * 8);
+        SHSTransformSSE2(u, W);
+
+        for (j = 0; j < 5; j++)
+            t[j] = vXOR(t[j], u[j]);
+    }
+
+    for (j = 0; j < 5; j++) {
+        _mm_storeu_si128((__m128i *)words, u[j]);
+        for (i = 0; (size_t)i < n; i++)
+            lanes[i].u[j] = words[i];
+        _mm_storeu_si128((__m128i *)words, t[j]);
+        for (i = 0; (size_t)i < n; i++)
+            lanes[i].t[j] = words[i];
+    }
+    for (i = 0; (size_t)i < n; i++)
+        lanes[i].count -= count;
+    memset(W, 0, sizeof(W));
+    memset(digest, 0, sizeof(digest));
+}
+
+#endif /* __SSE2__ */
+
 /* Perform the SHS transformation.  Note that this code, like MD5, seems to
    break some optimizing compilers due to the complexity of the expressions
    and the size of the basic block.  It may be necessary to split it into
@@ -105,6 +395,13 @@ void SHSTransform(SHS_LONG *digest, const SHS_LONG *data)
     SHS_LONG A, B, C, D, E;     /* Local vars */
     SHS_LONG eData[ 16 ];       /* Expanded data */
 
+#ifdef K5_SHANI
+    if (shaniSupported()) {
+        SHSTransformNI(digest, data, 1, 1);
+        return;
+    }
+#endif
+
     /* Set up first buffer and local data buffer */
     A = digest[ 0 ];
     B = digest[ 1 ];
@@ -298,6 +595,13 @@ void shsUpdate(SHS_INFO *shsInfo, const SHS_BYTE *buffer, unsigned int count)
     }
 
     /* Process data in SHS_DATASIZE chunks */
+#ifdef K5_SHANI
+    if (count >= SHS_DATASIZE && shaniSupported()) {
+        SHSTransformNI(shsInfo->digest, buffer, count / SHS_DATASIZE, 0);
+        buffer += count - count % SHS_DATASIZE;
+        count %= SHS_DATASIZE;
+    }
+#endif
     while (count >= SHS_DATASIZE) {
         lp = shsInfo->data;
         while (lp < shsInfo->data + 16) {
@@ -380,3 +684,47 @@ void shsFinal(SHS_INFO *shsInfo)
     *lp++ = shsInfo->countLo;
     SHSTransform(shsInfo->digest, shsInfo->data);
 }
+
+/* Run PBKDF2-HMAC-SHA1 iterations on each lane until its count is zero.  An
+   iteration hashes U with the inner and then the outer HMAC state, replaces U
+   with the result, and XORs it into T. */
+void shsPBKDF2(SHS_PBKDF2_LANE *lanes, size_t nlanes)
+{
+    SHS_PBKDF2_LANE *lane;
+    SHS_LONG block[16], digest[5];
+    size_t i;
+    int j;
+
+#ifdef K5_SHANI
+    if (shaniSupported()) {
+        for (i = 0; i < nlanes; i++)
+            SHSPBKDF2NI(&lanes[i]);
+        return;
+    }
+#endif
+#ifdef __SSE2__
+    /* A single lane is faster in scalar code. */
+    for (i = 0; i + 1 < nlanes; i += 4)
+        SHSPBKDF2SSE2(&lanes[i], (nlanes - i < 4) ? nlanes - i : 4);
+#endif
+
+    /* Run any remaining iterations one lane at a time. */
+    memset(block, 0, sizeof(block));
+    block[5] = (SHS_LONG) 0x80 << 24;
+    block[15] = (SHS_DATASIZE + SHS_DIGESTSIZE) * 8;
+    for (i = 0; i < nlanes; i++) {
+        lane = &lanes[i];
+        for (; lane->count > 0; lane->count--) {
+            memcpy(block, lane->u, sizeof(lane->u));
+            memcpy(digest, lane->inner, sizeof(digest));
+            SHSTransform(digest, block);
+            memcpy(block, digest, sizeof(digest));
+            memcpy(lane->u, lane->outer, sizeof(lane->u));
+            SHSTransform(lane->u, block);
+            for (j = 0; j < 5; j++)
+                lane->t[j] ^= lane->u[j];
+        }
+    }
+    memset(block, 0, sizeof(block));
+    memset(digest, 0, sizeof(digest));
+}
@@ -31,6 +31,19 @@ void shsInit(SHS_INFO *shsInfo);
 void shsUpdate(SHS_INFO *shsInfo, const SHS_BYTE *buffer, unsigned int count);
 void shsFinal(SHS_INFO *shsInfo);
 
+/* One PBKDF2-HMAC-SHA1 output block being computed by shsPBKDF2.  All
+   values are digests as SHS_LONG values in host order. */
+typedef struct {
+    SHS_LONG inner[ 5 ];             /* State after the HMAC inner key block */
+    SHS_LONG outer[ 5 ];             /* State after the HMAC outer key block */
+    SHS_LONG u[ 5 ];                 /* Latest PRF output */
+    SHS_LONG t[ 5 ];                 /* XOR of the PRF outputs so far */
+    unsigned long count;             /* Iterations remaining */
+} SHS_PBKDF2_LANE;
+
+/* Run the remaining iterations of nlanes PBKDF2 output blocks (shs.c). */
+void shsPBKDF2(SHS_PBKDF2_LANE *lanes, size_t nlanes);
+
 
 /* Keyed Message digest functions (hmac_sha.c) */
 krb5_error_code hmac_sha(krb5_octet *text,
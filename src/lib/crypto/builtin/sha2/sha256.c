@@ -35,6 +35,7 @@
 
 #include <k5-int.h>
 #include "sha2.h"
+#include "x86cpu.h"
 
 #ifdef K5_BE
 #define WORDS_BIGENDIAN
@@ -165,6 +166,95 @@ calc(SHA256_CTX *m, uint32_t *in)
     H += HH;
 }
 
+/* On x86-64, use the SHA extensions when the CPU has them. */
+
+#ifdef K5_X86_ACCEL
+#define K5_SHANI 1
+#endif
+
+#ifdef K5_SHANI
+
+#include <immintrin.h>
+
+#define TARGET __attribute__((target("sha,sse4.1,ssse3")))
+
+#define shani_supported() ((k5_x86_features() & K5_X86_SHA) != 0)
+
+/*
+ * Four rounds of group g (0-15), using message words m0 and advancing the
+ * message schedule held in m1 and m3.
+ */
+#define NI_ROUNDS(g, m0, m1, m3)					\
+    do {								\
+	wk = _mm_add_epi32(m0, _mm_loadu_si128(k + g));		\
+	cdgh = _mm_sha256rnds2_epu32(cdgh, abef, wk);			\
+	if (g >= 3 && g <= 14) {					\
+	    m1 = _mm_add_epi32(m1, _mm_alignr_epi8(m0, m3, 4));	\
+	    m1 = _mm_sha256msg2_epu32(m1, m0);				\
+	}								\
+	wk = _mm_shuffle_epi32(wk, 0x0e);				\
+	abef = _mm_sha256rnds2_epu32(abef, cdgh, wk);			\
+	if (g >= 1 && g <= 12)						\
+	    m3 = _mm_sha256msg1_epu32(m3, m0);				\
+    } while (0)
+
+/* Process nblocks 64-byte blocks of message bytes from in. */
+static TARGET void
+calc_ni(SHA256_CTX *m, const unsigned char *in, size_t nblocks)
+{
+    const __m128i *p = (const __m128i *)in;
+    const __m128i *k = (const __m128i *)constant_256;
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bLL,
+					0x0405060700010203LL);
+    __m128i abef, cdgh, abef_save, cdgh_save, t, wk;
+    __m128i m0, m1, m2, m3;
+
+    /* The rounds instructions want the state as (A, B, E, F) and
+     * (C, D, G, H), highest lane first. */
+    t = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *)&m->counter[0]), 0xb1);
+    cdgh = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *)&m->counter[4]), 0x1b);
+    abef = _mm_alignr_epi8(t, cdgh, 8);
+    cdgh = _mm_blend_epi16(cdgh, t, 0xf0);
+
+    for (; nblocks > 0; nblocks--, p += 4) {
+	abef_save = abef;
+	cdgh_save = cdgh;
+	m0 = _mm_shuffle_epi8(_mm_loadu_si128(p), mask);
+	m1 = _mm_shuffle_epi8(_mm_loadu_si128(p + 1), mask);
+	m2 = _mm_shuffle_epi8(_mm_loadu_si128(p + 2), mask);
+	m3 = _mm_shuffle_epi8(_mm_loadu_si128(p + 3), mask);
+
+	NI_ROUNDS(0, m0, m1, m3);
+	NI_ROUNDS(1, m1, m2, m0);
+	NI_ROUNDS(2, m2, m3, m1);
+	NI_ROUNDS(3, m3, m0, m2);
+	NI_ROUNDS(4, m0, m1, m3);
+	NI_ROUNDS(5, m1, m2, m0);
+	NI_ROUNDS(6, m2, m3, m1);
+	NI_ROUNDS(7, m3, m0, m2);
+	NI_ROUNDS(8, m0, m1, m3);
+	NI_ROUNDS(9, m1, m2, m0);
+	NI_ROUNDS(10, m2, m3, m1);
+	NI_ROUNDS(11, m3, m0, m2);
+	NI_ROUNDS(12, m0, m1, m3);
+	NI_ROUNDS(13, m1, m2, m0);
+	NI_ROUNDS(14, m2, m3, m1);
+	NI_ROUNDS(15, m3, m0, m2);
+
+	abef = _mm_add_epi32(abef, abef_save);
+	cdgh = _mm_add_epi32(cdgh, cdgh_save);
+    }
+
+    t = _mm_shuffle_epi32(abef, 0x1b);
+    cdgh = _mm_shuffle_epi32(cdgh, 0xb1);
+    abef = _mm_blend_epi16(t, cdgh, 0xf0);
+    cdgh = _mm_alignr_epi8(cdgh, t, 8);
+    _mm_storeu_si128((__m128i *)&m->counter[0], abef);
+    _mm_storeu_si128((__m128i *)&m->counter[4], cdgh);
+}
+
+#endif /* K5_SHANI */
+
 /*
  * From `Performance analysis of MD5' by Joseph D. Touch <touch@isi.edu>
  */
@@ -202,11 +292,27 @@ k5_sha256_update(SHA256_CTX *m, const void *v, size_t len)
 	++m->sz[1];
     offset = (old_sz / 8) % 64;
     while(len > 0){
-	size_t l = min(len, 64 - offset);
+	size_t l;
+#ifdef K5_SHANI
+	if (offset == 0 && len >= 64 && shani_supported()) {
+	    l = len - len % 64;
+	    calc_ni(m, p, l / 64);
+	    p += l;
+	    len -= l;
+	    continue;
+	}
+#endif
+	l = min(len, 64 - offset);
 	memcpy(m->save + offset, p, l);
 	offset += l;
 	p += l;
 	len -= l;
+#ifdef K5_SHANI
+	if (offset == 64 && shani_supported()) {
+	    calc_ni(m, m->save, 1);
+	    offset = 0;
+	}
+#endif
 	if(offset == 64){
 #if !defined(WORDS_BIGENDIAN) || defined(_CRAY)
 	    int i;
@@ -0,0 +1,79 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* lib/crypto/builtin/x86cpu.h - x86-64 CPU feature detection */
+/*
+ * Copyright (C) 2012 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Export of this software from the United States of America may
+ *   require a specific license from the United States Government.
+ *   It is the responsibility of any person or organization contemplating
+ *   export to obtain such a license before exporting.
+ *
+ * WITHIN THAT CONSTRAINT, permission to use, copy, modify, and
+ * distribute this software and its documentation for any purpose and
+ * without fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright notice and
+ * this permission notice appear in supporting documentation, and that
+ * the name of M.I.T. not be used in advertising or publicity pertaining
+ * to distribution of the software without specific, written prior
+ * permission.  Furthermore if you modify this software you must label
+ * your software as modified software and not distribute it in such a
+ * fashion that it might be confused with the original M.I.T. software.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is" without express
+ * or implied warranty.
+ */
+
+/*
+ * The builtin AES and SHA code uses x86-64 instruction set extensions when
+ * the CPU has them.  The functions using them are compiled with a target
+ * attribute, so no special compiler flags are needed, and K5_X86_ACCEL is
+ * only defined for compilers which support that.
+ */
+
+#ifndef X86CPU_H
+#define X86CPU_H
+
+#if defined(__x86_64__) &&                                              \
+    (defined(__clang__) ||                                              \
+     (defined(__GNUC__) &&                                              \
+      (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define K5_X86_ACCEL 1
+#endif
+
+#ifdef K5_X86_ACCEL
+
+#include <cpuid.h>
+#include <stddef.h>
+
+/* Flags returned by k5_x86_features(). */
+#define K5_X86_AES      0x1     /* AES-NI */
+#define K5_X86_SHA      0x2     /* SHA extensions, with SSSE3 and SSE4.1 */
+
+/* Return the K5_X86_* flags for the extensions the CPU supports.  The CPU is
+ * probed on the first call in each object file. */
+static inline unsigned int
+k5_x86_features(void)
+{
+    static int features = -1;
+    unsigned int eax, ebx, ecx, edx, result = 0;
+
+    if (features != -1)
+        return features;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        if (ecx & bit_AES)
+            result |= K5_X86_AES;
+        if ((ecx & bit_SSSE3) && (ecx & bit_SSE4_1) &&
+            __get_cpuid_max(0, NULL) >= 7) {
+            __cpuid_count(7, 0, eax, ebx, ecx, edx);
+            if (ebx & (1 << 29))
+                result |= K5_X86_SHA;
+        }
+    }
+    features = result;
+    return result;
+}
+
+#endif /* K5_X86_ACCEL */
+
+#endif /* X86CPU_H */
@@ -90,6 +90,129 @@ display(const char *msg, const krb5_data *d)
     printf("\n");
 }
 
+/* Encrypt a mix of enctypes and message lengths with the batch API, and check
+ * that each message decrypts with the single-message API and vice versa. */
+static void
+test_batch(krb5_context context)
+{
+    static const krb5_enctype etypes[] = {
+        ENCTYPE_AES128_CTS_HMAC_SHA1_96, ENCTYPE_AES256_CTS_HMAC_SHA1_96,
+        ENCTYPE_DES3_CBC_SHA1, ENCTYPE_ARCFOUR_HMAC
+    };
+    static const size_t lens[] = { 1, 16, 17, 32, 100, 1000, 4096 };
+    enum { NKEYS = sizeof(etypes) / sizeof(*etypes), NMSGS = 24 };
+    krb5_keyblock kb, *kbp;
+    krb5_key keys[NKEYS];
+    krb5_crypto_msg msgs[NMSGS];
+    krb5_crypto_iov iovs[NMSGS][4];
+    krb5_data states[NMSGS], states2[NMSGS], plain;
+    char *bufs[NMSGS];
+    int i, pass;
+
+    for (i = 0; i < NKEYS; i++) {
+        test("Generating batch key",
+             krb5_c_make_random_key(context, etypes[i], &kb));
+        test("Creating batch key", krb5_k_create_key(context, &kb, &keys[i]));
+        krb5_free_keyblock_contents(context, &kb);
+    }
+
+    plain.length = 4096;
+    plain.data = malloc(plain.length);
+    if (plain.data == NULL)
+        abort();
+    for (i = 0; i < (int)plain.length; i++)
+        plain.data[i] = i * 7;
+
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < NMSGS; i++) {
+            /* Change enctypes every three messages, to exercise grouping. */
+            krb5_key key = keys[(i / 3) % NKEYS];
+            size_t len = lens[i % (sizeof(lens) / sizeof(*lens))];
+            unsigned int hlen, tlen, plen;
+
+            krb5_c_crypto_length(context, key->keyblock.enctype,
+                                 KRB5_CRYPTO_TYPE_HEADER, &hlen);
+            krb5_c_crypto_length(context, key->keyblock.enctype,
+                                 KRB5_CRYPTO_TYPE_TRAILER, &tlen);
+            krb5_c_padding_length(context, key->keyblock.enctype, len, &plen);
+            bufs[i] = malloc(hlen + len + plen + tlen);
+            if (bufs[i] == NULL)
+                abort();
+            iovs[i][0].flags = KRB5_CRYPTO_TYPE_HEADER;
+            iovs[i][0].data = make_data(bufs[i], hlen);
+            iovs[i][1].flags = KRB5_CRYPTO_TYPE_DATA;
+            iovs[i][1].data = make_data(bufs[i] + hlen, len);
+            iovs[i][2].flags = KRB5_CRYPTO_TYPE_PADDING;
+            iovs[i][2].data = make_data(bufs[i] + hlen + len, plen);
+            iovs[i][3].flags = KRB5_CRYPTO_TYPE_TRAILER;
+            iovs[i][3].data = make_data(bufs[i] + hlen + len + plen, tlen);
+            memcpy(iovs[i][1].data.data, plain.data, len);
+
+            /* Use cipher state on every other non-RC4 message. */
+            states[i] = empty_data();
+            kbp = &key->keyblock;
+            if (i % 2 && kbp->enctype != ENCTYPE_ARCFOUR_HMAC) {
+                test("init_state",
+                     krb5_c_init_state(context, kbp, 7, &states[i]));
+                test("init_state",
+                     krb5_c_init_state(context, kbp, 7, &states2[i]));
+            }
+
+            msgs[i].key = key;
+            msgs[i].usage = 7;
+            msgs[i].cipher_state = states[i].length ? &states[i] : NULL;
+            msgs[i].data = iovs[i];
+            msgs[i].num_data = 4;
+            msgs[i].code = -1;
+        }
+
+        if (pass == 0) {
+            test("Batch encrypting",
+                 krb5_k_encrypt_iov_batch(context, msgs, NMSGS));
+            for (i = 0; i < NMSGS; i++) {
+                test("Batch message result", msgs[i].code);
+                test("Decrypting batch message",
+                     krb5_k_decrypt_iov(context, msgs[i].key, 7,
+                                        msgs[i].cipher_state ? &states2[i] :
+                                        NULL, iovs[i], 4));
+            }
+        } else {
+            for (i = 0; i < NMSGS; i++) {
+                test("Encrypting message for batch",
+                     krb5_k_encrypt_iov(context, msgs[i].key, 7,
+                                        msgs[i].cipher_state ? &states2[i] :
+                                        NULL, iovs[i], 4));
+            }
+            test("Batch decrypting",
+                 krb5_k_decrypt_iov_batch(context, msgs, NMSGS));
+            for (i = 0; i < NMSGS; i++)
+                test("Batch message result", msgs[i].code);
+        }
+
+        for (i = 0; i < NMSGS; i++) {
+            plain.length = iovs[i][1].data.length;
+            test("Comparing batch results",
+                 compare_results(&plain, &iovs[i][1].data));
+            if (msgs[i].cipher_state != NULL) {
+                kbp = &msgs[i].key->keyblock;
+                assert(states[i].length == states2[i].length);
+                assert(memcmp(states[i].data, states2[i].data,
+                              states[i].length) == 0);
+                test("free_state",
+                     krb5_c_free_state(context, kbp, &states[i]));
+                test("free_state",
+                     krb5_c_free_state(context, kbp, &states2[i]));
+            }
+            free(bufs[i]);
+        }
+        plain.length = 4096;
+    }
+
+    for (i = 0; i < NKEYS; i++)
+        krb5_k_free_key(context, keys[i]);
+    free(plain.data);
+}
+
 int
 main ()
 {
@@ -267,6 +390,8 @@ main ()
         krb5_k_free_key (context, key);
     }
 
+    test_batch(context);
+
     /* Test the RC4 decrypt fallback from key usage 9 to 8. */
     test ("Initializing an RC4 keyblock",
           krb5_init_keyblock (context, ENCTYPE_ARCFOUR_HMAC, 0, &keyblock));
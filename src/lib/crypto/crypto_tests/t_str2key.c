@@ -561,14 +561,16 @@ main(int argc, char **argv)
     krb5_data string, salt;
     krb5_error_code ret;
     krb5_keyblock *keyblock;
-    size_t i;
+    krb5_s2k_req *reqs;
+    krb5_data *strings, *salts;
+    size_t i, ntests = sizeof(test_cases) / sizeof(*test_cases);
     struct test *test;
     krb5_boolean verbose = FALSE;
     int status = 0;
 
     if (argc >= 2 && strcmp(argv[1], "-v") == 0)
         verbose = TRUE;
-    for (i = 0; i < sizeof(test_cases) / sizeof(*test_cases); i++) {
+    for (i = 0; i < ntests; i++) {
         test = &test_cases[i];
         string = string2data(test->string);
         salt = string2data(test->salt);
@@ -600,5 +602,39 @@ main(int argc, char **argv)
         }
         krb5_free_keyblock(context, keyblock);
     }
+
+    /* Perform all of the tests again as one batch. */
+    reqs = calloc(ntests, sizeof(*reqs));
+    strings = calloc(ntests, sizeof(*strings));
+    salts = calloc(ntests, sizeof(*salts));
+    assert(reqs != NULL && strings != NULL && salts != NULL);
+    for (i = 0; i < ntests; i++) {
+        test = &test_cases[i];
+        strings[i] = string2data(test->string);
+        salts[i] = string2data(test->salt);
+        reqs[i].enctype = test->enctype;
+        reqs[i].string = &strings[i];
+        reqs[i].salt = &salts[i];
+        reqs[i].params = &test->params;
+    }
+    ret = krb5_c_string_to_key_batch(context, reqs, ntests);
+    if (ret != 0) {
+        com_err(argv[0], ret, "in krb5_c_string_to_key_batch");
+        exit(1);
+    }
+    for (i = 0; i < ntests; i++) {
+        test = &test_cases[i];
+        assert(reqs[i].code == 0);
+        assert(reqs[i].key.length == test->expected_key.length);
+        if (memcmp(reqs[i].key.contents, test->expected_key.data,
+                   reqs[i].key.length) != 0) {
+            printf("str2key batch test %d failed\n", (int)i);
+            status = 1;
+        }
+        krb5_free_keyblock_contents(context, &reqs[i].key);
+    }
+    free(reqs);
+    free(strings);
+    free(salts);
     return status;
 }
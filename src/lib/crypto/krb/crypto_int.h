@@ -58,6 +58,13 @@ struct krb5_enc_provider {
 
     /* May be NULL if there is no key-derived data cached.  */
     void (*key_cleanup)(krb5_key key);
+
+    /*
+     * May be NULL.  Encrypt each message in msgs as encrypt would, using its
+     * key and treating its cipher_state as the ivec, and set its code.  The
+     * usage fields are ignored.
+     */
+    void (*encrypt_batch)(krb5_crypto_msg *msgs, size_t num_msgs);
 };
 
 struct krb5_hash_provider {
@@ -82,12 +89,17 @@ typedef krb5_error_code (*crypt_func)(const struct krb5_keytypes *ktp,
                                       const krb5_data *ivec,
                                       krb5_crypto_iov *data, size_t num_data);
 
+typedef void (*crypt_batch_func)(const struct krb5_keytypes *ktp,
+                                 krb5_crypto_msg *msgs, size_t num_msgs);
+
 typedef krb5_error_code (*str2key_func)(const struct krb5_keytypes *ktp,
                                         const krb5_data *string,
                                         const krb5_data *salt,
                                         const krb5_data *parm,
                                         krb5_keyblock *key);
 
+typedef void (*str2key_batch_func)(krb5_s2k_req **reqs, size_t num_reqs);
+
 typedef krb5_error_code (*rand2key_func)(const krb5_data *randombits,
                                          krb5_keyblock *key);
 
@@ -111,6 +123,12 @@ struct krb5_keytypes {
     prf_func prf;
     krb5_cksumtype required_ctype;
     krb5_flags flags;
+    /* May be NULL, in which case batches use encrypt on each message. */
+    crypt_batch_func encrypt_batch;
+    /* May be NULL, in which case batches use str2key on each request.
+     * Requests for all enctypes sharing a handler are passed to it
+     * together, with their keyblocks allocated. */
+    str2key_batch_func str2key_batch;
 };
 
 #define ETYPE_WEAK 1
@@ -233,6 +251,10 @@ krb5_error_code krb5int_dk_cmac_decrypt(const struct krb5_keytypes *ktp,
                                         krb5_crypto_iov *data,
                                         size_t num_data);
 
+/* Batch encrypt */
+void krb5int_dk_encrypt_batch(const struct krb5_keytypes *ktp,
+                              krb5_crypto_msg *msgs, size_t num_msgs);
+
 /* String to key */
 krb5_error_code krb5int_des_string_to_key(const struct krb5_keytypes *ktp,
                                           const krb5_data *string,
@@ -260,6 +282,9 @@ krb5_error_code krb5int_camellia_string_to_key(const struct krb5_keytypes *enc,
                                                const krb5_data *params,
                                                krb5_keyblock *key);
 
+/* Batch string to key */
+void krb5int_pbkdf2_string_to_key_batch(krb5_s2k_req **reqs, size_t num_reqs);
+
 /* Random to key */
 krb5_error_code k5_rand2key_direct(const krb5_data *randombits,
                                    krb5_keyblock *keyblock);
@@ -461,6 +486,24 @@ krb5_error_code krb5int_pbkdf2_hmac_sha1(const krb5_data *out,
                                          const krb5_data *password,
                                          const krb5_data *salt);
 
+/* One PBKDF2-HMAC-SHA1 computation for krb5int_pbkdf2_hmac_sha1_batch. */
+struct pbkdf2_req {
+    krb5_data out;              /* Caller-allocated output */
+    unsigned long count;
+    krb5_data pass;
+    krb5_data salt;
+};
+
+/*
+ * Compute the PBKDF2-HMAC-SHA-1 for each of nreqs requests.  s2k_pbkdf2.c
+ * provides a version which calls krb5int_pbkdf2_hmac_sha1 for each request in
+ * turn.  A module which can compute several requests, or several output
+ * blocks of one request, in parallel can instead provide its own by defining
+ * K5_PBKDF2_HMAC_SHA1_BATCH in its crypto_mod.h.
+ */
+krb5_error_code krb5int_pbkdf2_hmac_sha1_batch(const struct pbkdf2_req *reqs,
+                                               size_t nreqs);
+
 /* The following are used by test programs and are just handler functions from
  * the AES and Camellia enc providers.  Define a stub krb5int_camellia_cbc_mac
  * even if CAMELLIA isn't defined, since it's in the export list. */
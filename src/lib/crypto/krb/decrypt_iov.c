@@ -62,3 +62,37 @@ krb5_c_decrypt_iov(krb5_context context, const krb5_keyblock *keyblock,
     krb5_k_free_key(context, key);
     return ret;
 }
+
+krb5_error_code KRB5_CALLCONV
+krb5_k_decrypt_iov_batch(krb5_context context, krb5_crypto_msg *msgs,
+                         size_t num_msgs)
+{
+    const struct krb5_keytypes *ktp = NULL;
+    krb5_crypto_msg *m;
+    size_t i;
+
+    for (i = 0; i < num_msgs; i++) {
+        m = &msgs[i];
+
+        /* Only look up the enctype when it changes. */
+        if (ktp == NULL || ktp->etype != m->key->keyblock.enctype)
+            ktp = find_enctype(m->key->keyblock.enctype);
+        if (ktp == NULL) {
+            m->code = KRB5_BAD_ENCTYPE;
+        } else if (krb5int_c_locate_iov(m->data, m->num_data,
+                                        KRB5_CRYPTO_TYPE_STREAM) != NULL) {
+            m->code = krb5int_c_iov_decrypt_stream(ktp, m->key, m->usage,
+                                                   m->cipher_state, m->data,
+                                                   m->num_data);
+        } else {
+            m->code = ktp->decrypt(ktp, m->key, m->usage, m->cipher_state,
+                                   m->data, m->num_data);
+        }
+    }
+
+    for (i = 0; i < num_msgs; i++) {
+        if (msgs[i].code != 0)
+            return msgs[i].code;
+    }
+    return 0;
+}
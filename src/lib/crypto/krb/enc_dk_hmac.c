@@ -65,10 +65,17 @@ krb5int_aes_crypto_length(const struct krb5_keytypes *ktp,
     }
 }
 
-krb5_error_code
-krb5int_dk_encrypt(const struct krb5_keytypes *ktp, krb5_key key,
-                   krb5_keyusage usage, const krb5_data *ivec,
-                   krb5_crypto_iov *data, size_t num_data)
+/*
+ * Do the work of krb5int_dk_encrypt which comes before the encryption:
+ * validate the header, trailer and padding lengths, derive the keys, generate
+ * the confounder, and compute the checksum into cksum (which has room for
+ * ktp->hash->hashsize bytes).  On success, place the encryption key in *ke_out
+ * for the caller to release.
+ */
+static krb5_error_code
+dk_encrypt_prepare(const struct krb5_keytypes *ktp, krb5_key key,
+                   krb5_keyusage usage, krb5_crypto_iov *data,
+                   size_t num_data, krb5_key *ke_out, unsigned char *cksum)
 {
     const struct krb5_enc_provider *enc = ktp->enc;
     const struct krb5_hash_provider *hash = ktp->hash;
@@ -79,7 +86,8 @@ krb5int_dk_encrypt(const struct krb5_keytypes *ktp, krb5_key key,
     krb5_key ke = NULL, ki = NULL;
     size_t i;
     unsigned int blocksize, hmacsize, plainlen = 0, padsize = 0;
-    unsigned char *cksum = NULL;
+
+    *ke_out = NULL;
 
     /* E(Confounder | Plaintext | Pad) | Checksum */
 
@@ -118,10 +126,6 @@ krb5int_dk_encrypt(const struct krb5_keytypes *ktp, krb5_key key,
         padding->data.length = padsize;
     }
 
-    cksum = k5alloc(hash->hashsize, &ret);
-    if (ret != 0)
-        goto cleanup;
-
     /* Derive the keys. */
 
     d1.data = (char *)constantdata;
@@ -157,24 +161,122 @@ krb5int_dk_encrypt(const struct krb5_keytypes *ktp, krb5_key key,
     if (ret != 0)
         goto cleanup;
 
-    /* Encrypt the plaintext (header | data | padding) */
-    ret = enc->encrypt(ke, ivec, data, num_data);
-    if (ret != 0)
-        goto cleanup;
+    *ke_out = ke;
+    ke = NULL;
 
-    /* Possibly truncate the hash */
-    assert(hmacsize <= d2.length);
+cleanup:
+    krb5_k_free_key(NULL, ke);
+    krb5_k_free_key(NULL, ki);
+    return ret;
+}
+
+/* Place the (possibly truncated) checksum into the trailer after encrypting
+ * the plaintext. */
+static void
+dk_encrypt_finish(const struct krb5_keytypes *ktp, krb5_crypto_iov *data,
+                  size_t num_data, const unsigned char *cksum)
+{
+    krb5_crypto_iov *trailer;
+    unsigned int hmacsize;
+
+    hmacsize = ktp->crypto_length(ktp, KRB5_CRYPTO_TYPE_TRAILER);
+    assert(hmacsize <= ktp->hash->hashsize);
 
+    trailer = krb5int_c_locate_iov(data, num_data, KRB5_CRYPTO_TYPE_TRAILER);
     memcpy(trailer->data.data, cksum, hmacsize);
     trailer->data.length = hmacsize;
+}
+
+krb5_error_code
+krb5int_dk_encrypt(const struct krb5_keytypes *ktp, krb5_key key,
+                   krb5_keyusage usage, const krb5_data *ivec,
+                   krb5_crypto_iov *data, size_t num_data)
+{
+    krb5_error_code ret;
+    krb5_key ke = NULL;
+    unsigned char *cksum = NULL;
+
+    cksum = k5alloc(ktp->hash->hashsize, &ret);
+    if (ret != 0)
+        goto cleanup;
+
+    ret = dk_encrypt_prepare(ktp, key, usage, data, num_data, &ke, cksum);
+    if (ret != 0)
+        goto cleanup;
+
+    /* Encrypt the plaintext (header | data | padding) */
+    ret = ktp->enc->encrypt(ke, ivec, data, num_data);
+    if (ret != 0)
+        goto cleanup;
+
+    dk_encrypt_finish(ktp, data, num_data, cksum);
 
 cleanup:
     krb5_k_free_key(NULL, ke);
-    krb5_k_free_key(NULL, ki);
     free(cksum);
     return ret;
 }
 
+/*
+ * Encrypt a batch of messages.  If the enc provider can encrypt a batch, we
+ * derive the keys and compute the checksums for all of the messages first,
+ * and then let the provider encrypt them together.
+ */
+void
+krb5int_dk_encrypt_batch(const struct krb5_keytypes *ktp,
+                         krb5_crypto_msg *msgs, size_t num_msgs)
+{
+    krb5_crypto_msg *m, *emsgs = NULL;
+    unsigned char *cksums = NULL;
+    size_t hashsize = ktp->hash->hashsize, i, n;
+
+    if (ktp->enc->encrypt_batch != NULL) {
+        emsgs = calloc(num_msgs, sizeof(*emsgs));
+        cksums = calloc(num_msgs, hashsize);
+    }
+    if (emsgs == NULL || cksums == NULL) {
+        for (i = 0; i < num_msgs; i++) {
+            m = &msgs[i];
+            m->code = krb5int_dk_encrypt(ktp, m->key, m->usage,
+                                         m->cipher_state, m->data,
+                                         m->num_data);
+        }
+        goto cleanup;
+    }
+
+    /* Prepare each message, gathering the ones ready to be encrypted. */
+    for (i = 0, n = 0; i < num_msgs; i++) {
+        m = &msgs[i];
+        m->code = dk_encrypt_prepare(ktp, m->key, m->usage, m->data,
+                                     m->num_data, &emsgs[n].key,
+                                     cksums + i * hashsize);
+        if (m->code != 0)
+            continue;
+        emsgs[n].usage = m->usage;
+        emsgs[n].cipher_state = m->cipher_state;
+        emsgs[n].data = m->data;
+        emsgs[n].num_data = m->num_data;
+        n++;
+    }
+
+    ktp->enc->encrypt_batch(emsgs, n);
+
+    for (i = 0, n = 0; i < num_msgs; i++) {
+        m = &msgs[i];
+        if (m->code != 0)
+            continue;
+        m->code = emsgs[n].code;
+        if (m->code == 0)
+            dk_encrypt_finish(ktp, m->data, m->num_data, cksums + i * hashsize);
+        krb5_k_free_key(NULL, emsgs[n].key);
+        n++;
+    }
+
+cleanup:
+    free(emsgs);
+    zapfree(cksums, num_msgs * hashsize);
+}
+
 krb5_error_code
 krb5int_dk_decrypt(const struct krb5_keytypes *ktp, krb5_key key,
                    krb5_keyusage usage, const krb5_data *ivec,
@@ -56,3 +56,43 @@ krb5_c_encrypt_iov(krb5_context context, const krb5_keyblock *keyblock,
     krb5_k_free_key(context, key);
     return ret;
 }
+
+krb5_error_code KRB5_CALLCONV
+krb5_k_encrypt_iov_batch(krb5_context context, krb5_crypto_msg *msgs,
+                         size_t num_msgs)
+{
+    const struct krb5_keytypes *ktp;
+    krb5_crypto_msg *m;
+    krb5_enctype etype;
+    size_t i, j, k;
+
+    for (i = 0; i < num_msgs; i = j) {
+        /* Find the run of messages with the same enctype as this one. */
+        etype = msgs[i].key->keyblock.enctype;
+        for (j = i + 1; j < num_msgs; j++) {
+            if (msgs[j].key->keyblock.enctype != etype)
+                break;
+        }
+
+        ktp = find_enctype(etype);
+        if (ktp != NULL && ktp->encrypt_batch != NULL) {
+            ktp->encrypt_batch(ktp, msgs + i, j - i);
+            continue;
+        }
+        for (k = i; k < j; k++) {
+            m = &msgs[k];
+            if (ktp == NULL) {
+                m->code = KRB5_BAD_ENCTYPE;
+                continue;
+            }
+            m->code = ktp->encrypt(ktp, m->key, m->usage, m->cipher_state,
+                                   m->data, m->num_data);
+        }
+    }
+
+    for (i = 0; i < num_msgs; i++) {
+        if (msgs[i].code != 0)
+            return msgs[i].code;
+    }
+    return 0;
+}
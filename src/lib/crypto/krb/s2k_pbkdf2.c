@@ -102,18 +102,60 @@ cleanup:
 
 #define MAX_ITERATION_COUNT             0x1000000L
 
+#ifndef K5_PBKDF2_HMAC_SHA1_BATCH
+krb5_error_code
+krb5int_pbkdf2_hmac_sha1_batch(const struct pbkdf2_req *reqs, size_t nreqs)
+{
+    krb5_error_code ret;
+    size_t i;
+
+    for (i = 0; i < nreqs; i++) {
+        ret = krb5int_pbkdf2_hmac_sha1(&reqs[i].out, reqs[i].count,
+                                       &reqs[i].pass, &reqs[i].salt);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+#endif
+
+static const krb5_data usage = { KV5M_DATA, 8, "kerberos" };
+
+/* Get the PBKDF2 string-to-key settings for the enctype ktp. */
+static void
+get_settings(const struct krb5_keytypes *ktp, krb5_data *pepper_out,
+             enum deriv_alg *deriv_alg_out, unsigned long *def_iter_out)
+{
+#ifdef CAMELLIA
+    if (ktp->str2key == krb5int_camellia_string_to_key) {
+        *pepper_out = string2data(ktp->name);
+        *deriv_alg_out = DERIVE_SP800_108_CMAC;
+        *def_iter_out = 32768;
+        return;
+    }
+#endif
+    *pepper_out = empty_data();
+    *deriv_alg_out = DERIVE_RFC3961;
+    *def_iter_out = 4096;
+}
+
+/*
+ * Check key's length and determine the PBKDF2 inputs for a string-to-key
+ * operation with ktp: the iteration count, from params if given, and the
+ * salt, which is prefixed with the pepper (if any) in sandp.
+ */
 static krb5_error_code
-pbkdf2_string_to_key(const struct krb5_keytypes *ktp, const krb5_data *string,
-                     const krb5_data *salt, const krb5_data *pepper,
-                     const krb5_data *params, krb5_keyblock *key,
-                     enum deriv_alg deriv_alg, unsigned long def_iter_count)
+pbkdf2_inputs(const struct krb5_keytypes *ktp, const krb5_data *salt,
+              const krb5_data *params, const krb5_keyblock *key,
+              unsigned long *iter_count_out, krb5_data *sandp)
 {
     unsigned long iter_count;
-    krb5_data out;
-    static const krb5_data usage = { KV5M_DATA, 8, "kerberos" };
-    krb5_key tempkey = NULL;
+    krb5_data pepper;
+    enum deriv_alg deriv_alg;
     krb5_error_code err;
-    krb5_data sandp = empty_data();
+
+    *sandp = empty_data();
+    get_settings(ktp, &pepper, &deriv_alg, &iter_count);
 
     if (params) {
         unsigned char *p = (unsigned char *) params->data;
@@ -126,8 +168,7 @@ pbkdf2_string_to_key(const struct krb5_keytypes *ktp, const krb5_data *string,
             if (((iter_count >> 16) >> 16) != 1)
                 return KRB5_ERR_BAD_S2K_PARAMS;
         }
-    } else
-        iter_count = def_iter_count;
+    }
 
     /* This is not a protocol specification constraint; this is an
        implementation limit, which should eventually be controlled by
@@ -135,40 +176,70 @@ pbkdf2_string_to_key(const struct krb5_keytypes *ktp, const krb5_data *string,
     if (iter_count >= MAX_ITERATION_COUNT)
         return KRB5_ERR_BAD_S2K_PARAMS;
 
-    /* Use the output keyblock contents for temporary space. */
-    out.data = (char *) key->contents;
-    out.length = key->length;
-    if (out.length != 16 && out.length != 32)
+    if (key->length != 16 && key->length != 32)
         return KRB5_CRYPTO_INTERNAL;
 
-    if (pepper != NULL) {
-        err = alloc_data(&sandp, pepper->length + 1 + salt->length);
-        if (err)
-            return err;
+    /* Prefix the salt with the pepper and a zero byte, if we have one. */
+    err = alloc_data(sandp, pepper.length > 0 ?
+                     pepper.length + 1 + salt->length : salt->length);
+    if (err)
+        return err;
+    if (pepper.length > 0) {
+        memcpy(sandp->data, pepper.data, pepper.length);
+        sandp->data[pepper.length] = '\0';
+        memcpy(&sandp->data[pepper.length + 1], salt->data, salt->length);
+    } else {
+        memcpy(sandp->data, salt->data, salt->length);
+    }
 
-        memcpy(sandp.data, pepper->data, pepper->length);
-        sandp.data[pepper->length] = '\0';
-        memcpy(&sandp.data[pepper->length + 1], salt->data, salt->length);
+    *iter_count_out = iter_count;
+    return 0;
+}
 
-        salt = &sandp;
-    }
+/* Derive the final key in place from the PBKDF2 output in key. */
+static krb5_error_code
+pbkdf2_finish(const struct krb5_keytypes *ktp, krb5_keyblock *key)
+{
+    krb5_data pepper;
+    enum deriv_alg deriv_alg;
+    unsigned long def_iter;
+    krb5_key tempkey = NULL;
+    krb5_error_code err;
 
-    err = krb5int_pbkdf2_hmac_sha1 (&out, iter_count, string, salt);
+    get_settings(ktp, &pepper, &deriv_alg, &def_iter);
+    err = krb5_k_create_key(NULL, key, &tempkey);
+    if (err)
+        return err;
+    err = krb5int_derive_keyblock(ktp->enc, tempkey, key, &usage, deriv_alg);
+    krb5_k_free_key(NULL, tempkey);
+    return err;
+}
+
+static krb5_error_code
+pbkdf2_string_to_key(const struct krb5_keytypes *ktp, const krb5_data *string,
+                     const krb5_data *salt, const krb5_data *params,
+                     krb5_keyblock *key)
+{
+    unsigned long iter_count;
+    krb5_data out, sandp = empty_data();
+    krb5_error_code err;
+
+    err = pbkdf2_inputs(ktp, salt, params, key, &iter_count, &sandp);
     if (err)
         goto cleanup;
 
-    err = krb5_k_create_key (NULL, key, &tempkey);
+    /* Use the output keyblock contents for temporary space. */
+    out = make_data(key->contents, key->length);
+    err = krb5int_pbkdf2_hmac_sha1(&out, iter_count, string, &sandp);
     if (err)
         goto cleanup;
 
-    err = krb5int_derive_keyblock(ktp->enc, tempkey, key, &usage, deriv_alg);
+    err = pbkdf2_finish(ktp, key);
 
 cleanup:
-    if (sandp.data)
-        free(sandp.data);
+    free(sandp.data);
     if (err)
-        memset (out.data, 0, out.length);
-    krb5_k_free_key (NULL, tempkey);
+        memset(key->contents, 0, key->length);
     return err;
 }
 
@@ -179,8 +250,7 @@ krb5int_aes_string_to_key(const struct krb5_keytypes *ktp,
                           const krb5_data *params,
                           krb5_keyblock *key)
 {
-    return pbkdf2_string_to_key(ktp, string, salt, NULL, params, key,
-                                DERIVE_RFC3961, 4096);
+    return pbkdf2_string_to_key(ktp, string, salt, params, key);
 }
 
 #ifdef CAMELLIA
@@ -191,9 +261,94 @@ krb5int_camellia_string_to_key(const struct krb5_keytypes *ktp,
                                const krb5_data *params,
                                krb5_keyblock *key)
 {
-    krb5_data pepper = string2data(ktp->name);
-
-    return pbkdf2_string_to_key(ktp, string, salt, &pepper, params, key,
-                                DERIVE_SP800_108_CMAC, 32768);
+    return pbkdf2_string_to_key(ktp, string, salt, params, key);
 }
 #endif
+
+/*
+ * Perform a batch of PBKDF2 string-to-key operations, whose keyblocks have
+ * been allocated.  Requests with the same string, salt and iteration count
+ * (such as the AES128 and AES256 keys for a password) share one PBKDF2
+ * computation, since a shorter PBKDF2 output is a prefix of a longer one.
+ * The remaining computations are done together, so that the PBKDF2
+ * implementation can run them in parallel.
+ */
+void
+krb5int_pbkdf2_string_to_key_batch(krb5_s2k_req **reqs, size_t num_reqs)
+{
+    const struct krb5_keytypes *ktp;
+    struct pbkdf2_req *jobs = NULL;
+    krb5_data *salts = NULL;
+    size_t *jobnum = NULL, i, j, njobs = 0;
+    unsigned char *outbuf = NULL;
+    unsigned long iter_count;
+    krb5_s2k_req *r;
+    krb5_error_code err;
+
+    jobs = k5alloc(num_reqs * sizeof(*jobs), &err);
+    salts = k5alloc(num_reqs * sizeof(*salts), &err);
+    jobnum = k5alloc(num_reqs * sizeof(*jobnum), &err);
+    outbuf = k5alloc(num_reqs * 32, &err);
+    if (jobs == NULL || salts == NULL || jobnum == NULL || outbuf == NULL) {
+        /* Fall back to performing the requests individually. */
+        for (i = 0; i < num_reqs; i++) {
+            r = reqs[i];
+            ktp = find_enctype(r->enctype);
+            r->code = ktp->str2key(ktp, r->string, r->salt, r->params,
+                                   &r->key);
+        }
+        goto cleanup;
+    }
+
+    /* Find the distinct PBKDF2 computations we need. */
+    for (i = 0; i < num_reqs; i++) {
+        r = reqs[i];
+        ktp = find_enctype(r->enctype);
+        r->code = pbkdf2_inputs(ktp, r->salt, r->params, &r->key, &iter_count,
+                                &salts[i]);
+        if (r->code)
+            continue;
+        for (j = 0; j < njobs; j++) {
+            if (jobs[j].count == iter_count &&
+                data_eq(jobs[j].pass, *r->string) &&
+                data_eq(jobs[j].salt, salts[i]))
+                break;
+        }
+        if (j == njobs) {
+            jobs[j].out = make_data(outbuf + j * 32, 0);
+            jobs[j].count = iter_count;
+            jobs[j].pass = *r->string;
+            jobs[j].salt = salts[i];
+            njobs++;
+        }
+        if (jobs[j].out.length < r->key.length)
+            jobs[j].out.length = r->key.length;
+        jobnum[i] = j;
+    }
+
+    err = krb5int_pbkdf2_hmac_sha1_batch(jobs, njobs);
+
+    for (i = 0; i < num_reqs; i++) {
+        r = reqs[i];
+        if (r->code)
+            continue;
+        r->code = err;
+        if (r->code == 0) {
+            ktp = find_enctype(r->enctype);
+            memcpy(r->key.contents, jobs[jobnum[i]].out.data, r->key.length);
+            r->code = pbkdf2_finish(ktp, &r->key);
+        }
+        if (r->code)
+            memset(r->key.contents, 0, r->key.length);
+    }
+
+cleanup:
+    if (salts != NULL) {
+        for (i = 0; i < num_reqs; i++)
+            free(salts[i].data);
+    }
+    free(jobs);
+    free(salts);
+    free(jobnum);
+    zapfree(outbuf, num_reqs * 32);
+}
@@ -36,20 +36,12 @@ krb5_c_string_to_key(krb5_context context, krb5_enctype enctype,
                                             NULL, key);
 }
 
-krb5_error_code KRB5_CALLCONV
-krb5_c_string_to_key_with_params(krb5_context context, krb5_enctype enctype,
-                                 const krb5_data *string,
-                                 const krb5_data *salt,
-                                 const krb5_data *params, krb5_keyblock *key)
+/* Check the salt for ktp and allocate key's contents. */
+static krb5_error_code
+init_key(const struct krb5_keytypes *ktp, const krb5_data *salt,
+         krb5_keyblock *key)
 {
-    krb5_error_code ret;
-    const struct krb5_keytypes *ktp;
-    size_t keylength;
-
-    ktp = find_enctype(enctype);
-    if (ktp == NULL)
-        return KRB5_BAD_ENCTYPE;
-    keylength = ktp->enc->keylength;
+    size_t keylength = ktp->enc->keylength;
 
     /*
      * xxx AFS string2key function is indicated by a special length  in
@@ -57,7 +49,7 @@ krb5_c_string_to_key_with_params(krb5_context context, krb5_enctype enctype,
      * deal with this.  Using s2kparams would be a much better solution.
      */
     if (salt && salt->length == SALT_TYPE_AFS_LENGTH) {
-        switch (enctype) {
+        switch (ktp->etype) {
         case ENCTYPE_DES_CBC_CRC:
         case ENCTYPE_DES_CBC_MD4:
         case ENCTYPE_DES_CBC_MD5:
@@ -72,15 +64,101 @@ krb5_c_string_to_key_with_params(krb5_context context, krb5_enctype enctype,
         return ENOMEM;
 
     key->magic = KV5M_KEYBLOCK;
-    key->enctype = enctype;
+    key->enctype = ktp->etype;
     key->length = keylength;
+    return 0;
+}
+
+/* Release the contents of a key which could not be generated. */
+static void
+clear_key(krb5_keyblock *key)
+{
+    zapfree(key->contents, key->length);
+    key->length = 0;
+    key->contents = NULL;
+}
+
+krb5_error_code KRB5_CALLCONV
+krb5_c_string_to_key_with_params(krb5_context context, krb5_enctype enctype,
+                                 const krb5_data *string,
+                                 const krb5_data *salt,
+                                 const krb5_data *params, krb5_keyblock *key)
+{
+    krb5_error_code ret;
+    const struct krb5_keytypes *ktp;
+
+    ktp = find_enctype(enctype);
+    if (ktp == NULL)
+        return KRB5_BAD_ENCTYPE;
+
+    ret = init_key(ktp, salt, key);
+    if (ret)
+        return ret;
 
     ret = (*ktp->str2key)(ktp, string, salt, params, key);
-    if (ret) {
-        zapfree(key->contents, keylength);
-        key->length = 0;
-        key->contents = NULL;
-    }
+    if (ret)
+        clear_key(key);
 
     return ret;
 }
+
+krb5_error_code KRB5_CALLCONV
+krb5_c_string_to_key_batch(krb5_context context, krb5_s2k_req *reqs,
+                           size_t num_reqs)
+{
+    const struct krb5_keytypes *ktp;
+    str2key_batch_func handler;
+    krb5_s2k_req *r, **pending, **group;
+    size_t i, npending = 0, ngroup;
+    krb5_error_code ret;
+
+    /* If we can't allocate the pending list, do every request singly. */
+    pending = k5alloc(num_reqs * sizeof(*pending), &ret);
+
+    for (i = 0; i < num_reqs; i++) {
+        r = &reqs[i];
+        ktp = find_enctype(r->enctype);
+        if (ktp == NULL) {
+            r->code = KRB5_BAD_ENCTYPE;
+            continue;
+        }
+        r->code = init_key(ktp, r->salt, &r->key);
+        if (r->code)
+            continue;
+        if (ktp->str2key_batch != NULL && pending != NULL) {
+            pending[npending++] = r;
+            continue;
+        }
+        r->code = ktp->str2key(ktp, r->string, r->salt, r->params, &r->key);
+        if (r->code)
+            clear_key(&r->key);
+    }
+
+    /* Pass each group of pending requests to its batch handler. */
+    group = pending;
+    while (npending > 0) {
+        handler = find_enctype(group[0]->enctype)->str2key_batch;
+        ngroup = 1;
+        for (i = 1; i < npending; i++) {
+            r = group[i];
+            if (find_enctype(r->enctype)->str2key_batch == handler) {
+                group[i] = group[ngroup];
+                group[ngroup++] = r;
+            }
+        }
+        handler(group, ngroup);
+        for (i = 0; i < ngroup; i++) {
+            if (group[i]->code)
+                clear_key(&group[i]->key);
+        }
+        group += ngroup;
+        npending -= ngroup;
+    }
+    free(pending);
+
+    for (i = 0; i < num_reqs; i++) {
+        if (reqs[i].code != 0)
+            return reqs[i].code;
+    }
+    return 0;
+}
@@ -25,7 +25,7 @@
  */
 
 #include "crypto_int.h"
-#include <openssl/evp.h>
+#include "keycache.h"
 #include <openssl/aes.h>
 #include <openssl/modes.h>
 
@@ -47,47 +47,70 @@ cts_decr(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
 #define NUM_BITS 8
 #define IV_CTS_BUF_SIZE 16 /* 16 - hardcoded in CRYPTO_cts128_en/decrypt */
 
-static const EVP_CIPHER *
-map_mode(unsigned int len)
+/* Set *sched_out to key's AES encryption or decryption schedule, expanding
+ * it the first time it is needed. */
+static krb5_error_code
+get_sched(krb5_key key, krb5_boolean decrypt, const AES_KEY **sched_out)
 {
-    if (len==16)
-        return EVP_aes_128_cbc();
-    if (len==32)
-        return EVP_aes_256_cbc();
-    else
-        return NULL;
+    struct k5_openssl_cache *c;
+    int bits = NUM_BITS * key->keyblock.length;
+
+    *sched_out = NULL;
+    c = k5_openssl_get_cache(key);
+    if (c == NULL)
+        return ENOMEM;
+    if (decrypt && !c->dec_init) {
+        if (AES_set_decrypt_key(key->keyblock.contents, bits,
+                                &c->dec.aes) != 0)
+            return KRB5_CRYPTO_INTERNAL;
+        c->dec_init = TRUE;
+    } else if (!decrypt && !c->enc_init) {
+        if (AES_set_encrypt_key(key->keyblock.contents, bits,
+                                &c->enc.aes) != 0)
+            return KRB5_CRYPTO_INTERNAL;
+        c->enc_init = TRUE;
+    }
+    *sched_out = decrypt ? &c->dec.aes : &c->enc.aes;
+    return 0;
 }
 
-/* Encrypt one block using CBC. */
+/* Encrypt or decrypt one block using CBC. */
 static krb5_error_code
-cbc_enc(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
-        size_t num_data)
+cbc_crypt(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
+          size_t num_data, krb5_boolean decrypt)
 {
-    int             ret, olen = BLOCK_SIZE;
-    unsigned char   iblock[BLOCK_SIZE], oblock[BLOCK_SIZE];
-    EVP_CIPHER_CTX  ciph_ctx;
+    krb5_error_code ret;
+    unsigned char   iblock[BLOCK_SIZE], oblock[BLOCK_SIZE], iv[BLOCK_SIZE];
+    const AES_KEY   *sched;
     struct iov_block_state input_pos, output_pos;
 
-    EVP_CIPHER_CTX_init(&ciph_ctx);
-    ret = EVP_EncryptInit_ex(&ciph_ctx, map_mode(key->keyblock.length),
-                             NULL, key->keyblock.contents, (ivec) ? (unsigned char*)ivec->data : NULL);
-    if (ret == 0)
-        return KRB5_CRYPTO_INTERNAL;
+    ret = get_sched(key, decrypt, &sched);
+    if (ret)
+        return ret;
+
+    if (ivec != NULL)
+        memcpy(iv, ivec->data, BLOCK_SIZE);
+    else
+        memset(iv, 0, BLOCK_SIZE);
 
     IOV_BLOCK_STATE_INIT(&input_pos);
     IOV_BLOCK_STATE_INIT(&output_pos);
     krb5int_c_iov_get_block(iblock, BLOCK_SIZE, data, num_data, &input_pos);
-    EVP_CIPHER_CTX_set_padding(&ciph_ctx,0);
-    ret = EVP_EncryptUpdate(&ciph_ctx, oblock, &olen, iblock, BLOCK_SIZE);
-    if (ret == 1) {
-        krb5int_c_iov_put_block(data, num_data, oblock, BLOCK_SIZE,
-                                &output_pos);
-    }
-    EVP_CIPHER_CTX_cleanup(&ciph_ctx);
+    AES_cbc_encrypt(iblock, oblock, BLOCK_SIZE, sched, iv,
+                    decrypt ? AES_DECRYPT : AES_ENCRYPT);
+    krb5int_c_iov_put_block(data, num_data, oblock, BLOCK_SIZE, &output_pos);
 
     zap(iblock, BLOCK_SIZE);
     zap(oblock, BLOCK_SIZE);
-    return (ret == 1) ? 0 : KRB5_CRYPTO_INTERNAL;
+    return 0;
+}
+
+/* Encrypt one block using CBC. */
+static krb5_error_code
+cbc_enc(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
+        size_t num_data)
+{
+    return cbc_crypt(key, ivec, data, num_data, FALSE);
 }
 
 /* Decrypt one block using CBC. */
@@ -95,31 +118,7 @@ static krb5_error_code
 cbc_decr(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
          size_t num_data)
 {
-    int              ret = 0, olen = BLOCK_SIZE;
-    unsigned char    iblock[BLOCK_SIZE], oblock[BLOCK_SIZE];
-    EVP_CIPHER_CTX   ciph_ctx;
-    struct iov_block_state input_pos, output_pos;
-
-    EVP_CIPHER_CTX_init(&ciph_ctx);
-    ret = EVP_DecryptInit_ex(&ciph_ctx, map_mode(key->keyblock.length),
-                             NULL, key->keyblock.contents, (ivec) ? (unsigned char*)ivec->data : NULL);
-    if (ret == 0)
-        return KRB5_CRYPTO_INTERNAL;
-
-    IOV_BLOCK_STATE_INIT(&input_pos);
-    IOV_BLOCK_STATE_INIT(&output_pos);
-    krb5int_c_iov_get_block(iblock, BLOCK_SIZE, data, num_data, &input_pos);
-    EVP_CIPHER_CTX_set_padding(&ciph_ctx,0);
-    ret = EVP_DecryptUpdate(&ciph_ctx, oblock, &olen, iblock, BLOCK_SIZE);
-    if (ret == 1) {
-        krb5int_c_iov_put_block(data, num_data, oblock, BLOCK_SIZE,
-                                &output_pos);
-    }
-    EVP_CIPHER_CTX_cleanup(&ciph_ctx);
-
-    zap(iblock, BLOCK_SIZE);
-    zap(oblock, BLOCK_SIZE);
-    return (ret == 1) ? 0 : KRB5_CRYPTO_INTERNAL;
+    return cbc_crypt(key, ivec, data, num_data, TRUE);
 }
 
 static krb5_error_code
@@ -131,7 +130,11 @@ cts_encr(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
     unsigned char         *oblock = NULL, *dbuf = NULL;
     unsigned char          iv_cts[IV_CTS_BUF_SIZE];
     struct iov_block_state input_pos, output_pos;
-    AES_KEY                enck;
+    const AES_KEY         *enck;
+
+    ret = get_sched(key, FALSE, &enck);
+    if (ret)
+        return ret;
 
     memset(iv_cts,0,sizeof(iv_cts));
     if (ivec && ivec->data){
@@ -155,10 +158,7 @@ cts_encr(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
 
     krb5int_c_iov_get_block(dbuf, dlen, data, num_data, &input_pos);
 
-    AES_set_encrypt_key(key->keyblock.contents,
-                        NUM_BITS * key->keyblock.length, &enck);
-
-    size = CRYPTO_cts128_encrypt((unsigned char *)dbuf, oblock, dlen, &enck,
+    size = CRYPTO_cts128_encrypt((unsigned char *)dbuf, oblock, dlen, enck,
                                  iv_cts, (cbc128_f)AES_cbc_encrypt);
     if (size <= 0) {
         ret = KRB5_CRYPTO_INTERNAL;
@@ -188,7 +188,11 @@ cts_decr(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
     unsigned char         *dbuf = NULL;
     unsigned char          iv_cts[IV_CTS_BUF_SIZE];
     struct iov_block_state input_pos, output_pos;
-    AES_KEY                deck;
+    const AES_KEY         *deck;
+
+    ret = get_sched(key, TRUE, &deck);
+    if (ret)
+        return ret;
 
     memset(iv_cts,0,sizeof(iv_cts));
     if (ivec && ivec->data){
@@ -209,13 +213,10 @@ cts_decr(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
         return ENOMEM;
     }
 
-    AES_set_decrypt_key(key->keyblock.contents,
-                        NUM_BITS * key->keyblock.length, &deck);
-
     krb5int_c_iov_get_block(dbuf, dlen, data, num_data, &input_pos);
 
     size = CRYPTO_cts128_decrypt((unsigned char *)dbuf, oblock,
-                                 dlen, &deck,
+                                 dlen, deck,
                                  iv_cts, (cbc128_f)AES_cbc_encrypt);
     if (size <= 0)
         ret = KRB5_CRYPTO_INTERNAL;
@@ -306,7 +307,8 @@ const struct krb5_enc_provider krb5int_enc_aes128 = {
     krb5int_aes_decrypt,
     NULL,
     krb5int_aes_init_state,
-    krb5int_default_free_state
+    krb5int_default_free_state,
+    k5_openssl_key_cleanup
 };
 
 const struct krb5_enc_provider krb5int_enc_aes256 = {
@@ -316,5 +318,6 @@ const struct krb5_enc_provider krb5int_enc_aes256 = {
     krb5int_aes_decrypt,
     NULL,
     krb5int_aes_init_state,
-    krb5int_default_free_state
+    krb5int_default_free_state,
+    k5_openssl_key_cleanup
 };
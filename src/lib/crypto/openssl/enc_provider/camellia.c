@@ -25,7 +25,7 @@
  */
 
 #include "crypto_int.h"
-#include <openssl/evp.h>
+#include "keycache.h"
 #include <openssl/camellia.h>
 #include <openssl/modes.h>
 
@@ -73,47 +73,66 @@ xorblock(unsigned char *out, const unsigned char *in)
     }
 }
 
-static const EVP_CIPHER *
-map_mode(unsigned int len)
+/* Set *sched_out to key's Camellia schedule (which serves for both
+ * directions), expanding it the first time it is needed. */
+static krb5_error_code
+get_sched(krb5_key key, const CAMELLIA_KEY **sched_out)
 {
-    if (len==16)
-        return EVP_camellia_128_cbc();
-    if (len==32)
-        return EVP_camellia_256_cbc();
-    else
-        return NULL;
+    struct k5_openssl_cache *c;
+
+    *sched_out = NULL;
+    c = k5_openssl_get_cache(key);
+    if (c == NULL)
+        return ENOMEM;
+    if (!c->enc_init) {
+        if (Camellia_set_key(key->keyblock.contents,
+                             NUM_BITS * key->keyblock.length,
+                             &c->enc.camellia) != 0)
+            return KRB5_CRYPTO_INTERNAL;
+        c->enc_init = TRUE;
+    }
+    *sched_out = &c->enc.camellia;
+    return 0;
 }
 
-/* Encrypt one block using CBC. */
+/* Encrypt or decrypt one block using CBC. */
 static krb5_error_code
-cbc_enc(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
-        size_t num_data)
+cbc_crypt(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
+          size_t num_data, krb5_boolean decrypt)
 {
-    int             ret, olen = BLOCK_SIZE;
-    unsigned char   iblock[BLOCK_SIZE], oblock[BLOCK_SIZE];
-    EVP_CIPHER_CTX  ciph_ctx;
+    krb5_error_code     ret;
+    unsigned char       iblock[BLOCK_SIZE], oblock[BLOCK_SIZE];
+    unsigned char       iv[BLOCK_SIZE];
+    const CAMELLIA_KEY *sched;
     struct iov_block_state input_pos, output_pos;
 
-    EVP_CIPHER_CTX_init(&ciph_ctx);
-    ret = EVP_EncryptInit_ex(&ciph_ctx, map_mode(key->keyblock.length),
-                             NULL, key->keyblock.contents, (ivec) ? (unsigned char*)ivec->data : NULL);
-    if (ret == 0)
-        return KRB5_CRYPTO_INTERNAL;
+    ret = get_sched(key, &sched);
+    if (ret)
+        return ret;
+
+    if (ivec != NULL)
+        memcpy(iv, ivec->data, BLOCK_SIZE);
+    else
+        memset(iv, 0, BLOCK_SIZE);
 
     IOV_BLOCK_STATE_INIT(&input_pos);
     IOV_BLOCK_STATE_INIT(&output_pos);
     krb5int_c_iov_get_block(iblock, BLOCK_SIZE, data, num_data, &input_pos);
-    EVP_CIPHER_CTX_set_padding(&ciph_ctx,0);
-    ret = EVP_EncryptUpdate(&ciph_ctx, oblock, &olen, iblock, BLOCK_SIZE);
-    if (ret == 1) {
-        krb5int_c_iov_put_block(data, num_data, oblock, BLOCK_SIZE,
-                                &output_pos);
-    }
-    EVP_CIPHER_CTX_cleanup(&ciph_ctx);
+    Camellia_cbc_encrypt(iblock, oblock, BLOCK_SIZE, sched, iv,
+                         decrypt ? CAMELLIA_DECRYPT : CAMELLIA_ENCRYPT);
+    krb5int_c_iov_put_block(data, num_data, oblock, BLOCK_SIZE, &output_pos);
 
     zap(iblock, BLOCK_SIZE);
     zap(oblock, BLOCK_SIZE);
-    return (ret == 1) ? 0 : KRB5_CRYPTO_INTERNAL;
+    return 0;
+}
+
+/* Encrypt one block using CBC. */
+static krb5_error_code
+cbc_enc(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
+        size_t num_data)
+{
+    return cbc_crypt(key, ivec, data, num_data, FALSE);
 }
 
 /* Decrypt one block using CBC. */
@@ -121,31 +140,7 @@ static krb5_error_code
 cbc_decr(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
          size_t num_data)
 {
-    int              ret = 0, olen = BLOCK_SIZE;
-    unsigned char    iblock[BLOCK_SIZE], oblock[BLOCK_SIZE];
-    EVP_CIPHER_CTX   ciph_ctx;
-    struct iov_block_state input_pos, output_pos;
-
-    EVP_CIPHER_CTX_init(&ciph_ctx);
-    ret = EVP_DecryptInit_ex(&ciph_ctx, map_mode(key->keyblock.length),
-                             NULL, key->keyblock.contents, (ivec) ? (unsigned char*)ivec->data : NULL);
-    if (ret == 0)
-        return KRB5_CRYPTO_INTERNAL;
-
-    IOV_BLOCK_STATE_INIT(&input_pos);
-    IOV_BLOCK_STATE_INIT(&output_pos);
-    krb5int_c_iov_get_block(iblock, BLOCK_SIZE, data, num_data, &input_pos);
-    EVP_CIPHER_CTX_set_padding(&ciph_ctx,0);
-    ret = EVP_DecryptUpdate(&ciph_ctx, oblock, &olen, iblock, BLOCK_SIZE);
-    if (ret == 1) {
-        krb5int_c_iov_put_block(data, num_data, oblock, BLOCK_SIZE,
-                                &output_pos);
-    }
-    EVP_CIPHER_CTX_cleanup(&ciph_ctx);
-
-    zap(iblock, BLOCK_SIZE);
-    zap(oblock, BLOCK_SIZE);
-    return (ret == 1) ? 0 : KRB5_CRYPTO_INTERNAL;
+    return cbc_crypt(key, ivec, data, num_data, TRUE);
 }
 
 static krb5_error_code
@@ -157,7 +152,11 @@ cts_encr(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
     unsigned char         *oblock = NULL, *dbuf = NULL;
     unsigned char          iv_cts[IV_CTS_BUF_SIZE];
     struct iov_block_state input_pos, output_pos;
-    CAMELLIA_KEY           enck;
+    const CAMELLIA_KEY    *enck;
+
+    ret = get_sched(key, &enck);
+    if (ret)
+        return ret;
 
     memset(iv_cts,0,sizeof(iv_cts));
     if (ivec && ivec->data){
@@ -181,10 +180,7 @@ cts_encr(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
 
     krb5int_c_iov_get_block(dbuf, dlen, data, num_data, &input_pos);
 
-    Camellia_set_key(key->keyblock.contents, NUM_BITS * key->keyblock.length,
-                     &enck);
-
-    size = CRYPTO_cts128_encrypt((unsigned char *)dbuf, oblock, dlen, &enck,
+    size = CRYPTO_cts128_encrypt((unsigned char *)dbuf, oblock, dlen, enck,
                                  iv_cts, (cbc128_f)Camellia_cbc_encrypt);
     if (size <= 0) {
         ret = KRB5_CRYPTO_INTERNAL;
@@ -214,7 +210,11 @@ cts_decr(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
     unsigned char         *dbuf = NULL;
     unsigned char          iv_cts[IV_CTS_BUF_SIZE];
     struct iov_block_state input_pos, output_pos;
-    CAMELLIA_KEY           deck;
+    const CAMELLIA_KEY    *deck;
+
+    ret = get_sched(key, &deck);
+    if (ret)
+        return ret;
 
     memset(iv_cts,0,sizeof(iv_cts));
     if (ivec && ivec->data){
@@ -235,13 +235,10 @@ cts_decr(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
         return ENOMEM;
     }
 
-    Camellia_set_key(key->keyblock.contents, NUM_BITS * key->keyblock.length,
-                     &deck);
-
     krb5int_c_iov_get_block(dbuf, dlen, data, num_data, &input_pos);
 
     size = CRYPTO_cts128_decrypt((unsigned char *)dbuf, oblock,
-                                 dlen, &deck,
+                                 dlen, deck,
                                  iv_cts, (cbc128_f)Camellia_cbc_encrypt);
     if (size <= 0)
         ret = KRB5_CRYPTO_INTERNAL;
@@ -319,15 +316,17 @@ krb5int_camellia_cbc_mac(krb5_key key, const krb5_crypto_iov *data,
                          size_t num_data, const krb5_data *iv,
                          krb5_data *output)
 {
-    CAMELLIA_KEY enck;
+    krb5_error_code ret;
+    const CAMELLIA_KEY *enck;
     unsigned char blockY[CAMELLIA_BLOCK_SIZE];
     struct iov_block_state iov_state;
 
     if (output->length < CAMELLIA_BLOCK_SIZE)
         return KRB5_BAD_MSIZE;
 
-    Camellia_set_key(key->keyblock.contents,
-                     NUM_BITS * key->keyblock.length, &enck);
+    ret = get_sched(key, &enck);
+    if (ret)
+        return ret;
 
     if (iv != NULL)
         memcpy(blockY, iv->data, CAMELLIA_BLOCK_SIZE);
@@ -345,7 +344,7 @@ krb5int_camellia_cbc_mac(krb5_key key, const krb5_crypto_iov *data,
 
         xorblock(blockB, blockY);
 
-        Camellia_ecb_encrypt(blockB, blockY, &enck, 1);
+        Camellia_ecb_encrypt(blockB, blockY, enck, 1);
     }
 
     output->length = CAMELLIA_BLOCK_SIZE;
@@ -372,7 +371,8 @@ const struct krb5_enc_provider krb5int_enc_camellia128 = {
     krb5int_camellia_decrypt,
     krb5int_camellia_cbc_mac,
     krb5int_camellia_init_state,
-    krb5int_default_free_state
+    krb5int_default_free_state,
+    k5_openssl_key_cleanup
 };
 
 const struct krb5_enc_provider krb5int_enc_camellia256 = {
@@ -382,7 +382,8 @@ const struct krb5_enc_provider krb5int_enc_camellia256 = {
     krb5int_camellia_decrypt,
     krb5int_camellia_cbc_mac,
     krb5int_camellia_init_state,
-    krb5int_default_free_state
+    krb5int_default_free_state,
+    k5_openssl_key_cleanup
 };
 
 #else /* CAMELLIA */
@@ -51,7 +51,7 @@
  */
 
 #include "crypto_int.h"
-#include <openssl/evp.h>
+#include "keycache.h"
 #include <openssl/des.h>
 
 #define DES_BLOCK_SIZE 8
@@ -81,112 +81,85 @@ validate(krb5_key key, const krb5_data *ivec, const krb5_crypto_iov *data,
     return 0;
 }
 
+/* Set *sched_out to key's DES key schedule (which serves for both
+ * directions), setting it up the first time it is needed. */
 static krb5_error_code
-k5_des_encrypt(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
-               size_t num_data)
+get_sched(krb5_key key, DES_key_schedule **sched_out)
+{
+    struct k5_openssl_cache *c;
+
+    *sched_out = NULL;
+    c = k5_openssl_get_cache(key);
+    if (c == NULL)
+        return ENOMEM;
+    if (!c->enc_init) {
+        DES_set_key_unchecked((const_DES_cblock *)key->keyblock.contents,
+                              &c->enc.des[0]);
+        c->enc_init = TRUE;
+    }
+    *sched_out = c->enc.des;
+    return 0;
+}
+
+/* Encrypt or decrypt data in CBC mode, chaining from ivec if it is given and
+ * updating it. */
+static krb5_error_code
+cbc_crypt(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
+          size_t num_data, int enc)
 {
-    int ret, olen = DES_BLOCK_SIZE;
+    krb5_error_code ret;
     unsigned char iblock[DES_BLOCK_SIZE], oblock[DES_BLOCK_SIZE];
     struct iov_block_state input_pos, output_pos;
-    EVP_CIPHER_CTX ciph_ctx;
+    DES_key_schedule *sched;
+    DES_cblock iv;
     krb5_boolean empty;
 
-    IOV_BLOCK_STATE_INIT(&input_pos);
-    IOV_BLOCK_STATE_INIT(&output_pos);
-
     ret = validate(key, ivec, data, num_data, &empty);
     if (ret != 0 || empty)
         return ret;
 
-    EVP_CIPHER_CTX_init(&ciph_ctx);
+    ret = get_sched(key, &sched);
+    if (ret)
+        return ret;
 
-    ret = EVP_EncryptInit_ex(&ciph_ctx, EVP_des_cbc(), NULL,
-                             key->keyblock.contents, (ivec && ivec->data) ? (unsigned char*)ivec->data : NULL);
-    if (!ret)
-        return KRB5_CRYPTO_INTERNAL;
+    if (ivec != NULL)
+        memcpy(iv, ivec->data, DES_BLOCK_SIZE);
+    else
+        memset(iv, 0, DES_BLOCK_SIZE);
 
-    EVP_CIPHER_CTX_set_padding(&ciph_ctx,0);
+    IOV_BLOCK_STATE_INIT(&input_pos);
+    IOV_BLOCK_STATE_INIT(&output_pos);
 
     for (;;) {
-
-        if (!krb5int_c_iov_get_block(iblock, DES_BLOCK_SIZE, data,
-                                     num_data, &input_pos))
-            break;
-
-        ret = EVP_EncryptUpdate(&ciph_ctx, oblock, &olen,
-                                (unsigned char *)iblock, DES_BLOCK_SIZE);
-        if (!ret)
+        if (!krb5int_c_iov_get_block(iblock, DES_BLOCK_SIZE, data, num_data,
+                                     &input_pos))
             break;
-
+        DES_ncbc_encrypt(iblock, oblock, DES_BLOCK_SIZE, sched, &iv, enc);
         krb5int_c_iov_put_block(data, num_data, oblock, DES_BLOCK_SIZE,
                                 &output_pos);
     }
 
+    /* The cipher leaves the last ciphertext block in iv. */
     if (ivec != NULL)
-        memcpy(ivec->data, oblock, DES_BLOCK_SIZE);
-
-    EVP_CIPHER_CTX_cleanup(&ciph_ctx);
+        memcpy(ivec->data, iv, DES_BLOCK_SIZE);
 
     zap(iblock, sizeof(iblock));
     zap(oblock, sizeof(oblock));
-
-    if (ret != 1)
-        return KRB5_CRYPTO_INTERNAL;
     return 0;
 }
 
 static krb5_error_code
-k5_des_decrypt(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
+k5_des_encrypt(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
                size_t num_data)
 {
-    int ret, olen = DES_BLOCK_SIZE;
-    unsigned char iblock[DES_BLOCK_SIZE], oblock[DES_BLOCK_SIZE];
-    struct iov_block_state input_pos, output_pos;
-    EVP_CIPHER_CTX ciph_ctx;
-    krb5_boolean empty;
-
-    IOV_BLOCK_STATE_INIT(&input_pos);
-    IOV_BLOCK_STATE_INIT(&output_pos);
-
-    ret = validate(key, ivec, data, num_data, &empty);
-    if (ret != 0 || empty)
-        return ret;
-
-    EVP_CIPHER_CTX_init(&ciph_ctx);
-
-    ret = EVP_DecryptInit_ex(&ciph_ctx, EVP_des_cbc(), NULL,
-                             key->keyblock.contents,
-                             (ivec) ? (unsigned char*)ivec->data : NULL);
-    if (!ret)
-        return KRB5_CRYPTO_INTERNAL;
-
-    EVP_CIPHER_CTX_set_padding(&ciph_ctx,0);
-
-    for (;;) {
-
-        if (!krb5int_c_iov_get_block(iblock, DES_BLOCK_SIZE,
-                                     data, num_data, &input_pos))
-            break;
-
-        ret = EVP_DecryptUpdate(&ciph_ctx, oblock, &olen,
-                                iblock, DES_BLOCK_SIZE);
-        if (!ret) break;
-
-        krb5int_c_iov_put_block(data, num_data, oblock,
-                                DES_BLOCK_SIZE, &output_pos);
-    }
-
-    if (ivec != NULL)
-        memcpy(ivec->data, iblock, DES_BLOCK_SIZE);
-
-    EVP_CIPHER_CTX_cleanup(&ciph_ctx);
-
-    zap(iblock, sizeof(iblock));
-    zap(oblock, sizeof(oblock));
+    return cbc_crypt(key, ivec, data, num_data, DES_ENCRYPT);
+}
 
-    if (ret != 1)
-        return KRB5_CRYPTO_INTERNAL;
-    return 0;
+static krb5_error_code
+k5_des_decrypt(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
+               size_t num_data)
+{
+    return cbc_crypt(key, ivec, data, num_data, DES_DECRYPT);
 }
 
 static krb5_error_code
@@ -196,7 +169,7 @@ k5_des_cbc_mac(krb5_key key, const krb5_crypto_iov *data, size_t num_data,
     int ret;
     struct iov_block_state iov_state;
     DES_cblock blockY, blockB;
-    DES_key_schedule sched;
+    DES_key_schedule *sched;
     krb5_boolean empty;
 
     ret = validate(key, ivec, data, num_data, &empty);
@@ -206,8 +179,9 @@ k5_des_cbc_mac(krb5_key key, const krb5_crypto_iov *data, size_t num_data,
     if (output->length != DES_BLOCK_SIZE)
         return KRB5_BAD_MSIZE;
 
-    if (DES_set_key((DES_cblock *)key->keyblock.contents, &sched) != 0)
-        return KRB5_CRYPTO_INTERNAL;
+    ret = get_sched(key, &sched);
+    if (ret)
+        return ret;
 
     if (ivec != NULL)
         memcpy(blockY, ivec->data, DES_BLOCK_SIZE);
@@ -220,7 +194,7 @@ k5_des_cbc_mac(krb5_key key, const krb5_crypto_iov *data, size_t num_data,
                                      &iov_state))
             break;
         store_64_n(load_64_n(blockB) ^ load_64_n(blockY), blockB);
-        DES_ecb_encrypt(&blockB, &blockY, &sched, 1);
+        DES_ecb_encrypt(&blockB, &blockY, sched, 1);
     }
 
     memcpy(output->data, blockY, DES_BLOCK_SIZE);
@@ -234,5 +208,6 @@ const struct krb5_enc_provider krb5int_enc_des = {
     k5_des_decrypt,
     k5_des_cbc_mac,
     krb5int_des_init_state,
-    krb5int_default_free_state
+    krb5int_default_free_state,
+    k5_openssl_key_cleanup
 };
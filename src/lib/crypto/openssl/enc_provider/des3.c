@@ -50,7 +50,8 @@
  */
 
 #include "crypto_int.h"
-#include <openssl/evp.h>
+#include "keycache.h"
+#include <openssl/des.h>
 
 
 #define DES3_BLOCK_SIZE 8
@@ -80,116 +81,92 @@ validate(krb5_key key, const krb5_data *ivec, const krb5_crypto_iov *data,
     return 0;
 }
 
+/* Set *sched_out to key's three DES key schedules (which serve for both
+ * directions), setting them up the first time they are needed. */
 static krb5_error_code
-k5_des3_encrypt(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
-                size_t num_data)
+get_sched(krb5_key key, DES_key_schedule **sched_out)
 {
-    int ret, olen = DES3_BLOCK_SIZE;
-    unsigned char iblock[DES3_BLOCK_SIZE], oblock[DES3_BLOCK_SIZE];
-    struct iov_block_state input_pos, output_pos;
-    EVP_CIPHER_CTX ciph_ctx;
-    krb5_boolean empty;
-
-    ret = validate(key, ivec, data, num_data, &empty);
-    if (ret != 0 || empty)
-        return ret;
-
-    IOV_BLOCK_STATE_INIT(&input_pos);
-    IOV_BLOCK_STATE_INIT(&output_pos);
-
-    EVP_CIPHER_CTX_init(&ciph_ctx);
-
-    ret = EVP_EncryptInit_ex(&ciph_ctx, EVP_des_ede3_cbc(), NULL,
-                             key->keyblock.contents,
-                             (ivec) ? (unsigned char*)ivec->data : NULL);
-    if (!ret)
-        return KRB5_CRYPTO_INTERNAL;
-
-    EVP_CIPHER_CTX_set_padding(&ciph_ctx,0);
-
-    for (;;) {
-
-        if (!krb5int_c_iov_get_block(iblock, DES3_BLOCK_SIZE,
-                                     data, num_data, &input_pos))
-            break;
-
-        ret = EVP_EncryptUpdate(&ciph_ctx, oblock, &olen,
-                                (unsigned char *)iblock, DES3_BLOCK_SIZE);
-        if (!ret)
-            break;
-
-        krb5int_c_iov_put_block(data, num_data,
-                                oblock, DES3_BLOCK_SIZE, &output_pos);
+    struct k5_openssl_cache *c;
+    unsigned char *bits = key->keyblock.contents;
+    int i;
+
+    *sched_out = NULL;
+    c = k5_openssl_get_cache(key);
+    if (c == NULL)
+        return ENOMEM;
+    if (!c->enc_init) {
+        for (i = 0; i < 3; i++) {
+            DES_set_key_unchecked((const_DES_cblock *)(bits + 8 * i),
+                                  &c->enc.des[i]);
+        }
+        c->enc_init = TRUE;
     }
-
-    if (ivec != NULL)
-        memcpy(ivec->data, oblock, DES3_BLOCK_SIZE);
-
-    EVP_CIPHER_CTX_cleanup(&ciph_ctx);
-
-    zap(iblock, sizeof(iblock));
-    zap(oblock, sizeof(oblock));
-
-    if (ret != 1)
-        return KRB5_CRYPTO_INTERNAL;
+    *sched_out = c->enc.des;
     return 0;
 }
 
+/* Encrypt or decrypt data in CBC mode, chaining from ivec if it is given and
+ * updating it. */
 static krb5_error_code
-k5_des3_decrypt(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
-                size_t num_data)
+cbc_crypt(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
+          size_t num_data, int enc)
 {
-    int ret, olen = DES3_BLOCK_SIZE;
+    krb5_error_code ret;
     unsigned char iblock[DES3_BLOCK_SIZE], oblock[DES3_BLOCK_SIZE];
     struct iov_block_state input_pos, output_pos;
-    EVP_CIPHER_CTX ciph_ctx;
+    DES_key_schedule *sched;
+    DES_cblock iv;
     krb5_boolean empty;
 
     ret = validate(key, ivec, data, num_data, &empty);
     if (ret != 0 || empty)
         return ret;
 
-    IOV_BLOCK_STATE_INIT(&input_pos);
-    IOV_BLOCK_STATE_INIT(&output_pos);
-
-    EVP_CIPHER_CTX_init(&ciph_ctx);
+    ret = get_sched(key, &sched);
+    if (ret)
+        return ret;
 
-    ret = EVP_DecryptInit_ex(&ciph_ctx, EVP_des_ede3_cbc(), NULL,
-                             key->keyblock.contents,
-                             (ivec) ? (unsigned char*)ivec->data : NULL);
-    if (!ret)
-        return KRB5_CRYPTO_INTERNAL;
+    if (ivec != NULL)
+        memcpy(iv, ivec->data, DES3_BLOCK_SIZE);
+    else
+        memset(iv, 0, DES3_BLOCK_SIZE);
 
-    EVP_CIPHER_CTX_set_padding(&ciph_ctx,0);
+    IOV_BLOCK_STATE_INIT(&input_pos);
+    IOV_BLOCK_STATE_INIT(&output_pos);
 
     for (;;) {
-
-        if (!krb5int_c_iov_get_block(iblock, DES3_BLOCK_SIZE,
-                                     data, num_data, &input_pos))
+        if (!krb5int_c_iov_get_block(iblock, DES3_BLOCK_SIZE, data, num_data,
+                                     &input_pos))
             break;
-
-        ret = EVP_DecryptUpdate(&ciph_ctx, oblock, &olen,
-                                (unsigned char *)iblock, DES3_BLOCK_SIZE);
-        if (!ret)
-            break;
-
+        DES_ede3_cbc_encrypt(iblock, oblock, DES3_BLOCK_SIZE, &sched[0],
+                             &sched[1], &sched[2], &iv, enc);
         krb5int_c_iov_put_block(data, num_data, oblock, DES3_BLOCK_SIZE,
                                 &output_pos);
     }
 
+    /* The cipher leaves the last ciphertext block in iv. */
     if (ivec != NULL)
-        memcpy(ivec->data, iblock, DES3_BLOCK_SIZE);
-
-    EVP_CIPHER_CTX_cleanup(&ciph_ctx);
+        memcpy(ivec->data, iv, DES3_BLOCK_SIZE);
 
     zap(iblock, sizeof(iblock));
     zap(oblock, sizeof(oblock));
-
-    if (ret != 1)
-        return KRB5_CRYPTO_INTERNAL;
     return 0;
 }
 
+static krb5_error_code
+k5_des3_encrypt(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
+                size_t num_data)
+{
+    return cbc_crypt(key, ivec, data, num_data, DES_ENCRYPT);
+}
+
+static krb5_error_code
+k5_des3_decrypt(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
+                size_t num_data)
+{
+    return cbc_crypt(key, ivec, data, num_data, DES_DECRYPT);
+}
+
 const struct krb5_enc_provider krb5int_enc_des3 = {
     DES3_BLOCK_SIZE,
     DES3_KEY_BYTES, DES3_KEY_SIZE,
@@ -197,5 +174,6 @@ const struct krb5_enc_provider krb5int_enc_des3 = {
     k5_des3_decrypt,
     NULL,
     krb5int_des_init_state,
-    krb5int_default_free_state
+    krb5int_default_free_state,
+    k5_openssl_key_cleanup
 };
@@ -33,6 +33,7 @@
 
 
 #include "crypto_int.h"
+#include "keycache.h"
 #include <openssl/evp.h>
 
 /*
@@ -152,5 +153,6 @@ const struct krb5_enc_provider krb5int_enc_arcfour = {
     k5_arcfour_docrypt,
     NULL,
     k5_arcfour_init_state,
-    k5_arcfour_free_state
+    k5_arcfour_free_state,
+    k5_openssl_key_cleanup
 };
@@ -52,6 +52,7 @@
 
 
 #include "crypto_int.h"
+#include "keycache.h"
 #include <openssl/hmac.h>
 #include <openssl/evp.h>
 
@@ -80,14 +81,33 @@ map_digest(const struct krb5_hash_provider *hash)
         return NULL;
 }
 
+/* Feed the signed parts of data to c and place the HMAC result in output. */
+static void
+hmac_finish(HMAC_CTX *c, const krb5_crypto_iov *data, size_t num_data,
+            krb5_data *output)
+{
+    unsigned int i = 0, md_len = 0;
+    unsigned char md[EVP_MAX_MD_SIZE];
+
+    for (i = 0; i < num_data; i++) {
+        const krb5_crypto_iov *iov = &data[i];
+
+        if (SIGN_IOV(iov))
+            HMAC_Update(c, (unsigned char*) iov->data.data, iov->data.length);
+    }
+    HMAC_Final(c,(unsigned char *)md, &md_len);
+    if ( md_len <= output->length) {
+        output->length = md_len;
+        memcpy(output->data, md, output->length);
+    }
+}
+
 krb5_error_code
 krb5int_hmac_keyblock(const struct krb5_hash_provider *hash,
                       const krb5_keyblock *keyblock,
                       const krb5_crypto_iov *data, size_t num_data,
                       krb5_data *output)
 {
-    unsigned int i = 0, md_len = 0;
-    unsigned char md[EVP_MAX_MD_SIZE];
     HMAC_CTX c;
     size_t hashsize, blocksize;
 
@@ -104,27 +124,53 @@ krb5int_hmac_keyblock(const struct krb5_hash_provider *hash,
 
     HMAC_CTX_init(&c);
     HMAC_Init(&c, keyblock->contents, keyblock->length, map_digest(hash));
-    for (i = 0; i < num_data; i++) {
-        krb5_crypto_iov *iov = &data[i];
-
-        if (SIGN_IOV(iov))
-            HMAC_Update(&c, (unsigned char*) iov->data.data, iov->data.length);
-    }
-    HMAC_Final(&c,(unsigned char *)md, &md_len);
-    if ( md_len <= output->length) {
-        output->length = md_len;
-        memcpy(output->data, md, output->length);
-    }
+    hmac_finish(&c, data, num_data, output);
     HMAC_CTX_cleanup(&c);
     return 0;
-
-
 }
 
+/*
+ * Keying an HMAC costs two compression function calls, as much as hashing a
+ * short message, so remember a keyed context in the key's cache and start
+ * each computation from a copy of it.
+ */
 krb5_error_code
 krb5int_hmac(const struct krb5_hash_provider *hash, krb5_key key,
              const krb5_crypto_iov *data, size_t num_data,
              krb5_data *output)
 {
-    return krb5int_hmac_keyblock(hash, &key->keyblock, data, num_data, output);
+    struct k5_openssl_cache *cache;
+    const EVP_MD *md = map_digest(hash);
+    HMAC_CTX c;
+
+    if (key->keyblock.length > hash->blocksize)
+        return KRB5_CRYPTO_INTERNAL;
+    if (output->length < hash->hashsize)
+        return KRB5_BAD_MSIZE;
+    if (md == NULL)
+        return KRB5_CRYPTO_INTERNAL;
+
+    cache = k5_openssl_get_cache(key);
+    if (cache == NULL)
+        return ENOMEM;
+    if (cache->hmac_md != md) {
+        if (cache->hmac_md == NULL)
+            HMAC_CTX_init(&cache->hmac_ctx);
+        cache->hmac_md = NULL;
+        if (!HMAC_Init_ex(&cache->hmac_ctx, key->keyblock.contents,
+                          key->keyblock.length, md, NULL)) {
+            HMAC_CTX_cleanup(&cache->hmac_ctx);
+            return KRB5_CRYPTO_INTERNAL;
+        }
+        cache->hmac_md = md;
+    }
+
+    HMAC_CTX_init(&c);
+    if (!HMAC_CTX_copy(&c, &cache->hmac_ctx)) {
+        HMAC_CTX_cleanup(&c);
+        return KRB5_CRYPTO_INTERNAL;
+    }
+    hmac_finish(&c, data, num_data, output);
+    HMAC_CTX_cleanup(&c);
+    return 0;
 }
@@ -0,0 +1,71 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* lib/crypto/openssl/keycache.h - Per-key state cached by the OpenSSL back end */
+/*
+ * Copyright (C) 2012 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Export of this software from the United States of America may
+ *   require a specific license from the United States Government.
+ *   It is the responsibility of any person or organization contemplating
+ *   export to obtain such a license before exporting.
+ *
+ * WITHIN THAT CONSTRAINT, permission to use, copy, modify, and
+ * distribute this software and its documentation for any purpose and
+ * without fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright notice and
+ * this permission notice appear in supporting documentation, and that
+ * the name of M.I.T. not be used in advertising or publicity pertaining
+ * to distribution of the software without specific, written prior
+ * permission.  Furthermore if you modify this software you must label
+ * your software as modified software and not distribute it in such a
+ * fashion that it might be confused with the original M.I.T. software.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is" without express
+ * or implied warranty.
+ */
+
+
+/*
+ * The OpenSSL cipher providers and HMAC keep their per-key state in a single
+ * structure in the krb5_key cache field, so that a key used both to encrypt
+ * and to compute HMACs (as with RC4) has one owner and one cleanup method.
+ * Each part is set up on first use.
+ */
+
+#ifndef KEYCACHE_H
+#define KEYCACHE_H
+
+#include <openssl/aes.h>
+#include <openssl/des.h>
+#include <openssl/hmac.h>
+#ifdef CAMELLIA
+#include <openssl/camellia.h>
+#endif
+
+union k5_openssl_sched {
+    AES_KEY aes;
+#ifdef CAMELLIA
+    CAMELLIA_KEY camellia;
+#endif
+    DES_key_schedule des[3];
+};
+
+struct k5_openssl_cache {
+    /* Key schedules.  Ciphers with one schedule for both directions use enc
+     * only. */
+    krb5_boolean enc_init, dec_init;
+    union k5_openssl_sched enc, dec;
+
+    /* HMAC context initialized with the key, for the digest hmac_md. */
+    const EVP_MD *hmac_md;
+    HMAC_CTX hmac_ctx;
+};
+
+/* Return key's cache, allocating it if necessary.  Return NULL if out of
+ * memory. */
+struct k5_openssl_cache *k5_openssl_get_cache(krb5_key key);
+
+/* The key_cleanup method of the OpenSSL enc providers. */
+void k5_openssl_key_cleanup(krb5_key key);
+
+#endif /* KEYCACHE_H */
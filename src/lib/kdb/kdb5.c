@@ -37,6 +37,7 @@
  * Include files
  */
 
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <k5-int.h>
@@ -270,6 +271,19 @@ clean_n_exit:
     return result;
 }
 
+/* Copy a module's vtable into lib, leaving methods newer than the module's
+ * minor version NULL. */
+static void
+kdb_copy_vftabl(db_library lib, const kdb_vftabl *vftabl)
+{
+    size_t len = sizeof(kdb_vftabl);
+
+    if (vftabl->min_ver < 1)
+        len = offsetof(kdb_vftabl, get_generation);
+    memset(&lib->vftabl, 0, sizeof(kdb_vftabl));
+    memcpy(&lib->vftabl, vftabl, len);
+}
+
 static void
 kdb_setup_opt_functions(db_library lib)
 {
@@ -321,7 +335,7 @@ kdb_load_library(krb5_context kcontext, char *lib_name, db_library *libptr)
         return ENOMEM;
 
     strlcpy(lib->name, lib_name, sizeof(lib->name));
-    memcpy(&lib->vftabl, vftabl_addr, sizeof(kdb_vftabl));
+    kdb_copy_vftabl(lib, vftabl_addr);
     kdb_setup_opt_functions(lib);
 
     status = lib->vftabl.init_library();
@@ -427,7 +441,7 @@ kdb_load_library(krb5_context kcontext, char *lib_name, db_library *lib)
         goto clean_n_exit;
     }
 
-    memcpy(&(*lib)->vftabl, vftabl_addrs[0], sizeof(kdb_vftabl));
+    kdb_copy_vftabl(*lib, vftabl_addrs[0]);
     kdb_setup_opt_functions(*lib);
 
     if ((status = (*lib)->vftabl.init_library()))
@@ -586,6 +600,7 @@ kdb_free_lib_handle(krb5_context kcontext)
     if (status)
         return status;
 
+    krb5int_princ_cache_free(kcontext);
     free_mkey_list(kcontext, kcontext->dal_handle->master_keylist);
     krb5_free_principal(kcontext, kcontext->dal_handle->master_princ);
     free(kcontext->dal_handle);
@@ -737,12 +752,28 @@ krb5_db_unlock(krb5_context kcontext)
     return v->unlock(kcontext);
 }
 
+/* Get the module's database generation, for the principal cache. */
+krb5_error_code
+krb5int_db_get_generation(krb5_context kcontext, krb5_ui_4 *gen)
+{
+    krb5_error_code status;
+    kdb_vftabl *v;
+
+    status = get_vftabl(kcontext, &v);
+    if (status)
+        return status;
+    if (v->get_generation == NULL)
+        return KRB5_PLUGIN_OP_NOTSUPP;
+    return v->get_generation(kcontext, gen);
+}
+
 krb5_error_code
 krb5_db_get_principal(krb5_context kcontext, krb5_const_principal search_for,
                       unsigned int flags, krb5_db_entry **entry)
 {
     krb5_error_code status = 0;
     kdb_vftabl *v;
+    unsigned long epoch;
 
     *entry = NULL;
     status = get_vftabl(kcontext, &v);
@@ -750,7 +781,17 @@ krb5_db_get_principal(krb5_context kcontext, krb5_const_principal search_for,
         return status;
     if (v->get_principal == NULL)
         return KRB5_PLUGIN_OP_NOTSUPP;
-    return v->get_principal(kcontext, search_for, flags, entry);
+    if (kcontext->dal_handle->princ_cache == NULL)
+        return v->get_principal(kcontext, search_for, flags, entry);
+
+    status = krb5int_princ_cache_get(kcontext, search_for, flags, entry,
+                                     &epoch);
+    if (status != KRB5_KDB_NOENTRY)
+        return status;
+    status = v->get_principal(kcontext, search_for, flags, entry);
+    if (status == 0)
+        krb5int_princ_cache_put(kcontext, search_for, flags, *entry, epoch);
+    return status;
 }
 
 void
@@ -862,6 +903,7 @@ krb5int_put_principal_no_log(krb5_context kcontext, krb5_db_entry *entry)
     if (status)
         return status;
     status = v->put_principal(kcontext, entry, db_args);
+    krb5int_princ_cache_invalidate(kcontext, entry->princ, status == 0);
     free_db_args(kcontext, db_args);
     return status;
 }
@@ -917,6 +959,7 @@ krb5_db_put_principal(krb5_context kcontext, krb5_db_entry *entry)
     }
 
     status = v->put_principal(kcontext, entry, db_args);
+    krb5int_princ_cache_invalidate(kcontext, entry->princ, status == 0);
     if (status == 0 && upd != NULL)
         (void) ulog_finish_update(kcontext, upd);
 
@@ -942,7 +985,9 @@ krb5int_delete_principal_no_log(krb5_context kcontext,
         return status;
     if (v->delete_principal == NULL)
         return KRB5_PLUGIN_OP_NOTSUPP;
-    return v->delete_principal(kcontext, search_for);
+    status = v->delete_principal(kcontext, search_for);
+    krb5int_princ_cache_invalidate(kcontext, search_for, status == 0);
+    return status;
 }
 
 krb5_error_code
@@ -990,6 +1035,7 @@ krb5_db_delete_principal(krb5_context kcontext, krb5_principal search_for)
         return KRB5_PLUGIN_OP_NOTSUPP;
 
     status = v->delete_principal(kcontext, search_for);
+    krb5int_princ_cache_invalidate(kcontext, search_for, status == 0);
 
     /*
      * We need to commit our update upon success
@@ -2584,6 +2630,10 @@ krb5_db_audit_as_req(krb5_context kcontext, krb5_kdc_req *request,
     if (status || v->audit_as_req == NULL)
         return;
     v->audit_as_req(kcontext, request, client, server, authtime, error_code);
+
+    /* The module may have updated lockout attributes of the client. */
+    if (client != NULL)
+        krb5int_princ_cache_invalidate(kcontext, client->princ, TRUE);
 }
 
 void
@@ -16,6 +16,8 @@
 #define KRB5_DB_GET_PROFILE(kcontext)  ((kcontext)->profile)
 #define KRB5_DB_GET_REALM(kcontext)    ((kcontext)->default_realm)
 
+typedef struct _kdb_princ_cache *krb5_db_princ_cache;
+
 typedef struct _db_library {
     char name[KDB_MAX_DB_NAME];
     int reference_cnt;
@@ -32,6 +34,7 @@ struct _kdb5_dal_handle
     db_library lib_handle;
     krb5_keylist_node *master_keylist;
     krb5_principal master_princ;
+    krb5_db_princ_cache princ_cache;
 };
 /* typedef kdb5_dal_handle is in k5-int.h now */
 
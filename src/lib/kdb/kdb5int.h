@@ -37,4 +37,26 @@ krb5_error_code
 krb5int_delete_principal_no_log(krb5_context kcontext,
                                 krb5_principal search_for);
 
+krb5_error_code
+krb5int_db_get_generation(krb5_context kcontext, krb5_ui_4 *gen);
+
+/* kdb_cache.c */
+krb5_error_code
+krb5int_princ_cache_get(krb5_context context, krb5_const_principal search_for,
+                        unsigned int flags, krb5_db_entry **entry_out,
+                        unsigned long *epoch);
+
+void
+krb5int_princ_cache_put(krb5_context context, krb5_const_principal search_for,
+                        unsigned int flags, const krb5_db_entry *entry,
+                        unsigned long epoch);
+
+void
+krb5int_princ_cache_invalidate(krb5_context context,
+                               krb5_const_principal princ,
+                               krb5_boolean adopt_age);
+
+void
+krb5int_princ_cache_free(krb5_context context);
+
 #endif /* __KDB5INT_H__ */
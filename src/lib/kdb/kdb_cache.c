@@ -0,0 +1,485 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* lib/kdb/kdb_cache.c - Cache of decoded principal entries */
+/*
+ * Copyright (C) 2012 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Export of this software from the United States of America may
+ *   require a specific license from the United States Government.
+ *   It is the responsibility of any person or organization contemplating
+ *   export to obtain such a license before exporting.
+ *
+ * WITHIN THAT CONSTRAINT, permission to use, copy, modify, and
+ * distribute this software and its documentation for any purpose and
+ * without fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright notice and
+ * this permission notice appear in supporting documentation, and that
+ * the name of M.I.T. not be used in advertising or publicity pertaining
+ * to distribution of the software without specific, written prior
+ * permission.  Furthermore if you modify this software you must label
+ * your software as modified software and not distribute it in such a
+ * fashion that it might be confused with the original M.I.T. software.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is" without express
+ * or implied warranty.
+ */
+
+/*
+ * This file implements an optional cache of principal entries in front of
+ * the module's get_principal method, for read-mostly callers like the KDC
+ * which look up the same few principals (the local krbtgt, popular services)
+ * over and over.  Entries are keyed on the lookup name and flags, so that
+ * alias and canonicalization lookups are cached separately.
+ *
+ * Cached entries are invalidated:
+ *
+ * - when they are older than the configured lifetime,
+ * - when this context modifies or deletes the principal through the DAL, or
+ *   audits an AS request for it (which may update lockout attributes), and
+ * - all at once, when the database changes.  If the module supports the
+ *   get_generation method, the generation is checked on every lookup, so no
+ *   cached entry is returned after a modification by any process has
+ *   completed.  Otherwise we fall back to the database age, which is checked
+ *   at most once a second.
+ *
+ * A lookup which misses the cache notes the cache's epoch, which is advanced
+ * by every invalidation, and the result is only cached if the epoch has not
+ * changed in the meantime; otherwise it might have been read before the
+ * change which caused the invalidation.
+ *
+ * Entries with module-private data in e_data are never cached, since we
+ * cannot know how to copy them.
+ */
+
+#include "k5-int.h"
+#include "kdb5.h"
+#include "kdb5int.h"
+
+struct pcache_entry {
+    struct pcache_entry *hash_next;
+    struct pcache_entry *lru_prev;      /* more recently used */
+    struct pcache_entry *lru_next;      /* less recently used */
+    unsigned int hash;
+    unsigned int flags;
+    time_t expires;
+    krb5_principal name;                /* name used for the lookup */
+    krb5_db_entry *entry;
+};
+
+struct _kdb_princ_cache {
+    k5_mutex_t lock;
+    struct pcache_entry **table;
+    unsigned int nbuckets;
+    unsigned int max_entries;
+    unsigned int num_entries;
+    krb5_deltat ttl;
+    struct pcache_entry *lru_head, *lru_tail;
+    unsigned long epoch;
+    krb5_boolean have_gen;
+    krb5_ui_4 db_gen;
+    time_t db_age;
+    time_t last_age_check;
+    unsigned long hits;
+    unsigned long misses;
+};
+
+/* Hash a principal name and lookup flags. */
+static unsigned int
+hash_princ(krb5_const_principal princ, unsigned int flags)
+{
+    unsigned char buf[4];
+
+    store_32_be(flags, buf);
+    return k5_fnv_bytes(k5_fnv_princ(K5_FNV_INIT, princ), buf, sizeof(buf));
+}
+
+/* Free a principal entry allocated by copy_entry(). */
+static void
+free_entry(krb5_context context, krb5_db_entry *entry)
+{
+    krb5_tl_data *tl, *tl_next;
+    int i, j;
+
+    if (entry == NULL)
+        return;
+    krb5_free_principal(context, entry->princ);
+    for (tl = entry->tl_data; tl != NULL; tl = tl_next) {
+        tl_next = tl->tl_data_next;
+        free(tl->tl_data_contents);
+        free(tl);
+    }
+    for (i = 0; i < entry->n_key_data; i++) {
+        for (j = 0; j < entry->key_data[i].key_data_ver; j++) {
+            zapfree(entry->key_data[i].key_data_contents[j],
+                    entry->key_data[i].key_data_length[j]);
+        }
+    }
+    free(entry->key_data);
+    free(entry);
+}
+
+/*
+ * Make a deep copy of a principal entry, using the same allocation layout as
+ * the built-in modules so that the result can be freed with
+ * krb5_db_free_principal().  Entries with module-private data cannot be
+ * copied and yield KRB5_KDB_NOENTRY.
+ */
+static krb5_error_code
+copy_entry(krb5_context context, const krb5_db_entry *in,
+           krb5_db_entry **out)
+{
+    krb5_error_code ret;
+    krb5_db_entry *e;
+    krb5_tl_data *tl, **tlp;
+    krb5_key_data *kd;
+    int i, j;
+
+    *out = NULL;
+    if (in->e_data != NULL)
+        return KRB5_KDB_NOENTRY;
+
+    e = k5alloc(sizeof(*e), &ret);
+    if (e == NULL)
+        return ret;
+    *e = *in;
+    e->princ = NULL;
+    e->tl_data = NULL;
+    e->key_data = NULL;
+    e->n_key_data = 0;
+
+    ret = krb5_copy_principal(context, in->princ, &e->princ);
+    if (ret)
+        goto error;
+
+    tlp = &e->tl_data;
+    for (tl = in->tl_data; tl != NULL; tl = tl->tl_data_next) {
+        *tlp = k5alloc(sizeof(**tlp), &ret);
+        if (*tlp == NULL)
+            goto error;
+        (*tlp)->tl_data_type = tl->tl_data_type;
+        (*tlp)->tl_data_length = tl->tl_data_length;
+        if (tl->tl_data_length > 0) {
+            (*tlp)->tl_data_contents = k5alloc(tl->tl_data_length, &ret);
+            if ((*tlp)->tl_data_contents == NULL)
+                goto error;
+            memcpy((*tlp)->tl_data_contents, tl->tl_data_contents,
+                   tl->tl_data_length);
+        }
+        tlp = &(*tlp)->tl_data_next;
+    }
+
+    if (in->n_key_data > 0) {
+        e->key_data = k5alloc(in->n_key_data * sizeof(*e->key_data), &ret);
+        if (e->key_data == NULL)
+            goto error;
+        for (i = 0; i < in->n_key_data; i++) {
+            kd = &e->key_data[i];
+            *kd = in->key_data[i];
+            for (j = 0; j < kd->key_data_ver; j++)
+                kd->key_data_contents[j] = NULL;
+            /* Count the key now so that free_entry() cleans it up. */
+            e->n_key_data++;
+            for (j = 0; j < kd->key_data_ver; j++) {
+                if (in->key_data[i].key_data_length[j] == 0)
+                    continue;
+                kd->key_data_contents[j] =
+                    k5alloc(kd->key_data_length[j], &ret);
+                if (kd->key_data_contents[j] == NULL)
+                    goto error;
+                memcpy(kd->key_data_contents[j],
+                       in->key_data[i].key_data_contents[j],
+                       kd->key_data_length[j]);
+            }
+        }
+    }
+
+    *out = e;
+    return 0;
+
+error:
+    free_entry(context, e);
+    return ret;
+}
+
+static void
+lru_unlink(krb5_db_princ_cache pc, struct pcache_entry *pe)
+{
+    if (pe->lru_prev != NULL)
+        pe->lru_prev->lru_next = pe->lru_next;
+    else
+        pc->lru_head = pe->lru_next;
+    if (pe->lru_next != NULL)
+        pe->lru_next->lru_prev = pe->lru_prev;
+    else
+        pc->lru_tail = pe->lru_prev;
+    pe->lru_prev = pe->lru_next = NULL;
+}
+
+static void
+lru_push(krb5_db_princ_cache pc, struct pcache_entry *pe)
+{
+    pe->lru_prev = NULL;
+    pe->lru_next = pc->lru_head;
+    if (pc->lru_head != NULL)
+        pc->lru_head->lru_prev = pe;
+    else
+        pc->lru_tail = pe;
+    pc->lru_head = pe;
+}
+
+/* Remove pe from the cache and free it. */
+static void
+discard(krb5_context context, krb5_db_princ_cache pc, struct pcache_entry *pe)
+{
+    struct pcache_entry **pp;
+
+    for (pp = &pc->table[pe->hash % pc->nbuckets]; *pp != pe;
+         pp = &(*pp)->hash_next);
+    *pp = pe->hash_next;
+    lru_unlink(pc, pe);
+    krb5_free_principal(context, pe->name);
+    free_entry(context, pe->entry);
+    free(pe);
+    pc->num_entries--;
+}
+
+static void
+discard_all(krb5_context context, krb5_db_princ_cache pc)
+{
+    while (pc->lru_head != NULL)
+        discard(context, pc, pc->lru_head);
+    pc->epoch++;
+}
+
+/* Flush the cache if the database has changed since we last looked.  Call
+ * with pc locked. */
+static void
+check_changes(krb5_context context, krb5_db_princ_cache pc, time_t now)
+{
+    krb5_ui_4 gen;
+    time_t age;
+
+    if (krb5int_db_get_generation(context, &gen) == 0) {
+        if (!pc->have_gen || gen != pc->db_gen)
+            discard_all(context, pc);
+        pc->have_gen = TRUE;
+        pc->db_gen = gen;
+        return;
+    }
+    pc->have_gen = FALSE;
+
+    if (now == pc->last_age_check)
+        return;
+    pc->last_age_check = now;
+    if (krb5_db_get_age(context, NULL, &age) != 0)
+        age = -1;
+    if (age != pc->db_age || age == -1)
+        discard_all(context, pc);
+    pc->db_age = age;
+}
+
+krb5_error_code
+krb5_db_enable_principal_cache(krb5_context kcontext,
+                               unsigned int max_entries, krb5_deltat ttl)
+{
+    krb5_error_code ret;
+    krb5_db_princ_cache pc;
+    kdb5_dal_handle *dal;
+
+    if (kcontext->dal_handle == NULL) {
+        ret = krb5_db_setup_lib_handle(kcontext);
+        if (ret)
+            return ret;
+    }
+    dal = kcontext->dal_handle;
+    if (dal->princ_cache != NULL || max_entries == 0 || ttl <= 0)
+        return 0;
+
+    pc = k5alloc(sizeof(*pc), &ret);
+    if (pc == NULL)
+        return ret;
+    pc->nbuckets = max_entries;
+    pc->table = k5alloc(pc->nbuckets * sizeof(*pc->table), &ret);
+    if (pc->table == NULL) {
+        free(pc);
+        return ret;
+    }
+    ret = k5_mutex_init(&pc->lock);
+    if (ret) {
+        free(pc->table);
+        free(pc);
+        return ret;
+    }
+    pc->max_entries = max_entries;
+    pc->ttl = ttl;
+    pc->db_age = -1;
+    dal->princ_cache = pc;
+    return 0;
+}
+
+void
+krb5_db_principal_cache_stats(krb5_context kcontext, unsigned long *hits,
+                              unsigned long *misses, unsigned int *entries)
+{
+    krb5_db_princ_cache pc;
+
+    *hits = *misses = 0;
+    *entries = 0;
+    if (kcontext->dal_handle == NULL ||
+        kcontext->dal_handle->princ_cache == NULL)
+        return;
+    pc = kcontext->dal_handle->princ_cache;
+    if (k5_mutex_lock(&pc->lock) != 0)
+        return;
+    *hits = pc->hits;
+    *misses = pc->misses;
+    *entries = pc->num_entries;
+    k5_mutex_unlock(&pc->lock);
+}
+
+/*
+ * If search_for (looked up with flags) is cached, set *entry_out to a copy of
+ * the entry and return 0.  Otherwise return KRB5_KDB_NOENTRY, and set *epoch
+ * to the value to pass to krb5int_princ_cache_put() after looking up the
+ * entry in the database.
+ */
+krb5_error_code
+krb5int_princ_cache_get(krb5_context context, krb5_const_principal search_for,
+                        unsigned int flags, krb5_db_entry **entry_out,
+                        unsigned long *epoch)
+{
+    krb5_db_princ_cache pc = context->dal_handle->princ_cache;
+    struct pcache_entry *pe;
+    krb5_error_code ret;
+    unsigned int h = hash_princ(search_for, flags);
+    time_t now = time(NULL);
+
+    *entry_out = NULL;
+    ret = k5_mutex_lock(&pc->lock);
+    if (ret)
+        return ret;
+    check_changes(context, pc, now);
+    for (pe = pc->table[h % pc->nbuckets]; pe != NULL; pe = pe->hash_next) {
+        if (pe->hash == h && pe->flags == flags &&
+            krb5_principal_compare(context, pe->name, search_for))
+            break;
+    }
+    if (pe != NULL && now >= pe->expires) {
+        discard(context, pc, pe);
+        pe = NULL;
+    }
+    if (pe == NULL) {
+        pc->misses++;
+        *epoch = pc->epoch;
+        ret = KRB5_KDB_NOENTRY;
+    } else {
+        pc->hits++;
+        lru_unlink(pc, pe);
+        lru_push(pc, pe);
+        ret = copy_entry(context, pe->entry, entry_out);
+    }
+    k5_mutex_unlock(&pc->lock);
+    return ret;
+}
+
+/* Cache a copy of entry as the result of looking up search_for with flags,
+ * unless the cache has been invalidated since epoch was obtained.  Failures
+ * are not reported; the entry just won't be cached. */
+void
+krb5int_princ_cache_put(krb5_context context, krb5_const_principal search_for,
+                        unsigned int flags, const krb5_db_entry *entry,
+                        unsigned long epoch)
+{
+    krb5_db_princ_cache pc = context->dal_handle->princ_cache;
+    struct pcache_entry *pe, **bucket;
+    krb5_db_entry *copy;
+    unsigned int h = hash_princ(search_for, flags);
+
+    if (copy_entry(context, entry, &copy) != 0)
+        return;
+    pe = calloc(1, sizeof(*pe));
+    if (pe == NULL ||
+        krb5_copy_principal(context, search_for, &pe->name) != 0) {
+        free(pe);
+        free_entry(context, copy);
+        return;
+    }
+    pe->hash = h;
+    pe->flags = flags;
+    pe->entry = copy;
+    pe->expires = time(NULL) + pc->ttl;
+
+    if (k5_mutex_lock(&pc->lock) != 0) {
+        krb5_free_principal(context, pe->name);
+        free_entry(context, copy);
+        free(pe);
+        return;
+    }
+    if (pc->epoch != epoch) {
+        k5_mutex_unlock(&pc->lock);
+        krb5_free_principal(context, pe->name);
+        free_entry(context, copy);
+        free(pe);
+        return;
+    }
+    while (pc->num_entries >= pc->max_entries && pc->lru_tail != NULL)
+        discard(context, pc, pc->lru_tail);
+    bucket = &pc->table[h % pc->nbuckets];
+    pe->hash_next = *bucket;
+    *bucket = pe;
+    lru_push(pc, pe);
+    pc->num_entries++;
+    k5_mutex_unlock(&pc->lock);
+}
+
+/*
+ * Discard any cached entries for princ, whether looked up by that name or
+ * found under it through an alias.  If adopt_age is true, the caller has just
+ * modified the database, so take note of its new age rather than flushing
+ * the whole cache at the next check.  This is not done with a generation,
+ * since another process may have modified the database in the meantime; the
+ * whole cache is flushed at the next lookup instead.
+ */
+void
+krb5int_princ_cache_invalidate(krb5_context context,
+                               krb5_const_principal princ,
+                               krb5_boolean adopt_age)
+{
+    krb5_db_princ_cache pc;
+    struct pcache_entry *pe, *next;
+    time_t age;
+
+    if (context->dal_handle == NULL || context->dal_handle->princ_cache == NULL)
+        return;
+    pc = context->dal_handle->princ_cache;
+    if (k5_mutex_lock(&pc->lock) != 0)
+        return;
+    for (pe = pc->lru_head; pe != NULL; pe = next) {
+        next = pe->lru_next;
+        if (princ == NULL ||
+            krb5_principal_compare(context, pe->name, princ) ||
+            krb5_principal_compare(context, pe->entry->princ, princ))
+            discard(context, pc, pe);
+    }
+    pc->epoch++;
+    if (adopt_age && !pc->have_gen && pc->db_age != -1 &&
+        krb5_db_get_age(context, NULL, &age) == 0)
+        pc->db_age = age;
+    k5_mutex_unlock(&pc->lock);
+}
+
+/* Free the principal cache of a DAL handle. */
+void
+krb5int_princ_cache_free(krb5_context context)
+{
+    krb5_db_princ_cache pc;
+
+    if (context->dal_handle == NULL || context->dal_handle->princ_cache == NULL)
+        return;
+    pc = context->dal_handle->princ_cache;
+    discard_all(context, pc);
+    k5_mutex_destroy(&pc->lock);
+    free(pc->table);
+    free(pc);
+    context->dal_handle->princ_cache = NULL;
+}
@@ -35,6 +35,23 @@
 krb5_boolean
 krb5int_cc_creds_match_request(krb5_context, krb5_flags whichfields, krb5_creds *mcreds, krb5_creds *creds);
 
+unsigned int
+krb5int_cc_creds_hash(krb5_const_principal client,
+                      krb5_const_principal server);
+
+krb5_error_code
+krb5int_cc_get_ktypes(krb5_context context, krb5_flags flags,
+                      krb5_creds *mcreds, int *nktypes, krb5_enctype **ktypes);
+
+int
+krb5int_cc_ktype_pref(krb5_enctype my_ktype, int nktypes,
+                      krb5_enctype *ktypes);
+
+krb5_error_code
+krb5int_cc_retrieve_cred_cursor(krb5_context context, krb5_ccache id,
+                                krb5_cc_cursor *cursor, krb5_flags flags,
+                                krb5_creds *mcreds, krb5_creds *creds);
+
 int
 krb5int_cc_initialize(void);
 
@@ -275,6 +275,34 @@ static krb5_error_code krb5_fcc_data_last_change_time
 /* macros to make checking flags easier */
 #define OPENCLOSE(id) (((krb5_fcc_data *)id->data)->flags & KRB5_TC_OPENCLOSE)
 
+/*
+ * A copy of the whole cache file, read in one pass, from which cursors decode
+ * credentials.  It remains valid for reuse while the file's identity, size,
+ * and modification times are unchanged.  The index of credentials by client
+ * and server name is built the first time a retrieval needs it.  Snapshots
+ * are shared between cursors, and the reference count is protected by the
+ * lock of the cache data they belong to.
+ */
+struct fcc_snapshot {
+    unsigned int refcount;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    time_t ctime;
+    time_t built;               /* time the snapshot was read */
+    int version;                /* file format version */
+    unsigned char *buf;
+    size_t len;
+    size_t creds_start;         /* offset of the first credential */
+    krb5_boolean indexed;
+    size_t *cred_pos;           /* offsets of credentials in file order */
+    int ncreds;
+    int *chain;                 /* next credential in the same bucket, or -1 */
+    int *buckets;               /* first credential in each bucket, or -1 */
+    unsigned int nbuckets;      /* a power of two */
+};
+
 typedef struct _krb5_fcc_data {
     char *filename;
     /* Lock this one before reading or modifying the data stored here
@@ -293,6 +321,12 @@ typedef struct _krb5_fcc_data {
     size_t valid_bytes;
     size_t cur_offset;
     char buf[FCC_BUFSIZ];
+
+    /* The most recent snapshot of the file, if any. */
+    struct fcc_snapshot *snap;
+    /* If rsnap is set, read from it at offset rpos instead of the file. */
+    struct fcc_snapshot *rsnap;
+    size_t rpos;
 } krb5_fcc_data;
 
 static inline void invalidate_cache(krb5_fcc_data *data)
@@ -302,6 +336,19 @@ static inline void invalidate_cache(krb5_fcc_data *data)
 
 static off_t fcc_lseek(krb5_fcc_data *data, off_t offset, int whence)
 {
+    if (data->rsnap != NULL) {
+        if (whence == SEEK_CUR)
+            offset += data->rpos;
+        else if (whence == SEEK_END)
+            offset += data->rsnap->len;
+        if (offset < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        data->rpos = offset;
+        return offset;
+    }
+
     /* If we read some extra data in advance, and then want to know or
        use our "current" position, we need to back up a little.  */
     if (whence == SEEK_CUR && data->valid_bytes) {
@@ -330,6 +377,10 @@ struct krb5_fcc_ptcursor_data {
 /* An off_t can be arbitrarily complex */
 typedef struct _krb5_fcc_cursor {
     off_t pos;
+    struct fcc_snapshot *snap;
+    /* If set, visit the credentials chained from next in snap's index. */
+    krb5_boolean indexed;
+    int next;
 } krb5_fcc_cursor;
 
 #define MAYBE_OPEN(CONTEXT, ID, MODE)                                   \
@@ -393,6 +444,15 @@ krb5_fcc_read(krb5_context context, krb5_ccache id, krb5_pointer buf, unsigned i
 
     k5_cc_mutex_assert_locked(context, &data->lock);
 
+    if (data->rsnap != NULL) {
+        if (data->rpos > data->rsnap->len ||
+            data->rsnap->len - data->rpos < len)
+            return KRB5_CC_END;
+        memcpy(buf, data->rsnap->buf + data->rpos, len);
+        data->rpos += len;
+        return 0;
+    }
+
     while (len > 0) {
         int nread, e;
         size_t ncopied;
@@ -1421,6 +1481,311 @@ krb5_fcc_skip_principal(krb5_context context, krb5_ccache id)
     return KRB5_OK;
 }
 
+/* Read the next credential from the current position of id. */
+static krb5_error_code
+krb5_fcc_read_cred(krb5_context context, krb5_ccache id, krb5_creds *creds)
+{
+#define TCHECK(ret) if (ret != KRB5_OK) goto lose;
+    krb5_error_code kret;
+    krb5_int32 int32;
+    krb5_octet octet;
+
+    memset(creds, 0, sizeof(*creds));
+    kret = krb5_fcc_read_principal(context, id, &creds->client);
+    TCHECK(kret);
+    kret = krb5_fcc_read_principal(context, id, &creds->server);
+    TCHECK(kret);
+    kret = krb5_fcc_read_keyblock(context, id, &creds->keyblock);
+    TCHECK(kret);
+    kret = krb5_fcc_read_times(context, id, &creds->times);
+    TCHECK(kret);
+    kret = krb5_fcc_read_octet(context, id, &octet);
+    TCHECK(kret);
+    creds->is_skey = octet;
+    kret = krb5_fcc_read_int32(context, id, &int32);
+    TCHECK(kret);
+    creds->ticket_flags = int32;
+    kret = krb5_fcc_read_addrs(context, id, &creds->addresses);
+    TCHECK(kret);
+    kret = krb5_fcc_read_authdata(context, id, &creds->authdata);
+    TCHECK(kret);
+    kret = krb5_fcc_read_data(context, id, &creds->ticket);
+    TCHECK(kret);
+    kret = krb5_fcc_read_data(context, id, &creds->second_ticket);
+    TCHECK(kret);
+    return 0;
+
+lose:
+    krb5_free_cred_contents(context, creds);
+    return kret;
+#undef TCHECK
+}
+
+/* Release a reference to snap.  The cache data must be locked. */
+static void
+snapshot_release(struct fcc_snapshot *snap)
+{
+    if (snap == NULL || --snap->refcount > 0)
+        return;
+    if (snap->buf != NULL) {
+        zap(snap->buf, snap->len);
+        free(snap->buf);
+    }
+    free(snap->cred_pos);
+    free(snap->chain);
+    free(snap->buckets);
+    free(snap);
+}
+
+/* Drop the current snapshot of the cache, after a write. */
+static void
+snapshot_discard(krb5_fcc_data *data)
+{
+    snapshot_release(data->snap);
+    data->snap = NULL;
+}
+
+static krb5_boolean
+snapshot_current(struct fcc_snapshot *snap, struct stat *st)
+{
+    return snap->dev == st->st_dev && snap->ino == st->st_ino &&
+        snap->size == st->st_size && snap->mtime == st->st_mtime &&
+        snap->ctime == st->st_ctime && snap->ctime < snap->built;
+}
+
+/* Read the contents of id's open file, whose status is st, into a new
+ * snapshot. */
+static krb5_error_code
+snapshot_read(krb5_context context, krb5_ccache id, struct stat *st,
+              struct fcc_snapshot **snap_out)
+{
+    krb5_fcc_data *data = id->data;
+    struct fcc_snapshot *snap;
+    krb5_error_code kret;
+    size_t len;
+    int nread;
+
+    *snap_out = NULL;
+    if (st->st_size < 0 || (unsigned long long)st->st_size > SIZE_MAX)
+        return KRB5_CC_NOMEM;
+    snap = calloc(1, sizeof(*snap));
+    if (snap == NULL)
+        return KRB5_CC_NOMEM;
+    snap->refcount = 1;
+    snap->dev = st->st_dev;
+    snap->ino = st->st_ino;
+    snap->size = st->st_size;
+    snap->mtime = st->st_mtime;
+    snap->ctime = st->st_ctime;
+    snap->built = time(NULL);
+    snap->version = data->version;
+    snap->buf = malloc(st->st_size + 1);
+    if (snap->buf == NULL) {
+        snapshot_release(snap);
+        return KRB5_CC_NOMEM;
+    }
+
+    /* Read the whole file; other writers are shut out by the file lock. */
+    if (fcc_lseek(data, (off_t) 0, SEEK_SET) == (off_t) -1) {
+        kret = krb5_fcc_interpret(context, errno);
+        snapshot_release(snap);
+        return kret;
+    }
+    for (len = 0; len < (size_t)st->st_size; len += nread) {
+        nread = read(data->file, snap->buf + len, st->st_size - len);
+        if (nread < 0) {
+            kret = krb5_fcc_interpret(context, errno);
+            snap->len = len;
+            snapshot_release(snap);
+            return kret;
+        }
+        if (nread == 0)
+            break;
+    }
+    snap->len = len;
+
+    /* Find the first credential after the header and default principal. */
+    data->rsnap = snap;
+    kret = krb5_fcc_skip_header(context, id);
+    if (!kret)
+        kret = krb5_fcc_skip_principal(context, id);
+    snap->creds_start = data->rpos;
+    data->rsnap = NULL;
+    if (kret) {
+        snapshot_release(snap);
+        return kret;
+    }
+
+    *snap_out = snap;
+    return 0;
+}
+
+/*
+ * Get a reference to a snapshot of id's current contents, opening the file if
+ * necessary.  The cache data must be locked.
+ */
+static krb5_error_code
+fcc_get_snapshot(krb5_context context, krb5_ccache id,
+                 struct fcc_snapshot **snap_out)
+{
+    krb5_os_context os_ctx = &context->os_context;
+    krb5_fcc_data *data = id->data;
+    krb5_error_code kret, kret2;
+    struct fcc_snapshot *snap;
+    struct stat st;
+
+    k5_cc_mutex_assert_locked(context, &data->lock);
+    *snap_out = NULL;
+
+    /*
+     * If the file doesn't need to be opened, check whether the current
+     * snapshot is still good without doing so.  Opening the file can also
+     * pick up the KDC time offset from its header, so we can only skip it if
+     * that isn't wanted.
+     */
+    if (OPENCLOSE(id) && data->snap != NULL &&
+        (!(context->library_options & KRB5_LIBOPT_SYNC_KDCTIME) ||
+         (os_ctx->os_flags & KRB5_OS_TOFFSET_VALID)) &&
+        stat(data->filename, &st) == 0 && snapshot_current(data->snap, &st)) {
+        data->snap->refcount++;
+        *snap_out = data->snap;
+        return 0;
+    }
+
+    if (OPENCLOSE(id)) {
+        kret = krb5_fcc_open_file(context, id, FCC_OPEN_RDONLY);
+        if (kret)
+            return kret;
+    }
+
+    if (fstat(data->file, &st) == -1) {
+        kret = krb5_fcc_interpret(context, errno);
+        goto cleanup;
+    }
+    if (data->snap != NULL && snapshot_current(data->snap, &st)) {
+        snap = data->snap;
+    } else {
+        kret = snapshot_read(context, id, &st, &snap);
+        if (kret)
+            goto cleanup;
+        snapshot_release(data->snap);
+        data->snap = snap;
+    }
+    snap->refcount++;
+    *snap_out = snap;
+    kret = 0;
+
+cleanup:
+    if (OPENCLOSE(id)) {
+        kret2 = krb5_fcc_close_file(context, data);
+        if (!kret)
+            kret = kret2;
+        if (kret) {
+            snapshot_release(*snap_out);
+            *snap_out = NULL;
+        }
+    }
+    return kret;
+}
+
+/*
+ * Decode the credential at offset pos in snap into creds.  The cache data
+ * must be locked.
+ */
+static krb5_error_code
+snapshot_read_cred(krb5_context context, krb5_ccache id,
+                   struct fcc_snapshot *snap, size_t pos, krb5_creds *creds,
+                   size_t *next_pos)
+{
+    krb5_fcc_data *data = id->data;
+    krb5_error_code kret;
+
+    data->rsnap = snap;
+    data->rpos = pos;
+    data->version = snap->version;
+    kret = krb5_fcc_read_cred(context, id, creds);
+    if (next_pos != NULL)
+        *next_pos = data->rpos;
+    data->rsnap = NULL;
+    return kret;
+}
+
+/*
+ * Index the credentials in snap by client and server name, if that hasn't
+ * been done yet.  Like a sequential scan, stop at the first credential which
+ * can't be decoded.  The cache data must be locked.
+ */
+static krb5_error_code
+snapshot_index(krb5_context context, krb5_ccache id,
+               struct fcc_snapshot *snap)
+{
+    krb5_creds creds;
+    size_t pos, *cred_pos = NULL, *newpos;
+    unsigned int *hashes = NULL, *newhashes, nbuckets, b;
+    int i, n = 0, alloc = 0, *chain = NULL, *buckets = NULL, *tail = NULL;
+
+    if (snap->indexed)
+        return 0;
+
+    pos = snap->creds_start;
+    for (;;) {
+        if (n == alloc) {
+            alloc = (alloc == 0) ? 16 : alloc * 2;
+            newpos = realloc(cred_pos, alloc * sizeof(*cred_pos));
+            if (newpos == NULL)
+                goto oom;
+            cred_pos = newpos;
+            newhashes = realloc(hashes, alloc * sizeof(*hashes));
+            if (newhashes == NULL)
+                goto oom;
+            hashes = newhashes;
+        }
+        cred_pos[n] = pos;
+        if (snapshot_read_cred(context, id, snap, pos, &creds, &pos) != 0)
+            break;
+        hashes[n++] = krb5int_cc_creds_hash(creds.client, creds.server);
+        krb5_free_cred_contents(context, &creds);
+    }
+
+    for (nbuckets = 16; nbuckets < (unsigned int)n; nbuckets *= 2);
+    chain = malloc((n + 1) * sizeof(*chain));
+    buckets = malloc(nbuckets * sizeof(*buckets));
+    tail = malloc(nbuckets * sizeof(*tail));
+    if (chain == NULL || buckets == NULL || tail == NULL)
+        goto oom;
+    for (i = 0; i < (int)nbuckets; i++)
+        buckets[i] = tail[i] = -1;
+    /* Append each credential to its bucket, to keep the chains in file
+     * order. */
+    for (i = 0; i < n; i++) {
+        b = hashes[i] & (nbuckets - 1);
+        chain[i] = -1;
+        if (tail[b] == -1)
+            buckets[b] = i;
+        else
+            chain[tail[b]] = i;
+        tail[b] = i;
+    }
+    free(tail);
+    free(hashes);
+
+    snap->cred_pos = cred_pos;
+    snap->ncreds = n;
+    snap->chain = chain;
+    snap->buckets = buckets;
+    snap->nbuckets = nbuckets;
+    snap->indexed = TRUE;
+    return 0;
+
+oom:
+    free(cred_pos);
+    free(hashes);
+    free(chain);
+    free(buckets);
+    free(tail);
+    return KRB5_CC_NOMEM;
+}
+
 
 /*
  * Modifies:
@@ -1444,6 +1809,7 @@ krb5_fcc_initialize(krb5_context context, krb5_ccache id, krb5_principal princ)
     if (kret)
         return kret;
 
+    snapshot_discard(id->data);
     MAYBE_OPEN(context, id, FCC_OPEN_AND_ERASE);
 
 #if defined(HAVE_FCHMOD) || defined(HAVE_CHMOD)
@@ -1497,13 +1863,13 @@ static krb5_error_code dereference(krb5_context context, krb5_fcc_data *data)
         k5_cc_mutex_assert_unlocked(context, &data->lock);
         free(data->filename);
         zap(data->buf, sizeof(data->buf));
-        if (data->file >= 0) {
-            kerr = k5_cc_mutex_lock(context, &data->lock);
-            if (kerr)
-                return kerr;
+        kerr = k5_cc_mutex_lock(context, &data->lock);
+        if (kerr)
+            return kerr;
+        snapshot_discard(data);
+        if (data->file >= 0)
             krb5_fcc_close_file(context, data);
-            k5_cc_mutex_unlock(context, &data->lock);
-        }
+        k5_cc_mutex_unlock(context, &data->lock);
         k5_cc_mutex_destroy(&data->lock);
         free(data);
     } else
@@ -1550,6 +1916,7 @@ krb5_fcc_destroy(krb5_context context, krb5_ccache id)
     if (kret)
         return kret;
 
+    snapshot_discard(data);
     if (OPENCLOSE(id)) {
         invalidate_cache(data);
         ret = THREEPARAMOPEN(data->filename,
@@ -1743,6 +2110,8 @@ krb5_fcc_resolve (krb5_context context, krb5_ccache *id, const char *residual)
         data->flags = KRB5_TC_OPENCLOSE;
         data->file = -1;
         data->valid_bytes = 0;
+        data->snap = data->rsnap = NULL;
+        data->rpos = 0;
         setptr = malloc(sizeof(struct fcc_set));
         if (setptr == NULL) {
             k5_cc_mutex_unlock(context, &krb5int_cc_file_mutex);
@@ -1807,32 +2176,22 @@ krb5_fcc_start_seq_get(krb5_context context, krb5_ccache id,
         k5_cc_mutex_unlock(context, &data->lock);
         return KRB5_CC_NOMEM;
     }
-    if (OPENCLOSE(id)) {
-        kret = krb5_fcc_open_file(context, id, FCC_OPEN_RDONLY);
-        if (kret) {
-            free(fcursor);
-            k5_cc_mutex_unlock(context, &data->lock);
-            return kret;
-        }
-    }
 
-    /* Make sure we start reading right after the primary principal */
-    kret = krb5_fcc_skip_header(context, id);
+    /* Read the file once; the credentials are decoded from the snapshot as
+     * the cursor reaches them. */
+    kret = fcc_get_snapshot(context, id, &fcursor->snap);
     if (kret) {
         free(fcursor);
-        goto done;
-    }
-    kret = krb5_fcc_skip_principal(context, id);
-    if (kret) {
-        free(fcursor);
-        goto done;
+        k5_cc_mutex_unlock(context, &data->lock);
+        return kret;
     }
 
-    fcursor->pos = fcc_lseek(data, (off_t) 0, SEEK_CUR);
+    /* Start reading right after the primary principal */
+    fcursor->pos = fcursor->snap->creds_start;
+    fcursor->indexed = FALSE;
+    fcursor->next = -1;
     *cursor = (krb5_cc_cursor) fcursor;
 
-done:
-    MAYBE_CLOSE(context, id, kret);
     k5_cc_mutex_unlock(context, &data->lock);
     return kret;
 }
@@ -1862,59 +2221,34 @@ static krb5_error_code KRB5_CALLCONV
 krb5_fcc_next_cred(krb5_context context, krb5_ccache id, krb5_cc_cursor *cursor,
                    krb5_creds *creds)
 {
-#define TCHECK(ret) if (ret != KRB5_OK) goto lose;
     krb5_error_code kret;
-    krb5_fcc_cursor *fcursor;
-    krb5_int32 int32;
-    krb5_octet octet;
+    krb5_fcc_cursor *fcursor = (krb5_fcc_cursor *) *cursor;
+    struct fcc_snapshot *snap = fcursor->snap;
     krb5_fcc_data *d = (krb5_fcc_data *) id->data;
+    size_t pos;
 
+    memset(creds, 0, sizeof(*creds));
     kret = k5_cc_mutex_lock(context, &d->lock);
     if (kret)
         return kret;
 
-    memset(creds, 0, sizeof(*creds));
-    MAYBE_OPEN(context, id, FCC_OPEN_RDONLY);
-    fcursor = (krb5_fcc_cursor *) *cursor;
-
-    kret = (fcc_lseek(d, fcursor->pos, SEEK_SET) == (off_t) -1);
-    if (kret) {
-        kret = krb5_fcc_interpret(context, errno);
-        MAYBE_CLOSE(context, id, kret);
-        k5_cc_mutex_unlock(context, &d->lock);
-        return kret;
+    if (fcursor->indexed) {
+        if (fcursor->next == -1) {
+            kret = KRB5_CC_END;
+        } else {
+            kret = snapshot_read_cred(context, id, snap,
+                                      snap->cred_pos[fcursor->next], creds,
+                                      NULL);
+            fcursor->next = snap->chain[fcursor->next];
+        }
+    } else {
+        kret = snapshot_read_cred(context, id, snap, fcursor->pos, creds,
+                                  &pos);
+        if (!kret)
+            fcursor->pos = pos;
     }
 
-    kret = krb5_fcc_read_principal(context, id, &creds->client);
-    TCHECK(kret);
-    kret = krb5_fcc_read_principal(context, id, &creds->server);
-    TCHECK(kret);
-    kret = krb5_fcc_read_keyblock(context, id, &creds->keyblock);
-    TCHECK(kret);
-    kret = krb5_fcc_read_times(context, id, &creds->times);
-    TCHECK(kret);
-    kret = krb5_fcc_read_octet(context, id, &octet);
-    TCHECK(kret);
-    creds->is_skey = octet;
-    kret = krb5_fcc_read_int32(context, id, &int32);
-    TCHECK(kret);
-    creds->ticket_flags = int32;
-    kret = krb5_fcc_read_addrs(context, id, &creds->addresses);
-    TCHECK(kret);
-    kret = krb5_fcc_read_authdata(context, id, &creds->authdata);
-    TCHECK(kret);
-    kret = krb5_fcc_read_data(context, id, &creds->ticket);
-    TCHECK(kret);
-    kret = krb5_fcc_read_data(context, id, &creds->second_ticket);
-    TCHECK(kret);
-
-    fcursor->pos = fcc_lseek(d, (off_t) 0, SEEK_CUR);
-
-lose:
-    MAYBE_CLOSE (context, id, kret);
     k5_cc_mutex_unlock(context, &d->lock);
-    if (kret != KRB5_OK)
-        krb5_free_cred_contents(context, creds);
     return kret;
 }
 
@@ -1934,14 +2268,19 @@ lose:
 static krb5_error_code KRB5_CALLCONV
 krb5_fcc_end_seq_get(krb5_context context, krb5_ccache id, krb5_cc_cursor *cursor)
 {
-    /* We don't do anything with the file cache itself, so
-       no need to lock anything.  */
+    krb5_fcc_data *data = (krb5_fcc_data *) id->data;
+    krb5_fcc_cursor *fcursor = (krb5_fcc_cursor *) *cursor;
+    krb5_error_code kret;
 
-    /* don't close; it may be left open by the caller,
-       and if not, fcc_start_seq_get and/or fcc_next_cred will do the
-       MAYBE_CLOSE.
-       MAYBE_CLOSE(context, id, kret); */
-    free((krb5_fcc_cursor *) *cursor);
+    /* The file was closed by fcc_start_seq_get if necessary, but the
+       snapshot reference is counted under the lock. */
+    kret = k5_cc_mutex_lock(context, &data->lock);
+    if (kret)
+        return kret;
+    snapshot_release(fcursor->snap);
+    k5_cc_mutex_unlock(context, &data->lock);
+    free(fcursor);
+    *cursor = NULL;
     return 0;
 }
 
@@ -2015,6 +2354,8 @@ krb5int_fcc_new_unique(krb5_context context, char *template, krb5_ccache *id)
     data->flags = 0;
     data->file = -1;
     data->valid_bytes = 0;
+    data->snap = data->rsnap = NULL;
+    data->rpos = 0;
     /* data->version,mode filled in for real later */
     data->version = data->mode = 0;
 
@@ -2178,8 +2519,49 @@ done:
 static krb5_error_code KRB5_CALLCONV
 krb5_fcc_retrieve(krb5_context context, krb5_ccache id, krb5_flags whichfields, krb5_creds *mcreds, krb5_creds *creds)
 {
-    return krb5_cc_retrieve_cred_default (context, id, whichfields,
-                                          mcreds, creds);
+    krb5_fcc_data *data = (krb5_fcc_data *) id->data;
+    krb5_fcc_cursor *fcursor;
+    krb5_cc_cursor cursor;
+    struct fcc_snapshot *snap;
+    krb5_error_code kret;
+
+    /*
+     * Every match has the same client and server name components as mcreds,
+     * so only the credentials in the index bucket for those need to be
+     * decoded and compared.  The generic code takes care of the comparisons.
+     */
+    fcursor = malloc(sizeof(*fcursor));
+    if (fcursor == NULL)
+        return KRB5_CC_NOMEM;
+    kret = k5_cc_mutex_lock(context, &data->lock);
+    if (kret) {
+        free(fcursor);
+        return kret;
+    }
+    kret = fcc_get_snapshot(context, id, &snap);
+    if (kret) {
+        k5_cc_mutex_unlock(context, &data->lock);
+        free(fcursor);
+        return kret;
+    }
+    kret = snapshot_index(context, id, snap);
+    if (kret) {
+        snapshot_release(snap);
+        k5_cc_mutex_unlock(context, &data->lock);
+        free(fcursor);
+        return kret;
+    }
+    fcursor->snap = snap;
+    fcursor->pos = 0;
+    fcursor->indexed = TRUE;
+    fcursor->next = snap->buckets[krb5int_cc_creds_hash(mcreds->client,
+                                                        mcreds->server) &
+                                  (snap->nbuckets - 1)];
+    k5_cc_mutex_unlock(context, &data->lock);
+
+    cursor = (krb5_cc_cursor) fcursor;
+    return krb5int_cc_retrieve_cred_cursor(context, id, &cursor, whichfields,
+                                           mcreds, creds);
 }
 
 
@@ -2204,6 +2586,8 @@ krb5_fcc_store(krb5_context context, krb5_ccache id, krb5_creds *creds)
     if (ret)
         return ret;
 
+    snapshot_discard(id->data);
+
     /* Make sure we are writing to the end of the file */
     MAYBE_OPEN(context, id, FCC_OPEN_RDWR);
 
@@ -101,6 +101,8 @@ extern krb5_error_code krb5_change_cache (void);
 typedef struct _krb5_mcc_link {
     struct _krb5_mcc_link *next;
     krb5_creds *creds;
+    struct _krb5_mcc_link *hnext;       /* next in the same hash bucket */
+    unsigned int hash;                  /* from krb5int_cc_creds_hash */
 } krb5_mcc_link, *krb5_mcc_cursor;
 
 /* Per-cache data header.  */
@@ -110,6 +112,11 @@ typedef struct _krb5_mcc_data {
     krb5_principal prin;
     krb5_mcc_cursor link;
     krb5_timestamp changetime;
+    /* The credentials again, hashed by client and server name.  Each bucket
+     * is in the same order as the list. */
+    krb5_mcc_link **buckets;
+    unsigned int nbuckets;              /* zero or a power of two */
+    unsigned int count;
 } krb5_mcc_data;
 
 /* List of memory caches.  */
@@ -194,6 +201,9 @@ krb5_mcc_free(krb5_context context, krb5_ccache id)
         curr = next;
     }
     d->link = NULL;
+    free(d->buckets);
+    d->buckets = NULL;
+    d->nbuckets = d->count = 0;
     krb5_free_principal(context, d->prin);
 }
 
@@ -421,6 +431,8 @@ new_mcc_data (const char *name, krb5_mcc_data **dataptr)
     d->link = NULL;
     d->prin = NULL;
     d->changetime = 0;
+    d->buckets = NULL;
+    d->nbuckets = d->count = 0;
     update_mcc_change_time(d);
 
     n = malloc(sizeof(krb5_mcc_list_node));
@@ -581,12 +593,65 @@ krb5_mcc_get_principal(krb5_context context, krb5_ccache id, krb5_principal *pri
     return krb5_copy_principal(context, ptr->prin, princ);
 }
 
+/*
+ * Effects:
+ * Searches the cache for the best credential matching mcreds, in the same way
+ * as krb5_cc_retrieve_cred_default(), but looking only at the credentials
+ * with the same client and server name hash.
+ *
+ * Errors:
+ * KRB5_CC_NOTFOUND
+ * KRB5_CC_NOT_KTYPE
+ * system errors (mutex locking)
+ * ENOMEM
+ */
 krb5_error_code KRB5_CALLCONV
 krb5_mcc_retrieve(krb5_context context, krb5_ccache id, krb5_flags whichfields,
                   krb5_creds *mcreds, krb5_creds *creds)
 {
-    return krb5_cc_retrieve_cred_default (context, id, whichfields,
-                                          mcreds, creds);
+    krb5_error_code err, nomatch_err = KRB5_CC_NOTFOUND;
+    krb5_mcc_data *d = id->data;
+    krb5_mcc_link *l, *best = NULL;
+    krb5_enctype *ktypes;
+    unsigned int h;
+    int nktypes, p, best_pref = 0;
+
+    err = krb5int_cc_get_ktypes(context, whichfields, mcreds, &nktypes,
+                                &ktypes);
+    if (err)
+        return err;
+    h = krb5int_cc_creds_hash(mcreds->client, mcreds->server);
+
+    err = k5_cc_mutex_lock(context, &d->lock);
+    if (err) {
+        free(ktypes);
+        return err;
+    }
+    l = (d->nbuckets == 0) ? NULL : d->buckets[h & (d->nbuckets - 1)];
+    for (; l != NULL; l = l->hnext) {
+        if (l->hash != h ||
+            !krb5int_cc_creds_match_request(context, whichfields, mcreds,
+                                            l->creds))
+            continue;
+        if (ktypes == NULL) {
+            best = l;
+            break;
+        }
+        p = krb5int_cc_ktype_pref(l->creds->keyblock.enctype, nktypes, ktypes);
+        if (p < 0) {
+            nomatch_err = KRB5_CC_NOT_KTYPE;
+        } else if (best == NULL || p < best_pref) {
+            best = l;
+            best_pref = p;
+        }
+    }
+    if (best != NULL)
+        err = krb5int_copy_creds_contents(context, best->creds, creds);
+    else
+        err = nomatch_err;
+    k5_cc_mutex_unlock(context, &d->lock);
+    free(ktypes);
+    return err;
 }
 
 /*
@@ -627,6 +692,39 @@ krb5_mcc_get_flags(krb5_context context, krb5_ccache id, krb5_flags *flags)
     return KRB5_OK;
 }
 
+/*
+ * Resize the hash table of d to nbuckets buckets, keeping each bucket in list
+ * order.  d must be locked.
+ */
+static krb5_error_code
+rehash_mcc_data(krb5_mcc_data *d, unsigned int nbuckets)
+{
+    krb5_mcc_link **buckets, **tails, *l;
+    unsigned int b;
+
+    buckets = calloc(nbuckets, sizeof(*buckets));
+    tails = calloc(nbuckets, sizeof(*tails));
+    if (buckets == NULL || tails == NULL) {
+        free(buckets);
+        free(tails);
+        return ENOMEM;
+    }
+    for (l = d->link; l != NULL; l = l->next) {
+        b = l->hash & (nbuckets - 1);
+        l->hnext = NULL;
+        if (tails[b] == NULL)
+            buckets[b] = l;
+        else
+            tails[b]->hnext = l;
+        tails[b] = l;
+    }
+    free(tails);
+    free(d->buckets);
+    d->buckets = buckets;
+    d->nbuckets = nbuckets;
+    return 0;
+}
+
 /*
  * Modifies:
  * the memory cache
@@ -651,11 +749,27 @@ krb5_mcc_store(krb5_context ctx, krb5_ccache id, krb5_creds *creds)
     err = krb5_copy_creds(ctx, creds, &new_node->creds);
     if (err)
         goto cleanup;
+    new_node->hash = krb5int_cc_creds_hash(creds->client, creds->server);
     err = k5_cc_mutex_lock(ctx, &mptr->lock);
     if (err)
         goto cleanup;
+    /* Keep the chains short by growing the table as the cache fills.  If
+     * that fails, longer chains will do, but there must be a table. */
+    if (mptr->nbuckets == 0 || mptr->count >= mptr->nbuckets * 2) {
+        err = rehash_mcc_data(mptr, (mptr->nbuckets == 0) ? 16 :
+                              mptr->nbuckets * 4);
+        if (err && mptr->nbuckets == 0) {
+            k5_cc_mutex_unlock(ctx, &mptr->lock);
+            krb5_free_creds(ctx, new_node->creds);
+            goto cleanup;
+        }
+    }
     new_node->next = mptr->link;
     mptr->link = new_node;
+    /* The new node is first in the list, so it goes first in its bucket. */
+    new_node->hnext = mptr->buckets[new_node->hash & (mptr->nbuckets - 1)];
+    mptr->buckets[new_node->hash & (mptr->nbuckets - 1)] = new_node;
+    mptr->count++;
     update_mcc_change_time(mptr);
     k5_cc_mutex_unlock(ctx, &mptr->lock);
     return 0;
@@ -124,8 +124,10 @@ data_match(const krb5_data *data1, const krb5_data *data2)
     return data_eq(*data1, *data2) ? TRUE : FALSE;
 }
 
-static int
-pref (krb5_enctype my_ktype, int nktypes, krb5_enctype *ktypes)
+/* Return the position of my_ktype in ktypes, or -1 if it isn't there. */
+int
+krb5int_cc_ktype_pref(krb5_enctype my_ktype, int nktypes,
+                      krb5_enctype *ktypes)
 {
     int i;
     for (i = 0; i < nktypes; i++)
@@ -195,43 +197,49 @@ krb5int_cc_creds_match_request(krb5_context context, krb5_flags whichfields, krb
     return FALSE;
 }
 
-static krb5_error_code
-krb5_cc_retrieve_cred_seq (krb5_context context, krb5_ccache id,
-                           krb5_flags whichfields, krb5_creds *mcreds,
-                           krb5_creds *creds, int nktypes, krb5_enctype *ktypes)
+/*
+ * Hash the parts of a credential which every match for it must share,
+ * whatever the match flags: the client principal and the server name
+ * components (but not the server realm).  Cache types can use this to index
+ * their credentials for krb5int_cc_creds_match_request().
+ */
+unsigned int
+krb5int_cc_creds_hash(krb5_const_principal client,
+                      krb5_const_principal server)
 {
-    /* This function could be considerably faster if it kept indexing */
-    /* information.. sounds like a "next version" idea to me. :-) */
+    krb5_ui_4 h;
+    krb5_int32 i;
 
-    krb5_cc_cursor cursor;
-    krb5_error_code kret;
+    h = k5_fnv_princ(K5_FNV_INIT, client);
+    for (i = 0; i < server->length; i++)
+        h = k5_fnv_data(h, &server->data[i]);
+    return h;
+}
+
+/*
+ * Scan the credentials returned by cursor for the best match for mcreds, and
+ * end the cursor.
+ */
+static krb5_error_code
+retrieve_from_cursor(krb5_context context, krb5_ccache id,
+                     krb5_cc_cursor *cursor, krb5_flags whichfields,
+                     krb5_creds *mcreds, krb5_creds *creds, int nktypes,
+                     krb5_enctype *ktypes)
+{
     krb5_error_code nomatch_err = KRB5_CC_NOTFOUND;
     struct {
         krb5_creds creds;
         int pref;
     } fetched, best;
     int have_creds = 0;
-    krb5_flags oflags = 0;
 #define fetchcreds (fetched.creds)
 
-    kret = krb5_cc_get_flags(context, id, &oflags);
-    if (kret != KRB5_OK)
-        return kret;
-    if (oflags & KRB5_TC_OPENCLOSE)
-        (void) krb5_cc_set_flags(context, id, oflags & ~KRB5_TC_OPENCLOSE);
-    kret = krb5_cc_start_seq_get(context, id, &cursor);
-    if (kret != KRB5_OK) {
-        if (oflags & KRB5_TC_OPENCLOSE)
-            krb5_cc_set_flags(context, id, oflags);
-        return kret;
-    }
-
-    while (krb5_cc_next_cred(context, id, &cursor, &fetchcreds) == KRB5_OK) {
+    while (krb5_cc_next_cred(context, id, cursor, &fetchcreds) == KRB5_OK) {
         if (krb5int_cc_creds_match_request(context, whichfields, mcreds, &fetchcreds))
         {
             if (ktypes) {
-                fetched.pref = pref (fetchcreds.keyblock.enctype,
-                                     nktypes, ktypes);
+                fetched.pref = krb5int_cc_ktype_pref(
+                    fetchcreds.keyblock.enctype, nktypes, ktypes);
                 if (fetched.pref < 0)
                     nomatch_err = KRB5_CC_NOT_KTYPE;
                 else if (!have_creds || fetched.pref < best.pref) {
@@ -243,10 +251,8 @@ krb5_cc_retrieve_cred_seq (krb5_context context, krb5_ccache id,
                     continue;
                 }
             } else {
-                krb5_cc_end_seq_get(context, id, &cursor);
+                krb5_cc_end_seq_get(context, id, cursor);
                 *creds = fetchcreds;
-                if (oflags & KRB5_TC_OPENCLOSE)
-                    krb5_cc_set_flags(context, id, oflags);
                 return KRB5_OK;
             }
         }
@@ -256,14 +262,58 @@ krb5_cc_retrieve_cred_seq (krb5_context context, krb5_ccache id,
     }
 
     /* If we get here, a match wasn't found */
-    krb5_cc_end_seq_get(context, id, &cursor);
-    if (oflags & KRB5_TC_OPENCLOSE)
-        krb5_cc_set_flags(context, id, oflags);
+    krb5_cc_end_seq_get(context, id, cursor);
     if (have_creds) {
         *creds = best.creds;
         return KRB5_OK;
     } else
         return nomatch_err;
+#undef fetchcreds
+}
+
+static krb5_error_code
+krb5_cc_retrieve_cred_seq (krb5_context context, krb5_ccache id,
+                           krb5_flags whichfields, krb5_creds *mcreds,
+                           krb5_creds *creds, int nktypes, krb5_enctype *ktypes)
+{
+    krb5_cc_cursor cursor;
+    krb5_error_code kret;
+    krb5_flags oflags = 0;
+
+    kret = krb5_cc_get_flags(context, id, &oflags);
+    if (kret != KRB5_OK)
+        return kret;
+    if (oflags & KRB5_TC_OPENCLOSE)
+        (void) krb5_cc_set_flags(context, id, oflags & ~KRB5_TC_OPENCLOSE);
+    kret = krb5_cc_start_seq_get(context, id, &cursor);
+    if (kret == KRB5_OK) {
+        kret = retrieve_from_cursor(context, id, &cursor, whichfields, mcreds,
+                                    creds, nktypes, ktypes);
+    }
+    if (oflags & KRB5_TC_OPENCLOSE)
+        krb5_cc_set_flags(context, id, oflags);
+    return kret;
+}
+
+/*
+ * If flags requests it, get the enctypes permitted for mcreds->server, in
+ * order of preference.  Otherwise set *ktypes to NULL.
+ */
+krb5_error_code
+krb5int_cc_get_ktypes(krb5_context context, krb5_flags flags,
+                      krb5_creds *mcreds, int *nktypes, krb5_enctype **ktypes)
+{
+    krb5_error_code ret;
+
+    *nktypes = 0;
+    *ktypes = NULL;
+    if (!(flags & KRB5_TC_SUPPORTED_KTYPES))
+        return 0;
+    ret = krb5_get_tgs_ktypes (context, mcreds->server, ktypes);
+    if (ret)
+        return ret;
+    *nktypes = krb5int_count_etypes (*ktypes);
+    return 0;
 }
 
 krb5_error_code KRB5_CALLCONV
@@ -273,20 +323,40 @@ krb5_cc_retrieve_cred_default (krb5_context context, krb5_ccache id, krb5_flags
     int nktypes;
     krb5_error_code ret;
 
-    if (flags & KRB5_TC_SUPPORTED_KTYPES) {
-        ret = krb5_get_tgs_ktypes (context, mcreds->server, &ktypes);
-        if (ret)
-            return ret;
-        nktypes = krb5int_count_etypes (ktypes);
+    ret = krb5int_cc_get_ktypes(context, flags, mcreds, &nktypes, &ktypes);
+    if (ret)
+        return ret;
+    ret = krb5_cc_retrieve_cred_seq (context, id, flags, mcreds, creds,
+                                     nktypes, ktypes);
+    free (ktypes);
+    return ret;
+}
+
+/*
+ * Like krb5_cc_retrieve_cred_default(), but consider only the credentials
+ * returned by cursor, which must have come from id's start_seq_get method or
+ * an equivalent.  The cursor is ended whether or not this succeeds.  Cache
+ * types which can narrow down the candidates for mcreds use this to implement
+ * their retrieve method.
+ */
+krb5_error_code
+krb5int_cc_retrieve_cred_cursor(krb5_context context, krb5_ccache id,
+                                krb5_cc_cursor *cursor, krb5_flags flags,
+                                krb5_creds *mcreds, krb5_creds *creds)
+{
+    krb5_enctype *ktypes;
+    int nktypes;
+    krb5_error_code ret;
 
-        ret = krb5_cc_retrieve_cred_seq (context, id, flags, mcreds, creds,
-                                         nktypes, ktypes);
-        free (ktypes);
+    ret = krb5int_cc_get_ktypes(context, flags, mcreds, &nktypes, &ktypes);
+    if (ret) {
+        krb5_cc_end_seq_get(context, id, cursor);
         return ret;
-    } else {
-        return krb5_cc_retrieve_cred_seq (context, id, flags, mcreds, creds,
-                                          0, 0);
     }
+    ret = retrieve_from_cursor(context, id, cursor, flags, mcreds, creds,
+                               nktypes, ktypes);
+    free(ktypes);
+    return ret;
 }
 
 /* The following function duplicates some of the functionality above and */
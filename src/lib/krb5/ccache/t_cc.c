@@ -315,6 +315,93 @@ cc_test(krb5_context context, const char *name, krb5_flags flags)
 
 }
 
+/* Store creds for server svcN in realm, as a copy of test_creds. */
+static void
+store_server_cred(krb5_context context, krb5_ccache id, const char *realm,
+                  int n)
+{
+    krb5_error_code kret;
+    krb5_creds creds;
+    char svc[32];
+
+    creds = test_creds;
+    snprintf(svc, sizeof(svc), "svc%d", n);
+    kret = krb5_build_principal(context, &creds.server, strlen(realm), realm,
+                                svc, "host", NULL);
+    CHECK(kret, "build_principal");
+    kret = krb5_cc_store_cred(context, id, &creds);
+    CHECK(kret, "store");
+    krb5_free_principal(context, creds.server);
+}
+
+/* Retrieve the cred for svcN in realm, and check that it is from wantrealm. */
+static void
+check_retrieve(krb5_context context, krb5_ccache id, krb5_flags flags,
+               const char *realm, int n, const char *wantrealm)
+{
+    krb5_error_code kret;
+    krb5_creds mcreds, creds;
+    krb5_data *comp;
+    char svc[32];
+
+    memset(&mcreds, 0, sizeof(mcreds));
+    mcreds.client = test_creds.client;
+    snprintf(svc, sizeof(svc), "svc%d", n);
+    kret = krb5_build_principal(context, &mcreds.server, strlen(realm), realm,
+                                svc, "host", NULL);
+    CHECK(kret, "build_principal");
+    kret = krb5_cc_retrieve_cred(context, id, flags, &mcreds, &creds);
+    if (wantrealm == NULL) {
+        CHECK_BOOL(kret != KRB5_CC_NOTFOUND, "found missing cred",
+                   "retrieve");
+    } else {
+        CHECK(kret, "retrieve");
+        comp = krb5_princ_component(context, creds.server, 0);
+        CHECK_BOOL(!data_eq_string(*comp, svc), "wrong server",
+                   "retrieve");
+        CHECK_BOOL(!data_eq_string(creds.server->realm, wantrealm),
+                   "wrong server realm", "retrieve");
+        krb5_free_cred_contents(context, &creds);
+    }
+    krb5_free_principal(context, mcreds.server);
+}
+
+/* Test retrieval from a cache holding many credentials. */
+static void
+retrieve_test(krb5_context context, const char *name)
+{
+    krb5_error_code kret;
+    krb5_ccache id;
+    int i;
+
+    kret = init_test_cred(context);
+    CHECK(kret, "init_creds");
+    kret = krb5_cc_resolve(context, name, &id);
+    CHECK(kret, "resolve");
+    kret = krb5_cc_initialize(context, id, test_creds.client);
+    CHECK(kret, "initialize");
+
+    for (i = 0; i < 100; i++)
+        store_server_cred(context, id, REALM, i);
+    store_server_cred(context, id, "OTHER", 5);
+
+    for (i = 0; i < 100; i++)
+        check_retrieve(context, id, 0, REALM, i, REALM);
+    check_retrieve(context, id, 0, "OTHER", 5, "OTHER");
+    check_retrieve(context, id, 0, "OTHER", 6, NULL);
+    check_retrieve(context, id, 0, REALM, 100, NULL);
+    check_retrieve(context, id, KRB5_TC_MATCH_SRV_NAMEONLY, "OTHER", 6, REALM);
+    check_retrieve(context, id, KRB5_TC_MATCH_SRV_NAMEONLY, "NONE", 7, REALM);
+
+    /* Credentials stored after a retrieval can be found. */
+    store_server_cred(context, id, REALM, 100);
+    check_retrieve(context, id, 0, REALM, 100, REALM);
+
+    kret = krb5_cc_destroy(context, id);
+    CHECK(kret, "destroy");
+    free_test_cred(context);
+}
+
 /*
  * Checks if a credential type is registered with the library
  */
@@ -355,6 +442,7 @@ do_test(krb5_context context, const char *prefix)
     printf("Starting test on %s\n", name);
     cc_test (context, name, 0);
     cc_test (context, name, !0);
+    retrieve_test (context, name);
     printf("Test on %s passed\n", name);
 }
 
@@ -41,4 +41,10 @@ void krb5int_kt_finalize(void);
 int krb5int_mkt_initialize(void);
 
 void krb5int_mkt_finalize(void);
+
+int krb5int_ktfile_initialize(void);
+
+void krb5int_ktfile_finalize(void);
+
+unsigned int krb5int_kt_princ_hash(krb5_const_principal princ);
 #endif /* __KRB5_KEYTAB_INT_H__ */
@@ -55,6 +55,12 @@
 
 #include "k5-int.h"
 #include <stdio.h>
+#include "kt-int.h"
+
+#ifndef _WIN32
+#define KTFILE_INDEX
+#include <sys/mman.h>
+#endif
 
 /*
  * Information needed by internal routines of the file-based ticket
@@ -178,6 +184,12 @@ static krb5_error_code
 krb5_ktfileint_find_slot(krb5_context, krb5_keytab, krb5_int32 *,
                          krb5_int32 *);
 
+#ifdef KTFILE_INDEX
+static krb5_boolean
+ktindex_get_entry(krb5_context, const char *, krb5_const_principal, krb5_kvno,
+                  krb5_enctype, krb5_keytab_entry *, krb5_error_code *);
+#endif
+
 
 /*
  * This is an implementation specific resolver.  It returns a keytab id
@@ -271,6 +283,13 @@ krb5_ktfile_get_entry(krb5_context context, krb5_keytab id,
     int was_open;
     char *princname;
 
+#ifdef KTFILE_INDEX
+    /* Answer from the shared index of the file if it is still current. */
+    if (ktindex_get_entry(context, KTFILENAME(id), principal, kvno, enctype,
+                          entry, &kerror))
+        return kerror;
+#endif
+
     kerror = KTLOCK(id);
     if (kerror)
         return kerror;
@@ -1662,4 +1681,468 @@ krb5_ktfileint_find_slot(krb5_context context, krb5_keytab id, krb5_int32 *size_
     *commit_point_ptr = commit_point;
     return 0;
 }
+
+#ifdef KTFILE_INDEX
+
+/*
+ * Lookup index for file keytabs.
+ *
+ * Service acceptors look up keys in the same keytab many times a second, and
+ * krb5_ktfile_get_entry() would otherwise lock the file and parse every entry
+ * on each call.  Instead, the first lookup maps the file, parses it once into
+ * a table of entries hashed by principal, and later lookups through any
+ * handle on the same file are answered from that table.  The table is shared
+ * by file name and is revalidated with stat() on each lookup; it is rebuilt
+ * if the file's device, inode, size, mtime or ctime have changed.  A table
+ * built in the same second as the file's last change is used once and then
+ * rebuilt, since a second change within that second would not be visible in
+ * the timestamps.
+ */
+
+struct ktindex {
+    struct ktindex *next;
+    char *name;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    time_t ctime;
+    time_t built;               /* time the table was built */
+    krb5_keytab_entry *entries; /* entries in file order */
+    int nentries;
+    int *chain;                 /* next entry in the same bucket, or -1 */
+    int *buckets;               /* first entry in each bucket, or -1 */
+    unsigned int nbuckets;      /* a power of two */
+};
+
+static struct ktindex *ktindex_list = NULL;
+static k5_mutex_t ktindex_lock = K5_MUTEX_PARTIAL_INITIALIZER;
+
+static void
+ktindex_free(struct ktindex *idx)
+{
+    int i;
+
+    if (idx == NULL)
+        return;
+    for (i = 0; i < idx->nentries; i++)
+        krb5_kt_free_entry(NULL, &idx->entries[i]);
+    free(idx->entries);
+    free(idx->chain);
+    free(idx->buckets);
+    free(idx->name);
+    free(idx);
+}
+
+/* Read a 16- or 32-bit integer in the byte order of keytab version vno. */
+static krb5_int16
+ktindex_load16(const unsigned char *p, int vno)
+{
+    krb5_int16 val;
+
+    if (vno == KRB5_KT_VNO_1) {
+        memcpy(&val, p, sizeof(val));
+        return val;
+    }
+    return (krb5_int16)load_16_be(p);
+}
+
+static krb5_int32
+ktindex_load32(const unsigned char *p, int vno)
+{
+    krb5_int32 val;
+
+    if (vno == KRB5_KT_VNO_1) {
+        memcpy(&val, p, sizeof(val));
+        return val;
+    }
+    return (krb5_int32)load_32_be(p);
+}
+
+/*
+ * Decode the entry which starts at p and is followed by end, in the same way
+ * as krb5_ktfileint_internal_read_entry().  Return KRB5_KT_END if the entry
+ * is malformed.
+ */
+static krb5_error_code
+ktindex_parse_entry(const unsigned char *p, const unsigned char *end, int vno,
+                    krb5_keytab_entry *ent)
+{
+    krb5_principal princ;
+    krb5_int16 count, len;
+    krb5_data *d;
+    int i;
+
+#define NEED(n) if ((size_t)(end - p) < (size_t)(n)) goto eof
+
+    memset(ent, 0, sizeof(*ent));
+    ent->magic = KV5M_KEYTAB_ENTRY;
+
+    NEED(2);
+    count = ktindex_load16(p, vno);
+    p += 2;
+    if (vno == KRB5_KT_VNO_1)
+        count -= 1;         /* V1 includes the realm in the count */
+    if (count <= 0)
+        return KRB5_KT_END;
+
+    princ = calloc(1, sizeof(*princ));
+    if (princ == NULL)
+        return ENOMEM;
+    ent->principal = princ;
+    princ->magic = KV5M_PRINCIPAL;
+    princ->data = calloc(count, sizeof(krb5_data));
+    if (princ->data == NULL)
+        goto nomem;
+    princ->length = count;
+
+    for (i = -1; i < count; i++) {
+        d = (i < 0) ? &princ->realm : &princ->data[i];
+        NEED(2);
+        len = ktindex_load16(p, vno);
+        p += 2;
+        if (len <= 0)
+            goto eof;
+        NEED(len);
+        d->data = malloc(len + 1);
+        if (d->data == NULL)
+            goto nomem;
+        memcpy(d->data, p, len);
+        d->data[len] = '\0';
+        d->length = len;
+        p += len;
+    }
+
+    if (vno != KRB5_KT_VNO_1) {
+        NEED(4);
+        princ->type = ktindex_load32(p, vno);
+        p += 4;
+    }
+
+    NEED(4 + 1 + 2 + 2);
+    ent->timestamp = ktindex_load32(p, vno);
+    ent->vno = p[4];
+    ent->key.magic = KV5M_KEYBLOCK;
+    ent->key.enctype = ktindex_load16(p + 5, vno);
+    len = ktindex_load16(p + 7, vno);
+    p += 9;
+    if (len <= 0)
+        goto eof;
+    NEED(len);
+    ent->key.contents = malloc(len);
+    if (ent->key.contents == NULL)
+        goto nomem;
+    memcpy(ent->key.contents, p, len);
+    ent->key.length = len;
+    return 0;
+
+#undef NEED
+eof:
+    krb5_kt_free_entry(NULL, ent);
+    return KRB5_KT_END;
+nomem:
+    krb5_kt_free_entry(NULL, ent);
+    return ENOMEM;
+}
+
+/* Decode all of the active entries in the mapped keytab into idx. */
+static krb5_error_code
+ktindex_parse(struct ktindex *idx, const unsigned char *buf, size_t len)
+{
+    krb5_error_code ret;
+    const unsigned char *p = buf + 2, *end = buf + len;
+    krb5_keytab_entry *newents;
+    krb5_int32 size;
+    int vno, space = 0;
+
+    if (len < 2)
+        return KRB5_KEYTAB_BADVNO;
+    vno = load_16_be(buf);
+    if (vno != KRB5_KT_VNO && vno != KRB5_KT_VNO_1)
+        return KRB5_KEYTAB_BADVNO;
+
+    while ((size_t)(end - p) >= 4) {
+        size = ktindex_load32(p, vno);
+        p += 4;
+        if (size < 0) {
+            /* A hole left by a deleted entry. */
+            if ((size_t)(end - p) < (size_t)-size)
+                break;
+            p += -size;
+            continue;
+        }
+        if (size == 0)
+            break;
+
+        if (idx->nentries == space) {
+            space = space ? space * 2 : 16;
+            newents = realloc(idx->entries, space * sizeof(*newents));
+            if (newents == NULL)
+                return ENOMEM;
+            idx->entries = newents;
+        }
+        ret = ktindex_parse_entry(p, end, vno, &idx->entries[idx->nentries]);
+        if (ret == KRB5_KT_END)
+            break;
+        if (ret)
+            return ret;
+        idx->nentries++;
+        if ((size_t)(end - p) < (size_t)size)
+            break;
+        p += size;
+    }
+    return 0;
+}
+
+/* Hash the parsed entries of idx by principal. */
+static krb5_error_code
+ktindex_hash_entries(struct ktindex *idx)
+{
+    unsigned int b;
+    int i;
+
+    idx->nbuckets = 16;
+    while (idx->nbuckets < (unsigned int)idx->nentries)
+        idx->nbuckets *= 2;
+    idx->buckets = malloc(idx->nbuckets * sizeof(*idx->buckets));
+    idx->chain = malloc((idx->nentries + 1) * sizeof(*idx->chain));
+    if (idx->buckets == NULL || idx->chain == NULL)
+        return ENOMEM;
+    for (b = 0; b < idx->nbuckets; b++)
+        idx->buckets[b] = -1;
+
+    /* Insert in reverse so that each chain is in file order. */
+    for (i = idx->nentries - 1; i >= 0; i--) {
+        b = krb5int_kt_princ_hash(idx->entries[i].principal) &
+            (idx->nbuckets - 1);
+        idx->chain[i] = idx->buckets[b];
+        idx->buckets[b] = i;
+    }
+    return 0;
+}
+
+/* Map the keytab file name and build a new index of it. */
+static krb5_error_code
+ktindex_build(krb5_context context, const char *name, struct ktindex **out)
+{
+    krb5_error_code ret;
+    struct ktindex *idx = NULL;
+    struct stat st;
+    void *map = MAP_FAILED;
+    int fd, locked = 0;
+
+    *out = NULL;
+    fd = open(name, O_RDONLY);
+    if (fd == -1)
+        return errno;
+    set_cloexec_fd(fd);
+    ret = krb5_lock_file(context, fd, KRB5_LOCKMODE_SHARED);
+    if (ret)
+        goto cleanup;
+    locked = 1;
+    if (fstat(fd, &st) == -1) {
+        ret = errno;
+        goto cleanup;
+    }
+    if (st.st_size < 2 || (off_t)(size_t)st.st_size != st.st_size) {
+        ret = KRB5_KEYTAB_BADVNO;
+        goto cleanup;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        ret = errno;
+        goto cleanup;
+    }
+
+    idx = calloc(1, sizeof(*idx));
+    if (idx == NULL) {
+        ret = ENOMEM;
+        goto cleanup;
+    }
+    idx->name = strdup(name);
+    if (idx->name == NULL) {
+        ret = ENOMEM;
+        goto cleanup;
+    }
+    idx->dev = st.st_dev;
+    idx->ino = st.st_ino;
+    idx->size = st.st_size;
+    idx->mtime = st.st_mtime;
+    idx->ctime = st.st_ctime;
+    idx->built = time(NULL);
+
+    ret = ktindex_parse(idx, map, st.st_size);
+    if (ret)
+        goto cleanup;
+    ret = ktindex_hash_entries(idx);
+    if (ret)
+        goto cleanup;
+    *out = idx;
+    idx = NULL;
+
+cleanup:
+    if (map != MAP_FAILED)
+        munmap(map, st.st_size);
+    if (locked)
+        (void) krb5_unlock_file(context, fd);
+    close(fd);
+    ktindex_free(idx);
+    return ret;
+}
+
+/* Return true if idx still describes the file with status st. */
+static krb5_boolean
+ktindex_current(struct ktindex *idx, struct stat *st)
+{
+    return idx->dev == st->st_dev && idx->ino == st->st_ino &&
+        idx->size == st->st_size && idx->mtime == st->st_mtime &&
+        idx->ctime == st->st_ctime && idx->ctime < idx->built;
+}
+
+/*
+ * Look up principal in idx, choosing an entry in the same way as
+ * krb5_ktfile_get_entry(), and copy it into entry.
+ */
+static krb5_error_code
+ktindex_lookup(krb5_context context, struct ktindex *idx,
+               krb5_const_principal principal, krb5_kvno kvno,
+               krb5_enctype enctype, krb5_keytab_entry *entry)
+{
+    krb5_error_code ret;
+    krb5_keytab_entry *ent, *best = NULL;
+    krb5_boolean similar;
+    int i, found_wrong_kvno = 0, kvno_offset = 0;
+    char *princname;
+
+    i = idx->buckets[krb5int_kt_princ_hash(principal) &
+                     (idx->nbuckets - 1)];
+    for (; i != -1; i = idx->chain[i]) {
+        ent = &idx->entries[i];
+        if (!krb5_principal_compare(context, principal, ent->principal))
+            continue;
+        if (enctype != IGNORE_ENCTYPE) {
+            ret = krb5_c_enctype_compare(context, enctype, ent->key.enctype,
+                                         &similar);
+            if (ret)
+                return ret;
+            if (!similar)
+                continue;
+        }
+        if (kvno == IGNORE_VNO) {
+            /* Same 8-bit wraparound heuristic as krb5_ktfile_get_entry. */
+            if (ent->vno > 240)
+                kvno_offset = 128;
+            if (best == NULL ||
+                (ent->vno - kvno_offset + 256) % 256 >
+                (best->vno - kvno_offset + 256) % 256)
+                best = ent;
+        } else if (ent->vno == (kvno & 0xff)) {
+            best = ent;
+            break;
+        } else {
+            found_wrong_kvno++;
+        }
+    }
+
+    if (best == NULL) {
+        if (found_wrong_kvno)
+            return KRB5_KT_KVNONOTFOUND;
+        ret = KRB5_KT_NOTFOUND;
+        if (krb5_unparse_name(context, principal, &princname) == 0) {
+            krb5_set_error_message(context, ret,
+                                   _("No key table entry found for %s"),
+                                   princname);
+            free(princname);
+        }
+        return ret;
+    }
+
+    memset(entry, 0, sizeof(*entry));
+    entry->magic = KV5M_KEYTAB_ENTRY;
+    entry->timestamp = best->timestamp;
+    entry->vno = best->vno;
+    ret = krb5_copy_principal(context, best->principal, &entry->principal);
+    if (ret)
+        return ret;
+    ret = krb5_copy_keyblock_contents(context, &best->key, &entry->key);
+    if (ret) {
+        krb5_free_principal(context, entry->principal);
+        entry->principal = NULL;
+        return ret;
+    }
+    /* Coerce the enctype in case we got an inexact match. */
+    if (enctype != IGNORE_ENCTYPE)
+        entry->key.enctype = enctype;
+    return 0;
+}
+
+/*
+ * Try to answer a get_entry request for the keytab file name from the shared
+ * index, building or refreshing the index if necessary.  Return true and set
+ * *ret if the request was answered, or false if the caller should read the
+ * file itself (for instance because it does not exist or is malformed, so
+ * that the caller reports the error as usual).
+ */
+static krb5_boolean
+ktindex_get_entry(krb5_context context, const char *name,
+                  krb5_const_principal principal, krb5_kvno kvno,
+                  krb5_enctype enctype, krb5_keytab_entry *entry,
+                  krb5_error_code *ret)
+{
+    struct ktindex *idx, **pp, *newidx;
+    struct stat st;
+
+    if (stat(name, &st) == -1)
+        return FALSE;
+    if (k5_mutex_lock(&ktindex_lock) != 0)
+        return FALSE;
+
+    for (pp = &ktindex_list; *pp != NULL; pp = &(*pp)->next) {
+        if (strcmp((*pp)->name, name) == 0)
+            break;
+    }
+    idx = *pp;
+    if (idx == NULL || !ktindex_current(idx, &st)) {
+        if (ktindex_build(context, name, &newidx) != 0) {
+            k5_mutex_unlock(&ktindex_lock);
+            return FALSE;
+        }
+        if (idx != NULL) {
+            newidx->next = idx->next;
+            ktindex_free(idx);
+        }
+        *pp = idx = newidx;
+    }
+
+    *ret = ktindex_lookup(context, idx, principal, kvno, enctype, entry);
+    k5_mutex_unlock(&ktindex_lock);
+    return TRUE;
+}
+
+#endif /* KTFILE_INDEX */
+
+int
+krb5int_ktfile_initialize(void)
+{
+#ifdef KTFILE_INDEX
+    return k5_mutex_finish_init(&ktindex_lock);
+#else
+    return 0;
+#endif
+}
+
+void
+krb5int_ktfile_finalize(void)
+{
+#ifdef KTFILE_INDEX
+    struct ktindex *idx, *next;
+
+    k5_mutex_destroy(&ktindex_lock);
+    for (idx = ktindex_list; idx != NULL; idx = next) {
+        next = idx->next;
+        ktindex_free(idx);
+    }
+    ktindex_list = NULL;
+#endif
+}
 #endif /* LEAN_CLIENT */
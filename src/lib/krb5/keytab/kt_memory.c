@@ -59,6 +59,8 @@
 typedef struct _krb5_mkt_link {
     struct _krb5_mkt_link *next;
     krb5_keytab_entry *entry;
+    struct _krb5_mkt_link *hnext;       /* Next in the same hash bucket */
+    unsigned int hash;                  /* Hash of entry->principal */
 } krb5_mkt_link, *krb5_mkt_cursor;
 
 /* Per-keytab data header */
@@ -67,6 +69,10 @@ typedef struct _krb5_mkt_data {
     k5_mutex_t          lock;           /* Thread-safety - all but link */
     krb5_int32          refcount;
     krb5_mkt_cursor     link;
+    krb5_mkt_cursor    *buckets;        /* Entries by principal, in link
+                                           order */
+    unsigned int        nbuckets;       /* Zero or a power of two */
+    unsigned int        count;          /* Number of entries */
 } krb5_mkt_data;
 
 /* List of memory key tables */
@@ -98,6 +104,7 @@ static k5_mutex_t krb5int_mkt_mutex = K5_MUTEX_PARTIAL_INITIALIZER;
 #define KTGCHECKLOCK k5_mutex_assert_locked(&krb5int_mkt_mutex)
 
 #define KTLINK(id) (((krb5_mkt_data *)(id)->data)->link)
+#define KTDATA(id) ((krb5_mkt_data *)(id)->data)
 #define KTREFCNT(id) (((krb5_mkt_data *)(id)->data)->refcount)
 #define KTNAME(id) (((krb5_mkt_data *)(id)->data)->name)
 
@@ -163,6 +170,7 @@ krb5int_mkt_finalize(void)
             free(cursor->entry);
             free(cursor);
         }
+        free(KTDATA(node->keytab)->buckets);
 
         /* destroy the lock */
         k5_mutex_destroy(&(((krb5_mkt_data *)node->keytab->data)->lock));
@@ -352,6 +360,7 @@ krb5_mkt_close(krb5_context context, krb5_keytab id)
             free(cursor->entry);
             free(cursor);
         }
+        free(data->buckets);
 
         /* destroy the lock */
         k5_mutex_destroy(&(data->lock));
@@ -387,17 +396,22 @@ krb5_mkt_get_entry(krb5_context context, krb5_keytab id,
     krb5_error_code err = 0;
     int found_wrong_kvno = 0;
     krb5_boolean similar = 0;
+    unsigned int hash = krb5int_kt_princ_hash(principal);
 
     err = KTLOCK(id);
     if (err)
         return err;
 
-    for (cursor = KTLINK(id); cursor && cursor->entry; cursor = cursor->next) {
+    /* Only the entries in the principal's bucket can match. */
+    cursor = (KTDATA(id)->nbuckets == 0) ? NULL :
+        KTDATA(id)->buckets[hash & (KTDATA(id)->nbuckets - 1)];
+    for (; cursor && cursor->entry; cursor = cursor->hnext) {
         entry = cursor->entry;
 
         /* if the principal isn't the one requested, continue to the next. */
 
-        if (!krb5_principal_compare(context, principal, entry->principal))
+        if (cursor->hash != hash ||
+            !krb5_principal_compare(context, principal, entry->principal))
             continue;
 
         /* if the enctype is not ignored and doesn't match,
@@ -538,6 +552,39 @@ krb5_mkt_end_get(krb5_context context, krb5_keytab id, krb5_kt_cursor *cursor)
 }
 
 
+/*
+ * Resize the hash table of data to nbuckets buckets, keeping each bucket in
+ * the order of the entry list.  data must be locked.
+ */
+static krb5_error_code
+mkt_rehash(krb5_mkt_data *data, unsigned int nbuckets)
+{
+    krb5_mkt_cursor *buckets, *tails, cursor;
+    unsigned int b;
+
+    buckets = calloc(nbuckets, sizeof(*buckets));
+    tails = calloc(nbuckets, sizeof(*tails));
+    if (buckets == NULL || tails == NULL) {
+        free(buckets);
+        free(tails);
+        return ENOMEM;
+    }
+    for (cursor = data->link; cursor; cursor = cursor->next) {
+        b = cursor->hash & (nbuckets - 1);
+        cursor->hnext = NULL;
+        if (tails[b] == NULL)
+            buckets[b] = cursor;
+        else
+            tails[b]->hnext = cursor;
+        tails[b] = cursor;
+    }
+    free(tails);
+    free(data->buckets);
+    data->buckets = buckets;
+    data->nbuckets = nbuckets;
+    return 0;
+}
+
 /*
  * krb5_mkt_add()
  */
@@ -547,11 +594,23 @@ krb5_mkt_add(krb5_context context, krb5_keytab id, krb5_keytab_entry *entry)
 {
     krb5_error_code err = 0;
     krb5_mkt_cursor cursor;
+    krb5_mkt_data *data = KTDATA(id);
+    unsigned int b;
 
     err = KTLOCK(id);
     if (err)
         return err;
 
+    /* Grow the hash table as the keytab fills.  If that fails, longer
+     * chains will do, but there must be a table. */
+    if (data->nbuckets == 0 || data->count >= data->nbuckets * 2) {
+        err = mkt_rehash(data, (data->nbuckets == 0) ? 16 :
+                         data->nbuckets * 4);
+        if (err && data->nbuckets == 0)
+            goto done;
+        err = 0;
+    }
+
     cursor = (krb5_mkt_cursor)malloc(sizeof(krb5_mkt_link));
     if (cursor == NULL) {
         err = ENOMEM;
@@ -590,6 +649,13 @@ krb5_mkt_add(krb5_context context, krb5_keytab id, krb5_keytab_entry *entry)
         KTLINK(id) = cursor;
     }
 
+    /* The new entry is first in the list, so it goes first in its bucket. */
+    cursor->hash = krb5int_kt_princ_hash(cursor->entry->principal);
+    b = cursor->hash & (data->nbuckets - 1);
+    cursor->hnext = data->buckets[b];
+    data->buckets[b] = cursor;
+    data->count++;
+
 done:
     KTUNLOCK(id);
     return err;
@@ -602,7 +668,8 @@ done:
 krb5_error_code KRB5_CALLCONV
 krb5_mkt_remove(krb5_context context, krb5_keytab id, krb5_keytab_entry *entry)
 {
-    krb5_mkt_cursor *pcursor, next;
+    krb5_mkt_cursor *pcursor, *pchain, next;
+    krb5_mkt_data *data = KTDATA(id);
     krb5_error_code err = 0;
 
     err = KTLOCK(id);
@@ -626,6 +693,13 @@ krb5_mkt_remove(krb5_context context, krb5_keytab id, krb5_keytab_entry *entry)
         goto done;
     }
 
+    /* Unlink the entry from its hash bucket as well as the list. */
+    pchain = &data->buckets[(*pcursor)->hash & (data->nbuckets - 1)];
+    while (*pchain != *pcursor)
+        pchain = &(*pchain)->hnext;
+    *pchain = (*pchain)->hnext;
+    data->count--;
+
     krb5_kt_free_entry(context, (*pcursor)->entry);
     free((*pcursor)->entry);
     next = (*pcursor)->next;
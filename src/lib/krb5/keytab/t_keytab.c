@@ -397,6 +397,167 @@ kt_test(krb5_context context, const char *name)
 
 }
 
+/* Look up princ in kt and check that the highest kvno found is vno. */
+static void
+check_kvno(krb5_context context, krb5_keytab kt, krb5_principal princ,
+           krb5_kvno vno, const char *msg)
+{
+    krb5_error_code kret;
+    krb5_keytab_entry kent;
+
+    kret = krb5_kt_get_entry(context, kt, princ, 0, 0, &kent);
+    CHECK(kret, msg);
+    if (kent.vno != vno || kent.key.length != 1 ||
+        kent.key.contents[0] != kent.vno + '0') {
+        fprintf(stderr, "%s: wrong entry retrieved\n", msg);
+        exit(1);
+    }
+    krb5_free_keytab_entry_contents(context, &kent);
+}
+
+/*
+ * Check that file keytab lookups, which are answered from an index of the
+ * file once it has been unchanged for a second, see changes made to the file
+ * through another handle after the index was built.
+ */
+static void
+test_file_index(krb5_context context)
+{
+    krb5_error_code kret;
+    krb5_keytab kt, kt2;
+    krb5_keytab_entry kent, ent;
+    krb5_principal princ;
+    char *filename, *name;
+
+    fprintf(stderr, "Testing file keytab index\n");
+
+    if (asprintf(&filename, "/tmp/ktindex.%ld", (long) getpid()) < 0 ||
+        asprintf(&name, "FILE:%s", filename) < 0) {
+        perror("asprintf");
+        exit(1);
+    }
+    kret = krb5_kt_resolve(context, name, &kt);
+    CHECK(kret, "resolve");
+    kret = krb5_kt_resolve(context, name, &kt2);
+    CHECK(kret, "resolve second handle");
+    kret = krb5_parse_name(context, "test/index@TEST.MIT.EDU", &princ);
+    CHECK(kret, "parsing principal");
+
+    memset(&kent, 0, sizeof(kent));
+    kent.magic = KV5M_KEYTAB_ENTRY;
+    kent.principal = princ;
+    kent.vno = 1;
+    kent.key.magic = KV5M_KEYBLOCK;
+    kent.key.enctype = 1;
+    kent.key.length = 1;
+    kent.key.contents = (krb5_octet *) "1";
+    kret = krb5_kt_add_entry(context, kt, &kent);
+    CHECK(kret, "Adding initial entry");
+
+    /* Let the file age so that the index is trusted, then use it. */
+    sleep(2);
+    check_kvno(context, kt, princ, 1, "Indexed lookup");
+    check_kvno(context, kt, princ, 1, "Repeated indexed lookup");
+
+    kent.vno = 2;
+    kent.key.contents = (krb5_octet *) "2";
+    kret = krb5_kt_add_entry(context, kt2, &kent);
+    CHECK(kret, "Adding entry through second handle");
+    check_kvno(context, kt, princ, 2, "Lookup after add");
+
+    kret = krb5_kt_get_entry(context, kt, princ, 3, 0, &ent);
+    if (kret == 0)
+        krb5_free_keytab_entry_contents(context, &ent);
+    if (kret != KRB5_KT_KVNONOTFOUND) {
+        fprintf(stderr, "Looking up missing kvno: expected "
+                "KRB5_KT_KVNONOTFOUND, got %ld\n", (long)kret);
+        exit(1);
+    }
+
+    kent.vno = 2;
+    kret = krb5_kt_remove_entry(context, kt2, &kent);
+    CHECK(kret, "Removing entry through second handle");
+    check_kvno(context, kt, princ, 1, "Lookup after remove");
+
+    krb5_free_principal(context, princ);
+    kret = krb5_kt_close(context, kt);
+    CHECK(kret, "close");
+    kret = krb5_kt_close(context, kt2);
+    CHECK(kret, "close second handle");
+    unlink(filename);
+    free(filename);
+    free(name);
+}
+
+/*
+ * Check lookups and removals in a memory keytab with enough principals to
+ * resize its hash table a few times.
+ */
+static void
+test_memory_many(krb5_context context)
+{
+    krb5_error_code kret;
+    krb5_keytab kt;
+    krb5_keytab_entry kent;
+    krb5_principal princs[300], missing;
+    char name[64];
+    int i;
+
+    fprintf(stderr, "Testing memory keytab with many principals\n");
+
+    kret = krb5_kt_resolve(context, "MEMORY:t_keytab_many", &kt);
+    CHECK(kret, "resolve");
+
+    memset(&kent, 0, sizeof(kent));
+    kent.magic = KV5M_KEYTAB_ENTRY;
+    kent.key.magic = KV5M_KEYBLOCK;
+    kent.key.enctype = 1;
+    kent.key.length = 1;
+    for (i = 0; i < 300; i++) {
+        snprintf(name, sizeof(name), "svc%d/host@TEST.MIT.EDU", i);
+        kret = krb5_parse_name(context, name, &princs[i]);
+        CHECK(kret, "parsing principal");
+        kent.principal = princs[i];
+        kent.vno = 1;
+        kent.key.contents = (krb5_octet *) "1";
+        kret = krb5_kt_add_entry(context, kt, &kent);
+        CHECK(kret, "Adding kvno 1 entry");
+        kent.vno = 2;
+        kent.key.contents = (krb5_octet *) "2";
+        kret = krb5_kt_add_entry(context, kt, &kent);
+        CHECK(kret, "Adding kvno 2 entry");
+    }
+
+    for (i = 0; i < 300; i++)
+        check_kvno(context, kt, princs[i], 2, "Looking up principal");
+
+    /* Remove the newer key for every other principal. */
+    for (i = 0; i < 300; i += 2) {
+        kent.principal = princs[i];
+        kent.vno = 2;
+        kret = krb5_kt_remove_entry(context, kt, &kent);
+        CHECK(kret, "Removing entry");
+    }
+    for (i = 0; i < 300; i++) {
+        check_kvno(context, kt, princs[i], (i % 2) ? 2 : 1,
+                   "Looking up principal after remove");
+    }
+
+    kret = krb5_parse_name(context, "svc300/host@TEST.MIT.EDU", &missing);
+    CHECK(kret, "parsing principal");
+    kret = krb5_kt_get_entry(context, kt, missing, 0, 0, &kent);
+    if (kret != KRB5_KT_NOTFOUND) {
+        fprintf(stderr, "Getting non-existent entry: wrong result\n");
+        exit(1);
+    }
+    krb5_free_principal(context, missing);
+
+    for (i = 0; i < 300; i++)
+        krb5_free_principal(context, princs[i]);
+    kret = krb5_kt_close(context, kt);
+    CHECK(kret, "close");
+}
+
 static void
 do_test(krb5_context context, const char *prefix, krb5_boolean delete)
 {
@@ -443,6 +604,8 @@ main(void)
     test_misc(context);
     do_test(context, "WRFILE:", FALSE);
     do_test(context, "MEMORY:", TRUE);
+    test_file_index(context);
+    test_memory_many(context);
 
     krb5_free_context(context);
     return 0;
@@ -78,6 +78,9 @@ krb5_copy_context(krb5_context ctx, krb5_context *nctx_out)
     nctx->ser_ctx = NULL;
     nctx->prompt_types = NULL;
     nctx->os_context.default_ccname = NULL;
+    nctx->os_context.dns_cache = NULL;
+    nctx->os_context.kdc_prefs = NULL;
+    nctx->os_context.kdc_conns = NULL;
 
     memset(&nctx->libkrb5_plugins, 0, sizeof(nctx->libkrb5_plugins));
     nctx->vtbl = NULL;
@@ -25,8 +25,8 @@
  */
 
 /*
- * This file include krb5int_cm_call_select, which is used by
- * lib/apputils/net-server.c and sometimes by sendto_kdc.c.
+ * This file include krb5int_cm_call_select, which is used by sendto_kdc.c
+ * on platforms without poll().
  */
 
 #include "k5-int.h"
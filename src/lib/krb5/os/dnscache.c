@@ -0,0 +1,361 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* lib/krb5/os/dnscache.c - Per-context caches of KDC location lookups */
+/*
+ * Copyright (C) 2012 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Export of this software from the United States of America may
+ *   require a specific license from the United States Government.
+ *   It is the responsibility of any person or organization contemplating
+ *   export to obtain such a license before exporting.
+ *
+ * WITHIN THAT CONSTRAINT, permission to use, copy, modify, and
+ * distribute this software and its documentation for any purpose and
+ * without fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright notice and
+ * this permission notice appear in supporting documentation, and that
+ * the name of M.I.T. not be used in advertising or publicity pertaining
+ * to distribution of the software without specific, written prior
+ * permission.  Furthermore if you modify this software you must label
+ * your software as modified software and not distribute it in such a
+ * fashion that it might be confused with the original M.I.T. software.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is" without express
+ * or implied warranty.
+ */
+
+/*
+ * Every KDC exchange locates the realm's KDCs and resolves their hostnames.
+ * To spare programs which make several requests the resolver latency of
+ * repeating those lookups, a context remembers the results of DNS SRV queries
+ * for as long as their TTLs allow, and the results of getaddrinfo() for
+ * ADDR_LIFETIME seconds, since getaddrinfo() doesn't report TTLs.  Lookups
+ * which find that a name doesn't exist are remembered too; transient failures
+ * are not.  A context is not used by more than one thread at a time, so the
+ * caches need no locking.
+ */
+
+#include "fake-addrinfo.h"
+#include "k5-int.h"
+#include "os-proto.h"
+
+/* How long to reuse the results of getaddrinfo(). */
+#define ADDR_LIFETIME 30
+
+/* How many entries of each kind to keep. */
+#define MAX_ENTRIES 64
+
+struct srv_cache_entry {
+    struct srv_cache_entry *next;
+    char *name;                 /* service.protocol.realm */
+    time_t expire;
+    struct srv_dns_entry *answers;
+};
+
+struct addr_cache_entry {
+    struct addr_cache_entry *next;
+    char *host;
+    char *port;
+    int family;
+    int socktype;
+    int flags;
+    time_t expire;
+    int err;                    /* Result of getaddrinfo() */
+    struct addrinfo *addrs;
+};
+
+struct k5_dns_cache {
+    struct srv_cache_entry *srv;
+    struct addr_cache_entry *addr;
+};
+
+static struct k5_dns_cache *
+get_cache(krb5_context context)
+{
+    if (context->os_context.dns_cache == NULL)
+        context->os_context.dns_cache = calloc(1, sizeof(struct k5_dns_cache));
+    return context->os_context.dns_cache;
+}
+
+void
+k5_free_addrinfo_copy(struct addrinfo *ai)
+{
+    struct addrinfo *next;
+
+    for (; ai != NULL; ai = next) {
+        next = ai->ai_next;
+        free(ai);
+    }
+}
+
+/* Copy the address information in the list in, with each address stored in
+ * the same allocation as its addrinfo. */
+static struct addrinfo *
+copy_addrinfo(const struct addrinfo *in)
+{
+    struct addrinfo *head = NULL, **tailp = &head, *ai;
+
+    for (; in != NULL; in = in->ai_next) {
+        ai = malloc(sizeof(*ai) + in->ai_addrlen);
+        if (ai == NULL) {
+            k5_free_addrinfo_copy(head);
+            return NULL;
+        }
+        *ai = *in;
+        ai->ai_canonname = NULL;
+        ai->ai_addr = (struct sockaddr *)(ai + 1);
+        memcpy(ai->ai_addr, in->ai_addr, in->ai_addrlen);
+        ai->ai_next = NULL;
+        *tailp = ai;
+        tailp = &ai->ai_next;
+    }
+    return head;
+}
+
+/* Return true if a getaddrinfo() error means that the name doesn't exist. */
+static int
+nonexistent(int err)
+{
+#if defined(EAI_NODATA) && EAI_NODATA != EAI_NONAME
+    if (err == EAI_NODATA)
+        return 1;
+#endif
+    return err == EAI_NONAME;
+}
+
+static void
+free_addr_entry(struct addr_cache_entry *ent)
+{
+    free(ent->host);
+    free(ent->port);
+    k5_free_addrinfo_copy(ent->addrs);
+    free(ent);
+}
+
+/* Remove expired entries from the list *listp, and the oldest entry if the
+ * list is full. */
+static void
+prune_addr_cache(struct addr_cache_entry **listp, time_t now)
+{
+    struct addr_cache_entry **entp = listp, *ent;
+    int count = 0;
+
+    while ((ent = *entp) != NULL) {
+        if (ent->expire <= now || ++count >= MAX_ENTRIES) {
+            *entp = ent->next;
+            free_addr_entry(ent);
+        } else {
+            entp = &ent->next;
+        }
+    }
+}
+
+/*
+ * Look up host and port as getaddrinfo() would with hint, using the context's
+ * cache if possible.  Return a getaddrinfo() error code.  On success, free
+ * *addrs_out with k5_free_addrinfo_copy().
+ */
+int
+k5_cached_getaddrinfo(krb5_context context, const char *host,
+                      const char *port, const struct addrinfo *hint,
+                      struct addrinfo **addrs_out)
+{
+    struct k5_dns_cache *cache = get_cache(context);
+    struct addr_cache_entry *ent;
+    struct addrinfo *addrs;
+    time_t now = time(NULL);
+    int err;
+
+    *addrs_out = NULL;
+    if (cache != NULL) {
+        prune_addr_cache(&cache->addr, now);
+        for (ent = cache->addr; ent != NULL; ent = ent->next) {
+            if (strcmp(ent->host, host) == 0 &&
+                strcmp(ent->port, port) == 0 &&
+                ent->family == hint->ai_family &&
+                ent->socktype == hint->ai_socktype &&
+                ent->flags == hint->ai_flags)
+                break;
+        }
+        if (ent != NULL) {
+            TRACE_SENDTO_KDC_RESOLVE_CACHED(context, host);
+            if (ent->err)
+                return ent->err;
+            *addrs_out = copy_addrinfo(ent->addrs);
+            return (*addrs_out == NULL) ? EAI_MEMORY : 0;
+        }
+    }
+
+    TRACE_SENDTO_KDC_RESOLVING(context, host);
+    err = getaddrinfo(host, port, hint, &addrs);
+    if (err == 0) {
+        *addrs_out = copy_addrinfo(addrs);
+        freeaddrinfo(addrs);
+        if (*addrs_out == NULL)
+            return EAI_MEMORY;
+    }
+
+    /* Remember successes and nonexistent names, but not other failures. */
+    if (cache == NULL || (err != 0 && !nonexistent(err)))
+        return err;
+    ent = calloc(1, sizeof(*ent));
+    if (ent == NULL)
+        return err;
+    ent->host = strdup(host);
+    ent->port = strdup(port);
+    ent->family = hint->ai_family;
+    ent->socktype = hint->ai_socktype;
+    ent->flags = hint->ai_flags;
+    ent->expire = now + ADDR_LIFETIME;
+    ent->err = err;
+    if (err == 0)
+        ent->addrs = copy_addrinfo(*addrs_out);
+    if (ent->host == NULL || ent->port == NULL ||
+        (err == 0 && ent->addrs == NULL)) {
+        free_addr_entry(ent);
+        return err;
+    }
+    ent->next = cache->addr;
+    cache->addr = ent;
+    return err;
+}
+
+#ifdef KRB5_DNS_LOOKUP
+
+/* Copy the SRV answer list in into *out. */
+static krb5_error_code
+copy_srv(const struct srv_dns_entry *in, struct srv_dns_entry **out)
+{
+    struct srv_dns_entry *head = NULL, **tailp = &head, *srv;
+
+    *out = NULL;
+    for (; in != NULL; in = in->next) {
+        srv = malloc(sizeof(*srv));
+        if (srv == NULL)
+            goto oom;
+        *srv = *in;
+        srv->next = NULL;
+        srv->host = strdup(in->host);
+        if (srv->host == NULL) {
+            free(srv);
+            goto oom;
+        }
+        *tailp = srv;
+        tailp = &srv->next;
+    }
+    *out = head;
+    return 0;
+
+oom:
+    krb5int_free_srv_dns_data(head);
+    return ENOMEM;
+}
+
+static void
+free_srv_entry(struct srv_cache_entry *ent)
+{
+    free(ent->name);
+    krb5int_free_srv_dns_data(ent->answers);
+    free(ent);
+}
+
+static void
+prune_srv_cache(struct srv_cache_entry **listp, time_t now)
+{
+    struct srv_cache_entry **entp = listp, *ent;
+    int count = 0;
+
+    while ((ent = *entp) != NULL) {
+        if (ent->expire <= now || ++count >= MAX_ENTRIES) {
+            *entp = ent->next;
+            free_srv_entry(ent);
+        } else {
+            entp = &ent->next;
+        }
+    }
+}
+
+/* Make a DNS SRV query as krb5int_make_srv_query_realm() does, using the
+ * context's cache if possible. */
+krb5_error_code
+k5_cached_srv_query(krb5_context context, const krb5_data *realm,
+                    const char *service, const char *protocol,
+                    struct srv_dns_entry **answers)
+{
+    krb5_error_code ret;
+    struct k5_dns_cache *cache = get_cache(context);
+    struct srv_cache_entry *ent;
+    struct srv_dns_entry *head = NULL;
+    char *name;
+    time_t now = time(NULL);
+    int ttl;
+
+    *answers = NULL;
+    if (asprintf(&name, "%s.%s.%.*s", service, protocol, realm->length,
+                 realm->data) < 0)
+        return ENOMEM;
+
+    if (cache != NULL) {
+        prune_srv_cache(&cache->srv, now);
+        for (ent = cache->srv; ent != NULL; ent = ent->next) {
+            if (strcmp(ent->name, name) == 0)
+                break;
+        }
+        if (ent != NULL) {
+            if (ent->answers == NULL)
+                TRACE_DNS_SRV_CACHED_NONE(context, name);
+            else
+                TRACE_DNS_SRV_CACHED(context, name);
+            free(name);
+            return copy_srv(ent->answers, answers);
+        }
+    }
+
+    ret = krb5int_make_srv_query_realm(realm, service, protocol, &head, &ttl);
+    if (ret || cache == NULL || ttl <= 0)
+        goto cleanup;
+    ent = calloc(1, sizeof(*ent));
+    if (ent == NULL)
+        goto cleanup;
+    if (copy_srv(head, &ent->answers) != 0) {
+        free(ent);
+        goto cleanup;
+    }
+    ent->name = name;
+    name = NULL;
+    ent->expire = now + ttl;
+    ent->next = cache->srv;
+    cache->srv = ent;
+
+cleanup:
+    free(name);
+    *answers = head;
+    return ret;
+}
+
+#endif /* KRB5_DNS_LOOKUP */
+
+void
+k5_free_dns_cache(krb5_context context)
+{
+    struct k5_dns_cache *cache = context->os_context.dns_cache;
+    struct addr_cache_entry *aent, *anext;
+#ifdef KRB5_DNS_LOOKUP
+    struct srv_cache_entry *sent, *snext;
+#endif
+
+    if (cache == NULL)
+        return;
+    for (aent = cache->addr; aent != NULL; aent = anext) {
+        anext = aent->next;
+        free_addr_entry(aent);
+    }
+#ifdef KRB5_DNS_LOOKUP
+    for (sent = cache->srv; sent != NULL; sent = snext) {
+        snext = sent->next;
+        free_srv_entry(sent);
+    }
+#endif
+    free(cache);
+    context->os_context.dns_cache = NULL;
+}
@@ -50,6 +50,8 @@ struct krb5int_dns_state {
     void *ansp;
     int anslen;
     int ansmax;
+    int ttl;                    /* smallest TTL of answers returned */
+    int nonexistent;            /* query failed because name doesn't exist */
 #if HAVE_NS_INITPARSE
     int cur_ans;
     ns_msg msg;
@@ -92,6 +94,8 @@ krb5int_dns_init(struct krb5int_dns_state **dsp,
     ds->ansp = NULL;
     ds->anslen = 0;
     ds->ansmax = 0;
+    ds->ttl = -1;
+    ds->nonexistent = 0;
     nextincr = 2048;
     maxincr = INT_MAX;
 
@@ -126,6 +130,14 @@ krb5int_dns_init(struct krb5int_dns_state **dsp,
         len = res_search(host, ds->nclass, ds->ntype,
                          ds->ansp, ds->ansmax);
 #endif
+        if (len < 0) {
+            /* Distinguish a name with no records of this type, whose absence
+             * can be cached, from a failure to get an answer. */
+            ds->nonexistent = (h_errno == HOST_NOT_FOUND ||
+                               h_errno == NO_DATA);
+            ret = -1;
+            goto errout;
+        }
         if ((size_t) len > maxincr) {
             ret = -1;
             goto errout;
@@ -186,6 +198,8 @@ krb5int_dns_nextans(struct krb5int_dns_state *ds,
         ds->cur_ans++;
         if (ds->nclass == (int)ns_rr_class(rr)
             && ds->ntype == (int)ns_rr_type(rr)) {
+            if (ds->ttl < 0 || ns_rr_ttl(rr) < (unsigned long)ds->ttl)
+                ds->ttl = (ns_rr_ttl(rr) > INT_MAX) ? INT_MAX : ns_rr_ttl(rr);
             *pp = ns_rr_rdata(rr);
             *lenp = ns_rr_rdlen(rr);
             return 0;
@@ -214,6 +228,29 @@ krb5int_dns_expand(struct krb5int_dns_state *ds, const unsigned char *p,
 #endif
 }
 
+/*
+ * krb5int_dns_ttl - get the smallest TTL of the answers returned so far
+ *
+ * Returns -1 if no answers have been returned.
+ */
+int
+krb5int_dns_ttl(struct krb5int_dns_state *ds)
+{
+    return ds->ttl;
+}
+
+/*
+ * krb5int_dns_nonexistent - check why krb5int_dns_init() failed
+ *
+ * Returns true if the server said that the name has no records of the
+ * requested type, rather than the query failing.
+ */
+int
+krb5int_dns_nonexistent(struct krb5int_dns_state *ds)
+{
+    return ds != NULL && ds->nonexistent;
+}
+
 /*
  * Free stuff.
  */
@@ -289,7 +326,8 @@ krb5int_dns_nextans(struct krb5int_dns_state *ds,
 {
     int len;
     unsigned char *p;
-    unsigned short ntype, nclass, rdlen;
+    unsigned short ntype, nclass, rdlen, ttlhi, ttllo;
+    unsigned long ttl;
 #if !HAVE_DN_SKIPNAME
     char host[MAXDNAME];
 #endif
@@ -309,8 +347,9 @@ krb5int_dns_nextans(struct krb5int_dns_state *ds,
             return -1;
         p += len;
         SAFE_GETUINT16(ds->ansp, ds->anslen, p, 2, ntype, out);
-        /* Also skip 4 bytes of TTL */
-        SAFE_GETUINT16(ds->ansp, ds->anslen, p, 6, nclass, out);
+        SAFE_GETUINT16(ds->ansp, ds->anslen, p, 2, nclass, out);
+        SAFE_GETUINT16(ds->ansp, ds->anslen, p, 2, ttlhi, out);
+        SAFE_GETUINT16(ds->ansp, ds->anslen, p, 2, ttllo, out);
         SAFE_GETUINT16(ds->ansp, ds->anslen, p, 2, rdlen, out);
 
         if (!INCR_OK(ds->ansp, ds->anslen, p, rdlen))
@@ -318,6 +357,9 @@ krb5int_dns_nextans(struct krb5int_dns_state *ds,
         if (rdlen > INT_MAX)
             return -1;
         if (nclass == ds->nclass && ntype == ds->ntype) {
+            ttl = (unsigned long)ttlhi << 16 | ttllo;
+            if (ds->ttl < 0 || ttl < (unsigned long)ds->ttl)
+                ds->ttl = (ttl > INT_MAX) ? INT_MAX : ttl;
             *pp = p;
             *lenp = rdlen;
             ds->ptr = p + rdlen;
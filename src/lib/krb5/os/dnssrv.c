@@ -29,6 +29,10 @@
 
 #include "dnsglue.h"
 
+/* How long to remember that a realm has no SRV records.  Resolvers don't tell
+ * us the negative-caching TTL of the zone, so use a conservative value. */
+#define SRV_NEGATIVE_TTL 60
+
 /*
  * Lookup a KDC via DNS SRV records
  */
@@ -49,13 +53,19 @@ krb5int_free_srv_dns_data (struct srv_dns_entry *p)
 
    Make best effort to return all the data we can.  On memory or
    decoding errors, just return what we've got.  Always return 0,
-   currently.  */
+   currently.
+
+   Set *ttl_out to the number of seconds for which the result may be
+   reused: the smallest TTL of the answers, SRV_NEGATIVE_TTL if DNS
+   says there are no records, or 0 if we couldn't get a complete
+   answer.  */
 
 krb5_error_code
 krb5int_make_srv_query_realm(const krb5_data *realm,
                              const char *service,
                              const char *protocol,
-                             struct srv_dns_entry **answers)
+                             struct srv_dns_entry **answers,
+                             int *ttl_out)
 {
     const unsigned char *p = NULL, *base = NULL;
     char host[MAXDNAME];
@@ -67,6 +77,8 @@ krb5int_make_srv_query_realm(const krb5_data *realm,
     struct srv_dns_entry *head = NULL;
     struct srv_dns_entry *srv = NULL, *entry = NULL;
 
+    *ttl_out = 0;
+
     /*
      * First off, build a query of the form:
      *
@@ -105,13 +117,22 @@ krb5int_make_srv_query_realm(const krb5_data *realm,
 #endif
 
     size = krb5int_dns_init(&ds, host, C_IN, T_SRV);
-    if (size < 0)
+    if (size < 0) {
+        if (krb5int_dns_nonexistent(ds))
+            *ttl_out = SRV_NEGATIVE_TTL;
         goto out;
+    }
 
     for (;;) {
         ret = krb5int_dns_nextans(ds, &base, &rdlen);
-        if (ret < 0 || base == NULL)
+        if (ret < 0)
+            goto out;
+        if (base == NULL) {
+            /* We got every answer. */
+            ret = krb5int_dns_ttl(ds);
+            *ttl_out = (ret >= 0) ? ret : SRV_NEGATIVE_TTL;
             goto out;
+        }
 
         p = base;
 
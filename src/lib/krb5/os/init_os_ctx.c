@@ -543,6 +543,10 @@ krb5_os_free_context(krb5_context ctx)
         os_ctx->default_ccname = 0;
     }
 
+    k5_free_dns_cache(ctx);
+    k5_free_kdc_prefs(ctx);
+    k5_free_kdc_conns(ctx);
+
     os_ctx->magic = 0;
 
     if (ctx->profile) {
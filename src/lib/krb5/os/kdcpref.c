@@ -0,0 +1,260 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* lib/krb5/os/kdcpref.c - Per-context record of KDC responsiveness */
+/*
+ * Copyright (C) 2012 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Export of this software from the United States of America may
+ *   require a specific license from the United States Government.
+ *   It is the responsibility of any person or organization contemplating
+ *   export to obtain such a license before exporting.
+ *
+ * WITHIN THAT CONSTRAINT, permission to use, copy, modify, and
+ * distribute this software and its documentation for any purpose and
+ * without fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright notice and
+ * this permission notice appear in supporting documentation, and that
+ * the name of M.I.T. not be used in advertising or publicity pertaining
+ * to distribution of the software without specific, written prior
+ * permission.  Furthermore if you modify this software you must label
+ * your software as modified software and not distribute it in such a
+ * fashion that it might be confused with the original M.I.T. software.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is" without express
+ * or implied warranty.
+ */
+
+
+/*
+ * Each KDC exchange tries a realm's servers in order, waiting a second for an
+ * answer from one before contacting the next.  If the first server is down or
+ * slow, every exchange pays for it.  To pay that cost only once, a context
+ * remembers how quickly each server it has contacted answered, and which
+ * servers failed to answer before another server did.  Before an exchange,
+ * the servers which answered are moved to the front in order of their recent
+ * round-trip times, and the servers which recently failed are moved to the
+ * back until FAILURE_BACKOFF seconds have passed.  Servers are only reordered,
+ * never dropped, so an exchange still tries every server in the end.
+ */
+
+#include "k5-int.h"
+#include "os-proto.h"
+
+/* How long to try other servers first after a server fails to answer. */
+#define FAILURE_BACKOFF 60
+
+/* How long to remember a server after we last heard about it. */
+#define ENTRY_LIFETIME 600
+
+/* How many servers to remember. */
+#define MAX_ENTRIES 64
+
+struct kdc_pref {
+    struct kdc_pref *next;
+    struct server_entry server; /* hostname is our own copy */
+    time_t expire;
+    time_t backoff_until;       /* Deprioritize until this time */
+    long rtt;                   /* Smoothed round-trip time in ms, or -1 */
+};
+
+struct k5_kdc_prefs {
+    struct kdc_pref *list;
+};
+
+/* Return true if a and b name the same server. */
+static krb5_boolean
+same_server(const struct server_entry *a, const struct server_entry *b)
+{
+    if (a->socktype != b->socktype)
+        return FALSE;
+    if (a->hostname != NULL || b->hostname != NULL) {
+        return a->hostname != NULL && b->hostname != NULL &&
+            a->port == b->port && strcmp(a->hostname, b->hostname) == 0;
+    }
+    return a->addrlen == b->addrlen &&
+        memcmp(&a->addr, &b->addr, a->addrlen) == 0;
+}
+
+static void
+free_pref(struct kdc_pref *pref)
+{
+    free(pref->server.hostname);
+    free(pref);
+}
+
+/* Remove expired entries from the list *listp, and the oldest entries beyond
+ * limit. */
+static void
+prune(struct kdc_pref **listp, time_t now, int limit)
+{
+    struct kdc_pref **pp = listp, *pref;
+    int count = 0;
+
+    while ((pref = *pp) != NULL) {
+        if (pref->expire <= now || ++count > limit) {
+            *pp = pref->next;
+            free_pref(pref);
+        } else {
+            pp = &pref->next;
+        }
+    }
+}
+
+/* Return the context's entry for server, or NULL if there isn't one. */
+static struct kdc_pref *
+find_pref(krb5_context context, const struct server_entry *server,
+          time_t now)
+{
+    struct k5_kdc_prefs *prefs = context->os_context.kdc_prefs;
+    struct kdc_pref *pref;
+
+    if (prefs == NULL)
+        return NULL;
+    prune(&prefs->list, now, MAX_ENTRIES);
+    for (pref = prefs->list; pref != NULL; pref = pref->next) {
+        if (same_server(&pref->server, server))
+            return pref;
+    }
+    return NULL;
+}
+
+/* Return the context's entry for server, moved to the front of the list and
+ * created if necessary, or NULL if out of memory. */
+static struct kdc_pref *
+get_pref(krb5_context context, const struct server_entry *server,
+         time_t now)
+{
+    struct k5_kdc_prefs *prefs = context->os_context.kdc_prefs;
+    struct kdc_pref **pp, *pref;
+
+    if (prefs == NULL) {
+        prefs = calloc(1, sizeof(*prefs));
+        if (prefs == NULL)
+            return NULL;
+        context->os_context.kdc_prefs = prefs;
+    }
+
+    prune(&prefs->list, now, MAX_ENTRIES);
+    for (pp = &prefs->list; *pp != NULL; pp = &(*pp)->next) {
+        if (same_server(&(*pp)->server, server))
+            break;
+    }
+    if (*pp != NULL) {
+        pref = *pp;
+        *pp = pref->next;
+    } else {
+        /* Make room for the new entry. */
+        prune(&prefs->list, now, MAX_ENTRIES - 1);
+        pref = calloc(1, sizeof(*pref));
+        if (pref == NULL)
+            return NULL;
+        pref->server = *server;
+        if (server->hostname != NULL) {
+            pref->server.hostname = strdup(server->hostname);
+            if (pref->server.hostname == NULL) {
+                free(pref);
+                return NULL;
+            }
+        }
+        pref->rtt = -1;
+    }
+    pref->expire = now + ENTRY_LIFETIME;
+    pref->next = prefs->list;
+    prefs->list = pref;
+    return pref;
+}
+
+/* Record that server answered a request after msec milliseconds. */
+void
+k5_note_kdc_reply(krb5_context context, const struct server_entry *server,
+                  long msec)
+{
+    struct kdc_pref *pref;
+
+    pref = get_pref(context, server, time(NULL));
+    if (pref == NULL)
+        return;
+    /* Weight the new sample by 1/4, as a cheap moving average. */
+    pref->rtt = (pref->rtt < 0) ? msec : (pref->rtt * 3 + msec) / 4;
+    pref->backoff_until = 0;
+}
+
+/* Record that server didn't answer a request before some other server did, or
+ * before the exchange gave up. */
+void
+k5_note_kdc_failure(krb5_context context, const struct server_entry *server)
+{
+    struct kdc_pref *pref;
+    time_t now = time(NULL);
+
+    pref = get_pref(context, server, now);
+    if (pref == NULL)
+        return;
+    pref->backoff_until = now + FAILURE_BACKOFF;
+    pref->rtt = -1;
+}
+
+/*
+ * Return a sort key for server: servers which answered recently come first by
+ * round-trip time, then servers we know nothing about, then servers which
+ * recently failed.
+ */
+static long
+sort_key(krb5_context context, const struct server_entry *server, time_t now)
+{
+    struct kdc_pref *pref = find_pref(context, server, now);
+
+    if (pref == NULL)
+        return LONG_MAX - 1;
+    if (pref->backoff_until > now)
+        return LONG_MAX;
+    return (pref->rtt < 0) ? LONG_MAX - 1 : pref->rtt;
+}
+
+/* Reorder the entries of servers according to the context's record of their
+ * responsiveness, otherwise preserving their order. */
+void
+k5_sort_kdcs(krb5_context context, struct serverlist *servers)
+{
+    struct server_entry tmp;
+    long *keys, tmpkey;
+    size_t i, j;
+    time_t now = time(NULL);
+    krb5_boolean moved = FALSE;
+
+    if (context->os_context.kdc_prefs == NULL || servers->nservers < 2)
+        return;
+    keys = malloc(servers->nservers * sizeof(*keys));
+    if (keys == NULL)
+        return;
+    for (i = 0; i < servers->nservers; i++)
+        keys[i] = sort_key(context, &servers->servers[i], now);
+
+    /* Insertion sort, which is stable and fine for short lists. */
+    for (i = 1; i < servers->nservers; i++) {
+        tmp = servers->servers[i];
+        tmpkey = keys[i];
+        for (j = i; j > 0 && keys[j - 1] > tmpkey; j--) {
+            servers->servers[j] = servers->servers[j - 1];
+            keys[j] = keys[j - 1];
+            moved = TRUE;
+        }
+        servers->servers[j] = tmp;
+        keys[j] = tmpkey;
+    }
+    if (moved)
+        TRACE_SENDTO_KDC_REORDER(context);
+    free(keys);
+}
+
+void
+k5_free_kdc_prefs(krb5_context context)
+{
+    struct k5_kdc_prefs *prefs = context->os_context.kdc_prefs;
+
+    if (prefs == NULL)
+        return;
+    prune(&prefs->list, 0, 0);
+    free(prefs);
+    context->os_context.kdc_prefs = NULL;
+}
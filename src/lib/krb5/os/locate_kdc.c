@@ -304,14 +304,15 @@ krb5_locate_srv_conf(krb5_context context, const krb5_data *realm,
 
 #ifdef KRB5_DNS_LOOKUP
 static krb5_error_code
-locate_srv_dns_1(const krb5_data *realm, const char *service,
-                 const char *protocol, struct serverlist *serverlist)
+locate_srv_dns_1(krb5_context context, const krb5_data *realm,
+                 const char *service, const char *protocol,
+                 struct serverlist *serverlist)
 {
     struct srv_dns_entry *head = NULL, *entry = NULL;
     krb5_error_code code = 0;
     int socktype;
 
-    code = krb5int_make_srv_query_realm(realm, service, protocol, &head);
+    code = k5_cached_srv_query(context, realm, service, protocol, &head);
     if (code)
         return 0;
 
@@ -551,12 +552,14 @@ dns_locate_server(krb5_context context, const krb5_data *realm,
 
     code = 0;
     if (socktype == SOCK_DGRAM || socktype == 0) {
-        code = locate_srv_dns_1(realm, dnsname, "_udp", serverlist);
+        code = locate_srv_dns_1(context, realm, dnsname, "_udp",
+                                serverlist);
         if (code)
             Tprintf("dns udp lookup returned error %d\n", code);
     }
     if ((socktype == SOCK_STREAM || socktype == 0) && code == 0) {
-        code = locate_srv_dns_1(realm, dnsname, "_tcp", serverlist);
+        code = locate_srv_dns_1(context, realm, dnsname, "_tcp",
+                                serverlist);
         if (code)
             Tprintf("dns tcp lookup returned error %d\n", code);
     }
@@ -100,6 +100,30 @@ krb5_error_code k5_sendto(krb5_context context, const krb5_data *message,
                                              void *),
                           void *msg_handler_data);
 
+/* dnscache.c */
+int k5_cached_getaddrinfo(krb5_context context, const char *host,
+                          const char *port, const struct addrinfo *hint,
+                          struct addrinfo **addrs_out);
+void k5_free_addrinfo_copy(struct addrinfo *ai);
+#ifdef KRB5_DNS_LOOKUP
+krb5_error_code k5_cached_srv_query(krb5_context context,
+                                    const krb5_data *realm,
+                                    const char *service,
+                                    const char *protocol,
+                                    struct srv_dns_entry **answers);
+#endif
+void k5_free_dns_cache(krb5_context context);
+
+/* kdcpref.c */
+void k5_note_kdc_reply(krb5_context context, const struct server_entry *server,
+                       long msec);
+void k5_note_kdc_failure(krb5_context context,
+                         const struct server_entry *server);
+void k5_sort_kdcs(krb5_context context, struct serverlist *servers);
+void k5_free_kdc_prefs(krb5_context context);
+
+void k5_free_kdc_conns(krb5_context context);
+
 krb5_error_code krb5int_get_fq_local_hostname(char *, size_t);
 
 /* The io vector is *not* const here, unlike writev()!  */
@@ -54,6 +54,8 @@
 #define MAX_PASS                    3
 #define DEFAULT_UDP_PREF_LIMIT   1465
 #define HARD_UDP_LIMIT          32700 /* could probably do 64K-epsilon ? */
+#define MAX_CACHED_CONNS            4
+#define CACHED_CONN_IDLE           30 /* seconds */
 
 #undef DEBUG
 
@@ -270,6 +272,71 @@ check_for_svc_unavailable (krb5_context context,
     return 1;
 }
 
+/* Choose the socket types to try for message, in order of preference. */
+static krb5_error_code
+get_socktypes(krb5_context context, const krb5_data *message, int tcp_only,
+              int *socktype1, int *socktype2)
+{
+    krb5_error_code retval;
+    int tmp;
+
+    if (!tcp_only && context->udp_pref_limit < 0) {
+        retval = profile_get_integer(context->profile,
+                                     KRB5_CONF_LIBDEFAULTS, KRB5_CONF_UDP_PREFERENCE_LIMIT, 0,
+                                     DEFAULT_UDP_PREF_LIMIT, &tmp);
+        if (retval)
+            return retval;
+        if (tmp < 0)
+            tmp = DEFAULT_UDP_PREF_LIMIT;
+        else if (tmp > HARD_UDP_LIMIT)
+            /* In the unlikely case that a *really* big value is
+               given, let 'em use as big as we think we can
+               support.  */
+            tmp = HARD_UDP_LIMIT;
+        context->udp_pref_limit = tmp;
+    }
+
+    if (tcp_only)
+        *socktype1 = SOCK_STREAM, *socktype2 = 0;
+    else if (message->length <= (unsigned int) context->udp_pref_limit)
+        *socktype1 = SOCK_DGRAM, *socktype2 = SOCK_STREAM;
+    else
+        *socktype1 = SOCK_STREAM, *socktype2 = SOCK_DGRAM;
+    return 0;
+}
+
+/* Translate a KRB5_KDC_UNREACH result from k5_sendto, given the last KDC error
+ * seen by check_for_svc_unavailable. */
+static krb5_error_code
+unreachable_error(krb5_context context, const krb5_data *realm,
+                  krb5_error_code err)
+{
+    if (err == KDC_ERR_SVC_UNAVAILABLE)
+        return KRB5KDC_ERR_SVC_UNAVAILABLE;
+    krb5_set_error_message(context, KRB5_KDC_UNREACH,
+                           _("Cannot contact any KDC for realm '%.*s'"),
+                           realm->length, realm->data);
+    return KRB5_KDC_UNREACH;
+}
+
+/* Set *use_master to 1 if the server at index server_used in servers is a
+ * master KDC for realm. */
+static void
+check_master(krb5_context context, const krb5_data *realm,
+             struct serverlist *servers, int server_used, int *use_master)
+{
+    struct serverlist mservers;
+    struct server_entry *entry = &servers->servers[server_used];
+
+    if (k5_locate_kdc(context, realm, &mservers, TRUE,
+                      entry->socktype) == 0) {
+        if (in_addrlist(entry, &mservers))
+            *use_master = 1;
+        k5_free_serverlist(&mservers);
+    }
+    TRACE_SENDTO_KDC_MASTER(context, *use_master);
+}
+
 /*
  * send the formatted request 'message' to a KDC for realm 'realm' and
  * return the response (if any) in 'reply'.
@@ -286,7 +353,7 @@ krb5_sendto_kdc(krb5_context context, const krb5_data *message,
                 const krb5_data *realm, krb5_data *reply, int *use_master,
                 int tcp_only)
 {
-    krb5_error_code retval, err;
+    krb5_error_code retval, err = 0;
     struct serverlist servers;
     int socktype1 = 0, socktype2 = 0, server_used;
 
@@ -307,65 +374,28 @@ krb5_sendto_kdc(krb5_context context, const krb5_data *message,
            message->length, message->data, realm, *use_master, tcp_only);
     TRACE_SENDTO_KDC(context, message->length, realm, *use_master, tcp_only);
 
-    if (!tcp_only && context->udp_pref_limit < 0) {
-        int tmp;
-        retval = profile_get_integer(context->profile,
-                                     KRB5_CONF_LIBDEFAULTS, KRB5_CONF_UDP_PREFERENCE_LIMIT, 0,
-                                     DEFAULT_UDP_PREF_LIMIT, &tmp);
-        if (retval)
-            return retval;
-        if (tmp < 0)
-            tmp = DEFAULT_UDP_PREF_LIMIT;
-        else if (tmp > HARD_UDP_LIMIT)
-            /* In the unlikely case that a *really* big value is
-               given, let 'em use as big as we think we can
-               support.  */
-            tmp = HARD_UDP_LIMIT;
-        context->udp_pref_limit = tmp;
-    }
-
-    if (tcp_only)
-        socktype1 = SOCK_STREAM, socktype2 = 0;
-    else if (message->length <= (unsigned int) context->udp_pref_limit)
-        socktype1 = SOCK_DGRAM, socktype2 = SOCK_STREAM;
-    else
-        socktype1 = SOCK_STREAM, socktype2 = SOCK_DGRAM;
+    retval = get_socktypes(context, message, tcp_only, &socktype1, &socktype2);
+    if (retval)
+        return retval;
 
     retval = k5_locate_kdc(context, realm, &servers, *use_master,
                            tcp_only ? SOCK_STREAM : 0);
     if (retval)
         return retval;
+    k5_sort_kdcs(context, &servers);
 
     retval = k5_sendto(context, message, &servers, socktype1, socktype2,
                        NULL, reply, NULL, NULL, &server_used,
                        check_for_svc_unavailable, &err);
-    if (retval == KRB5_KDC_UNREACH) {
-        if (err == KDC_ERR_SVC_UNAVAILABLE) {
-            retval = KRB5KDC_ERR_SVC_UNAVAILABLE;
-        } else {
-            krb5_set_error_message(context, retval,
-                                   _("Cannot contact any KDC for realm "
-                                     "'%.*s'"), realm->length, realm->data);
-        }
-    }
+    if (retval == KRB5_KDC_UNREACH)
+        retval = unreachable_error(context, realm, err);
     if (retval)
         goto cleanup;
 
     /* Set use_master to 1 if we ended up talking to a master when we didn't
      * explicitly request to. */
-    if (*use_master == 0) {
-        struct serverlist mservers;
-        struct server_entry *entry = &servers.servers[server_used];
-        retval = k5_locate_kdc(context, realm, &mservers, TRUE,
-                               entry->socktype);
-        if (retval == 0) {
-            if (in_addrlist(entry, &mservers))
-                *use_master = 1;
-            k5_free_serverlist(&mservers);
-        }
-        TRACE_SENDTO_KDC_MASTER(context, *use_master);
-        retval = 0;
-    }
+    if (*use_master == 0)
+        check_master(context, realm, &servers, server_used, use_master);
 
 cleanup:
     k5_free_serverlist(&servers);
@@ -417,8 +447,10 @@ cleanup:
  * Currently only sendto_kdc.c knows how to use poll(); the other candidate
  * user, lib/apputils/net-server.c, is stuck using select() for the moment
  * since it is entangled with the RPC library.  The following cm_* functions
- * are not fully generic, are O(n^2) in the poll case, and are limited to
- * handling 1024 connections (in order to maintain a constant-sized selstate).
+ * are not fully generic and are limited to handling 1024 connections (in
+ * order to maintain a constant-sized selstate).  In the poll case, each
+ * connection remembers its slot, so the cost of a wakeup is proportional to
+ * the number of connections in this exchange, whatever the fd numbers are.
  * More rearchitecting would be appropriate before extending this support to
  * the KDC and kadmind.
  */
@@ -428,7 +460,9 @@ cm_init_selstate(struct select_state *selstate)
 {
     selstate->nfds = 0;
     selstate->end_time.tv_sec = selstate->end_time.tv_usec = 0;
-#ifndef USE_POLL
+#ifdef USE_POLL
+    selstate->nslots = 0;
+#else
     selstate->max = 0;
     FD_ZERO(&selstate->rfds);
     FD_ZERO(&selstate->wfds);
@@ -437,17 +471,23 @@ cm_init_selstate(struct select_state *selstate)
 }
 
 static krb5_boolean
-cm_add_fd(struct select_state *selstate, int fd, unsigned int ssflags)
+cm_add_fd(struct select_state *selstate, struct conn_state *conn,
+          unsigned int ssflags)
 {
+    int fd = conn->fd;
 #ifdef USE_POLL
-    if (selstate->nfds >= MAX_POLLFDS)
+    struct pollfd *pfd;
+
+    if (selstate->nslots >= MAX_POLLFDS)
         return FALSE;
-    selstate->fds[selstate->nfds].fd = fd;
-    selstate->fds[selstate->nfds].events = 0;
+    conn->sel_slot = selstate->nslots++;
+    pfd = &selstate->fds[conn->sel_slot];
+    pfd->fd = fd;
+    pfd->events = pfd->revents = 0;
     if (ssflags & SSF_READ)
-        selstate->fds[selstate->nfds].events |= POLLIN;
+        pfd->events |= POLLIN;
     if (ssflags & SSF_WRITE)
-        selstate->fds[selstate->nfds].events |= POLLOUT;
+        pfd->events |= POLLOUT;
 #else
 #ifndef _WIN32  /* On Windows FD_SETSIZE is a count, not a max value. */
     if (fd >= FD_SETSIZE)
@@ -467,17 +507,22 @@ cm_add_fd(struct select_state *selstate, int fd, unsigned int ssflags)
 }
 
 static void
-cm_remove_fd(struct select_state *selstate, int fd)
+cm_remove_fd(struct select_state *selstate, struct conn_state *conn)
 {
 #ifdef USE_POLL
-    int i;
+    struct pollfd *pfd = &selstate->fds[conn->sel_slot];
 
-    /* Find the FD in the array and move the last entry to its place. */
     assert(selstate->nfds > 0);
-    for (i = 0; i < selstate->nfds && selstate->fds[i].fd != fd; i++);
-    assert(i < selstate->nfds);
-    selstate->fds[i] = selstate->fds[selstate->nfds - 1];
+    assert(pfd->fd == conn->fd);
+    /* Leave the slot in place so that other connections keep theirs. */
+    pfd->fd = -1;
+    pfd->events = pfd->revents = 0;
+    /* Reclaim trailing dead slots, so we don't keep polling them. */
+    while (selstate->nslots > 0 && selstate->fds[selstate->nslots - 1].fd < 0)
+        selstate->nslots--;
 #else
+    int fd = conn->fd;
+
     FD_CLR(fd, &selstate->rfds);
     FD_CLR(fd, &selstate->wfds);
     FD_CLR(fd, &selstate->xfds);
@@ -494,16 +539,13 @@ cm_remove_fd(struct select_state *selstate, int fd)
 }
 
 static void
-cm_unset_write(struct select_state *selstate, int fd)
+cm_unset_write(struct select_state *selstate, struct conn_state *conn)
 {
 #ifdef USE_POLL
-    int i;
-
-    for (i = 0; i < selstate->nfds && selstate->fds[i].fd != fd; i++);
-    assert(i < selstate->nfds);
-    selstate->fds[i].events &= ~POLLOUT;
+    assert(selstate->fds[conn->sel_slot].fd == conn->fd);
+    selstate->fds[conn->sel_slot].events &= ~POLLOUT;
 #else
-    FD_CLR(fd, &selstate->wfds);
+    FD_CLR(conn->fd, &selstate->wfds);
 #endif
 }
 
@@ -525,9 +567,13 @@ cm_select_or_poll(const struct select_state *in, struct select_state *out,
             (in->end_time.tv_usec - now.tv_usec) / 1000;
     }
     /* We don't need a separate copy of the selstate for poll, but use one
-     * anyone for consistency with the select wrapper. */
-    *out = *in;
-    *sret = poll(out->fds, out->nfds, timeout);
+     * anyway for consistency with the select wrapper.  Only copy the slots in
+     * use, rather than the whole array. */
+    out->nfds = in->nfds;
+    out->nslots = in->nslots;
+    out->end_time = in->end_time;
+    memcpy(out->fds, in->fds, in->nslots * sizeof(*in->fds));
+    *sret = poll(out->fds, out->nslots, timeout);
     e = SOCKET_ERRNO;
     return (*sret < 0) ? e : 0;
 #else
@@ -537,26 +583,32 @@ cm_select_or_poll(const struct select_state *in, struct select_state *out,
 }
 
 static unsigned int
-cm_get_ssflags(struct select_state *selstate, int fd)
+cm_get_ssflags(struct select_state *selstate, struct conn_state *conn)
 {
     unsigned int ssflags = 0;
 #ifdef USE_POLL
-    int i;
+    struct pollfd *pfd;
 
-    for (i = 0; i < selstate->nfds && selstate->fds[i].fd != fd; i++);
-    assert(i < selstate->nfds);
-    if (selstate->fds[i].revents & POLLIN)
+    /* A connection added after the poll has no results yet. */
+    if (conn->sel_slot >= selstate->nslots)
+        return 0;
+    pfd = &selstate->fds[conn->sel_slot];
+    if (pfd->fd != conn->fd)
+        return 0;
+    /* As with select, a hangup shows up as readability, so that the read
+     * sees the end of the stream. */
+    if (pfd->revents & (POLLIN | POLLHUP))
         ssflags |= SSF_READ;
-    if (selstate->fds[i].revents & POLLOUT)
+    if (pfd->revents & POLLOUT)
         ssflags |= SSF_WRITE;
-    if (selstate->fds[i].revents & POLLERR)
+    if (pfd->revents & (POLLERR | POLLNVAL))
         ssflags |= SSF_EXCEPTION;
 #else
-    if (FD_ISSET(fd, &selstate->rfds))
+    if (FD_ISSET(conn->fd, &selstate->rfds))
         ssflags |= SSF_READ;
-    if (FD_ISSET(fd, &selstate->wfds))
+    if (FD_ISSET(conn->fd, &selstate->wfds))
         ssflags |= SSF_WRITE;
-    if (FD_ISSET(fd, &selstate->xfds))
+    if (FD_ISSET(conn->fd, &selstate->xfds))
         ssflags |= SSF_EXCEPTION;
 #endif
     return ssflags;
@@ -732,8 +784,8 @@ resolve_server(krb5_context context, const struct serverlist *servers,
     result = snprintf(portbuf, sizeof(portbuf), "%d", ntohs(entry->port));
     if (SNPRINTF_OVERFLOW(result, sizeof(portbuf)))
         return EINVAL;
-    TRACE_SENDTO_KDC_RESOLVING(context, entry->hostname);
-    err = getaddrinfo(entry->hostname, portbuf, &hint, &addrs);
+    err = k5_cached_getaddrinfo(context, entry->hostname, portbuf, &hint,
+                                &addrs);
     if (err)
         return translate_ai_error(err);
     /* Add each address with the preferred socktype. */
@@ -747,7 +799,7 @@ resolve_server(krb5_context context, const struct serverlist *servers,
             retval = add_connection(conns, a, ind, message, udpbufp);
         }
     }
-    freeaddrinfo(addrs);
+    k5_free_addrinfo_copy(addrs);
     return retval;
 }
 
@@ -806,6 +858,7 @@ start_connection(krb5_context context, struct conn_state *state,
         state->fd = fd;
     }
     dprint("new state = %s\n", state_strings[state->state]);
+    (void)k5_getcurtime(&state->start_time);
 
 
     /*
@@ -851,7 +904,7 @@ start_connection(krb5_context context, struct conn_state *state,
     ssflags = SSF_READ | SSF_EXCEPTION;
     if (state->state == CONNECTING || state->state == WRITING)
         ssflags |= SSF_WRITE;
-    if (!cm_add_fd(selstate, state->fd, ssflags)) {
+    if (!cm_add_fd(selstate, state, ssflags)) {
         (void) closesocket(state->fd);
         state->fd = INVALID_SOCKET;
         state->state = FAILED;
@@ -914,7 +967,7 @@ static void
 kill_conn(struct conn_state *conn, struct select_state *selstate, int err)
 {
     dprint("abandoning connection %d: %m\n", conn->fd, err);
-    cm_remove_fd(selstate, conn->fd);
+    cm_remove_fd(selstate, conn);
     closesocket(conn->fd);
     conn->fd = INVALID_SOCKET;
     conn->state = FAILED;
@@ -1040,7 +1093,7 @@ service_tcp_fd(krb5_context context, struct conn_state *conn,
             /* Done writing, switch to reading.  */
             /* Don't call shutdown at this point because
              * some implementations cannot deal with half-closed connections.*/
-            cm_unset_write(selstate, conn->fd);
+            cm_unset_write(selstate, conn);
             /* Q: How do we detect failures to send the remaining data
                to the remote side, since we're in non-blocking mode?
                Will we always get errors on the reading side?  */
@@ -1086,9 +1139,9 @@ service_tcp_fd(krb5_context context, struct conn_state *conn,
             nread = SOCKET_READ(conn->fd,
                                 conn->x.in.bufsizebytes + conn->x.in.bufsizebytes_read,
                                 4 - conn->x.in.bufsizebytes_read);
-            if (nread < 0) {
+            if (nread <= 0) {
+                e = nread ? SOCKET_ERRNO : ECONNRESET;
                 TRACE_SENDTO_KDC_TCP_ERROR_RECV_LEN(context, conn, e);
-                e = SOCKET_ERRNO;
                 goto kill_conn;
             }
             conn->x.in.bufsizebytes_read += nread;
@@ -1140,73 +1193,233 @@ service_udp_fd(krb5_context context, struct conn_state *conn,
     return 1;
 }
 
+/*
+ * If kdc_tcp_reuse is set in libdefaults, a context keeps the TCP connections
+ * which yield KDC replies open, and sends later requests to the same address
+ * over them instead of connecting again.  The KDC accepts any number of
+ * requests on a connection, one at a time.  A connection the KDC has closed
+ * may only be noticed when a request on it fails, in which case we connect
+ * again immediately.
+ */
+
+struct cached_conn {
+    SOCKET fd;
+    int family;
+    size_t addrlen;
+    struct sockaddr_storage addr;
+    time_t expire;
+};
+
+struct k5_kdc_conns {
+    struct cached_conn conns[MAX_CACHED_CONNS];
+    int nconns;
+};
+
 static krb5_boolean
-service_fds(krb5_context context, struct select_state *selstate, int interval,
-            struct conn_state *conns, struct select_state *seltemp,
-            int (*msg_handler)(krb5_context, const krb5_data *, void *),
-            void *msg_handler_data, struct conn_state **winner_out)
+tcp_reuse_enabled(krb5_context context)
 {
-    int e, selret = 0;
-    struct timeval now;
-    struct conn_state *state;
+    int val;
 
-    *winner_out = NULL;
+    if (profile_get_boolean(context->profile, KRB5_CONF_LIBDEFAULTS,
+                            KRB5_CONF_KDC_TCP_REUSE, NULL, 0, &val) != 0)
+        return FALSE;
+    return val;
+}
 
-    e = k5_getcurtime(&now);
-    if (e)
-        return 1;
-    selstate->end_time = now;
-    selstate->end_time.tv_sec += interval;
+static void
+drop_cached_conn(struct k5_kdc_conns *cache, int i)
+{
+    closesocket(cache->conns[i].fd);
+    cache->conns[i] = cache->conns[--cache->nconns];
+}
 
-    e = 0;
-    while (selstate->nfds > 0) {
-        e = cm_select_or_poll(selstate, seltemp, &selret);
-        if (e == EINTR)
+/* Return true if fd is still open at the other end with nothing to read. */
+static krb5_boolean
+conn_is_idle(SOCKET fd)
+{
+    char c;
+
+    return recv(fd, &c, 1, MSG_PEEK) < 0 && (SOCKET_ERRNO == EWOULDBLOCK ||
+                                             SOCKET_ERRNO == EAGAIN);
+}
+
+/* If the context has a connection to conn's address, take it over for conn,
+ * which must be an unstarted TCP connection, and return true. */
+static krb5_boolean
+reuse_connection(krb5_context context, struct conn_state *conn,
+                 struct select_state *selstate)
+{
+    struct k5_kdc_conns *cache = context->os_context.kdc_conns;
+    struct cached_conn *cc;
+    time_t now = time(NULL);
+    int i;
+
+    if (cache == NULL || conn->is_udp || conn->state != INITIALIZING)
+        return FALSE;
+    for (i = cache->nconns - 1; i >= 0; i--) {
+        cc = &cache->conns[i];
+        if (cc->expire <= now || !conn_is_idle(cc->fd)) {
+            drop_cached_conn(cache, i);
             continue;
-        if (e != 0)
+        }
+        if (cc->family == conn->family && cc->addrlen == conn->addrlen &&
+            memcmp(&cc->addr, &conn->addr, cc->addrlen) == 0)
             break;
+    }
+    if (i < 0)
+        return FALSE;
 
-        dprint("service_fds examining results, selret=%d\n", selret);
+    conn->fd = cc->fd;
+    cache->conns[i] = cache->conns[--cache->nconns];
+    if (!cm_add_fd(selstate, conn, SSF_READ | SSF_WRITE | SSF_EXCEPTION)) {
+        closesocket(conn->fd);
+        conn->fd = INVALID_SOCKET;
+        return FALSE;
+    }
+    TRACE_SENDTO_KDC_TCP_REUSE(context, conn);
+    conn->state = WRITING;
+    conn->reused = 1;
+    (void)k5_getcurtime(&conn->start_time);
+    return TRUE;
+}
 
-        if (selret == 0)
-            /* Timeout, return to caller.  */
-            return 0;
+/* Keep conn's socket open in the context for later requests, after a complete
+ * reply has been read from it. */
+static void
+cache_connection(krb5_context context, struct conn_state *conn,
+                 struct select_state *selstate)
+{
+    struct k5_kdc_conns *cache = context->os_context.kdc_conns;
+    struct cached_conn *cc;
 
-        /* Got something on a socket, process it.  */
-        for (state = conns; state != NULL; state = state->next) {
-            int ssflags;
+    if (cache == NULL) {
+        cache = calloc(1, sizeof(*cache));
+        if (cache == NULL)
+            return;
+        context->os_context.kdc_conns = cache;
+    }
+    /* If the cache is full, drop a connection to make room. */
+    if (cache->nconns == MAX_CACHED_CONNS)
+        drop_cached_conn(cache, 0);
+
+    TRACE_SENDTO_KDC_TCP_CACHE(context, conn);
+    cc = &cache->conns[cache->nconns++];
+    cc->fd = conn->fd;
+    cc->family = conn->family;
+    cc->addrlen = conn->addrlen;
+    memcpy(&cc->addr, &conn->addr, conn->addrlen);
+    cc->expire = time(NULL) + CACHED_CONN_IDLE;
+    cm_remove_fd(selstate, conn);
+    conn->fd = INVALID_SOCKET;
+}
 
-            if (state->fd == INVALID_SOCKET)
-                continue;
-            ssflags = cm_get_ssflags(seltemp, state->fd);
-            if (!ssflags)
-                continue;
+void
+k5_free_kdc_conns(krb5_context context)
+{
+    struct k5_kdc_conns *cache = context->os_context.kdc_conns;
 
-            if (state->service(context, state, selstate, ssflags)) {
-                int stop = 1;
+    if (cache == NULL)
+        return;
+    while (cache->nconns > 0)
+        drop_cached_conn(cache, 0);
+    free(cache);
+    context->os_context.kdc_conns = NULL;
+}
 
-                if (msg_handler != NULL) {
-                    krb5_data reply;
+/* Phases of the k5_sendto contact schedule; see sendto_advance(). */
+enum sendto_phase {
+    PHASE_FIRST,                /* First pass, preferred socktype */
+    PHASE_SECOND,               /* First pass, non-preferred socktype */
+    PHASE_PASS,                 /* Later passes over all connections */
+    PHASE_DONE
+};
+
+/* The state of one exchange, as driven by k5_sendto or by the asynchronous
+ * krb5_sendto_kdc_async functions. */
+struct sendto_state {
+    const krb5_data *message;
+    const struct serverlist *servers;
+    int socktype1, socktype2;
+    struct sendto_callback_info *callback_info;
+    int (*msg_handler)(krb5_context, const krb5_data *, void *);
+    void *msg_handler_data;
+    krb5_boolean reuse_tcp;     /* Use the context's TCP connections */
+
+    struct conn_state *conns;
+    /* All of our fds in use, and temporary space for the fds of interest. */
+    struct select_state *selstate, *seltemp;
+    char *udpbuf;
+
+    /* Our place in the schedule. */
+    enum sendto_phase phase;
+    size_t server;              /* Next server entry to resolve */
+    struct conn_state *next;    /* Next connection to consider */
+    int pass, delay;
 
-                    reply.data = state->x.in.buf;
-                    reply.length = state->x.in.pos - state->x.in.buf;
+    struct conn_state *winner;
+};
 
-                    stop = (msg_handler(context, &reply, msg_handler_data) != 0);
-                }
+static krb5_error_code
+sendto_init(krb5_context context, const krb5_data *message,
+            const struct serverlist *servers, int socktype1, int socktype2,
+            struct sendto_callback_info *callback_info,
+            int (*msg_handler)(krb5_context, const krb5_data *, void *),
+            void *msg_handler_data, struct sendto_state **st_out)
+{
+    struct sendto_state *st;
 
-                if (stop) {
-                    dprint("fd service routine says we're done\n");
-                    *winner_out = state;
-                    return 1;
-                }
-            }
-        }
+    *st_out = NULL;
+    st = calloc(1, sizeof(*st));
+    if (st == NULL)
+        return ENOMEM;
+    /* Since fd_set can be large, don't put the selstates in st itself. */
+    st->selstate = malloc(2 * sizeof(*st->selstate));
+    if (st->selstate == NULL) {
+        free(st);
+        return ENOMEM;
     }
-    if (e != 0)
-        return 1;
+    st->seltemp = &st->selstate[1];
+    cm_init_selstate(st->selstate);
+    st->message = message;
+    st->servers = servers;
+    st->socktype1 = socktype1;
+    st->socktype2 = socktype2;
+    st->callback_info = callback_info;
+    st->msg_handler = msg_handler;
+    st->msg_handler_data = msg_handler_data;
+    /* kpasswd exchanges use a different protocol; don't mix them in. */
+    st->reuse_tcp = (callback_info == NULL && tcp_reuse_enabled(context));
+    st->phase = PHASE_FIRST;
+    st->pass = 1;
+    st->delay = 4;
+    *st_out = st;
     return 0;
 }
 
+static void
+sendto_free(struct sendto_state *st)
+{
+    struct conn_state *state, *next;
+
+    if (st == NULL)
+        return;
+    for (state = st->conns; state != NULL; state = next) {
+        next = state->next;
+        if (state->fd != INVALID_SOCKET)
+            closesocket(state->fd);
+        if (state->state == READING && !state->is_udp)
+            free(state->x.in.buf);
+        if (st->callback_info) {
+            st->callback_info->pfn_cleanup(st->callback_info->context,
+                                           &state->callback_buffer);
+        }
+        free(state);
+    }
+    free(st->udpbuf);
+    free(st->selstate);
+    free(st);
+}
+
 /*
  * Current worst-case timeout behavior:
  *
@@ -1229,126 +1442,485 @@ service_fds(krb5_context context, struct select_state *selstate, int interval,
  * one server, it counts as two.
  */
 
-krb5_error_code
-k5_sendto(krb5_context context, const krb5_data *message,
-          const struct serverlist *servers, int socktype1, int socktype2,
-          struct sendto_callback_info* callback_info, krb5_data *reply,
-          struct sockaddr *remoteaddr, socklen_t *remoteaddrlen,
-          int *server_used,
-          /* return 0 -> keep going, 1 -> quit */
-          int (*msg_handler)(krb5_context, const krb5_data *, void *),
-          void *msg_handler_data)
+/*
+ * Advance st through the schedule above until something is sent, and set
+ * *interval to the number of seconds to wait for replies before advancing
+ * again.  Set *interval to -1 if the schedule is finished.
+ */
+static krb5_error_code
+sendto_advance(krb5_context context, struct sendto_state *st, int *interval)
 {
-    int pass, delay;
     krb5_error_code retval;
-    struct conn_state *conns = NULL, *state, **tailptr, *next, *winner;
-    size_t s;
-    struct select_state *sel_state = NULL, *seltemp;
-    char *udpbuf = NULL;
-    krb5_boolean done = FALSE;
-
-    reply->data = 0;
-    reply->length = 0;
+    struct conn_state *conn, *last;
+
+    *interval = -1;
+    for (;;) {
+        switch (st->phase) {
+        case PHASE_FIRST:
+            /* Resolve server hosts, communicate with resulting addresses of
+             * the preferred socktype, and wait 1s for an answer from each. */
+            if (st->next == NULL) {
+                if (st->server >= st->servers->nservers) {
+                    st->phase = PHASE_SECOND;
+                    st->next = st->conns;
+                    continue;
+                }
+                for (last = st->conns; last != NULL && last->next != NULL;
+                     last = last->next);
+                retval = resolve_server(context, st->servers, st->server++,
+                                        st->socktype1, st->socktype2,
+                                        st->message, &st->udpbuf, &st->conns);
+                if (retval)
+                    return retval;
+                st->next = (last == NULL) ? st->conns : last->next;
+                continue;
+            }
+            conn = st->next;
+            st->next = conn->next;
+            if (conn->socktype != st->socktype1)
+                continue;
+            break;
 
-    /* One for use here, listing all our fds in use, and one for
-     * temporary use in service_fds, for the fds of interest.  */
-    sel_state = malloc(2 * sizeof(*sel_state));
-    if (sel_state == NULL) {
-        retval = ENOMEM;
-        goto cleanup;
-    }
-    seltemp = &sel_state[1];
-    cm_init_selstate(sel_state);
-
-    /* First pass: resolve server hosts, communicate with resulting addresses
-     * of the preferred socktype, and wait 1s for an answer from each. */
-    for (s = 0; s < servers->nservers && !done; s++) {
-        /* Find the current tail pointer. */
-        for (tailptr = &conns; *tailptr != NULL; tailptr = &(*tailptr)->next);
-        retval = resolve_server(context, servers, s, socktype1, socktype2,
-                                message, &udpbuf, &conns);
-        if (retval)
-            goto cleanup;
-        for (state = *tailptr; state != NULL && !done; state = state->next) {
-            /* Contact each new connection whose socktype matches socktype1. */
-            if (state->socktype != socktype1)
+        case PHASE_SECOND:
+            /* Complete the first pass by contacting servers of the
+             * non-preferred socktype (if given), waiting 1s for an answer
+             * from each.  Then wait for two seconds. */
+            if (st->next == NULL) {
+                st->phase = PHASE_PASS;
+                st->next = st->conns;
+                *interval = 2;
+                return 0;
+            }
+            conn = st->next;
+            st->next = conn->next;
+            if (conn->socktype != st->socktype2)
                 continue;
-            if (maybe_send(context, state, sel_state, callback_info))
+            break;
+
+        case PHASE_PASS:
+            /* Make remaining passes over all of the connections, waiting for
+             * the delay backoff at the end of each pass. */
+            if (st->pass >= MAX_PASS || st->selstate->nfds == 0) {
+                st->phase = PHASE_DONE;
                 continue;
-            done = service_fds(context, sel_state, 1, conns, seltemp,
-                               msg_handler, msg_handler_data, &winner);
+            }
+            if (st->next == NULL) {
+                *interval = st->delay;
+                st->delay *= 2;
+                st->pass++;
+                st->next = st->conns;
+                return 0;
+            }
+            conn = st->next;
+            st->next = conn->next;
+            break;
+
+        default:
+            return 0;
+        }
+
+        if (st->reuse_tcp && reuse_connection(context, conn, st->selstate)) {
+            *interval = 1;
+            return 0;
+        }
+        if (maybe_send(context, conn, st->selstate, st->callback_info) == 0) {
+            *interval = 1;
+            return 0;
         }
     }
+}
 
-    /* Complete the first pass by contacting servers of the non-preferred
-     * socktype (if given), waiting 1s for an answer from each. */
-    for (state = conns; state != NULL && !done; state = state->next) {
-        if (state->socktype != socktype2)
-            continue;
-        if (maybe_send(context, state, sel_state, callback_info))
+/*
+ * Record how the servers of a finished exchange performed, for
+ * k5_sort_kdcs().  The winner answered; a server we contacted before the
+ * winner, or any server we contacted if there is no winner, didn't.
+ */
+static void
+note_responsiveness(krb5_context context, struct sendto_state *st)
+{
+    struct conn_state *conn, *winner = st->winner;
+    struct timeval now;
+    long msec;
+
+    if (k5_getcurtime(&now) != 0)
+        return;
+    for (conn = st->conns; conn != NULL; conn = conn->next) {
+        if (conn->start_time.tv_sec == 0)
             continue;
-        done = service_fds(context, sel_state, 1, state, seltemp, msg_handler,
-                           msg_handler_data, &winner);
+        if (conn == winner) {
+            msec = (now.tv_sec - conn->start_time.tv_sec) * 1000 +
+                (now.tv_usec - conn->start_time.tv_usec) / 1000;
+            k5_note_kdc_reply(context,
+                              &st->servers->servers[conn->server_index],
+                              msec);
+        } else if (winner == NULL ||
+                   (conn->server_index != winner->server_index &&
+                    (conn->start_time.tv_sec < winner->start_time.tv_sec ||
+                     (conn->start_time.tv_sec == winner->start_time.tv_sec &&
+                      conn->start_time.tv_usec <
+                      winner->start_time.tv_usec)))) {
+            TRACE_SENDTO_KDC_NO_ANSWER(context, conn);
+            k5_note_kdc_failure(context,
+                                &st->servers->servers[conn->server_index]);
+        }
     }
+}
 
-    /* Wait for two seconds at the end of the first pass. */
-    if (!done) {
-        done = service_fds(context, sel_state, 2, conns, seltemp, msg_handler,
-                           msg_handler_data, &winner);
-    }
+/*
+ * Advance st until we are waiting on at least one socket, and set the end
+ * time of the wait.  Return KRB5_KDC_UNREACH if the schedule is finished.
+ */
+static krb5_error_code
+sendto_schedule(krb5_context context, struct sendto_state *st)
+{
+    krb5_error_code retval;
+    struct timeval now;
+    int interval;
 
-    /* Make remaining passes over all of the connections. */
-    delay = 4;
-    for (pass = 1; pass < MAX_PASS && !done; pass++) {
-        for (state = conns; state != NULL && !done; state = state->next) {
-            if (maybe_send(context, state, sel_state, callback_info))
-                continue;
-            done = service_fds(context, sel_state, 1, conns, seltemp,
-                               msg_handler, msg_handler_data, &winner);
-            if (sel_state->nfds == 0)
-                break;
+    do {
+        retval = sendto_advance(context, st, &interval);
+        if (retval)
+            return retval;
+        if (interval < 0) {
+            note_responsiveness(context, st);
+            return KRB5_KDC_UNREACH;
         }
-        /* Wait for the delay backoff at the end of this pass. */
-        if (!done) {
-            done = service_fds(context, sel_state, delay, conns, seltemp,
-                               msg_handler, msg_handler_data, &winner);
+    } while (st->selstate->nfds == 0);
+
+    retval = k5_getcurtime(&now);
+    if (retval)
+        return retval;
+    st->selstate->end_time = now;
+    st->selstate->end_time.tv_sec += interval;
+    return 0;
+}
+
+/* Service conn, which is ready according to ssflags.  Return true if it
+ * yielded a reply which finishes the exchange. */
+static krb5_boolean
+service_conn(krb5_context context, struct sendto_state *st,
+             struct conn_state *conn, unsigned int ssflags)
+{
+    krb5_data reply;
+
+    if (!conn->service(context, conn, st->selstate, ssflags)) {
+        if (conn->reused && conn->state == FAILED) {
+            /* The KDC probably closed the connection while it was idle.
+             * Start over with a new one. */
+            TRACE_SENDTO_KDC_TCP_RETRY(context, conn);
+            conn->reused = 0;
+            conn->state = INITIALIZING;
+            conn->err = 0;
+            conn->x.out.sgp = conn->x.out.sgbuf;
+            set_conn_state_msg_length(conn, st->message);
+            (void)start_connection(context, conn, st->selstate,
+                                   st->callback_info);
         }
-        if (sel_state->nfds == 0)
-            break;
-        delay *= 2;
+        return FALSE;
+    }
+    if (st->msg_handler != NULL) {
+        reply.data = conn->x.in.buf;
+        reply.length = conn->x.in.pos - conn->x.in.buf;
+        if (st->msg_handler(context, &reply, st->msg_handler_data) == 0)
+            return FALSE;
     }
+    dprint("fd service routine says we're done\n");
+    st->winner = conn;
+    note_responsiveness(context, st);
+    return TRUE;
+}
 
-    if (sel_state->nfds == 0 || !done || winner == NULL) {
-        retval = KRB5_KDC_UNREACH;
-        goto cleanup;
+/* Wait for replies until the end time of st's selstate.  Return true if the
+ * exchange is finished, either because of a reply or an error. */
+static krb5_boolean
+service_fds(krb5_context context, struct sendto_state *st)
+{
+    int e = 0, selret = 0;
+    struct conn_state *state;
+
+    while (st->selstate->nfds > 0) {
+        e = cm_select_or_poll(st->selstate, st->seltemp, &selret);
+        if (e == EINTR)
+            continue;
+        if (e != 0)
+            break;
+
+        dprint("service_fds examining results, selret=%d\n", selret);
+
+        if (selret == 0)
+            /* Timeout, return to caller.  */
+            return 0;
+
+        /* Got something on a socket, process it.  */
+        for (state = st->conns; state != NULL; state = state->next) {
+            unsigned int ssflags;
+
+            if (state->fd == INVALID_SOCKET)
+                continue;
+            ssflags = cm_get_ssflags(st->seltemp, state);
+            if (ssflags && service_conn(context, st, state, ssflags))
+                return 1;
+        }
     }
-    /* Success!  */
-    TRACE_SENDTO_KDC_RESPONSE(context, winner);
+    if (e != 0)
+        return 1;
+    return 0;
+}
+
+/* Move the reply from st's winning connection into *reply. */
+static void
+sendto_result(krb5_context context, struct sendto_state *st, krb5_data *reply,
+              int *server_used, struct sockaddr *remoteaddr,
+              socklen_t *remoteaddrlen)
+{
+    struct conn_state *winner = st->winner;
+
     reply->data = winner->x.in.buf;
     reply->length = winner->x.in.pos - winner->x.in.buf;
-    retval = 0;
+    if (reply->data == st->udpbuf)
+        st->udpbuf = NULL;
     winner->x.in.buf = NULL;
     if (server_used != NULL)
         *server_used = winner->server_index;
     if (remoteaddr != NULL && remoteaddrlen != 0 && *remoteaddrlen > 0)
         (void)getpeername(winner->fd, remoteaddr, remoteaddrlen);
+    if (st->reuse_tcp && !winner->is_udp)
+        cache_connection(context, winner, st->selstate);
+}
+
+krb5_error_code
+k5_sendto(krb5_context context, const krb5_data *message,
+          const struct serverlist *servers, int socktype1, int socktype2,
+          struct sendto_callback_info* callback_info, krb5_data *reply,
+          struct sockaddr *remoteaddr, socklen_t *remoteaddrlen,
+          int *server_used,
+          /* return 0 -> keep going, 1 -> quit */
+          int (*msg_handler)(krb5_context, const krb5_data *, void *),
+          void *msg_handler_data)
+{
+    krb5_error_code retval;
+    struct sendto_state *st;
+
+    reply->data = 0;
+    reply->length = 0;
+
+    retval = sendto_init(context, message, servers, socktype1, socktype2,
+                         callback_info, msg_handler, msg_handler_data, &st);
+    if (retval)
+        return retval;
+
+    do {
+        retval = sendto_schedule(context, st);
+        if (retval)
+            goto cleanup;
+    } while (!service_fds(context, st));
+
+    if (st->winner == NULL) {
+        retval = KRB5_KDC_UNREACH;
+        goto cleanup;
+    }
+    /* Success!  */
+    TRACE_SENDTO_KDC_RESPONSE(context, st->winner);
+    sendto_result(context, st, reply, server_used, remoteaddr,
+                  remoteaddrlen);
 
 cleanup:
-    for (state = conns; state != NULL; state = next) {
-        next = state->next;
-        if (state->fd != INVALID_SOCKET)
-            closesocket(state->fd);
-        if (state->state == READING && state->x.in.buf != udpbuf)
-            free(state->x.in.buf);
-        if (callback_info) {
-            callback_info->pfn_cleanup(callback_info->context,
-                                       &state->callback_buffer);
+    sendto_free(st);
+    return retval;
+}
+
+/*
+ * Asynchronous KDC exchanges.  Rather than waiting in service_fds, the caller
+ * waits for the sockets and timeout reported by krb5_sendto_kdc_async_fds in
+ * its own event loop, and reports each event to krb5_sendto_kdc_async_step.
+ * Locating and resolving the KDCs still blocks, as in krb5_sendto_kdc.
+ */
+
+struct _krb5_sendto_kdc_async_context {
+    struct sendto_state *st;
+    krb5_data message;          /* Our copy, referenced by the connections */
+    krb5_data realm;
+    struct serverlist servers;
+    int use_master;
+    krb5_error_code err;        /* Set by check_for_svc_unavailable */
+    krb5_sendto_fd *fds;
+    size_t fds_space;
+};
+
+krb5_error_code KRB5_CALLCONV
+krb5_sendto_kdc_async_begin(krb5_context context, const krb5_data *message,
+                            const krb5_data *realm, int use_master,
+                            int tcp_only, krb5_sendto_kdc_async_context *ctx)
+{
+    krb5_error_code retval;
+    krb5_sendto_kdc_async_context as;
+    int socktype1, socktype2;
+
+    *ctx = NULL;
+    TRACE_SENDTO_KDC(context, message->length, realm, use_master, tcp_only);
+
+    retval = get_socktypes(context, message, tcp_only, &socktype1, &socktype2);
+    if (retval)
+        return retval;
+
+    as = calloc(1, sizeof(*as));
+    if (as == NULL)
+        return ENOMEM;
+    as->use_master = use_master;
+    retval = krb5int_copy_data_contents(context, message, &as->message);
+    if (retval)
+        goto cleanup;
+    retval = krb5int_copy_data_contents(context, realm, &as->realm);
+    if (retval)
+        goto cleanup;
+    retval = k5_locate_kdc(context, realm, &as->servers, use_master,
+                           tcp_only ? SOCK_STREAM : 0);
+    if (retval)
+        goto cleanup;
+    k5_sort_kdcs(context, &as->servers);
+    retval = sendto_init(context, &as->message, &as->servers, socktype1,
+                         socktype2, NULL, check_for_svc_unavailable, &as->err,
+                         &as->st);
+    if (retval)
+        goto cleanup;
+
+    retval = sendto_schedule(context, as->st);
+    if (retval == KRB5_KDC_UNREACH)
+        retval = unreachable_error(context, realm, as->err);
+    if (retval)
+        goto cleanup;
+
+    *ctx = as;
+    as = NULL;
+
+cleanup:
+    krb5_sendto_kdc_async_free(context, as);
+    return retval;
+}
+
+krb5_error_code KRB5_CALLCONV
+krb5_sendto_kdc_async_fds(krb5_context context,
+                          krb5_sendto_kdc_async_context as,
+                          const krb5_sendto_fd **fds_out, size_t *nfds_out,
+                          int *timeout_ms_out)
+{
+    krb5_error_code retval;
+    struct conn_state *conn;
+    struct timeval now, *end;
+    krb5_sendto_fd *fds;
+    size_t n = 0;
+    long ms;
+
+    retval = k5_getcurtime(&now);
+    if (retval)
+        return retval;
+
+    for (conn = as->st->conns; conn != NULL; conn = conn->next) {
+        if (conn->fd != INVALID_SOCKET)
+            n++;
+    }
+    if (n > as->fds_space) {
+        fds = realloc(as->fds, n * sizeof(*fds));
+        if (fds == NULL)
+            return ENOMEM;
+        as->fds = fds;
+        as->fds_space = n;
+    }
+
+    n = 0;
+    for (conn = as->st->conns; conn != NULL; conn = conn->next) {
+        if (conn->fd == INVALID_SOCKET)
+            continue;
+        as->fds[n].fd = conn->fd;
+        as->fds[n].flags = KRB5_SENDTO_READ;
+        if (conn->state == CONNECTING || conn->state == WRITING)
+            as->fds[n].flags |= KRB5_SENDTO_WRITE;
+        n++;
+    }
+    *fds_out = as->fds;
+    *nfds_out = n;
+
+    /* Round up, so that the timeout isn't ignored as early. */
+    end = &as->st->selstate->end_time;
+    ms = (end->tv_sec - now.tv_sec) * 1000 +
+        (end->tv_usec - now.tv_usec + 999) / 1000;
+    *timeout_ms_out = (ms > 0) ? ms : 0;
+    return 0;
+}
+
+krb5_error_code KRB5_CALLCONV
+krb5_sendto_kdc_async_step(krb5_context context,
+                           krb5_sendto_kdc_async_context as, int fd,
+                           unsigned int flags, krb5_data *reply,
+                           int *use_master_out, krb5_boolean *done_out)
+{
+    krb5_error_code retval;
+    struct sendto_state *st = as->st;
+    struct conn_state *conn;
+    struct timeval now;
+    unsigned int ssflags = 0;
+    int server_used;
+
+    *done_out = FALSE;
+    reply->data = NULL;
+    reply->length = 0;
+
+    if (fd == -1) {
+        /* Ignore early timeouts. */
+        retval = k5_getcurtime(&now);
+        if (retval)
+            return retval;
+        if (now.tv_sec < st->selstate->end_time.tv_sec ||
+            (now.tv_sec == st->selstate->end_time.tv_sec &&
+             now.tv_usec < st->selstate->end_time.tv_usec))
+            return 0;
+    } else {
+        for (conn = st->conns; conn != NULL; conn = conn->next) {
+            if (conn->fd == fd)
+                break;
         }
-        free(state);
+        /* Ignore stale events for connections we have closed. */
+        if (conn == NULL)
+            return 0;
+        if (flags & KRB5_SENDTO_READ)
+            ssflags |= SSF_READ;
+        if ((flags & KRB5_SENDTO_WRITE) &&
+            (conn->state == CONNECTING || conn->state == WRITING))
+            ssflags |= SSF_WRITE;
+        if (ssflags == 0)
+            return 0;
+        if (service_conn(context, st, conn, ssflags)) {
+            TRACE_SENDTO_KDC_RESPONSE(context, st->winner);
+            sendto_result(context, st, reply, &server_used, NULL, NULL);
+            *use_master_out = as->use_master;
+            if (*use_master_out == 0) {
+                check_master(context, &as->realm, &as->servers, server_used,
+                             use_master_out);
+            }
+            *done_out = TRUE;
+            return 0;
+        }
+        /* Keep waiting unless that was the last socket. */
+        if (st->selstate->nfds > 0)
+            return 0;
     }
 
-    if (reply->data != udpbuf)
-        free(udpbuf);
-    free(sel_state);
+    retval = sendto_schedule(context, st);
+    if (retval == KRB5_KDC_UNREACH)
+        retval = unreachable_error(context, &as->realm, as->err);
     return retval;
 }
+
+void KRB5_CALLCONV
+krb5_sendto_kdc_async_free(krb5_context context,
+                           krb5_sendto_kdc_async_context as)
+{
+    if (as == NULL)
+        return;
+    sendto_free(as->st);
+    k5_free_serverlist(&as->servers);
+    krb5_free_data_contents(context, &as->message);
+    krb5_free_data_contents(context, &as->realm);
+    free(as->fds);
+    free(as);
+}
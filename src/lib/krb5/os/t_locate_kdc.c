@@ -7,6 +7,7 @@
 
 #define TEST
 #include "fake-addrinfo.h"
+#include "dnscache.c"
 #include "dnsglue.c"
 #include "dnssrv.c"
 #include "locate_kdc.c"
@@ -125,7 +126,7 @@ main (int argc, char *argv[])
         break;
 
     case LOOKUP_DNS:
-        err = locate_srv_dns_1(&realm, "_kerberos", "_udp", &sl);
+        err = locate_srv_dns_1(ctx, &realm, "_kerberos", "_udp", &sl);
         break;
 
     case LOOKUP_WHATEVER:
@@ -86,6 +86,19 @@ typedef struct _krb5_rc_ops krb5_rc_ops;
 krb5_error_code krb5_rc_register_type(krb5_context, const krb5_rc_ops *);
 
 extern const krb5_rc_ops krb5_rc_dfl_ops;
+extern const krb5_rc_ops krb5_rc_hash_ops;
 extern const krb5_rc_ops krb5_rc_none_ops;
 
+#if defined(ENABLE_THREADS) && defined(HAVE_PTHREAD) && \
+    defined(_POSIX_THREAD_PROCESS_SHARED) && !defined(_WIN32)
+#define K5_RC_SHM
+extern const krb5_rc_ops krb5_rc_shm_ops;
+#endif
+
+/* Length of the key used by k5_rc_tag_rep(). */
+#define K5_RC_TAG_KEYLEN 48
+
+void k5_rc_tag_rep(const unsigned char *key, const krb5_donot_replay *rep,
+                   UINT64_TYPE tag[3]);
+
 #endif /* __KRB5_RCACHE_INT_H__ */
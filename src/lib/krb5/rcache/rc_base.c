@@ -19,7 +19,13 @@ struct krb5_rc_typelist {
     struct krb5_rc_typelist *next;
 };
 static struct krb5_rc_typelist none = { &krb5_rc_none_ops, 0 };
-static struct krb5_rc_typelist krb5_rc_typelist_dfl = { &krb5_rc_dfl_ops, &none };
+#ifdef K5_RC_SHM
+static struct krb5_rc_typelist shm = { &krb5_rc_shm_ops, &none };
+static struct krb5_rc_typelist hash = { &krb5_rc_hash_ops, &shm };
+#else
+static struct krb5_rc_typelist hash = { &krb5_rc_hash_ops, &none };
+#endif
+static struct krb5_rc_typelist krb5_rc_typelist_dfl = { &krb5_rc_dfl_ops, &hash };
 static struct krb5_rc_typelist *typehead = &krb5_rc_typelist_dfl;
 static k5_mutex_t rc_typelist_lock = K5_MUTEX_PARTIAL_INITIALIZER;
 
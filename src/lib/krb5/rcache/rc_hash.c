@@ -0,0 +1,892 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* lib/krb5/rcache/rc_hash.c - Hashed replay cache type */
+/*
+ * Copyright (C) 2012 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Export of this software from the United States of America may
+ *   require a specific license from the United States Government.
+ *   It is the responsibility of any person or organization contemplating
+ *   export to obtain such a license before exporting.
+ *
+ * WITHIN THAT CONSTRAINT, permission to use, copy, modify, and
+ * distribute this software and its documentation for any purpose and
+ * without fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright notice and
+ * this permission notice appear in supporting documentation, and that
+ * the name of M.I.T. not be used in advertising or publicity pertaining
+ * to distribution of the software without specific, written prior
+ * permission.  Furthermore if you modify this software you must label
+ * your software as modified software and not distribute it in such a
+ * fashion that it might be confused with the original M.I.T. software.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is" without express
+ * or implied warranty.
+ */
+
+/*
+ * The "hash" replay cache type is meant for services which accept many
+ * authenticators a second.  Unlike the dfl type, it does not keep the client
+ * and server names of each authenticator.  Each record is reduced to a
+ * 128-bit tag (a keyed hash of the client, server and timestamp) and a 64-bit
+ * tag of the message hash, so records have a fixed size and comparisons are
+ * cheap.  The hash key is chosen at random when the cache file is created and
+ * is stored in the file, which only its owner can read.
+ *
+ * In memory, records are kept in a hash table which doubles in size as it
+ * fills, and in a ring of time slots by authenticator timestamp, so that
+ * expired records are discarded a slot at a time as the clock advances rather
+ * than by rewriting the whole cache.
+ *
+ * On disk, the file (after the usual replay cache version number) contains a
+ * header and then fixed-size records, which are only ever appended.  The file
+ * is rewritten with just the live records when it has grown to several times
+ * their number.  The hash_rcache_sync libdefaults relation controls
+ * durability: "always" (the default) writes and syncs each record as it is
+ * stored, as the dfl type does; "batch" collects records and writes and syncs
+ * them together; "never" also collects records but does not sync them.  There
+ * is no timer: collected records are written when HRC_BATCH of them have been
+ * collected, when a store comes in a later second than the last write, and
+ * when the cache is expunged or closed.  A process which stops storing
+ * without closing or expunging the cache can therefore hold up to HRC_BATCH -
+ * 1 records in memory indefinitely.  With "batch" or "never", records which
+ * have not been written (or synced) when a process or host crashes are lost,
+ * allowing those authenticators to be replayed.
+ *
+ * As with the dfl type, a cache is read from its file only when it is opened;
+ * processes sharing a cache file do not see each other's later records.
+ */
+
+#include "k5-int.h"
+#include "rc-int.h"
+#include "rc_io.h"
+
+#define HRC_MAGIC "hrc1"
+#define HRC_KEYLEN (K5_RC_TAG_KEYLEN / 3)
+#define HRC_HEADERLEN (4 + 4 + K5_RC_TAG_KEYLEN)
+#define HRC_RECLEN 32
+
+/* Initial number of hash table buckets (a power of two). */
+#define HRC_INITIAL_BUCKETS 256
+
+/* Number of time slots spanned by one lifespan. */
+#define HRC_SLOTS_PER_SPAN 16
+
+/* Number of records collected before writing in batch and never modes. */
+#define HRC_BATCH 64
+
+/* Rewrite the file when it holds this many more records than are live, and
+ * more than twice as many. */
+#define HRC_EXCESS 1024
+
+enum hrc_sync { HRC_SYNC_ALWAYS, HRC_SYNC_BATCH, HRC_SYNC_NEVER };
+
+struct hrc_entry {
+    struct hrc_entry *next;     /* next entry in the hash bucket */
+    struct hrc_entry *tnext;    /* next entry in the time slot */
+    UINT64_TYPE tag[2];         /* keyed hash of client, server, time */
+    UINT64_TYPE msgtag;         /* keyed hash of the message hash */
+    krb5_timestamp ctime;
+    krb5_boolean has_msghash;
+};
+
+struct hrc_data {
+    char *name;
+    krb5_deltat lifespan;
+    unsigned char key[K5_RC_TAG_KEYLEN];
+    enum hrc_sync sync;
+
+    struct hrc_entry **table;
+    unsigned int nbuckets;
+    unsigned int count;         /* live entries in memory */
+
+    struct hrc_entry **slots;   /* ring of time slots */
+    unsigned int nslots;
+    krb5_deltat slotwidth;      /* seconds of timestamps per slot */
+    long expired_through;       /* last time slot number discarded */
+
+    krb5_rc_iostuff d;
+    unsigned int file_records;  /* records in the file, live or not */
+    unsigned char wbuf[HRC_BATCH * HRC_RECLEN];
+    unsigned int wcount;        /* records waiting in wbuf */
+    krb5_timestamp last_flush;
+};
+
+/*
+ * SipHash-2-4, computed incrementally so that variable-length client and
+ * server names need not be copied into one buffer.
+ */
+
+struct siphash {
+    UINT64_TYPE v0, v1, v2, v3;
+    unsigned char buf[8];
+    size_t buflen;
+    size_t total;
+};
+
+#define ROTL64(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define K64(hi, lo) (((UINT64_TYPE)(hi) << 32) | (UINT64_TYPE)(lo))
+
+#define SIPROUND(s)                                                     \
+    do {                                                                \
+        (s)->v0 += (s)->v1; (s)->v1 = ROTL64((s)->v1, 13);              \
+        (s)->v1 ^= (s)->v0; (s)->v0 = ROTL64((s)->v0, 32);              \
+        (s)->v2 += (s)->v3; (s)->v3 = ROTL64((s)->v3, 16);              \
+        (s)->v3 ^= (s)->v2;                                             \
+        (s)->v0 += (s)->v3; (s)->v3 = ROTL64((s)->v3, 21);              \
+        (s)->v3 ^= (s)->v0;                                             \
+        (s)->v2 += (s)->v1; (s)->v1 = ROTL64((s)->v1, 17);              \
+        (s)->v1 ^= (s)->v2; (s)->v2 = ROTL64((s)->v2, 32);              \
+    } while (0)
+
+static void
+sip_init(struct siphash *s, const unsigned char *key)
+{
+    UINT64_TYPE k0 = load_64_le(key), k1 = load_64_le(key + 8);
+
+    s->v0 = k0 ^ K64(0x736f6d65, 0x70736575);
+    s->v1 = k1 ^ K64(0x646f7261, 0x6e646f6d);
+    s->v2 = k0 ^ K64(0x6c796765, 0x6e657261);
+    s->v3 = k1 ^ K64(0x74656462, 0x79746573);
+    s->buflen = s->total = 0;
+}
+
+static void
+sip_block(struct siphash *s, UINT64_TYPE m)
+{
+    s->v3 ^= m;
+    SIPROUND(s);
+    SIPROUND(s);
+    s->v0 ^= m;
+}
+
+static void
+sip_update(struct siphash *s, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    s->total += len;
+    while (len > 0) {
+        s->buf[s->buflen++] = *p++;
+        len--;
+        if (s->buflen == 8) {
+            sip_block(s, load_64_le(s->buf));
+            s->buflen = 0;
+        }
+        while (s->buflen == 0 && len >= 8) {
+            sip_block(s, load_64_le(p));
+            p += 8;
+            len -= 8;
+        }
+    }
+}
+
+static UINT64_TYPE
+sip_final(struct siphash *s)
+{
+    UINT64_TYPE b = (UINT64_TYPE)(s->total & 0xff) << 56;
+    size_t i;
+
+    for (i = 0; i < s->buflen; i++)
+        b |= (UINT64_TYPE)s->buf[i] << (8 * i);
+    sip_block(s, b);
+    s->v2 ^= 0xff;
+    SIPROUND(s);
+    SIPROUND(s);
+    SIPROUND(s);
+    SIPROUND(s);
+    return s->v0 ^ s->v1 ^ s->v2 ^ s->v3;
+}
+
+/* Hash the fields of rep which identify an authenticator using key. */
+static UINT64_TYPE
+rep_hash(const krb5_donot_replay *rep, const unsigned char *key)
+{
+    struct siphash s;
+    unsigned char nums[8];
+
+    sip_init(&s, key);
+    sip_update(&s, rep->client, strlen(rep->client) + 1);
+    sip_update(&s, rep->server, strlen(rep->server) + 1);
+    store_32_be(rep->cusec, nums);
+    store_32_be(rep->ctime, nums + 4);
+    sip_update(&s, nums, 8);
+    return sip_final(&s);
+}
+
+/*
+ * Compute the tags identifying rep under key, which is K5_RC_TAG_KEYLEN bytes
+ * long.  tag[0] and tag[1] cover the client, server and timestamp; tag[2]
+ * covers the message hash, or is zero if rep has none.
+ */
+void
+k5_rc_tag_rep(const unsigned char *key, const krb5_donot_replay *rep,
+              UINT64_TYPE tag[3])
+{
+    struct siphash s;
+
+    tag[0] = rep_hash(rep, key);
+    tag[1] = rep_hash(rep, key + HRC_KEYLEN);
+    tag[2] = 0;
+    if (rep->msghash != NULL) {
+        sip_init(&s, key + 2 * HRC_KEYLEN);
+        sip_update(&s, rep->msghash, strlen(rep->msghash));
+        tag[2] = sip_final(&s);
+    }
+}
+
+/* Fill in the tags of ent from rep. */
+static void
+make_entry(struct hrc_data *t, const krb5_donot_replay *rep,
+           struct hrc_entry *ent)
+{
+    UINT64_TYPE tag[3];
+
+    k5_rc_tag_rep(t->key, rep, tag);
+    ent->tag[0] = tag[0];
+    ent->tag[1] = tag[1];
+    ent->msgtag = tag[2];
+    ent->ctime = rep->ctime;
+    ent->has_msghash = (rep->msghash != NULL);
+}
+
+static void
+encode_entry(const struct hrc_entry *ent, unsigned char *p)
+{
+    store_64_be(ent->tag[0], p);
+    store_64_be(ent->tag[1], p + 8);
+    store_64_be(ent->msgtag, p + 16);
+    store_32_be(ent->ctime, p + 24);
+    store_32_be(ent->has_msghash ? 1 : 0, p + 28);
+}
+
+static void
+decode_entry(const unsigned char *p, struct hrc_entry *ent)
+{
+    ent->tag[0] = load_64_be(p);
+    ent->tag[1] = load_64_be(p + 8);
+    ent->msgtag = load_64_be(p + 16);
+    ent->ctime = load_32_be(p + 24);
+    ent->has_msghash = (load_32_be(p + 28) & 1) != 0;
+}
+
+/*
+ * Return true if new and old describe the same authenticator.  As with the
+ * dfl type, message hashes are only compared if both records have one.
+ */
+static krb5_boolean
+entry_match(const struct hrc_entry *old, const struct hrc_entry *new)
+{
+    if (old->tag[0] != new->tag[0] || old->tag[1] != new->tag[1])
+        return FALSE;
+    return !old->has_msghash || !new->has_msghash ||
+        old->msgtag == new->msgtag;
+}
+
+static krb5_boolean
+entry_expired(struct hrc_data *t, const struct hrc_entry *ent,
+              krb5_timestamp now)
+{
+    return ent->ctime + t->lifespan < now;
+}
+
+/* Return the number of the time slot containing timestamp ts. */
+static long
+slot_number(struct hrc_data *t, krb5_timestamp ts)
+{
+    return (long)ts / t->slotwidth;
+}
+
+/* Return the ring position of time slot number n. */
+static struct hrc_entry **
+slot_head(struct hrc_data *t, long n)
+{
+    long i = n % (long)t->nslots;
+
+    return &t->slots[(i < 0) ? i + t->nslots : i];
+}
+
+static struct hrc_entry *
+table_find(struct hrc_data *t, const struct hrc_entry *ent)
+{
+    struct hrc_entry *e;
+
+    e = t->table[ent->tag[0] & (t->nbuckets - 1)];
+    for (; e != NULL; e = e->next) {
+        if (entry_match(e, ent))
+            return e;
+    }
+    return NULL;
+}
+
+/* Double the number of hash table buckets. */
+static krb5_error_code
+table_grow(struct hrc_data *t)
+{
+    struct hrc_entry **newtable, *e, *next;
+    unsigned int i, newsize = t->nbuckets * 2, b;
+
+    newtable = calloc(newsize, sizeof(*newtable));
+    if (newtable == NULL)
+        return KRB5_RC_MALLOC;
+    for (i = 0; i < t->nbuckets; i++) {
+        for (e = t->table[i]; e != NULL; e = next) {
+            next = e->next;
+            b = e->tag[0] & (newsize - 1);
+            e->next = newtable[b];
+            newtable[b] = e;
+        }
+    }
+    free(t->table);
+    t->table = newtable;
+    t->nbuckets = newsize;
+    return 0;
+}
+
+/* Add a copy of ent to the table and to its time slot. */
+static krb5_error_code
+table_add(struct hrc_data *t, const struct hrc_entry *ent)
+{
+    struct hrc_entry *e, **bucket, **slot;
+
+    /* Growing is best-effort; chains just get longer if it fails. */
+    if (t->count >= t->nbuckets)
+        (void)table_grow(t);
+
+    e = malloc(sizeof(*e));
+    if (e == NULL)
+        return KRB5_RC_MALLOC;
+    *e = *ent;
+    bucket = &t->table[e->tag[0] & (t->nbuckets - 1)];
+    e->next = *bucket;
+    *bucket = e;
+    slot = slot_head(t, slot_number(t, e->ctime));
+    e->tnext = *slot;
+    *slot = e;
+    t->count++;
+    return 0;
+}
+
+static void
+table_remove(struct hrc_data *t, struct hrc_entry *ent)
+{
+    struct hrc_entry **pp;
+
+    pp = &t->table[ent->tag[0] & (t->nbuckets - 1)];
+    while (*pp != ent)
+        pp = &(*pp)->next;
+    *pp = ent->next;
+    t->count--;
+}
+
+/*
+ * Discard the entries in time slots which have wholly expired since the last
+ * call.  Entries in a slot which belong to a later pass around the ring (only
+ * possible for timestamps far in the future) are kept.
+ */
+static void
+expire_entries(struct hrc_data *t, krb5_timestamp now)
+{
+    struct hrc_entry **pp, *e;
+    long last, n;
+
+    last = slot_number(t, now - t->lifespan) - 1;
+    n = t->expired_through + 1;
+    if (last - n >= (long)t->nslots)
+        n = last - t->nslots + 1;
+    for (; n <= last; n++) {
+        pp = slot_head(t, n);
+        while (*pp != NULL) {
+            e = *pp;
+            if (entry_expired(t, e, now)) {
+                *pp = e->tnext;
+                table_remove(t, e);
+                free(e);
+            } else {
+                pp = &e->tnext;
+            }
+        }
+    }
+    if (last > t->expired_through)
+        t->expired_through = last;
+}
+
+static void
+free_entries(struct hrc_data *t)
+{
+    struct hrc_entry *e, *next;
+    unsigned int i;
+
+    if (t->slots == NULL)
+        return;
+    for (i = 0; i < t->nslots; i++) {
+        for (e = t->slots[i]; e != NULL; e = next) {
+            next = e->tnext;
+            free(e);
+        }
+        t->slots[i] = NULL;
+    }
+    memset(t->table, 0, t->nbuckets * sizeof(*t->table));
+    t->count = 0;
+}
+
+/* Set up the time slots once the lifespan is known. */
+static krb5_error_code
+init_slots(struct hrc_data *t, krb5_timestamp now)
+{
+    t->slotwidth = t->lifespan / HRC_SLOTS_PER_SPAN;
+    if (t->slotwidth < 1)
+        t->slotwidth = 1;
+    /* Cover timestamps from one lifespan in the past to one in the future,
+     * plus a slot at each end for partial coverage. */
+    t->nslots = 2 * t->lifespan / t->slotwidth + 3;
+    t->slots = calloc(t->nslots, sizeof(*t->slots));
+    if (t->slots == NULL)
+        return KRB5_RC_MALLOC;
+    t->expired_through = slot_number(t, now - t->lifespan) - 1;
+    return 0;
+}
+
+static enum hrc_sync
+get_sync_mode(krb5_context context)
+{
+    enum hrc_sync mode = HRC_SYNC_ALWAYS;
+    char *str = NULL;
+
+    if (profile_get_string(context->profile, KRB5_CONF_LIBDEFAULTS,
+                           KRB5_CONF_HASH_RCACHE_SYNC, NULL, NULL,
+                           &str) != 0 || str == NULL)
+        return mode;
+    if (strcasecmp(str, "batch") == 0)
+        mode = HRC_SYNC_BATCH;
+    else if (strcasecmp(str, "never") == 0)
+        mode = HRC_SYNC_NEVER;
+    profile_release_string(str);
+    return mode;
+}
+
+/* Write any collected records to the file, syncing if the mode calls for
+ * it. */
+static krb5_error_code
+flush_records(krb5_context context, struct hrc_data *t, krb5_timestamp now)
+{
+    krb5_error_code ret;
+
+    if (t->wcount == 0)
+        return 0;
+    ret = krb5_rc_io_write(context, &t->d, t->wbuf, t->wcount * HRC_RECLEN);
+    if (ret)
+        return ret;
+    t->wcount = 0;
+    t->last_flush = now;
+    if (t->sync != HRC_SYNC_NEVER && krb5_rc_io_sync(context, &t->d))
+        return KRB5_RC_IO;
+    return 0;
+}
+
+/* Write the cache header after the version number in a newly created file. */
+static krb5_error_code
+write_header(krb5_context context, struct hrc_data *t)
+{
+    unsigned char hdr[HRC_HEADERLEN];
+
+    memcpy(hdr, HRC_MAGIC, 4);
+    store_32_be(t->lifespan, hdr + 4);
+    memcpy(hdr + 8, t->key, sizeof(t->key));
+    return krb5_rc_io_write(context, &t->d, hdr, sizeof(hdr));
+}
+
+/*
+ * Replace the file with one holding only the live records.  Any collected
+ * records are in memory, so they are written along with the rest.
+ */
+static krb5_error_code
+compact_file(krb5_context context, struct hrc_data *t)
+{
+    krb5_error_code ret;
+    krb5_rc_iostuff tmp;
+    struct hrc_entry *e;
+    unsigned char buf[HRC_BATCH * HRC_RECLEN];
+    unsigned int i, n = 0;
+
+    tmp.fd = -1;
+    tmp.fn = NULL;
+    ret = krb5_rc_io_creat(context, &tmp, NULL);
+    if (ret)
+        return ret;
+    {
+        krb5_rc_iostuff save = t->d;
+
+        t->d = tmp;
+        ret = write_header(context, t);
+        t->d = save;
+    }
+    if (ret)
+        goto cleanup;
+
+    for (i = 0; i < t->nslots; i++) {
+        for (e = t->slots[i]; e != NULL; e = e->tnext) {
+            encode_entry(e, buf + n * HRC_RECLEN);
+            if (++n == HRC_BATCH) {
+                ret = krb5_rc_io_write(context, &tmp, buf, n * HRC_RECLEN);
+                if (ret)
+                    goto cleanup;
+                n = 0;
+            }
+        }
+    }
+    ret = krb5_rc_io_write(context, &tmp, buf, n * HRC_RECLEN);
+    if (ret)
+        goto cleanup;
+    ret = KRB5_RC_IO;
+    if (krb5_rc_io_sync(context, &tmp))
+        goto cleanup;
+    if (krb5_rc_io_move(context, &t->d, &tmp))
+        goto cleanup;
+    t->file_records = t->count;
+    t->wcount = 0;
+    ret = 0;
+
+cleanup:
+    if (ret)
+        (void)unlink(tmp.fn);
+    (void)krb5_rc_io_close(context, &tmp);
+    return ret;
+}
+
+static krb5_error_code
+hrc_init_locked(krb5_context context, krb5_rcache id, krb5_deltat lifespan)
+{
+    struct hrc_data *t = id->data;
+    krb5_error_code ret;
+    krb5_timestamp now;
+    krb5_data d;
+
+    ret = krb5_timeofday(context, &now);
+    if (ret)
+        return ret;
+
+    free_entries(t);
+    free(t->slots);
+    t->slots = NULL;
+    (void)krb5_rc_io_close(context, &t->d);
+    t->wcount = t->file_records = 0;
+
+    t->lifespan = lifespan ? lifespan : context->clockskew;
+    t->sync = get_sync_mode(context);
+    t->last_flush = now;
+    d = make_data(t->key, sizeof(t->key));
+    ret = krb5_c_random_make_octets(context, &d);
+    if (ret)
+        return ret;
+    ret = init_slots(t, now);
+    if (ret)
+        return ret;
+
+    ret = krb5_rc_io_creat(context, &t->d, &t->name);
+    if (ret) {
+        t->d.fd = -1;
+        return ret;
+    }
+    ret = write_header(context, t);
+    if (ret == 0 && krb5_rc_io_sync(context, &t->d))
+        ret = KRB5_RC_IO;
+    return ret;
+}
+
+static krb5_error_code
+hrc_recover_locked(krb5_context context, krb5_rcache id)
+{
+    struct hrc_data *t = id->data;
+    krb5_error_code ret;
+    krb5_timestamp now;
+    unsigned char hdr[HRC_HEADERLEN], buf[HRC_BATCH * HRC_RECLEN];
+    struct hrc_entry ent;
+    ssize_t len;
+    off_t end;
+    size_t i, n;
+
+    if (t->name == NULL)
+        return KRB5_RC_IO;
+    ret = krb5_timeofday(context, &now);
+    if (ret)
+        return ret;
+
+    free_entries(t);
+    free(t->slots);
+    t->slots = NULL;
+    (void)krb5_rc_io_close(context, &t->d);
+    t->wcount = t->file_records = 0;
+
+    ret = krb5_rc_io_open(context, &t->d, t->name);
+    if (ret) {
+        t->d.fd = -1;
+        return ret;
+    }
+    ret = krb5_rc_io_read(context, &t->d, hdr, sizeof(hdr));
+    if (ret)
+        goto cleanup;
+    if (memcmp(hdr, HRC_MAGIC, 4) != 0) {
+        /* Probably a dfl cache file of the same name. */
+        ret = KRB5_RCACHE_BADVNO;
+        goto cleanup;
+    }
+    t->lifespan = load_32_be(hdr + 4);
+    memcpy(t->key, hdr + 8, sizeof(t->key));
+    t->sync = get_sync_mode(context);
+    t->last_flush = now;
+    ret = init_slots(t, now);
+    if (ret)
+        goto cleanup;
+
+    for (;;) {
+        len = read(t->d.fd, buf, sizeof(buf));
+        if (len < 0) {
+            ret = KRB5_RC_IO_UNKNOWN;
+            goto cleanup;
+        }
+        n = len / HRC_RECLEN;
+        for (i = 0; i < n; i++) {
+            decode_entry(buf + i * HRC_RECLEN, &ent);
+            t->file_records++;
+            if (entry_expired(t, &ent, now) || table_find(t, &ent) != NULL)
+                continue;
+            ret = table_add(t, &ent);
+            if (ret)
+                goto cleanup;
+        }
+        if ((size_t)len < sizeof(buf))
+            break;
+    }
+
+    /* Drop any partial record left by an interrupted write, so that new
+     * records are appended at a record boundary. */
+    end = sizeof(krb5_int16) + HRC_HEADERLEN +
+        (off_t)t->file_records * HRC_RECLEN;
+    if (ftruncate(t->d.fd, end) != 0 ||
+        lseek(t->d.fd, end, SEEK_SET) == -1) {
+        ret = KRB5_RC_IO_UNKNOWN;
+        goto cleanup;
+    }
+
+    if (t->file_records > 2 * t->count + HRC_EXCESS)
+        ret = compact_file(context, t);
+
+cleanup:
+    if (ret) {
+        free_entries(t);
+        (void)krb5_rc_io_close(context, &t->d);
+    }
+    return ret;
+}
+
+static krb5_error_code KRB5_CALLCONV
+hrc_init(krb5_context context, krb5_rcache id, krb5_deltat lifespan)
+{
+    krb5_error_code ret;
+
+    ret = k5_mutex_lock(&id->lock);
+    if (ret)
+        return ret;
+    ret = hrc_init_locked(context, id, lifespan);
+    k5_mutex_unlock(&id->lock);
+    return ret;
+}
+
+static krb5_error_code KRB5_CALLCONV
+hrc_recover(krb5_context context, krb5_rcache id)
+{
+    krb5_error_code ret;
+
+    ret = k5_mutex_lock(&id->lock);
+    if (ret)
+        return ret;
+    ret = hrc_recover_locked(context, id);
+    k5_mutex_unlock(&id->lock);
+    return ret;
+}
+
+static krb5_error_code KRB5_CALLCONV
+hrc_recover_or_init(krb5_context context, krb5_rcache id,
+                    krb5_deltat lifespan)
+{
+    krb5_error_code ret;
+
+    ret = k5_mutex_lock(&id->lock);
+    if (ret)
+        return ret;
+    ret = hrc_recover_locked(context, id);
+    if (ret)
+        ret = hrc_init_locked(context, id, lifespan);
+    k5_mutex_unlock(&id->lock);
+    return ret;
+}
+
+static krb5_error_code KRB5_CALLCONV
+hrc_close(krb5_context context, krb5_rcache id)
+{
+    struct hrc_data *t;
+    krb5_timestamp now;
+
+    if (k5_mutex_lock(&id->lock) == 0) {
+        t = id->data;
+        if (t->d.fd != -1) {
+            if (krb5_timeofday(context, &now))
+                now = 0;
+            (void)flush_records(context, t, now);
+        }
+        free_entries(t);
+        free(t->slots);
+        free(t->table);
+        free(t->name);
+        (void)krb5_rc_io_close(context, &t->d);
+        zap(t->key, sizeof(t->key));
+        free(t);
+        k5_mutex_unlock(&id->lock);
+    }
+    k5_mutex_destroy(&id->lock);
+    free(id);
+    return 0;
+}
+
+static krb5_error_code KRB5_CALLCONV
+hrc_destroy(krb5_context context, krb5_rcache id)
+{
+    struct hrc_data *t = id->data;
+
+    t->wcount = 0;
+    if (t->d.fn != NULL && krb5_rc_io_destroy(context, &t->d))
+        return KRB5_RC_IO;
+    return hrc_close(context, id);
+}
+
+static krb5_error_code KRB5_CALLCONV
+hrc_store(krb5_context context, krb5_rcache id, krb5_donot_replay *rep)
+{
+    struct hrc_data *t = id->data;
+    krb5_error_code ret;
+    krb5_timestamp now;
+    struct hrc_entry ent;
+
+    ret = krb5_timeofday(context, &now);
+    if (ret)
+        return ret;
+    ret = k5_mutex_lock(&id->lock);
+    if (ret)
+        return ret;
+    if (t->slots == NULL || t->d.fd == -1) {
+        ret = KRB5_RC_IO;
+        goto cleanup;
+    }
+
+    expire_entries(t, now);
+    make_entry(t, rep, &ent);
+    if (table_find(t, &ent) != NULL) {
+        ret = KRB5KRB_AP_ERR_REPEAT;
+        goto cleanup;
+    }
+    ret = table_add(t, &ent);
+    if (ret)
+        goto cleanup;
+
+    encode_entry(&ent, t->wbuf + t->wcount * HRC_RECLEN);
+    t->wcount++;
+    t->file_records++;
+    if (t->sync == HRC_SYNC_ALWAYS || t->wcount == HRC_BATCH ||
+        now != t->last_flush) {
+        ret = flush_records(context, t, now);
+        if (ret)
+            goto cleanup;
+    }
+
+    if (t->file_records > 2 * t->count + HRC_EXCESS)
+        ret = compact_file(context, t);
+
+cleanup:
+    k5_mutex_unlock(&id->lock);
+    return ret;
+}
+
+static krb5_error_code KRB5_CALLCONV
+hrc_expunge(krb5_context context, krb5_rcache id)
+{
+    struct hrc_data *t = id->data;
+    krb5_error_code ret;
+    krb5_timestamp now;
+
+    ret = krb5_timeofday(context, &now);
+    if (ret)
+        return ret;
+    ret = k5_mutex_lock(&id->lock);
+    if (ret)
+        return ret;
+    if (t->slots == NULL || t->d.fd == -1) {
+        ret = KRB5_RC_IO;
+    } else {
+        expire_entries(t, now);
+        ret = compact_file(context, t);
+    }
+    k5_mutex_unlock(&id->lock);
+    return ret;
+}
+
+static krb5_error_code KRB5_CALLCONV
+hrc_get_span(krb5_context context, krb5_rcache id, krb5_deltat *lifespan)
+{
+    krb5_error_code ret;
+
+    ret = k5_mutex_lock(&id->lock);
+    if (ret)
+        return ret;
+    *lifespan = ((struct hrc_data *)id->data)->lifespan;
+    k5_mutex_unlock(&id->lock);
+    return 0;
+}
+
+static char * KRB5_CALLCONV
+hrc_get_name(krb5_context context, krb5_rcache id)
+{
+    return ((struct hrc_data *)id->data)->name;
+}
+
+static krb5_error_code KRB5_CALLCONV
+hrc_resolve(krb5_context context, krb5_rcache id, char *name)
+{
+    struct hrc_data *t;
+
+    t = calloc(1, sizeof(*t));
+    if (t == NULL)
+        return KRB5_RC_MALLOC;
+    if (name != NULL) {
+        t->name = strdup(name);
+        if (t->name == NULL)
+            goto oom;
+    }
+    t->nbuckets = HRC_INITIAL_BUCKETS;
+    t->table = calloc(t->nbuckets, sizeof(*t->table));
+    if (t->table == NULL)
+        goto oom;
+    t->d.fd = -1;
+    id->data = t;
+    return 0;
+
+oom:
+    free(t->name);
+    free(t);
+    return KRB5_RC_MALLOC;
+}
+
+const krb5_rc_ops krb5_rc_hash_ops = {
+    0,
+    "hash",
+    hrc_init,
+    hrc_recover,
+    hrc_recover_or_init,
+    hrc_destroy,
+    hrc_close,
+    hrc_store,
+    hrc_expunge,
+    hrc_get_span,
+    hrc_get_name,
+    hrc_resolve
+};
@@ -16,8 +16,6 @@
 #  define PATH_SEPARATOR "/"
 #endif
 
-#define KRB5_RC_VNO     0x0501          /* krb5, rcache v 1 */
-
 #if HAVE_SYS_STAT_H
 #include <sys/stat.h>
 #endif
@@ -212,75 +210,75 @@ cleanup:
     return retval;
 }
 
+/*
+ * Open the existing cache file d->fn for reading and writing, checking that it
+ * is a regular file which belongs to us and is not accessible to others.
+ */
 static krb5_error_code
-krb5_rc_io_open_internal(krb5_context context, krb5_rc_iostuff *d, char *fn,
-                         char* full_pathname)
+open_existing(krb5_context context, krb5_rc_iostuff *d)
 {
-    krb5_int16 rc_vno;
-    krb5_error_code retval = 0;
-    int do_not_unlink = 1;
-#ifndef NO_USERID
-    struct stat sb1, sb2;
-#endif
-    char *dir;
-    size_t dirlen;
-
-    GETDIR;
-    if (full_pathname) {
-        if (!(d->fn = strdup(full_pathname)))
-            return KRB5_RC_IO_MALLOC;
-    } else {
-        if (asprintf(&d->fn, "%s%s%s", dir, PATH_SEPARATOR, fn) < 0)
-            return KRB5_RC_IO_MALLOC;
-    }
-
 #ifdef NO_USERID
     d->fd = THREEPARAMOPEN(d->fn, O_RDWR | O_BINARY, 0600);
-    if (d->fd == -1) {
-        retval = rc_map_errno(context, errno, d->fn, "open");
-        goto cleanup;
-    }
+    if (d->fd == -1)
+        return rc_map_errno(context, errno, d->fn, "open");
 #else
+    struct stat sb1, sb2;
+
     d->fd = -1;
-    retval = lstat(d->fn, &sb1);
-    if (retval != 0) {
-        retval = rc_map_errno(context, errno, d->fn, "lstat");
-        goto cleanup;
-    }
+    if (lstat(d->fn, &sb1) != 0)
+        return rc_map_errno(context, errno, d->fn, "lstat");
     d->fd = THREEPARAMOPEN(d->fn, O_RDWR | O_BINARY, 0600);
-    if (d->fd < 0) {
-        retval = rc_map_errno(context, errno, d->fn, "open");
-        goto cleanup;
-    }
-    retval = fstat(d->fd, &sb2);
-    if (retval < 0) {
-        retval = rc_map_errno(context, errno, d->fn, "fstat");
-        goto cleanup;
-    }
+    if (d->fd < 0)
+        return rc_map_errno(context, errno, d->fn, "open");
+    if (fstat(d->fd, &sb2) < 0)
+        return rc_map_errno(context, errno, d->fn, "fstat");
     /* check if someone was playing with symlinks */
     if ((sb1.st_dev != sb2.st_dev || sb1.st_ino != sb2.st_ino)
         || (sb1.st_mode & S_IFMT) != S_IFREG)
     {
-        retval = KRB5_RC_IO_PERM;
-        krb5_set_error_message(context, retval,
+        krb5_set_error_message(context, KRB5_RC_IO_PERM,
                                "rcache not a file %s", d->fn);
-        goto cleanup;
+        return KRB5_RC_IO_PERM;
     }
     /* check that non other can read/write/execute the file */
     if (sb1.st_mode & 077) {
-        krb5_set_error_message(context, retval,
+        krb5_set_error_message(context, KRB5_RC_IO_UNKNOWN,
                                _("Insecure file mode for replay cache file "
                                  "%s"), d->fn);
         return KRB5_RC_IO_UNKNOWN;
     }
     /* owned by me */
     if (sb1.st_uid != geteuid()) {
-        retval = KRB5_RC_IO_PERM;
-        krb5_set_error_message(context, retval, _("rcache not owned by %d"),
-                               (int)geteuid());
-        goto cleanup;
+        krb5_set_error_message(context, KRB5_RC_IO_PERM,
+                               _("rcache not owned by %d"), (int)geteuid());
+        return KRB5_RC_IO_PERM;
     }
 #endif
+    return 0;
+}
+
+static krb5_error_code
+krb5_rc_io_open_internal(krb5_context context, krb5_rc_iostuff *d, char *fn,
+                         char* full_pathname)
+{
+    krb5_int16 rc_vno;
+    krb5_error_code retval = 0;
+    int do_not_unlink = 1;
+    char *dir;
+    size_t dirlen;
+
+    GETDIR;
+    if (full_pathname) {
+        if (!(d->fn = strdup(full_pathname)))
+            return KRB5_RC_IO_MALLOC;
+    } else {
+        if (asprintf(&d->fn, "%s%s%s", dir, PATH_SEPARATOR, fn) < 0)
+            return KRB5_RC_IO_MALLOC;
+    }
+
+    retval = open_existing(context, d);
+    if (retval)
+        goto cleanup;
     set_cloexec_fd(d->fd);
 
     do_not_unlink = 0;
@@ -310,6 +308,42 @@ krb5_rc_io_open(krb5_context context, krb5_rc_iostuff *d, char *fn)
     return krb5_rc_io_open_internal(context, d, fn, NULL);
 }
 
+/*
+ * Open the cache file fn for use by several processes at once, creating it if
+ * it does not exist and create is true.  Unlike krb5_rc_io_creat() and
+ * krb5_rc_io_open(), never unlink an existing file, and do not read or write
+ * the version number, since another process may be initializing the file.
+ */
+krb5_error_code
+krb5_rc_io_attach(krb5_context context, krb5_rc_iostuff *d, char *fn,
+                  krb5_boolean create)
+{
+    krb5_error_code retval = 0;
+    char *dir = getdir();
+
+    if (asprintf(&d->fn, "%s%s%s", dir, PATH_SEPARATOR, fn) < 0)
+        return KRB5_RC_IO_MALLOC;
+    d->fd = -1;
+    if (create) {
+        d->fd = THREEPARAMOPEN(d->fn, O_RDWR | O_CREAT | O_EXCL | O_BINARY,
+                               0600);
+    }
+    if (!create || (d->fd < 0 && errno == EEXIST))
+        retval = open_existing(context, d);
+    else if (d->fd < 0)
+        retval = rc_map_errno(context, errno, d->fn, "create");
+    if (retval) {
+        if (d->fd >= 0)
+            (void) close(d->fd);
+        d->fd = -1;
+        free(d->fn);
+        d->fn = NULL;
+        return retval;
+    }
+    set_cloexec_fd(d->fd);
+    return 0;
+}
+
 krb5_error_code
 krb5_rc_io_move(krb5_context context, krb5_rc_iostuff *new1,
                 krb5_rc_iostuff *old)
@@ -13,6 +13,8 @@
 #ifndef KRB5_RC_IO_H
 #define KRB5_RC_IO_H
 
+#define KRB5_RC_VNO     0x0501          /* krb5, rcache v 1 */
+
 typedef struct krb5_rc_iostuff {
     int fd;
 #ifdef MSDOS_FILESYSTEM
@@ -31,6 +33,9 @@ krb5_rc_io_creat(krb5_context, krb5_rc_iostuff *, char **);
 krb5_error_code
 krb5_rc_io_open(krb5_context, krb5_rc_iostuff *, char *);
 
+krb5_error_code
+krb5_rc_io_attach(krb5_context, krb5_rc_iostuff *, char *, krb5_boolean);
+
 krb5_error_code
 krb5_rc_io_move(krb5_context, krb5_rc_iostuff *, krb5_rc_iostuff *);
 
@@ -0,0 +1,563 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* lib/krb5/rcache/rc_shm.c - Shared-memory replay cache type */
+/*
+ * Copyright (C) 2012 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Export of this software from the United States of America may
+ *   require a specific license from the United States Government.
+ *   It is the responsibility of any person or organization contemplating
+ *   export to obtain such a license before exporting.
+ *
+ * WITHIN THAT CONSTRAINT, permission to use, copy, modify, and
+ * distribute this software and its documentation for any purpose and
+ * without fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright notice and
+ * this permission notice appear in supporting documentation, and that
+ * the name of M.I.T. not be used in advertising or publicity pertaining
+ * to distribution of the software without specific, written prior
+ * permission.  Furthermore if you modify this software you must label
+ * your software as modified software and not distribute it in such a
+ * fashion that it might be confused with the original M.I.T. software.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is" without express
+ * or implied warranty.
+ */
+
+/*
+ * The "shm" replay cache type keeps its records in a table in a file mapped
+ * into the memory of every process which opens the cache, so that prefork
+ * and multithreaded servers get replay detection across all of their
+ * processes and threads without reading or writing the file per request.
+ *
+ * The table is set-associative: an authenticator's tags (see k5_rc_tag_rep())
+ * select a set, and the set's slots are searched for a match and for a free or
+ * expired slot under a process-shared mutex, so that storing is an atomic
+ * insert-if-absent.  The sets are striped over at most SHM_MAX_LOCKS mutexes,
+ * kept in a small array after the header, so only stores which land in sets
+ * sharing a mutex contend.  Where the platform supports it the mutexes are
+ * robust, so a process which dies while holding one does not block the
+ * others.
+ *
+ * The table has a fixed size, chosen by the process which creates the file:
+ * the libdefaults relation shm_rcache_entries if set, or else enough slots for
+ * twice SHM_DEFAULT_RATE authenticators per second over the lifespan.  An
+ * all-zero slot is empty, so the sets are left as a hole in the file and a
+ * page of them is only written when a record is first stored in it.  A store
+ * reuses an expired slot in its set, and only if every slot in the set holds a
+ * live record does it fail with KRB5_RC_IO_SPACE, rather than forgetting an
+ * authenticator which could then be replayed.
+ *
+ * A process which finds an existing file with a different version or layout
+ * (for instance, one created by a different build) fails rather than
+ * reinitializing a table which other processes may be using.
+ *
+ * The file is only written through the mapping, so records survive the exit
+ * of all processes but not necessarily a crash of the host.  Destroying the
+ * cache unlinks the file; processes which still have it open continue to
+ * share the old table.
+ */
+
+#include "k5-int.h"
+#include "rc-int.h"
+#include "rc_io.h"
+
+#ifdef K5_RC_SHM
+
+#include <sys/mman.h>
+#include <pthread.h>
+
+#define SHM_MAGIC 0x4b525348    /* "KRSH" */
+#define SHM_WAYS 16
+#define SHM_DEFAULT_RATE 50
+#define SHM_MAX_SETS (1U << 24)
+#define SHM_MAX_LOCKS 256
+
+#define SLOT_USED       0x1
+#define SLOT_MSGHASH    0x2
+
+struct shm_header {
+    krb5_int16 vno;             /* KRB5_RC_VNO in network byte order */
+    krb5_int16 pad;
+    krb5_ui_4 magic;
+    krb5_ui_4 setsize;          /* sizeof(struct shm_set) of the creator */
+    krb5_ui_4 locksize;         /* sizeof(pthread_mutex_t) of the creator */
+    krb5_ui_4 nsets;            /* a power of two */
+    krb5_deltat lifespan;
+    unsigned char key[K5_RC_TAG_KEYLEN];
+};
+
+/* Round n up to a multiple of the cache line size. */
+#define CACHE_ALIGN(n) (((n) + 63) & ~(size_t)63)
+
+/* Offset of the lock array. */
+#define LOCKS_OFFSET CACHE_ALIGN(sizeof(struct shm_header))
+
+struct shm_slot {
+    UINT64_TYPE tag[3];
+    krb5_timestamp ctime;
+    krb5_ui_4 flags;
+};
+
+struct shm_set {
+    struct shm_slot slots[SHM_WAYS];
+};
+
+struct shm_data {
+    char *name;
+    krb5_rc_iostuff d;
+    struct shm_header *hdr;     /* the mapping, or NULL */
+    pthread_mutex_t *locks;
+    struct shm_set *sets;
+    size_t len;
+};
+
+/* Return the number of locks for a table of nsets sets. */
+static unsigned int
+num_locks(unsigned int nsets)
+{
+    return (nsets < SHM_MAX_LOCKS) ? nsets : SHM_MAX_LOCKS;
+}
+
+/* Return the offset of the first set in a table of nsets sets. */
+static size_t
+sets_offset(unsigned int nsets)
+{
+    return CACHE_ALIGN(LOCKS_OFFSET + num_locks(nsets) *
+                       sizeof(pthread_mutex_t));
+}
+
+static size_t
+table_len(unsigned int nsets)
+{
+    return sets_offset(nsets) + (size_t)nsets * sizeof(struct shm_set);
+}
+
+/* Point t's lock and set pointers into the mapping at t->hdr. */
+static void
+set_pointers(struct shm_data *t)
+{
+    char *base = (char *)t->hdr;
+
+    t->locks = (pthread_mutex_t *)(base + LOCKS_OFFSET);
+    t->sets = (struct shm_set *)(base + sets_offset(t->hdr->nsets));
+}
+
+/* Return the lock protecting set number i. */
+static pthread_mutex_t *
+set_lock(struct shm_data *t, unsigned int i)
+{
+    return &t->locks[i & (num_locks(t->hdr->nsets) - 1)];
+}
+
+/* Return the number of sets for a new table with the given lifespan. */
+static unsigned int
+get_nsets(krb5_context context, krb5_deltat lifespan)
+{
+    unsigned int nsets;
+    int entries, def;
+
+    /* Leave half of the slots free at the default rate, so that sets rarely
+     * fill up. */
+    if (lifespan < INT_MAX / (2 * SHM_DEFAULT_RATE))
+        def = lifespan * 2 * SHM_DEFAULT_RATE;
+    else
+        def = INT_MAX;
+    if (profile_get_integer(context->profile, KRB5_CONF_LIBDEFAULTS,
+                            KRB5_CONF_SHM_RCACHE_ENTRIES, NULL, def,
+                            &entries) != 0 || entries <= 0)
+        entries = def;
+    for (nsets = 1; nsets * SHM_WAYS < (unsigned int)entries &&
+             nsets < SHM_MAX_SETS; nsets <<= 1);
+    return nsets;
+}
+
+/* Lock a set lock, recovering it if a previous holder died. */
+static int
+lock_set(pthread_mutex_t *lock)
+{
+    int ret;
+
+    ret = pthread_mutex_lock(lock);
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETROBUST
+    if (ret == EOWNERDEAD) {
+        /* Each slot is marked used only once it is filled in, so the sets
+         * are still well formed. */
+        ret = pthread_mutex_consistent(lock);
+    }
+#endif
+    return ret;
+}
+
+/* Check the header of an initialized table in a file of size len. */
+static krb5_error_code
+check_header(krb5_context context, struct shm_data *t,
+             const struct shm_header *hdr, off_t len)
+{
+    if (ntohs(hdr->vno) != KRB5_RC_VNO || hdr->magic != SHM_MAGIC) {
+        krb5_set_error_message(context, KRB5_RCACHE_BADVNO,
+                               _("Replay cache %s is not a shm replay cache"),
+                               t->name);
+        return KRB5_RCACHE_BADVNO;
+    }
+    if (hdr->setsize != sizeof(struct shm_set) ||
+        hdr->locksize != sizeof(pthread_mutex_t) || hdr->nsets == 0 ||
+        hdr->nsets > SHM_MAX_SETS || (hdr->nsets & (hdr->nsets - 1)) != 0 ||
+        (off_t)table_len(hdr->nsets) != len) {
+        krb5_set_error_message(context, KRB5_RC_IO,
+                               _("Replay cache %s has an unexpected layout"),
+                               t->name);
+        return KRB5_RC_IO;
+    }
+    return 0;
+}
+
+/* Initialize the header and locks of a new table in the zero-filled mapping
+ * at addr, leaving the sets empty.  The caller holds the file lock, so no
+ * other process is using the mapping. */
+static krb5_error_code
+init_table(krb5_context context, void *addr, unsigned int nsets,
+           krb5_deltat lifespan)
+{
+    struct shm_header *hdr = addr;
+    pthread_mutex_t *locks = (pthread_mutex_t *)((char *)addr + LOCKS_OFFSET);
+    pthread_mutexattr_t attr;
+    krb5_error_code ret;
+    unsigned int i;
+    krb5_data d;
+
+    d = make_data(hdr->key, sizeof(hdr->key));
+    ret = krb5_c_random_make_octets(context, &d);
+    if (ret)
+        return ret;
+
+    if (pthread_mutexattr_init(&attr) != 0)
+        return KRB5_RC_IO_UNKNOWN;
+    ret = KRB5_RC_IO_UNKNOWN;
+    if (pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) != 0)
+        goto cleanup;
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETROBUST
+    if (pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) != 0)
+        goto cleanup;
+#endif
+    for (i = 0; i < num_locks(nsets); i++) {
+        if (pthread_mutex_init(&locks[i], &attr) != 0)
+            goto cleanup;
+    }
+
+    hdr->vno = htons(KRB5_RC_VNO);
+    hdr->setsize = sizeof(struct shm_set);
+    hdr->locksize = sizeof(pthread_mutex_t);
+    hdr->nsets = nsets;
+    hdr->lifespan = lifespan;
+    /* Write the magic number last, so a table left half-initialized by a
+     * crash is initialized again by the next process to open it. */
+    hdr->magic = SHM_MAGIC;
+    ret = 0;
+
+cleanup:
+    pthread_mutexattr_destroy(&attr);
+    return ret;
+}
+
+static void
+detach(krb5_context context, struct shm_data *t)
+{
+    if (t->hdr != NULL)
+        munmap((void *)t->hdr, t->len);
+    t->hdr = NULL;
+    t->locks = NULL;
+    t->sets = NULL;
+    t->len = 0;
+    (void)krb5_rc_io_close(context, &t->d);
+}
+
+/*
+ * Open and map the cache file.  If lifespan is nonzero, create and initialize
+ * the table if it does not already exist; otherwise fail if it does not.
+ */
+static krb5_error_code
+attach(krb5_context context, struct shm_data *t, krb5_deltat lifespan)
+{
+    krb5_error_code ret;
+    struct shm_header hdr;
+    struct stat st;
+    unsigned int nsets;
+    size_t len = 0;
+    void *addr = MAP_FAILED;
+
+    detach(context, t);
+    if (t->name == NULL)
+        return KRB5_RC_IO;
+    ret = krb5_rc_io_attach(context, &t->d, t->name, lifespan != 0);
+    if (ret)
+        return ret;
+
+    /* Hold the file lock while checking or initializing the header, so that
+     * only one process initializes a new table. */
+    ret = krb5_lock_file(context, t->d.fd, KRB5_LOCKMODE_EXCLUSIVE);
+    if (ret)
+        goto cleanup;
+    ret = KRB5_RC_IO_UNKNOWN;
+    memset(&hdr, 0, sizeof(hdr));
+    if (fstat(t->d.fd, &st) != 0 || pread(t->d.fd, &hdr, sizeof(hdr), 0) < 0)
+        goto unlock;
+    if (hdr.magic != 0) {
+        ret = check_header(context, t, &hdr, st.st_size);
+        if (ret)
+            goto unlock;
+        ret = KRB5_RC_IO_UNKNOWN;
+        len = table_len(hdr.nsets);
+        addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, t->d.fd,
+                    0);
+        if (addr == MAP_FAILED)
+            goto unlock;
+    } else if (lifespan != 0) {
+        /* The file is new, or its creator died before writing the magic
+         * number, so no other process can have attached to it.  Truncate
+         * and extend the file, leaving a zero-filled hole for the table. */
+        nsets = get_nsets(context, lifespan);
+        len = table_len(nsets);
+        if (ftruncate(t->d.fd, 0) != 0 || ftruncate(t->d.fd, len) != 0) {
+            ret = (errno == ENOSPC) ? KRB5_RC_IO_SPACE : KRB5_RC_IO_UNKNOWN;
+            goto unlock;
+        }
+        addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, t->d.fd,
+                    0);
+        if (addr == MAP_FAILED)
+            goto unlock;
+        ret = init_table(context, addr, nsets, lifespan);
+        if (ret)
+            goto unlock;
+    } else {
+        ret = KRB5_RCACHE_BADVNO;
+        goto unlock;
+    }
+
+    t->hdr = addr;
+    t->len = len;
+    set_pointers(t);
+    addr = MAP_FAILED;
+    ret = 0;
+
+unlock:
+    (void)krb5_lock_file(context, t->d.fd, KRB5_LOCKMODE_UNLOCK);
+    if (addr != MAP_FAILED)
+        munmap(addr, len);
+cleanup:
+    if (ret)
+        detach(context, t);
+    return ret;
+}
+
+static krb5_error_code KRB5_CALLCONV
+shm_init(krb5_context context, krb5_rcache id, krb5_deltat lifespan)
+{
+    krb5_error_code ret;
+
+    ret = k5_mutex_lock(&id->lock);
+    if (ret)
+        return ret;
+    ret = attach(context, id->data, lifespan ? lifespan : context->clockskew);
+    k5_mutex_unlock(&id->lock);
+    return ret;
+}
+
+static krb5_error_code KRB5_CALLCONV
+shm_recover(krb5_context context, krb5_rcache id)
+{
+    krb5_error_code ret;
+
+    ret = k5_mutex_lock(&id->lock);
+    if (ret)
+        return ret;
+    ret = attach(context, id->data, 0);
+    k5_mutex_unlock(&id->lock);
+    return ret;
+}
+
+static krb5_error_code KRB5_CALLCONV
+shm_recover_or_init(krb5_context context, krb5_rcache id,
+                    krb5_deltat lifespan)
+{
+    /* Initializing attaches to an existing table, so there is no need to try
+     * recovering first. */
+    return shm_init(context, id, lifespan);
+}
+
+static krb5_error_code KRB5_CALLCONV
+shm_close(krb5_context context, krb5_rcache id)
+{
+    struct shm_data *t = id->data;
+
+    detach(context, t);
+    free(t->name);
+    free(t);
+    k5_mutex_destroy(&id->lock);
+    free(id);
+    return 0;
+}
+
+static krb5_error_code KRB5_CALLCONV
+shm_destroy(krb5_context context, krb5_rcache id)
+{
+    struct shm_data *t = id->data;
+
+    if (t->d.fn != NULL && krb5_rc_io_destroy(context, &t->d))
+        return KRB5_RC_IO;
+    return shm_close(context, id);
+}
+
+static krb5_boolean
+slot_expired(struct shm_data *t, const struct shm_slot *slot,
+             krb5_timestamp now)
+{
+    return slot->ctime + t->hdr->lifespan < now;
+}
+
+static krb5_error_code KRB5_CALLCONV
+shm_store(krb5_context context, krb5_rcache id, krb5_donot_replay *rep)
+{
+    struct shm_data *t = id->data;
+    struct shm_set *set;
+    struct shm_slot *slot, *victim = NULL;
+    pthread_mutex_t *lock;
+    krb5_error_code ret;
+    krb5_timestamp now;
+    UINT64_TYPE tag[3];
+    unsigned int setnum;
+    int i;
+
+    if (t->hdr == NULL)
+        return KRB5_RC_IO;
+    ret = krb5_timeofday(context, &now);
+    if (ret)
+        return ret;
+    k5_rc_tag_rep(t->hdr->key, rep, tag);
+    setnum = tag[0] & (t->hdr->nsets - 1);
+    set = &t->sets[setnum];
+    lock = set_lock(t, setnum);
+
+    if (lock_set(lock) != 0)
+        return KRB5_RC_IO_UNKNOWN;
+    for (i = 0; i < SHM_WAYS; i++) {
+        slot = &set->slots[i];
+        if (!(slot->flags & SLOT_USED) || slot_expired(t, slot, now)) {
+            if (victim == NULL)
+                victim = slot;
+            continue;
+        }
+        /* As with the dfl type, message hashes are only compared if both
+         * records have one. */
+        if (slot->tag[0] == tag[0] && slot->tag[1] == tag[1] &&
+            (!(slot->flags & SLOT_MSGHASH) || rep->msghash == NULL ||
+             slot->tag[2] == tag[2])) {
+            ret = KRB5KRB_AP_ERR_REPEAT;
+            goto cleanup;
+        }
+    }
+    if (victim == NULL) {
+        ret = KRB5_RC_IO_SPACE;
+        krb5_set_error_message(context, ret, _("Replay cache %s is full"),
+                               t->name);
+        goto cleanup;
+    }
+    victim->flags = 0;
+    victim->tag[0] = tag[0];
+    victim->tag[1] = tag[1];
+    victim->tag[2] = tag[2];
+    victim->ctime = rep->ctime;
+    victim->flags = SLOT_USED | ((rep->msghash != NULL) ? SLOT_MSGHASH : 0);
+
+cleanup:
+    pthread_mutex_unlock(lock);
+    return ret;
+}
+
+static krb5_error_code KRB5_CALLCONV
+shm_expunge(krb5_context context, krb5_rcache id)
+{
+    struct shm_data *t = id->data;
+    struct shm_set *set;
+    struct shm_slot *slot;
+    pthread_mutex_t *lock;
+    krb5_error_code ret;
+    krb5_timestamp now;
+    unsigned int i;
+    int j;
+
+    if (t->hdr == NULL)
+        return KRB5_RC_IO;
+    ret = krb5_timeofday(context, &now);
+    if (ret)
+        return ret;
+    for (i = 0; i < t->hdr->nsets; i++) {
+        set = &t->sets[i];
+        lock = set_lock(t, i);
+        if (lock_set(lock) != 0)
+            return KRB5_RC_IO_UNKNOWN;
+        /* Only write to used slots, so that pages of empty sets are left
+         * unwritten. */
+        for (j = 0; j < SHM_WAYS; j++) {
+            slot = &set->slots[j];
+            if ((slot->flags & SLOT_USED) && slot_expired(t, slot, now))
+                slot->flags = 0;
+        }
+        pthread_mutex_unlock(lock);
+    }
+    return 0;
+}
+
+static krb5_error_code KRB5_CALLCONV
+shm_get_span(krb5_context context, krb5_rcache id, krb5_deltat *lifespan)
+{
+    struct shm_data *t = id->data;
+
+    if (t->hdr == NULL)
+        return KRB5_RC_IO;
+    *lifespan = t->hdr->lifespan;
+    return 0;
+}
+
+static char * KRB5_CALLCONV
+shm_get_name(krb5_context context, krb5_rcache id)
+{
+    return ((struct shm_data *)id->data)->name;
+}
+
+static krb5_error_code KRB5_CALLCONV
+shm_resolve(krb5_context context, krb5_rcache id, char *name)
+{
+    struct shm_data *t;
+
+    t = calloc(1, sizeof(*t));
+    if (t == NULL)
+        return KRB5_RC_MALLOC;
+    if (name != NULL) {
+        t->name = strdup(name);
+        if (t->name == NULL) {
+            free(t);
+            return KRB5_RC_MALLOC;
+        }
+    }
+    t->d.fd = -1;
+    id->data = t;
+    return 0;
+}
+
+const krb5_rc_ops krb5_rc_shm_ops = {
+    0,
+    "shm",
+    shm_init,
+    shm_recover,
+    shm_recover_or_init,
+    shm_destroy,
+    shm_close,
+    shm_store,
+    shm_expunge,
+    shm_get_span,
+    shm_get_name,
+    shm_resolve
+};
+
+#endif /* K5_RC_SHM */
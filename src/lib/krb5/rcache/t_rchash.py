@@ -0,0 +1,54 @@
+#!/usr/bin/python
+from k5test import *
+
+def store(realm, rc, client, msg, tstamp, usec, now, expected):
+    args = ['./t_replay', 'store', rc, client, 'server', msg, str(tstamp),
+            str(usec), str(now), '0']
+    out = realm.run_as_server(args)
+    if expected not in out:
+        fail('Expected "%s" storing %s %s %d.%d at %d, got: %s' %
+             (expected, client, msg, tstamp, usec, now, out))
+
+def expunge(realm, rc, now):
+    out = realm.run_as_server(['./t_replay', 'expunge', rc, str(now), '0'])
+    if 'Cache successfully expunged' not in out:
+        fail('Expunge of %s failed: %s' % (rc, out))
+
+stored = 'Entry successfully stored'
+replay = 'Replay'
+
+realm = K5Realm(create_kdb=False, create_user=False, create_host=False,
+                get_creds=False, start_kdc=False, start_kadmind=False)
+
+rc = 'hash:rc_test'
+store(realm, rc, 'alice', 'msg1', 1000, 1, 1000, stored)
+store(realm, rc, 'alice', 'msg1', 1000, 1, 1000, replay)
+
+# Records survive reopening the cache, and the message hash is compared only
+# when both records have one.
+store(realm, rc, 'alice', 'msg2', 1000, 1, 1001, stored)
+store(realm, rc, 'alice', '', 1000, 1, 1001, replay)
+store(realm, rc, 'alice', 'msg1', 1000, 2, 1001, stored)
+store(realm, rc, 'bob', 'msg1', 1000, 1, 1001, stored)
+
+# Records outside the lifespan are discarded, both on store and on expunge.
+store(realm, rc, 'carol', 'msg1', 1100, 1, 1100, stored)
+store(realm, rc, 'alice', 'msg1', 1000, 1, 1400, stored)
+store(realm, rc, 'carol', 'msg1', 1100, 1, 1400, replay)
+expunge(realm, rc, 5000)
+store(realm, rc, 'carol', 'msg1', 1100, 1, 1400, stored)
+
+# Records held back by the batch and never sync modes are written when the
+# cache is closed.
+for mode in ('batch', 'never'):
+    conf = {'server': {'libdefaults': {'hash_rcache_sync': mode}}}
+    realm2 = K5Realm(krb5_conf=conf, testdir='testdir.' + mode,
+                     create_kdb=False, create_user=False, create_host=False,
+                     get_creds=False, start_kdc=False, start_kadmind=False)
+    store(realm2, rc, 'alice', 'msg1', 1000, 1, 1000, stored)
+    store(realm2, rc, 'alice', 'msg1', 1000, 1, 1000, replay)
+    store(realm2, rc, 'alice', 'msg1', 1000, 2, 1000, stored)
+    expunge(realm2, rc, 1000)
+    store(realm2, rc, 'alice', 'msg1', 1000, 2, 1000, replay)
+
+success('Hash replay cache tests')
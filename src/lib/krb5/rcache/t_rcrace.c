@@ -0,0 +1,140 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* lib/krb5/rcache/t_rcrace.c - Test concurrent stores into a replay cache */
+/*
+ * Copyright (C) 2012 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Export of this software from the United States of America may
+ *   require a specific license from the United States Government.
+ *   It is the responsibility of any person or organization contemplating
+ *   export to obtain such a license before exporting.
+ *
+ * WITHIN THAT CONSTRAINT, permission to use, copy, modify, and
+ * distribute this software and its documentation for any purpose and
+ * without fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright notice and
+ * this permission notice appear in supporting documentation, and that
+ * the name of M.I.T. not be used in advertising or publicity pertaining
+ * to distribution of the software without specific, written prior
+ * permission.  Furthermore if you modify this software you must label
+ * your software as modified software and not distribute it in such a
+ * fashion that it might be confused with the original M.I.T. software.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is" without express
+ * or implied warranty.
+ */
+
+/*
+ * This program forks nprocs processes which each open the replay cache rc,
+ * wait until all of them have it open, and then store the same count
+ * authenticators.  Each child reports through a pipe how many of its stores
+ * succeeded and how many were replays; every authenticator must be stored by
+ * exactly one process and found to be a replay by all of the others.
+ */
+
+#include "k5-int.h"
+#include <sys/wait.h>
+
+static void
+check(krb5_error_code code, const char *what)
+{
+    if (code) {
+        com_err("t_rcrace", code, "%s", what);
+        exit(1);
+    }
+}
+
+static void
+run_child(const char *rcspec, long count, int gofd, int resultfd)
+{
+    krb5_context ctx;
+    krb5_rcache rc;
+    krb5_donot_replay rep;
+    krb5_error_code ret;
+    long i, counts[2] = { 0, 0 };
+    char c;
+
+    check(krb5_init_context(&ctx), "while initializing context");
+    check(krb5_rc_resolve_full(ctx, &rc, (char *)rcspec),
+          "while resolving replay cache");
+    check(krb5_rc_recover_or_initialize(ctx, rc, ctx->clockskew),
+          "while opening replay cache");
+
+    /* Wait for the parent to close the other end of the pipe. */
+    (void)read(gofd, &c, 1);
+
+    rep.client = "client";
+    rep.server = "server";
+    rep.msghash = NULL;
+    rep.ctime = time(NULL);
+    for (i = 0; i < count; i++) {
+        rep.cusec = i;
+        ret = krb5_rc_store(ctx, rc, &rep);
+        if (ret == KRB5KRB_AP_ERR_REPEAT)
+            counts[1]++;
+        else if (ret == 0)
+            counts[0]++;
+        else
+            check(ret, "while storing authenticator");
+    }
+    krb5_rc_close(ctx, rc);
+    krb5_free_context(ctx);
+    if (write(resultfd, counts, sizeof(counts)) != sizeof(counts))
+        exit(1);
+    exit(0);
+}
+
+int
+main(int argc, char **argv)
+{
+    int nprocs, i, status, gofds[2], resultfds[2], failed = 0;
+    long count, counts[2], stored = 0, replays = 0;
+    pid_t pid;
+
+    if (argc != 4) {
+        fprintf(stderr, "Usage: %s rc nprocs count\n", argv[0]);
+        return 1;
+    }
+    nprocs = atoi(argv[2]);
+    count = atol(argv[3]);
+
+    if (pipe(gofds) != 0 || pipe(resultfds) != 0) {
+        perror("pipe");
+        return 1;
+    }
+    for (i = 0; i < nprocs; i++) {
+        pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (pid == 0) {
+            close(gofds[1]);
+            close(resultfds[0]);
+            run_child(argv[1], count, gofds[0], resultfds[1]);
+        }
+    }
+    close(gofds[0]);
+    close(resultfds[1]);
+
+    /* The first process to open the cache creates the table; let them all
+     * finish opening it before any of them stores. */
+    sleep(1);
+    close(gofds[1]);
+
+    while (read(resultfds[0], counts, sizeof(counts)) == sizeof(counts)) {
+        stored += counts[0];
+        replays += counts[1];
+    }
+    for (i = 0; i < nprocs; i++) {
+        if (wait(&status) < 0 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0)
+            failed = 1;
+    }
+    printf("%ld stored, %ld replays\n", stored, replays);
+    if (failed || stored != count || replays != count * (nprocs - 1)) {
+        fprintf(stderr, "Concurrent stores gave the wrong result\n");
+        return 1;
+    }
+    return 0;
+}
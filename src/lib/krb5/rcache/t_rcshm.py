@@ -0,0 +1,69 @@
+#!/usr/bin/python
+from k5test import *
+
+def store(realm, rc, client, usec, now, expected):
+    args = ['./t_replay', 'store', rc, client, 'server', '', str(now),
+            str(usec), str(now), '0']
+    out = realm.run_as_server(args)
+    if expected not in out:
+        fail('Expected "%s" storing %s %d at %d, got: %s' %
+             (expected, client, usec, now, out))
+
+stored = 'Entry successfully stored'
+replay = 'Replay'
+
+# Several processes which have the cache mapped at once store the same
+# authenticators concurrently; each must be stored exactly once.  The
+# default table is sized for a much lower rate, so make it bigger.
+conf = {'server': {'libdefaults': {'shm_rcache_entries': '131072'}}}
+realm = K5Realm(krb5_conf=conf, create_kdb=False, create_user=False,
+                create_host=False, get_creds=False, start_kdc=False,
+                start_kadmind=False)
+realm.run_as_server(['./t_rcrace', 'shm:rc_race', '4', '20000'])
+
+# With one set of sixteen slots, a store into the full set fails rather than
+# evicting a live record, and succeeds once a record in the set has expired.
+conf = {'server': {'libdefaults': {'shm_rcache_entries': '16'}}}
+realm = K5Realm(krb5_conf=conf, create_kdb=False, create_user=False,
+                create_host=False, get_creds=False, start_kdc=False,
+                start_kadmind=False)
+rc = 'shm:rc_test'
+store(realm, rc, 'alice', 0, 1000, stored)
+for i in range(15):
+    store(realm, rc, 'bob', i, 1100, stored)
+store(realm, rc, 'carol', 0, 1100, 'is full')
+store(realm, rc, 'bob', 14, 1100, replay)
+store(realm, rc, 'carol', 0, 1350, stored)
+store(realm, rc, 'dave', 0, 1350, 'is full')
+store(realm, rc, 'carol', 0, 1350, replay)
+
+# A file with a different header is left alone.
+path = os.path.join(realm.testdir, 'rc_test')
+f = open(path, 'rb')
+contents = f.read()
+f.close()
+
+def check_mismatch(data, expected):
+    f = open(path, 'wb')
+    f.write(data)
+    f.close()
+    store(realm, rc, 'erin', 0, 1350, expected)
+    f = open(path, 'rb')
+    after = f.read()
+    f.close()
+    if after != data:
+        fail('Replay cache file with a mismatched header was modified')
+
+check_mismatch('\xff\xff' + contents[2:], 'not a shm replay cache')
+check_mismatch(contents[:4] + 'XXXX' + contents[8:], 'not a shm replay cache')
+check_mismatch(contents + '\0', 'unexpected layout')
+
+# A file whose creator did not get as far as writing the magic number is
+# initialized again.
+f = open(path, 'wb')
+f.write(contents[:4] + '\0\0\0\0' + contents[8:])
+f.close()
+store(realm, rc, 'alice', 0, 1350, stored)
+store(realm, rc, 'alice', 0, 1350, replay)
+
+success('Shared-memory replay cache tests')
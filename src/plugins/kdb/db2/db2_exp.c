@@ -106,6 +106,9 @@ WRAP_K (krb5_db2_get_age,
          char *s,
          time_t *t),
         (ctx, s, t));
+WRAP_K (krb5_db2_get_generation,
+        (krb5_context ctx, krb5_ui_4 *gen),
+        (ctx, gen));
 
 WRAP_K (krb5_db2_lock,
         ( krb5_context    context,
@@ -206,7 +209,7 @@ hack_cleanup (void)
 
 kdb_vftabl PLUGIN_SYMBOL_NAME(krb5_db2, kdb_function_table) = {
     KRB5_KDB_DAL_MAJOR_VERSION,             /* major version number */
-    0,                                      /* minor version number 0 */
+    1,                                      /* minor version number 1 */
     /* init_library */                  hack_init,
     /* fini_library */                  hack_cleanup,
     /* init_module */                   wrap_krb5_db2_open,
@@ -235,5 +238,6 @@ kdb_vftabl PLUGIN_SYMBOL_NAME(krb5_db2, kdb_function_table) = {
     /* check_policy_as */               wrap_krb5_db2_check_policy_as,
     0,
     /* audit_as_req */                  wrap_krb5_db2_audit_as_req,
-    0, 0
+    0, 0,
+    /* get_generation */                wrap_krb5_db2_get_generation
 };
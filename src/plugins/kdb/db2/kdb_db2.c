@@ -61,12 +61,14 @@
 #include <stdio.h>
 #include <errno.h>
 #include <utime.h>
+#include <sys/mman.h>
 #include "kdb5.h"
 #include "kdb_db2.h"
 #include "kdb_xdr.h"
 #include "policy_db.h"
 
 #define KDB_DB2_DATABASE_NAME "database_name"
+#define DEFAULT_LOCKOUT_FLUSH_INTERVAL 30
 
 #define SUFFIX_DB ""
 #define SUFFIX_LOCK ".ok"
@@ -170,6 +172,7 @@ ctx_clear(krb5_db2_context *dbc)
     dbc->db_name = NULL;
     dbc->db_nb_locks = FALSE;
     dbc->tempdb = FALSE;
+    dbc->lockout_fd = -1;
 }
 
 /* Set *dbc_out to the db2 database context for context.  If one does not
@@ -265,6 +268,19 @@ configure_context(krb5_context context, char *conf_section, char **db_args)
         goto cleanup;
     dbc->disable_lockout = bval;
 
+    status = profile_get_integer(profile, KDB_MODULE_SECTION, conf_section,
+                                 KRB5_CONF_LOCKOUT_TABLE_ENTRIES, 0,
+                                 &dbc->lockout_entries);
+    if (status != 0)
+        goto cleanup;
+
+    status = profile_get_integer(profile, KDB_MODULE_SECTION, conf_section,
+                                 KRB5_CONF_LOCKOUT_FLUSH_INTERVAL,
+                                 DEFAULT_LOCKOUT_FLUSH_INTERVAL,
+                                 &dbc->lockout_flush_interval);
+    if (status != 0)
+        goto cleanup;
+
 cleanup:
     free(opt);
     free(val);
@@ -321,20 +337,21 @@ error:
 }
 
 /*
- * Open the DB2 database described by dbc, using the specified flags and mode,
- * and return the resulting handle.  Try both hash and btree database types;
+ * Open the DB2 database described by dbc, using the specified flags and mode
+ * and a page cache of cachesize bytes (or the default size if 0), and return
+ * the resulting handle.  Try both hash and btree database types;
  * dbc->hashfirst determines which is attempted first.  If dbc->hashfirst
  * indicated the wrong type, update it to indicate the correct type.
  */
 static DB *
-open_db(krb5_db2_context *dbc, int flags, int mode)
+open_db(krb5_db2_context *dbc, int flags, int mode, unsigned int cachesize)
 {
     char *fname = NULL;
     DB *db;
     BTREEINFO bti;
     HASHINFO hashi;
     bti.flags = 0;
-    bti.cachesize = 0;
+    bti.cachesize = cachesize;
     bti.psize = 4096;
     bti.lorder = 0;
     bti.minkeypage = 0;
@@ -347,7 +364,7 @@ open_db(krb5_db2_context *dbc, int flags, int mode)
     }
 
     hashi.bsize = 4096;
-    hashi.cachesize = 0;
+    hashi.cachesize = cachesize;
     hashi.ffactor = 40;
     hashi.hash = NULL;
     hashi.lorder = 0;
@@ -380,6 +397,141 @@ done:
     return db;
 }
 
+/*
+ * The first four bytes of the lock file hold a generation counter, mapped
+ * into memory, which lets principal lookups skip the file lock.  Writers make
+ * the counter odd when they acquire an exclusive lock and even again before
+ * releasing it.
+ *
+ * A writer changes database pages in place, and libdb does not survive
+ * reading a torn page or following a stale page pointer, so lookups without
+ * the lock never read the database file.  Instead, a read-only handle is
+ * opened, and reads pages into its cache, only while the shared lock is held
+ * and the counter is even, so what it has read is a consistent snapshot of
+ * the database at that generation.  A lookup without the lock goes through
+ * that handle with R_CACHEONLY, and is used only if every page it needed was
+ * cached and no write has finished since the handle was opened; a write
+ * which has started but not finished doesn't matter, as the lookup is simply
+ * ordered before it.  Otherwise the caller falls back to a locked lookup,
+ * which reopens the handle if necessary and reads the missing pages into its
+ * cache.
+ *
+ * The counter is only ever accessed with atomic operations.  A writer
+ * publishes the odd value followed by a release fence before it changes the
+ * database, and stores the even value with release semantics.  A reader loads
+ * the counter with acquire semantics, and issues an acquire fence after the
+ * lookup before loading it again.  On compilers without atomic builtins the
+ * counter is not mapped, so lookups always take the lock.
+ */
+
+#if defined(__GNUC__) && defined(__ATOMIC_ACQUIRE)
+#define HAVE_GEN_ATOMICS
+#endif
+
+/* Map the generation counter from dbc's lock file, extending the file if
+ * necessary.  On failure, leave dbc->db_gen NULL so that all lookups lock. */
+static void
+ctx_map_gen(krb5_db2_context *dbc)
+{
+#ifdef HAVE_GEN_ATOMICS
+    struct stat st;
+    void *p;
+    int rw;
+
+    if (fstat(dbc->db_lf_file, &st) != 0)
+        return;
+    rw = ((fcntl(dbc->db_lf_file, F_GETFL) & O_ACCMODE) == O_RDWR);
+    if (st.st_size < (off_t)sizeof(krb5_ui_4)) {
+        if (!rw || ftruncate(dbc->db_lf_file, sizeof(krb5_ui_4)) != 0)
+            return;
+    }
+    p = mmap(NULL, sizeof(krb5_ui_4), rw ? PROT_READ | PROT_WRITE : PROT_READ,
+             MAP_SHARED, dbc->db_lf_file, 0);
+    if (p == MAP_FAILED)
+        return;
+    dbc->db_gen = p;
+    dbc->db_gen_rw = rw;
+#endif
+}
+
+static void
+ctx_unmap_gen(krb5_db2_context *dbc)
+{
+    if (dbc->db_ro != NULL) {
+        dbc->db_ro->close(dbc->db_ro);
+        dbc->db_ro = NULL;
+    }
+    if (dbc->db_gen != NULL) {
+        (void) munmap(dbc->db_gen, sizeof(krb5_ui_4));
+        dbc->db_gen = NULL;
+    }
+}
+
+#ifdef HAVE_GEN_ATOMICS
+
+/* Return the generation counter at the start of an unlocked read. */
+static krb5_ui_4
+gen_read_begin(krb5_db2_context *dbc)
+{
+    return __atomic_load_n(dbc->db_gen, __ATOMIC_ACQUIRE);
+}
+
+/* Return the generation counter at the end of an unlocked read, ordered
+ * after the data read since gen_read_begin(). */
+static krb5_ui_4
+gen_read_end(krb5_db2_context *dbc)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(dbc->db_gen, __ATOMIC_RELAXED);
+}
+
+/* Mark the start (odd) or end (even) of a write.  The caller must hold an
+ * exclusive lock, or a shared lock if repairing the counter after a writer
+ * died while holding the exclusive lock; since several readers may repair it
+ * at once, the counter is advanced with a compare-and-swap. */
+static void
+ctx_set_gen_writing(krb5_db2_context *dbc, krb5_boolean writing)
+{
+    krb5_ui_4 gen;
+
+    if (dbc->db_gen == NULL || !dbc->db_gen_rw)
+        return;
+    gen = __atomic_load_n(dbc->db_gen, __ATOMIC_RELAXED);
+    if ((gen & 1) == (writing ? 1 : 0))
+        return;
+    if (writing) {
+        (void) __atomic_compare_exchange_n(dbc->db_gen, &gen, gen + 1, 0,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        /* Order the odd value before any change to the database. */
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    } else {
+        (void) __atomic_compare_exchange_n(dbc->db_gen, &gen, gen + 1, 0,
+                                           __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    }
+}
+
+#else /* HAVE_GEN_ATOMICS */
+
+/* The counter is never mapped, so these are never reached. */
+static krb5_ui_4
+gen_read_begin(krb5_db2_context *dbc)
+{
+    return 1;
+}
+
+static krb5_ui_4
+gen_read_end(krb5_db2_context *dbc)
+{
+    return 1;
+}
+
+static void
+ctx_set_gen_writing(krb5_db2_context *dbc, krb5_boolean writing)
+{
+}
+
+#endif /* HAVE_GEN_ATOMICS */
+
 static krb5_error_code
 ctx_unlock(krb5_context context, krb5_db2_context *dbc)
 {
@@ -397,6 +549,8 @@ ctx_unlock(krb5_context context, krb5_db2_context *dbc)
     if (--(dbc->db_locks_held) == 0) {
         db->close(db);
         dbc->db = NULL;
+        if (dbc->db_lock_mode == KRB5_LOCKMODE_EXCLUSIVE)
+            ctx_set_gen_writing(dbc, FALSE);
         dbc->db_lock_mode = 0;
 
         retval = krb5_lock_file(context, dbc->db_lf_file,
@@ -445,7 +599,7 @@ ctx_lock(krb5_context context, krb5_db2_context *dbc, int lockmode)
             dbc->db->close(dbc->db);
         dbc->db = open_db(dbc,
                           kmode == KRB5_LOCKMODE_SHARED ? O_RDONLY : O_RDWR,
-                          0600);
+                          0600, 0);
         if (dbc->db == NULL) {
             retval = errno;
             dbc->db_locks_held = 0;
@@ -457,6 +611,9 @@ ctx_lock(krb5_context context, krb5_db2_context *dbc, int lockmode)
         }
 
         dbc->db_lock_mode = kmode;
+
+        /* Start a write, or finish one abandoned by a dead writer. */
+        ctx_set_gen_writing(dbc, kmode == KRB5_LOCKMODE_EXCLUSIVE);
     }
     dbc->db_locks_held++;
 
@@ -490,6 +647,7 @@ ctx_init(krb5_db2_context *dbc)
         }
     }
     set_cloexec_fd(dbc->db_lf_file);
+    ctx_map_gen(dbc);
     dbc->db_inited++;
 
     retval = ctx_dbsuffix(dbc, SUFFIX_POLICY, &polname);
@@ -512,6 +670,7 @@ cleanup:
 static void
 ctx_fini(krb5_db2_context *dbc)
 {
+    ctx_unmap_gen(dbc);
     if (dbc->db_lf_file != -1)
         (void) close(dbc->db_lf_file);
     if (dbc->policy_db)
@@ -524,6 +683,7 @@ krb5_error_code
 krb5_db2_fini(krb5_context context)
 {
     if (context->dal_handle->db_context != NULL) {
+        krb5_db2_lockout_fini(context);
         ctx_fini(context->dal_handle->db_context);
         context->dal_handle->db_context = NULL;
     }
@@ -538,7 +698,7 @@ check_openable(krb5_context context)
     krb5_db2_context *dbc;
 
     dbc = context->dal_handle->db_context;
-    db = open_db(dbc, O_RDONLY, 0);
+    db = open_db(dbc, O_RDONLY, 0, 0);
     if (db == NULL)
         return errno;
     db->close(db);
@@ -568,6 +728,21 @@ krb5_db2_get_age(krb5_context context, char *db_name, time_t *age)
     return 0;
 }
 
+/* Return the generation counter, which changes with every write. */
+krb5_error_code
+krb5_db2_get_generation(krb5_context context, krb5_ui_4 *gen)
+{
+    krb5_db2_context *dbc;
+
+    if (!inited(context))
+        return KRB5_KDB_DBNOTINITED;
+    dbc = context->dal_handle->db_context;
+    if (dbc->db_gen == NULL)
+        return KRB5_PLUGIN_OP_NOTSUPP;
+    *gen = gen_read_begin(dbc);
+    return 0;
+}
+
 /* Try to update the timestamp on dbc's lockfile. */
 static void
 ctx_update_age(krb5_db2_context *dbc)
@@ -683,8 +858,9 @@ ctx_create_db(krb5_context context, krb5_db2_context *dbc)
     if (retval)
         return retval;
 
-    dbc->db_lf_file = open(dbc->db_lf_name, O_CREAT | O_RDWR | O_TRUNC,
-                           0600);
+    /* Don't truncate an existing lock file; other processes may have the
+     * generation counter mapped. */
+    dbc->db_lf_file = open(dbc->db_lf_name, O_CREAT | O_RDWR, 0600);
     if (dbc->db_lf_file < 0) {
         retval = errno;
         goto cleanup;
@@ -696,6 +872,8 @@ ctx_create_db(krb5_context context, krb5_db2_context *dbc)
     set_cloexec_fd(dbc->db_lf_file);
     dbc->db_lock_mode = KRB5_LOCKMODE_EXCLUSIVE;
     dbc->db_locks_held = 1;
+    ctx_map_gen(dbc);
+    ctx_set_gen_writing(dbc, TRUE);
 
     if (dbc->tempdb) {
         /* Temporary DBs are locked for their whole lifetime.  Since we have
@@ -705,7 +883,7 @@ ctx_create_db(krb5_context context, krb5_db2_context *dbc)
         (void) unlink(plockname);
     }
 
-    dbc->db = open_db(dbc, O_RDWR | O_CREAT | O_EXCL, 0600);
+    dbc->db = open_db(dbc, O_RDWR | O_CREAT | O_EXCL, 0600, 0);
     if (dbc->db == NULL) {
         retval = errno;
         goto cleanup;
@@ -730,9 +908,11 @@ cleanup:
         if (dbc->db != NULL)
             dbc->db->close(dbc->db);
         if (dbc->db_locks_held > 0) {
+            ctx_set_gen_writing(dbc, FALSE);
             (void) krb5_lock_file(context, dbc->db_lf_file,
                                   KRB5_LOCKMODE_UNLOCK);
         }
+        ctx_unmap_gen(dbc);
         if (dbc->db_lf_file >= 0)
             close(dbc->db_lf_file);
         ctx_clear(dbc);
@@ -743,6 +923,88 @@ cleanup:
     return retval;
 }
 
+/* Number of times to wait for a writer before taking the file lock. */
+/* Page cache size for the read-only handle, which holds the pages used by
+ * lookups without the lock. */
+#define RO_CACHE_SIZE (4 * 1024 * 1024)
+
+/*
+ * Make sure the read-only handle is open at the current generation, reopening
+ * it if the database has been written since.  Call with a shared lock, and
+ * not an exclusive one, held.
+ */
+static krb5_error_code
+ctx_open_ro(krb5_db2_context *dbc)
+{
+    krb5_ui_4 gen;
+
+    /* A dead writer's odd counter can't be repaired without write access. */
+    gen = gen_read_begin(dbc);
+    if (gen & 1)
+        return KRB5_KDB_DB_INUSE;
+
+    if (dbc->db_ro != NULL && dbc->db_ro_gen != gen) {
+        dbc->db_ro->close(dbc->db_ro);
+        dbc->db_ro = NULL;
+    }
+    if (dbc->db_ro == NULL) {
+        dbc->db_ro = open_db(dbc, O_RDONLY, 0600, RO_CACHE_SIZE);
+        if (dbc->db_ro == NULL)
+            return errno;
+        dbc->db_ro_gen = gen;
+    }
+    return 0;
+}
+
+/*
+ * Look up the principal with DB key keydata without taking the file lock,
+ * using only pages the read-only handle read under the lock (see the comment
+ * above ctx_map_gen()).  Return KRB5_KDB_DB_INUSE if a write has finished
+ * since the handle was opened or a needed page isn't cached, in which case
+ * the caller should take the lock.
+ */
+static krb5_error_code
+get_principal_unlocked(krb5_context context, krb5_db2_context *dbc,
+                       krb5_data *keydata, krb5_db_entry **entry)
+{
+    krb5_error_code retval;
+    DBT key, contents;
+    krb5_data contdata;
+    int dbret;
+
+    /* The cached pages are still current if no write has started since they
+     * were read, and still consistent (ordering this lookup before the write)
+     * if one write has started but not finished. */
+    if (dbc->db_ro == NULL || gen_read_begin(dbc) - dbc->db_ro_gen > 1)
+        return KRB5_KDB_DB_INUSE;
+
+    key.data = keydata->data;
+    key.size = keydata->length;
+    dbret = (*dbc->db_ro->get)(dbc->db_ro, &key, &contents, R_CACHEONLY);
+    switch (dbret) {
+    case 1:
+        retval = KRB5_KDB_NOENTRY;
+        break;
+    case 0:
+        contdata.data = contents.data;
+        contdata.length = contents.size;
+        retval = krb5_decode_princ_entry(context, &contdata, entry);
+        break;
+    default:
+        /* Most likely a page which isn't cached; retry with the lock. */
+        return KRB5_KDB_DB_INUSE;
+    }
+
+    /* If a write finished in the meantime, our snapshot is out of date. */
+    if (gen_read_end(dbc) - dbc->db_ro_gen > 1) {
+        if (*entry != NULL)
+            krb5_dbe_free(context, *entry);
+        *entry = NULL;
+        return KRB5_KDB_DB_INUSE;
+    }
+    return retval;
+}
+
 krb5_error_code
 krb5_db2_get_principal(krb5_context context, krb5_const_principal searchfor,
                        unsigned int flags, krb5_db_entry **entry)
@@ -760,26 +1022,45 @@ krb5_db2_get_principal(krb5_context context, krb5_const_principal searchfor,
 
     dbc = context->dal_handle->db_context;
 
+    /* XXX deal with wildcard lookups */
+    retval = krb5_encode_princ_dbkey(context, &keydata, searchfor);
+    if (retval)
+        return retval;
+
+    /* If we don't already hold the lock, try to avoid taking it. */
+    if (dbc->db_gen != NULL && dbc->db_locks_held == 0) {
+        retval = get_principal_unlocked(context, dbc, &keydata, entry);
+        if (retval != KRB5_KDB_DB_INUSE) {
+            krb5_free_data_contents(context, &keydata);
+            return retval;
+        }
+    }
+
     for (trynum = 0; trynum < KRB5_DB2_MAX_RETRY; trynum++) {
         if ((retval = ctx_lock(context, dbc, KRB5_LOCKMODE_SHARED))) {
-            if (dbc->db_nb_locks)
+            if (dbc->db_nb_locks) {
+                krb5_free_data_contents(context, &keydata);
                 return (retval);
+            }
             sleep(1);
             continue;
         }
         break;
     }
-    if (trynum == KRB5_DB2_MAX_RETRY)
+    if (trynum == KRB5_DB2_MAX_RETRY) {
+        krb5_free_data_contents(context, &keydata);
         return KRB5_KDB_DB_INUSE;
+    }
 
-    /* XXX deal with wildcard lookups */
-    retval = krb5_encode_princ_dbkey(context, &keydata, searchfor);
-    if (retval)
-        goto cleanup;
     key.data = keydata.data;
     key.size = keydata.length;
 
+    /* With only a shared lock held, read through the read-only handle, so
+     * that its cache has the pages for later lookups without the lock. */
     db = dbc->db;
+    if (dbc->db_gen != NULL && dbc->db_lock_mode == KRB5_LOCKMODE_SHARED &&
+        ctx_open_ro(dbc) == 0)
+        db = dbc->db_ro;
     dbret = (*db->get)(db, &key, &contents, 0);
     retval = errno;
     krb5_free_data_contents(context, &keydata);
@@ -855,6 +1136,8 @@ krb5_db2_put_principal(krb5_context context, krb5_db_entry *entry,
     retval = dbret ? errno : 0;
     krb5_free_data_contents(context, &keydata);
     krb5_free_data_contents(context, &contdata);
+    if (retval == 0)
+        krb5_db2_lockout_sync(context, entry->princ, entry);
 
 cleanup:
     ctx_update_age(dbc);
@@ -926,6 +1209,8 @@ krb5_db2_delete_principal(krb5_context context, krb5_const_principal searchfor)
         goto cleankey;
     dbret = (*db->del) (db, &key, 0);
     retval = dbret ? errno : 0;
+    if (retval == 0)
+        krb5_db2_lockout_sync(context, searchfor, NULL);
 cleankey:
     krb5_free_data_contents(context, &keydata);
 
@@ -1080,6 +1365,7 @@ krb5_db2_destroy(krb5_context context, char *conf_section, char **db_args)
     krb5_error_code status;
     krb5_db2_context *dbc;
     char *dbname = NULL, *lockname = NULL, *polname = NULL, *plockname = NULL;
+    char *lockoutname = NULL;
 
     if (inited(context)) {
         status = krb5_db2_fini(context);
@@ -1101,6 +1387,15 @@ krb5_db2_destroy(krb5_context context, char *conf_section, char **db_args)
     status = ctx_allfiles(dbc, &dbname, &lockname, &polname, &plockname);
     if (status)
         goto cleanup;
+    /* Send processes reading without the lock down the locked path. */
+    dbc->db_lf_file = open(lockname, O_RDWR);
+    if (dbc->db_lf_file >= 0) {
+        ctx_map_gen(dbc);
+        ctx_set_gen_writing(dbc, TRUE);
+        ctx_unmap_gen(dbc);
+        close(dbc->db_lf_file);
+        dbc->db_lf_file = -1;
+    }
     status = destroy_file(dbname);
     if (status)
         goto cleanup;
@@ -1110,6 +1405,8 @@ krb5_db2_destroy(krb5_context context, char *conf_section, char **db_args)
     status = osa_adb_destroy_db(polname, plockname, OSA_ADB_POLICY_DB_MAGIC);
     if (status)
         return status;
+    if (ctx_dbsuffix(dbc, SUFFIX_LOCKOUT, &lockoutname) == 0)
+        (void) unlink(lockoutname);
 
     status = krb5_db2_fini(context);
 
@@ -1118,6 +1415,7 @@ cleanup:
     free(lockname);
     free(polname);
     free(plockname);
+    free(lockoutname);
     return status;
 }
 
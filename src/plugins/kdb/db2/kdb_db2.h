@@ -43,17 +43,30 @@ typedef struct _krb5_db2_context {
     int                 db_locks_held;  /* Number of times locked       */
     int                 db_lock_mode;   /* Last lock mode, e.g. greatest*/
     krb5_boolean        db_nb_locks;    /* [Non]Blocking lock modes     */
+    krb5_ui_4          *db_gen;         /* Generation counter in lock file */
+    krb5_boolean        db_gen_rw;      /* db_gen mapped read/write     */
+    DB *                db_ro;          /* Unlocked read-only DB handle */
+    krb5_ui_4           db_ro_gen;      /* Generation db_ro was opened at */
     osa_adb_policy_t    policy_db;
     krb5_boolean        tempdb;
     krb5_boolean        disable_last_success;
     krb5_boolean        disable_lockout;
+    int                 lockout_entries;  /* Lockout table size, or 0   */
+    int                 lockout_flush_interval;
+    int                 lockout_fd;     /* Lockout table file, or -1    */
+    void *              lockout_table;  /* Mapped lockout table         */
+    size_t              lockout_size;   /* Size of lockout_table        */
 } krb5_db2_context;
 
+/* Suffix of the shared lockout table file; see lockout.c. */
+#define SUFFIX_LOCKOUT ".lockout"
+
 #define KRB5_DB2_MAX_RETRY 5
 
 krb5_error_code krb5_db2_init(krb5_context);
 krb5_error_code krb5_db2_fini(krb5_context);
 krb5_error_code krb5_db2_get_age(krb5_context, char *, time_t *);
+krb5_error_code krb5_db2_get_generation(krb5_context, krb5_ui_4 *);
 krb5_error_code krb5_db2_get_principal(krb5_context, krb5_const_principal,
                                        unsigned int, krb5_db_entry **);
 void krb5_db2_free_principal(krb5_context, krb5_db_entry *);
@@ -131,6 +144,13 @@ krb5_db2_lockout_audit(krb5_context context,
                        krb5_timestamp stamp,
                        krb5_error_code status);
 
+void
+krb5_db2_lockout_sync(krb5_context context, krb5_const_principal princ,
+                      krb5_db_entry *entry);
+
+void
+krb5_db2_lockout_fini(krb5_context context);
+
 krb5_error_code
 krb5_db2_check_policy_as(krb5_context kcontext, krb5_kdc_req *request,
                          krb5_db_entry *client, krb5_db_entry *server,
@@ -72,6 +72,19 @@ __bt_get(dbp, key, data, flags)
 
 	t = dbp->internal;
 
+	/* Fail rather than read pages which are not cached. */
+	if (flags == R_CACHEONLY) {
+		t->bt_mp->cacheonly = 1;
+		t->bt_mp->missed = 0;
+		status = __bt_get(dbp, key, data, 0);
+		t->bt_mp->cacheonly = 0;
+		if (t->bt_mp->missed) {
+			errno = EAGAIN;
+			return (RET_ERROR);
+		}
+		return (status);
+	}
+
 	/* Toss any page pinned across calls. */
 	if (t->bt_pinned != NULL) {
 		mpool_put(t->bt_mp, t->bt_pinned, 0);
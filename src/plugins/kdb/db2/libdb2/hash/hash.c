@@ -630,13 +630,29 @@ hash_get(dbp, key, data, flag)
 	u_int32_t flag;
 {
 	HTAB *hashp;
+	int32_t ret;
 
 	hashp = (HTAB *)dbp->internal;
-	if (flag) {
+	if (flag && flag != R_CACHEONLY) {
 		hashp->local_errno = errno = EINVAL;
 		return (ERROR);
 	}
-	return (hash_access(hashp, HASH_GET, key, data));
+	if (flag != R_CACHEONLY)
+		return (hash_access(hashp, HASH_GET, key, data));
+
+	/*
+	 * Fail if any page needed was not cached.  The lookup code does not
+	 * always distinguish a failed page get from a missing key.
+	 */
+	hashp->mp->cacheonly = 1;
+	hashp->mp->missed = 0;
+	ret = hash_access(hashp, HASH_GET, key, data);
+	hashp->mp->cacheonly = 0;
+	if (hashp->mp->missed) {
+		hashp->local_errno = errno = EAGAIN;
+		return (ERROR);
+	}
+	return (ret);
 }
 
 static int32_t
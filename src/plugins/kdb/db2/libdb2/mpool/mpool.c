@@ -218,6 +218,13 @@ mpool_get(mp, pgno, flags)
 		return (bp->page);
 	}
 
+	/* Don't read the file if the caller only wants cached pages. */
+	if (mp->cacheonly) {
+		mp->missed = 1;
+		errno = EAGAIN;
+		return (NULL);
+	}
+
 	/* Get a page from the cache. */
 	if ((bp = mpool_bkt(mp)) == NULL)
 		return (NULL);
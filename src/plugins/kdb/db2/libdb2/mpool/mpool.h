@@ -72,6 +72,8 @@ typedef struct MPOOL {
 					/* page out conversion routine */
 	void    (*pgout) __P((void *, db_pgno_t, void *));
 	void	*pgcookie;		/* cookie for page in/out routines */
+	int	cacheonly;		/* fail gets of uncached pages */
+	int	missed;			/* a cacheonly get has failed */
 #ifdef STATISTICS
 	u_long	cachehit;
 	u_long	cachemiss;
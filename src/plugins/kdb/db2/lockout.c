@@ -31,12 +31,506 @@
 #include <kadm5/server_internal.h>
 #include "kdb5.h"
 #include "kdb_db2.h"
+#include "adm_proto.h"
+#include <sys/mman.h>
+#include <syslog.h>
 
 /*
  * Helper routines for databases that wish to use the default
  * principal lockout functionality.
  */
 
+/*
+ * If lockout_table_entries is set, the lockout fields of principals which
+ * have been audited are kept in a table in a file next to the database,
+ * mapped into every KDC process (and thus shared by worker processes).  The
+ * table is authoritative for lockout decisions, and dirty entries are written
+ * back to the database in one batch, under a single exclusive lock, at most
+ * every lockout_flush_interval seconds and when the database is closed.  This
+ * keeps failed authentications from turning every request into a database
+ * write.
+ *
+ * Administrative changes made through kadm5 update the table entry when the
+ * principal is written (see krb5_db2_lockout_sync()): an unlock or a new
+ * principal reseeds the entry from the database, and a deletion drops it.
+ * Each seeding gives the entry a new generation number, and a flush writes an
+ * entry back only if its generation is unchanged, so a flush never overwrites
+ * an administrative change made after the entry was collected.  Table entries
+ * also record the last administrative modification time of the principal
+ * entry; if the database entry was modified by other means (for instance,
+ * loaded by kdb5_util), the table entry is seeded again on lookup, and is not
+ * written back.  Clean entries may be replaced by other principals.
+ * Principals which cannot get a table entry, because their name is too long
+ * or all candidate entries are dirty, are updated in the database directly.
+ *
+ * If the table file has a different size from the one configured, it is
+ * resized, keeping the entries which fit.  Other processes notice the new
+ * size in the header and map the table again.
+ *
+ * The table is protected by a file lock on the table file.  When both are
+ * needed, the database lock is taken before the table lock.
+ */
+
+#define LOCKOUT_TABLE_MAGIC 0x4b444c54  /* "KDLT" */
+#define LOCKOUT_NAME_MAX 256            /* including terminator */
+#define LOCKOUT_PROBE 8                 /* entries examined per lookup */
+
+#define SLOT_USED  0x1
+#define SLOT_DIRTY 0x2
+
+struct lockout_header {
+    krb5_ui_4 magic;
+    krb5_ui_4 nslots;
+    krb5_timestamp next_flush;
+    krb5_ui_4 next_gen;
+};
+
+struct lockout_slot {
+    krb5_ui_4 hash;
+    krb5_ui_4 flags;
+    krb5_ui_4 gen;                      /* changes each time slot is seeded */
+    krb5_timestamp mod_time;
+    krb5_kvno fail_auth_count;
+    krb5_timestamp last_failed;
+    krb5_timestamp last_success;
+    char name[LOCKOUT_NAME_MAX];
+};
+
+#define TABLE_HEADER(dbc) ((struct lockout_header *)(dbc)->lockout_table)
+#define TABLE_SLOTS(dbc) ((struct lockout_slot *)(TABLE_HEADER(dbc) + 1))
+
+#define TABLE_SIZE(nslots) \
+    (sizeof(struct lockout_header) + (nslots) * sizeof(struct lockout_slot))
+
+static struct lockout_slot *find_slot(krb5_db2_context *dbc, const char *name,
+                                      krb5_boolean create);
+static void write_batch(krb5_context context, struct lockout_slot *batch,
+                        unsigned int n, krb5_boolean check);
+
+/* Map size bytes of the table file for dbc, replacing any current mapping.
+ * Return true on success. */
+static krb5_boolean
+map_table(krb5_db2_context *dbc, size_t size)
+{
+    void *p;
+
+    if (dbc->lockout_table != NULL)
+        (void) munmap(dbc->lockout_table, dbc->lockout_size);
+    dbc->lockout_table = NULL;
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, dbc->lockout_fd,
+             0);
+    if (p == MAP_FAILED)
+        return FALSE;
+    dbc->lockout_table = p;
+    dbc->lockout_size = size;
+    return TRUE;
+}
+
+/* After locking the table, map it again if another process has resized it.
+ * Return true if the table is usable. */
+static krb5_boolean
+check_table(krb5_db2_context *dbc)
+{
+    size_t size = TABLE_SIZE(TABLE_HEADER(dbc)->nslots);
+
+    return size == dbc->lockout_size || map_table(dbc, size);
+}
+
+/*
+ * Reinitialize the table file with nslots empty slots, carrying over the
+ * entries of old (an array of oldn slots) which fit.  Dirty entries which do
+ * not fit are returned in *leftover_out, to be written to the database
+ * after the table is unlocked.  The caller must hold the table lock.
+ */
+static krb5_error_code
+init_table(krb5_db2_context *dbc, krb5_ui_4 nslots, krb5_ui_4 next_gen,
+           struct lockout_slot *old, unsigned int oldn,
+           struct lockout_slot **leftover_out, unsigned int *nleftover_out)
+{
+    struct lockout_header hdr;
+    struct lockout_slot *slot, *leftover = NULL;
+    unsigned int i, nleftover = 0;
+
+    *leftover_out = NULL;
+    *nleftover_out = 0;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = LOCKOUT_TABLE_MAGIC;
+    hdr.nslots = nslots;
+    hdr.next_gen = next_gen;
+    if (ftruncate(dbc->lockout_fd, 0) != 0 ||
+        lseek(dbc->lockout_fd, 0, SEEK_SET) != 0 ||
+        write(dbc->lockout_fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        ftruncate(dbc->lockout_fd, TABLE_SIZE(nslots)) != 0 ||
+        !map_table(dbc, TABLE_SIZE(nslots)))
+        return errno;
+
+    for (i = 0; i < oldn; i++) {
+        if (!(old[i].flags & SLOT_USED))
+            continue;
+        slot = find_slot(dbc, old[i].name, TRUE);
+        if (slot != NULL) {
+            *slot = old[i];
+        } else if (old[i].flags & SLOT_DIRTY) {
+            if (leftover == NULL)
+                leftover = calloc(oldn, sizeof(*leftover));
+            if (leftover != NULL)
+                leftover[nleftover++] = old[i];
+        }
+    }
+    *leftover_out = leftover;
+    *nleftover_out = nleftover;
+    return 0;
+}
+
+/* Open and map the lockout table for dbc if it is configured and we haven't
+ * already.  On failure, leave the table unmapped; we then update the database
+ * directly, as if the table were not configured. */
+static void
+open_table(krb5_context context, krb5_db2_context *dbc)
+{
+    char *fname;
+    struct stat st;
+    struct lockout_header hdr;
+    struct lockout_slot *old = NULL, *leftover = NULL;
+    unsigned int oldn = 0, nleftover = 0;
+    int fd;
+
+    if (dbc->lockout_table != NULL || dbc->lockout_fd != -1 ||
+        dbc->lockout_entries <= 0 || dbc->tempdb)
+        return;
+    if (asprintf(&fname, "%s%s", dbc->db_name, SUFFIX_LOCKOUT) < 0)
+        return;
+    fd = open(fname, O_RDWR | O_CREAT, 0600);
+    /* Remember the failure so that we don't retry on every request. */
+    dbc->lockout_fd = fd;
+    if (fd < 0)
+        goto cleanup;
+    set_cloexec_fd(fd);
+
+    /* Initialize the table if we are the first to open it, or resize it if
+     * it does not match our configuration. */
+    if (krb5_lock_file(context, fd, KRB5_LOCKMODE_EXCLUSIVE) != 0)
+        goto cleanup;
+    if (fstat(fd, &st) != 0)
+        goto unlock;
+    memset(&hdr, 0, sizeof(hdr));
+    if (st.st_size == 0) {
+        (void) init_table(dbc, dbc->lockout_entries, 0, NULL, 0, &leftover,
+                          &nleftover);
+        goto unlock;
+    }
+    if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        hdr.magic != LOCKOUT_TABLE_MAGIC ||
+        (off_t)TABLE_SIZE(hdr.nslots) != st.st_size) {
+        krb5_klog_syslog(LOG_ERR, _("Lockout table %s%s is invalid; "
+                                    "reinitializing it"),
+                         dbc->db_name, SUFFIX_LOCKOUT);
+        (void) init_table(dbc, dbc->lockout_entries, 0, NULL, 0, &leftover,
+                          &nleftover);
+        goto unlock;
+    }
+    if (hdr.nslots == (krb5_ui_4)dbc->lockout_entries) {
+        (void) map_table(dbc, TABLE_SIZE(hdr.nslots));
+        goto unlock;
+    }
+
+    krb5_klog_syslog(LOG_NOTICE, _("Resizing lockout table %s%s from %u to "
+                                   "%d entries"), dbc->db_name,
+                     SUFFIX_LOCKOUT, (unsigned int)hdr.nslots,
+                     dbc->lockout_entries);
+    old = calloc(hdr.nslots, sizeof(*old));
+    if (old == NULL ||
+        read(fd, old, hdr.nslots * sizeof(*old)) !=
+        (ssize_t)(hdr.nslots * sizeof(*old)))
+        goto unlock;
+    oldn = hdr.nslots;
+    (void) init_table(dbc, dbc->lockout_entries, hdr.next_gen, old, oldn,
+                      &leftover, &nleftover);
+
+unlock:
+    (void) krb5_lock_file(context, fd, KRB5_LOCKMODE_UNLOCK);
+    if (nleftover > 0) {
+        krb5_klog_syslog(LOG_NOTICE, _("Writing %u lockout table entries "
+                                       "which no longer fit to the database"),
+                         nleftover);
+        write_batch(context, leftover, nleftover, FALSE);
+    }
+cleanup:
+    free(fname);
+    free(old);
+    free(leftover);
+}
+
+/*
+ * Find the table entry for name.  If there is none and create is true, return
+ * an unused or clean entry which may be taken over for name.  The caller must
+ * hold the table lock.
+ */
+static struct lockout_slot *
+find_slot(krb5_db2_context *dbc, const char *name, krb5_boolean create)
+{
+    struct lockout_header *hdr = TABLE_HEADER(dbc);
+    struct lockout_slot *slot, *victim = NULL;
+    krb5_ui_4 hash = k5_fnv_bytes(K5_FNV_INIT, name, strlen(name));
+    unsigned int i;
+
+    for (i = 0; i < LOCKOUT_PROBE && i < hdr->nslots; i++) {
+        slot = &TABLE_SLOTS(dbc)[(hash + i) % hdr->nslots];
+        if (!(slot->flags & SLOT_USED)) {
+            if (victim == NULL || (victim->flags & SLOT_USED))
+                victim = slot;
+        } else if (slot->hash == hash && strcmp(slot->name, name) == 0) {
+            return slot;
+        } else if (!(slot->flags & SLOT_DIRTY) && victim == NULL) {
+            victim = slot;
+        }
+    }
+    if (!create || victim == NULL)
+        return NULL;
+    memset(victim, 0, sizeof(*victim));
+    victim->hash = hash;
+    strlcpy(victim->name, name, sizeof(victim->name));
+    return victim;
+}
+
+/* Return the time of the last administrative modification of entry. */
+static krb5_timestamp
+entry_mod_time(krb5_context context, krb5_db_entry *entry)
+{
+    krb5_timestamp mod_time = 0;
+    krb5_principal mod_princ = NULL;
+
+    (void) krb5_dbe_lookup_mod_princ_data(context, entry, &mod_time,
+                                          &mod_princ);
+    krb5_free_principal(context, mod_princ);
+    return mod_time;
+}
+
+/*
+ * Lock the lockout table and look up the entry for entry's principal, seeding
+ * it from entry if create is true and it is new or stale.  Copy the lockout
+ * fields of a current table entry into entry.  On success, the caller must
+ * unlock the table with unlock_table().  Return NULL if the table is not in
+ * use or has no entry for the principal.
+ */
+static struct lockout_slot *
+lock_slot(krb5_context context, krb5_db_entry *entry, krb5_boolean create)
+{
+    krb5_db2_context *dbc = context->dal_handle->db_context;
+    struct lockout_slot *slot;
+    krb5_timestamp mod_time;
+    char *name;
+
+    open_table(context, dbc);
+    if (dbc->lockout_table == NULL)
+        return NULL;
+    if (krb5_unparse_name(context, entry->princ, &name) != 0)
+        return NULL;
+    if (strlen(name) >= LOCKOUT_NAME_MAX ||
+        krb5_lock_file(context, dbc->lockout_fd,
+                       create ? KRB5_LOCKMODE_EXCLUSIVE :
+                       KRB5_LOCKMODE_SHARED) != 0) {
+        free(name);
+        return NULL;
+    }
+
+    mod_time = entry_mod_time(context, entry);
+    slot = check_table(dbc) ? find_slot(dbc, name, create) : NULL;
+    free(name);
+    if (slot != NULL && (!(slot->flags & SLOT_USED) ||
+                         slot->mod_time != mod_time)) {
+        if (!create) {
+            slot = NULL;
+        } else {
+            slot->flags = SLOT_USED;
+            slot->gen = TABLE_HEADER(dbc)->next_gen++;
+            slot->mod_time = mod_time;
+            slot->fail_auth_count = entry->fail_auth_count;
+            slot->last_failed = entry->last_failed;
+            slot->last_success = entry->last_success;
+        }
+    }
+    if (slot == NULL) {
+        (void) krb5_lock_file(context, dbc->lockout_fd, KRB5_LOCKMODE_UNLOCK);
+        return NULL;
+    }
+
+    entry->fail_auth_count = slot->fail_auth_count;
+    entry->last_failed = slot->last_failed;
+    entry->last_success = slot->last_success;
+    return slot;
+}
+
+static void
+unlock_table(krb5_context context)
+{
+    krb5_db2_context *dbc = context->dal_handle->db_context;
+
+    (void) krb5_lock_file(context, dbc->lockout_fd, KRB5_LOCKMODE_UNLOCK);
+}
+
+/*
+ * Write the lockout fields of the n table entries in batch to the database,
+ * under one exclusive database lock.  If check is true, skip entries whose
+ * table slot has been seeded again since the batch was collected, or whose
+ * database entry has been modified other than through the table.  Errors are
+ * ignored; the table remains authoritative, and a principal which has since
+ * been deleted has no entry to update.
+ */
+static void
+write_batch(krb5_context context, struct lockout_slot *batch, unsigned int n,
+            krb5_boolean check)
+{
+    krb5_db2_context *dbc = context->dal_handle->db_context;
+    struct lockout_slot *slot;
+    krb5_principal princ;
+    krb5_db_entry *entry;
+    krb5_timestamp mod_time;
+    krb5_boolean current;
+    unsigned int i;
+
+    if (krb5_db2_lock(context, KRB5_DB_LOCKMODE_EXCLUSIVE) != 0)
+        return;
+    for (i = 0; i < n; i++) {
+        /* Holding the database lock keeps krb5_db2_lockout_sync() from
+         * reseeding the slot until we have written the entry. */
+        mod_time = batch[i].mod_time;
+        if (check) {
+            if (krb5_lock_file(context, dbc->lockout_fd,
+                               KRB5_LOCKMODE_SHARED) != 0)
+                continue;
+            slot = check_table(dbc) ? find_slot(dbc, batch[i].name, FALSE) :
+                NULL;
+            current = (slot != NULL && slot->gen == batch[i].gen);
+            if (current)
+                mod_time = slot->mod_time;
+            unlock_table(context);
+            if (!current)
+                continue;
+        }
+        if (krb5_parse_name(context, batch[i].name, &princ) != 0)
+            continue;
+        if (krb5_db2_get_principal(context, princ, 0, &entry) == 0) {
+            if (!check || entry_mod_time(context, entry) == mod_time) {
+                entry->fail_auth_count = batch[i].fail_auth_count;
+                entry->last_failed = batch[i].last_failed;
+                entry->last_success = batch[i].last_success;
+                (void) krb5_db2_put_principal(context, entry, NULL);
+            }
+            krb5_db2_free_principal(context, entry);
+        }
+        krb5_free_principal(context, princ);
+    }
+    (void) krb5_db2_unlock(context);
+}
+
+/* Write dirty lockout table entries back to the database, if the flush
+ * interval has passed or force is true. */
+static void
+flush_table(krb5_context context, krb5_boolean force)
+{
+    krb5_db2_context *dbc = context->dal_handle->db_context;
+    struct lockout_header *hdr;
+    struct lockout_slot *slot, *batch = NULL;
+    krb5_timestamp now;
+    unsigned int i, n = 0;
+
+    if (dbc->lockout_table == NULL)
+        return;
+    now = time(NULL);
+    if (!force && now < TABLE_HEADER(dbc)->next_flush)
+        return;
+
+    /* Collect and clean the dirty entries under the table lock. */
+    if (krb5_lock_file(context, dbc->lockout_fd, KRB5_LOCKMODE_EXCLUSIVE))
+        return;
+    if (check_table(dbc) && (force || now >= TABLE_HEADER(dbc)->next_flush)) {
+        hdr = TABLE_HEADER(dbc);
+        hdr->next_flush = now + dbc->lockout_flush_interval;
+        for (i = 0; i < hdr->nslots; i++) {
+            if (TABLE_SLOTS(dbc)[i].flags & SLOT_DIRTY)
+                n++;
+        }
+        batch = (n > 0) ? calloc(n, sizeof(*batch)) : NULL;
+        n = 0;
+        for (i = 0; batch != NULL && i < hdr->nslots; i++) {
+            slot = &TABLE_SLOTS(dbc)[i];
+            if (slot->flags & SLOT_DIRTY) {
+                batch[n++] = *slot;
+                slot->flags &= ~SLOT_DIRTY;
+            }
+        }
+    }
+    unlock_table(context);
+    if (batch == NULL)
+        return;
+    write_batch(context, batch, n, TRUE);
+    free(batch);
+}
+
+/*
+ * Bring the lockout table entry for princ up to date after entry (or, if
+ * entry is NULL, the deletion of princ) has been written to the database.
+ * An administrative change to the lockout fields, or a new principal, reseeds
+ * the table entry from entry; a deletion drops it; other changes only record
+ * the new modification time, leaving the table's lockout fields
+ * authoritative.  The caller must hold the database lock.
+ */
+void
+krb5_db2_lockout_sync(krb5_context context, krb5_const_principal princ,
+                      krb5_db_entry *entry)
+{
+    krb5_db2_context *dbc = context->dal_handle->db_context;
+    struct lockout_slot *slot;
+    char *name;
+
+    if (entry != NULL && entry->mask == 0)
+        return;
+    open_table(context, dbc);
+    if (dbc->lockout_table == NULL)
+        return;
+    if (krb5_unparse_name(context, princ, &name) != 0)
+        return;
+    if (krb5_lock_file(context, dbc->lockout_fd,
+                       KRB5_LOCKMODE_EXCLUSIVE) != 0) {
+        free(name);
+        return;
+    }
+    slot = check_table(dbc) ? find_slot(dbc, name, FALSE) : NULL;
+    free(name);
+    if (slot == NULL) {
+        /* Nothing to do; a new entry is seeded on lookup. */
+    } else if (entry == NULL) {
+        memset(slot, 0, sizeof(*slot));
+    } else if (entry->mask & (KADM5_PRINCIPAL | KADM5_FAIL_AUTH_COUNT |
+                              KADM5_LAST_FAILED | KADM5_LAST_SUCCESS)) {
+        slot->flags = SLOT_USED;
+        slot->gen = TABLE_HEADER(dbc)->next_gen++;
+        slot->mod_time = entry_mod_time(context, entry);
+        slot->fail_auth_count = entry->fail_auth_count;
+        slot->last_failed = entry->last_failed;
+        slot->last_success = entry->last_success;
+    } else {
+        slot->mod_time = entry_mod_time(context, entry);
+    }
+    unlock_table(context);
+}
+
+/* Flush and release the lockout table, if we have it open. */
+void
+krb5_db2_lockout_fini(krb5_context context)
+{
+    krb5_db2_context *dbc = context->dal_handle->db_context;
+
+    flush_table(context, TRUE);
+    if (dbc->lockout_table != NULL)
+        (void) munmap(dbc->lockout_table, dbc->lockout_size);
+    if (dbc->lockout_fd != -1)
+        close(dbc->lockout_fd);
+    dbc->lockout_table = NULL;
+    dbc->lockout_fd = -1;
+}
+
 static krb5_error_code
 lookup_lockout_policy(krb5_context context,
                       krb5_db_entry *entry,
@@ -132,6 +626,11 @@ krb5_db2_lockout_check_policy(krb5_context context,
     if (code != 0)
         return code;
 
+    /* Use the lockout table's view of the entry, if it has one. */
+    if (lock_slot(context, entry, FALSE) != NULL)
+        unlock_table(context);
+    flush_table(context, FALSE);
+
     if (locked_check_p(context, stamp, max_fail, lockout_duration, entry))
         return KRB5KDC_ERR_CLIENT_REVOKED;
 
@@ -151,6 +650,7 @@ krb5_db2_lockout_audit(krb5_context context,
     krb5_db2_context *db_ctx = context->dal_handle->db_context;
     krb5_boolean need_update = FALSE;
     krb5_timestamp unlock_time;
+    struct lockout_slot *slot;
 
     switch (status) {
     case 0:
@@ -175,6 +675,8 @@ krb5_db2_lockout_audit(krb5_context context,
             return code;
     }
 
+    slot = lock_slot(context, entry, TRUE);
+
     /*
      * Don't continue to modify the DB for an already locked account.
      * (In most cases, status will be KRB5KDC_ERR_CLIENT_REVOKED, and
@@ -182,7 +684,7 @@ krb5_db2_lockout_audit(krb5_context context,
      * integrity error or preauth failure before a policy check.)
      */
     if (locked_check_p(context, stamp, max_fail, lockout_duration, entry))
-        return 0;
+        goto done;
 
     /* Only mark the authentication as successful if the entry
      * required preauthentication, otherwise we have no idea. */
@@ -216,11 +718,20 @@ krb5_db2_lockout_audit(krb5_context context,
         need_update = TRUE;
     }
 
-    if (need_update) {
+    if (need_update && slot != NULL) {
+        slot->fail_auth_count = entry->fail_auth_count;
+        slot->last_failed = entry->last_failed;
+        slot->last_success = entry->last_success;
+        slot->flags |= SLOT_DIRTY;
+    } else if (need_update) {
         code = krb5_db2_put_principal(context, entry, NULL);
         if (code != 0)
             return code;
     }
 
+done:
+    if (slot != NULL)
+        unlock_table(context);
+    flush_table(context, FALSE);
     return 0;
 }
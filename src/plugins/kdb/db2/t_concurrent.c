@@ -0,0 +1,201 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* plugins/kdb/db2/t_concurrent.c - Test unlocked reads during writes */
+/*
+ * Copyright (C) 2012 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Export of this software from the United States of America may
+ *   require a specific license from the United States Government.
+ *   It is the responsibility of any person or organization contemplating
+ *   export to obtain such a license before exporting.
+ *
+ * WITHIN THAT CONSTRAINT, permission to use, copy, modify, and
+ * distribute this software and its documentation for any purpose and
+ * without fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright notice and
+ * this permission notice appear in supporting documentation, and that
+ * the name of M.I.T. not be used in advertising or publicity pertaining
+ * to distribution of the software without specific, written prior
+ * permission.  Furthermore if you modify this software you must label
+ * your software as modified software and not distribute it in such a
+ * fashion that it might be confused with the original M.I.T. software.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is" without express
+ * or implied warranty.
+ */
+
+/*
+ * This program forks a writer process which repeatedly rewrites a principal
+ * entry, alternating between a small and a large version, while the parent
+ * looks the principal up in KDC mode (which reads cached pages without the
+ * lock while the generation counter is stable, and takes the lock to refill
+ * them after a change).  Every entry the reader sees must be one of the two
+ * versions in full.  The reader stops after seeing the entry change a
+ * number of times, and tells the writer to stop by closing a pipe.
+ */
+
+#include "k5-int.h"
+#include <kdb.h>
+#include <sys/wait.h>
+
+#define NCHANGES 200
+
+/* The two versions of the entry differ in max_life and in the length and
+ * contents of a string attribute. */
+static const krb5_deltat lives[2] = { 1000, 2000 };
+static const size_t padlens[2] = { 50, 3000 };
+static const char padchars[2] = { 'a', 'b' };
+
+static void
+check(krb5_error_code code, const char *what)
+{
+    if (code) {
+        com_err("t_concurrent", code, "%s", what);
+        exit(1);
+    }
+}
+
+static void
+write_version(krb5_context ctx, krb5_principal princ, int v)
+{
+    krb5_db_entry *ent;
+    char pad[3001];
+
+    check(krb5_db_get_principal(ctx, princ, 0, &ent), "while reading entry");
+    ent->max_life = lives[v];
+    memset(pad, padchars[v], padlens[v]);
+    pad[padlens[v]] = '\0';
+    check(krb5_dbe_set_string(ctx, ent, "pad", pad), "while setting pad");
+    check(krb5_db_put_principal(ctx, ent), "while writing entry");
+    krb5_db_free_principal(ctx, ent);
+}
+
+/* Return which version ent is, or exit if it is neither. */
+static int
+entry_version(krb5_context ctx, krb5_db_entry *ent)
+{
+    char *pad;
+    size_t i;
+    int v;
+
+    v = (ent->max_life == lives[1]);
+    if (ent->max_life != lives[v]) {
+        fprintf(stderr, "Unexpected max_life %d\n", (int)ent->max_life);
+        exit(1);
+    }
+    check(krb5_dbe_get_string(ctx, ent, "pad", &pad), "while reading pad");
+    if (pad == NULL || strlen(pad) != padlens[v]) {
+        fprintf(stderr, "Pad does not match max_life %d\n",
+                (int)ent->max_life);
+        exit(1);
+    }
+    for (i = 0; i < padlens[v]; i++) {
+        if (pad[i] != padchars[v]) {
+            fprintf(stderr, "Corrupt pad for max_life %d\n",
+                    (int)ent->max_life);
+            exit(1);
+        }
+    }
+    krb5_dbe_free_string(ctx, pad);
+    return v;
+}
+
+static void
+run_writer(int stopfd)
+{
+    krb5_context ctx;
+    krb5_principal princ;
+    struct timespec ts;
+    char c;
+    int v = 1;
+
+    /* Parsing the name also sets the default realm, which the KDB needs. */
+    check(krb5int_init_context_kdc(&ctx), "while initializing context");
+    check(krb5_parse_name(ctx, "user", &princ), "while parsing name");
+    check(krb5_db_open(ctx, NULL, KRB5_KDB_OPEN_RW | KRB5_KDB_SRV_TYPE_ADMIN),
+          "while opening database for writing");
+    /* Stop when the parent closes its end of the pipe. */
+    while (read(stopfd, &c, 1) < 0 && errno == EAGAIN) {
+        write_version(ctx, princ, v);
+        v = !v;
+        /* Pause so that the reader, which gives up on a lock held by the
+         * writer and sleeps before retrying, gets a chance to take it. */
+        ts.tv_sec = 0;
+        ts.tv_nsec = 20 * 1000 * 1000;
+        (void) nanosleep(&ts, NULL);
+    }
+    krb5_db_fini(ctx);
+    krb5_free_principal(ctx, princ);
+    krb5_free_context(ctx);
+    exit(0);
+}
+
+int
+main(int argc, char **argv)
+{
+    krb5_context ctx;
+    krb5_principal princ;
+    krb5_db_entry *ent;
+    krb5_error_code ret;
+    int fds[2], status, v, last, changes = 0;
+    unsigned long reads = 0, busy = 0;
+    pid_t pid;
+
+    check(krb5int_init_context_kdc(&ctx), "while initializing context");
+    check(krb5_parse_name(ctx, "user", &princ), "while parsing name");
+
+    /* Start from the first version. */
+    check(krb5_db_open(ctx, NULL, KRB5_KDB_OPEN_RW | KRB5_KDB_SRV_TYPE_ADMIN),
+          "while opening database for writing");
+    write_version(ctx, princ, 0);
+    krb5_db_fini(ctx);
+
+    if (pipe(fds) != 0 || fcntl(fds[0], F_SETFL, O_NONBLOCK) != 0) {
+        perror("pipe");
+        return 1;
+    }
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0) {
+        close(fds[1]);
+        run_writer(fds[0]);
+    }
+    close(fds[0]);
+
+    /* Give up if the writer never seems to make progress. */
+    alarm(120);
+    check(krb5_db_open(ctx, NULL, KRB5_KDB_OPEN_RO | KRB5_KDB_SRV_TYPE_KDC),
+          "while opening database for reading");
+    last = 0;
+    while (changes < NCHANGES) {
+        /* KDC-mode lookups fail rather than wait if the writer holds the
+         * lock; just try again. */
+        ret = krb5_db_get_principal(ctx, princ, 0, &ent);
+        if (ret == KRB5_KDB_DB_INUSE) {
+            busy++;
+            continue;
+        }
+        check(ret, "while looking up entry");
+        v = entry_version(ctx, ent);
+        krb5_db_free_principal(ctx, ent);
+        if (v != last)
+            changes++;
+        last = v;
+        reads++;
+    }
+    krb5_db_fini(ctx);
+
+    close(fds[1]);
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Writer process failed\n");
+        return 1;
+    }
+    printf("%lu reads (%lu busy), %d changes seen\n", reads, busy, changes);
+    krb5_free_principal(ctx, princ);
+    krb5_free_context(ctx);
+    return 0;
+}
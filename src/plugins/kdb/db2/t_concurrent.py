@@ -0,0 +1,9 @@
+#!/usr/bin/python
+from k5test import *
+
+# Check that KDC-mode lookups, which read the database without taking
+# the lock, see consistent entries while another process writes.
+realm = K5Realm(start_kdc=False, start_kadmind=False, create_host=False)
+realm.run_as_master(['./t_concurrent'])
+
+success('db2 unlocked reads during writes')
@@ -62,6 +62,7 @@ extern struct timeval timelimit;
 #define  SERV_COUNT                  100
 #define  DEFAULT_CONNS_PER_SERVER    5
 #define  REALM_READ_REFRESH_INTERVAL (5 * 60)
+#define  SERVER_RETRY_INTERVAL       30  /* seconds before retrying an OFF server */
 
 #ifdef HAVE_EDIRECTORY
 #define  SECURITY_CONTAINER "cn=Security"
@@ -176,7 +176,7 @@ krb5_ldap_initialize(krb5_ldap_context *ldap_context,
         st = KRB5_KDB_ACCESS_ERROR;
         server_info->server_status = OFF;
         time(&server_info->downtime);
-        /* ldap_unbind_s(ldap_server_handle->ldap_handle); */
+        ldap_unbind_ext_s(ldap_server_handle->ldap_handle, NULL, NULL);
         free(ldap_server_handle);
     }
 
@@ -272,10 +272,19 @@ krb5_ldap_db_single_init(krb5_ldap_context *ldap_context)
     krb5_error_code             st=0;
     int                         cnt=0;
     krb5_ldap_server_info       *server_info=NULL;
-
+    time_t                      now;
+
+    /*
+     * Prefer servers which are up and below their connection limit.  A
+     * server marked OFF is given another chance once SERVER_RETRY_INTERVAL
+     * has passed since it went down, so that the pool recovers after an
+     * outage without waiting for every other server to fail.
+     */
+    time(&now);
     while (ldap_context->server_info_list[cnt] != NULL) {
         server_info = ldap_context->server_info_list[cnt];
-        if ((server_info->server_status == NOTSET || server_info->server_status == ON)) {
+        if (server_info->server_status != OFF ||
+            now - server_info->downtime >= SERVER_RETRY_INTERVAL) {
             if (server_info->num_conns < ldap_context->max_server_conns-1) {
                 st = krb5_ldap_initialize(ldap_context, server_info);
                 if (st == LDAP_SUCCESS)
@@ -306,6 +315,7 @@ krb5_ldap_rebind(krb5_ldap_context *ldap_context,
     krb5_ldap_server_handle     *handle = *ldap_server_handle;
 
     ldap_unbind_ext_s(handle->ldap_handle, NULL, NULL);
+    handle->ldap_handle = NULL;
     if ((ldap_initialize(&handle->ldap_handle, handle->server_info->server_name) != LDAP_SUCCESS)
         || (krb5_ldap_bind(ldap_context, handle) != LDAP_SUCCESS))
         return krb5_ldap_request_next_handle_from_pool(ldap_context, ldap_server_handle);
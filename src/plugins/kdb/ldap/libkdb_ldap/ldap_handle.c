@@ -187,6 +187,8 @@ krb5_update_ldap_handle(krb5_ldap_server_handle *ldap_server_handle,
 /*
  * Free up all the ldap server handles of the server info.
  * This function is called when the ldap server returns LDAP_SERVER_DOWN.
+ * The connections are closed and no longer count against the server's
+ * connection limit, so that they can be reopened once the server is back.
  */
 
 static krb5_error_code
@@ -197,9 +199,12 @@ krb5_ldap_cleanup_handles(krb5_ldap_server_info *ldap_server_info)
     while (ldap_server_info->ldap_server_handles != NULL) {
         ldap_server_handle = ldap_server_info->ldap_server_handles;
         ldap_server_info->ldap_server_handles = ldap_server_handle->next;
-        /* ldap_unbind_s(ldap_server_handle); */
+        if (ldap_server_handle->ldap_handle != NULL)
+            ldap_unbind_ext_s(ldap_server_handle->ldap_handle, NULL, NULL);
         free (ldap_server_handle);
         ldap_server_handle = NULL;
+        if (ldap_server_info->num_conns > 0)
+            ldap_server_info->num_conns--;
     }
     return 0;
 }
@@ -605,6 +605,113 @@ cleanup:
     return st;
 }
 
+/*
+ * Send a search of each of the ntrees subtrees over the connection in
+ * *ldap_server_handle without waiting for the replies, storing the message
+ * IDs in msgids.  The server can work on all of the searches at once rather
+ * than one round trip at a time.  If the connection is found to be down,
+ * rebind (possibly to another server) and send all of the searches again.
+ */
+krb5_error_code
+krb5_ldap_send_subtree_searches(krb5_context context,
+                                krb5_ldap_context *ldap_context,
+                                krb5_ldap_server_handle **ldap_server_handle,
+                                char **subtree, unsigned int ntrees,
+                                int scope, char *filter, char **attrs,
+                                int *msgids)
+{
+    krb5_error_code             st=0;
+    krb5_boolean                rebound=FALSE;
+    unsigned int                i=0;
+    LDAP                        *ld=NULL;
+
+    for (i = 0; i < ntrees; i++)
+        msgids[i] = -1;
+
+    ld = (*ldap_server_handle)->ldap_handle;
+    i = 0;
+    while (i < ntrees) {
+        st = ldap_search_ext(ld, subtree[i], scope, filter, attrs, 0, NULL,
+                             NULL, &timelimit, LDAP_NO_LIMIT, &msgids[i]);
+        if (st == LDAP_SUCCESS) {
+            i++;
+            continue;
+        }
+        msgids[i] = -1;
+        if (rebound ||
+            translate_ldap_error(st, OP_SEARCH) != KRB5_KDB_ACCESS_ERROR) {
+            krb5_ldap_abandon_searches(ld, msgids, i);
+            return set_ldap_error(context, st, OP_SEARCH);
+        }
+
+        /* Any searches already sent went away with the connection. */
+        for (i = 0; i < ntrees; i++)
+            msgids[i] = -1;
+        rebound = TRUE;
+        st = krb5_ldap_rebind(ldap_context, ldap_server_handle);
+        if (st != 0 || *ldap_server_handle == NULL) {
+            prepend_err_str(context, "LDAP handle unavailable: ",
+                            KRB5_KDB_ACCESS_ERROR, st);
+            return KRB5_KDB_ACCESS_ERROR;
+        }
+        ld = (*ldap_server_handle)->ldap_handle;
+        i = 0;
+    }
+    return 0;
+}
+
+/*
+ * Wait for the complete reply to the search with message ID msgid and
+ * return it in *result.  An error status in the reply is returned as an
+ * error, as the synchronous LDAP_SEARCH macro does.
+ */
+krb5_error_code
+krb5_ldap_subtree_search_result(krb5_context context, LDAP *ld, int msgid,
+                                LDAPMessage **result)
+{
+    int                         ret=0, st=0;
+    struct timeval              tv=timelimit;
+    LDAPMessage                 *res=NULL;
+
+    *result = NULL;
+    ret = ldap_result(ld, msgid, LDAP_MSG_ALL, &tv, &res);
+    if (ret == 0) {
+        ldap_abandon_ext(ld, msgid, NULL, NULL);
+        return set_ldap_error(context, LDAP_TIMEOUT, OP_SEARCH);
+    }
+    if (ret == -1) {
+        ldap_get_option(ld, LDAP_OPT_RESULT_CODE, &st);
+        return set_ldap_error(context, st, OP_SEARCH);
+    }
+
+    ret = ldap_parse_result(ld, res, &st, NULL, NULL, NULL, NULL, 0);
+    if (ret == LDAP_SUCCESS)
+        ret = st;
+    if (ret != LDAP_SUCCESS) {
+        ldap_msgfree(res);
+        return set_ldap_error(context, ret, OP_SEARCH);
+    }
+    *result = res;
+    return 0;
+}
+
+/*
+ * Abandon any of the first n searches in msgids which are still
+ * outstanding, so that their replies are discarded before the connection
+ * is returned to the pool.
+ */
+void
+krb5_ldap_abandon_searches(LDAP *ld, int *msgids, unsigned int n)
+{
+    unsigned int                i=0;
+
+    for (i = 0; i < n; i++) {
+        if (msgids[i] != -1)
+            ldap_abandon_ext(ld, msgids[i], NULL, NULL);
+        msgids[i] = -1;
+    }
+}
+
 /*
  * This function appends the content with a type into the tl_data
  * structure.  Based on the type the length of the content is either
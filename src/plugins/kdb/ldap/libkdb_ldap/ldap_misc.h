@@ -88,6 +88,17 @@ is_principal_in_realm(krb5_ldap_context *, krb5_const_principal);
 krb5_error_code
 krb5_get_subtree_info(krb5_ldap_context *, char ***, unsigned int *);
 
+krb5_error_code
+krb5_ldap_send_subtree_searches(krb5_context, krb5_ldap_context *,
+                                krb5_ldap_server_handle **, char **,
+                                unsigned int, int, char *, char **, int *);
+
+krb5_error_code
+krb5_ldap_subtree_search_result(krb5_context, LDAP *, int, LDAPMessage **);
+
+void
+krb5_ldap_abandon_searches(LDAP *, int *, unsigned int);
+
 krb5_error_code
 krb5_ldap_read_server_params(krb5_context , char *, int);
 
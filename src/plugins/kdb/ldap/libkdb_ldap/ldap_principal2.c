@@ -79,7 +79,7 @@ krb5_ldap_get_principal(krb5_context context, krb5_const_principal searchfor,
 {
     char                        *user=NULL, *filter=NULL, *filtuser=NULL;
     unsigned int                tree=0, ntrees=1, princlen=0;
-    krb5_error_code             tempst=0, st=0;
+    krb5_error_code             st=0;
     char                        **values=NULL, **subtree=NULL, *cname=NULL;
     LDAP                        *ld=NULL;
     LDAPMessage                 *result=NULL, *ent=NULL;
@@ -87,8 +87,9 @@ krb5_ldap_get_principal(krb5_context context, krb5_const_principal searchfor,
     kdb5_dal_handle             *dal_handle=NULL;
     krb5_ldap_server_handle     *ldap_server_handle=NULL;
     krb5_principal              cprinc=NULL;
-    krb5_boolean                found=FALSE;
+    krb5_boolean                found=FALSE, resent=FALSE;
     krb5_db_entry               *entry = NULL;
+    int                         *msgids=NULL, scope;
 
     *entry_ptr = NULL;
 
@@ -133,9 +134,48 @@ krb5_ldap_get_principal(krb5_context context, krb5_const_principal searchfor,
         goto cleanup;
 
     GET_HANDLE();
+
+    /*
+     * Send the searches of all the subtrees before reading any of the
+     * replies, so that a realm with several subtrees costs one round trip
+     * to the directory rather than one per subtree.
+     */
+    msgids = k5alloc(ntrees * sizeof(*msgids), &st);
+    if (msgids == NULL)
+        goto cleanup;
+    scope = ldap_context->lrparams->search_scope;
+    st = krb5_ldap_send_subtree_searches(context, ldap_context,
+                                         &ldap_server_handle, subtree, ntrees,
+                                         scope, filter, principal_attributes,
+                                         msgids);
+    if (st != 0)
+        goto cleanup;
+    ld = ldap_server_handle->ldap_handle;
+
     for (tree=0; tree < ntrees && !found; ++tree) {
 
-        LDAP_SEARCH(subtree[tree], ldap_context->lrparams->search_scope, filter, principal_attributes);
+        st = krb5_ldap_subtree_search_result(context, ld, msgids[tree],
+                                             &result);
+        msgids[tree] = -1;
+        if (st == KRB5_KDB_ACCESS_ERROR && !resent) {
+            /* The connection was lost; send the remaining searches again. */
+            resent = TRUE;
+            st = krb5_ldap_send_subtree_searches(context, ldap_context,
+                                                 &ldap_server_handle,
+                                                 subtree + tree, ntrees - tree,
+                                                 scope, filter,
+                                                 principal_attributes,
+                                                 msgids + tree);
+            if (st != 0)
+                goto cleanup;
+            ld = ldap_server_handle->ldap_handle;
+            st = krb5_ldap_subtree_search_result(context, ld, msgids[tree],
+                                                 &result);
+            msgids[tree] = -1;
+        }
+        if (st != 0)
+            goto cleanup;
+
         for (ent=ldap_first_entry(ld, result); ent != NULL && !found; ent=ldap_next_entry(ld, ent)) {
 
             /* get the associated directory user information */
@@ -198,6 +238,12 @@ cleanup:
     ldap_msgfree(result);
     krb5_ldap_free_principal(context, entry);
 
+    if (msgids) {
+        /* Discard the replies for subtrees we did not need to look at. */
+        krb5_ldap_abandon_searches(ld, msgids, ntrees);
+        free(msgids);
+    }
+
     if (filter)
         free (filter);
 
@@ -28,6 +28,13 @@ for realm in multipass_realms(create_host=False):
     realm.kinit('user/fast', fastpw, flags=['-T', realm.ccache])
     realm.klist('user/fast@%s' % realm.realm)
 
+    # Check that the preauth exchange reuses the resolved KDC address.
+    realm.env_client['KRB5_TRACE'] = '/dev/stdout'
+    output = realm.run_as_client([kinit, 'user/fast'], input=fastpw + '\n')
+    del realm.env_client['KRB5_TRACE']
+    if 'Using cached addresses' not in output:
+        fail('KDC address not reused within a context')
+
     # Test kinit against kdb keytab
     realm.run_as_master([kinit, "-k", "-t",
                          "KDB:", realm.user_princ])
@@ -43,11 +50,59 @@ for realm in multipass_realms(create_host=False):
     princ = 'foo/bar@%s' % realm.realm
     realm.addprinc(princ)
     realm.run_kadminl('modprinc -kvno 252 %s' % princ)
-    for kvno in range(253, 259):
+    for i in range(253, 259):
         realm.run_kadminl('ktadd -k %s %s' % (realm.keytab, princ))
         realm.klist_keytab(princ)
     output = realm.run_kadminl('getprinc %s' % princ)
     if 'Key: vno 258,' not in output:
         fail('Expected vno not seen in kadmin.local output')
 
-success('Dump/load, FAST kinit, kdestroy, kvno wrapping')
+# Make a realm with the client configuration conf and a principal which
+# requires preauth, and return it with the trace output of a kinit as that
+# principal.  The kinit makes two KDC exchanges in one context.
+def preauth_kinit(conf):
+    realm = K5Realm(krb5_conf=conf, create_host=False, get_creds=False,
+                    start_kadmind=False)
+    realm.run_kadminl('ank -pw pw +requires_preauth user/preauth')
+    realm.env_client['KRB5_TRACE'] = '/dev/stdout'
+    output = realm.run_as_client([kinit, 'user/preauth'], input='pw\n')
+    return realm, output
+
+# List a KDC address with nothing listening before the real KDC.  The first
+# exchange should find that the dead KDC doesn't answer, and the second
+# should try the real KDC first.
+conf = {'client': {'realms': {'$realm': {
+                'kdc': ['127.0.0.1:$port9', '$hostname:$port0']}}}}
+realm, output = preauth_kinit(conf)
+dead = '127.0.0.1:%d' % (realm.portbase + 9)
+if 'No answer from dgram %s' % dead not in output:
+    fail('Dead KDC not noticed')
+if 'Reordering KDCs by recent responsiveness' not in output:
+    fail('KDCs not reordered')
+if output.count('Sending initial UDP request to dgram %s' % dead) != 1:
+    fail('Dead KDC contacted more than once')
+realm.stop()
+
+# Send all KDC requests over TCP, and keep the connections for reuse.  The
+# second exchange should use the connection made for the first.
+conf = {'client': {'libdefaults': {'udp_preference_limit': '1',
+                                   'kdc_tcp_reuse': 'true'}}}
+realm, output = preauth_kinit(conf)
+if output.count('Initiating TCP connection') != 1:
+    fail('Expected one TCP connection')
+if 'Reusing TCP connection' not in output:
+    fail('TCP connection not reused')
+
+# Several TGS requests in one context also share the connection.
+realm.addprinc('a')
+realm.addprinc('b')
+realm.addprinc('c')
+output = realm.run_as_client([kvno, 'a', 'b', 'c'])
+if output.count('Initiating TCP connection') != 1:
+    fail('Expected one TCP connection for kvno')
+if output.count('Reusing TCP connection') != 2:
+    fail('TCP connection not reused for kvno')
+realm.stop()
+
+success('Dump/load, FAST kinit, kdestroy, kvno wrapping, KDC preference, '
+        'KDC TCP connection reuse')
@@ -0,0 +1,143 @@
+#!/usr/bin/python
+from k5test import *
+import binascii
+import shutil
+import signal
+import time
+
+# Test the LDAP KDB module against a private slapd, with principals kept in
+# two subtrees, so that principal lookups send a search of each subtree
+# before reading the replies.  Skip the test if the module was not built or
+# OpenLDAP is not installed.
+system_slapd = '/usr/sbin/slapd'
+system_ldapadd = '/usr/bin/ldapadd'
+schema_dir = '/etc/ldap/schema'
+slapd_modules = '/usr/lib/ldap'
+kdb5_ldap_util = os.path.join(buildtop, 'plugins', 'kdb', 'ldap', 'ldap_util',
+                              'kdb5_ldap_util')
+if not os.path.exists(os.path.join(plugins, 'kdb', 'kldap.so')):
+    success('Warning: not testing LDAP back end because it has not been '
+            'built')
+    sys.exit(0)
+for path in (system_slapd, system_ldapadd, schema_dir):
+    if not os.path.exists(path):
+        success('Warning: not testing LDAP back end because %s is missing' %
+                path)
+        sys.exit(0)
+
+ldapdir = os.path.abspath('ldap')
+dbdir = os.path.join(ldapdir, 'db')
+slapd_conf = os.path.join(ldapdir, 'slapd.conf')
+slapd_pidfile = os.path.join(ldapdir, 'pid')
+ldap_pwfile = os.path.join(ldapdir, 'pw')
+ldap_sock = os.path.join(ldapdir, 'sock')
+ldap_uri = 'ldapi://%s/' % ldap_sock.replace(os.path.sep, '%2F')
+schema = os.path.join(srctop, 'plugins', 'kdb', 'ldap', 'libkdb_ldap',
+                      'kerberos.schema')
+top_dn = 'cn=krb5'
+admin_dn = 'cn=admin,cn=krb5'
+admin_pw = 'admin'
+subtree_a = 'ou=a,cn=krb5'
+subtree_b = 'ou=b,cn=krb5'
+
+shutil.rmtree(ldapdir, True)
+os.mkdir(ldapdir)
+os.mkdir(dbdir)
+
+f = open(slapd_conf, 'w')
+f.write('pidfile %s\n' % slapd_pidfile)
+f.write('include %s/core.schema\n' % schema_dir)
+f.write('include %s\n' % schema)
+if os.path.exists(os.path.join(slapd_modules, 'back_mdb.la')):
+    f.write('modulepath %s\n' % slapd_modules)
+    f.write('moduleload back_mdb\n')
+f.write('database mdb\n')
+f.write('suffix %s\n' % top_dn)
+f.write('rootdn %s\n' % admin_dn)
+f.write('rootpw %s\n' % admin_pw)
+f.write('directory %s\n' % dbdir)
+f.close()
+
+# Start slapd, which detaches itself, and wait for it to write its PID.
+def start_slapd():
+    if subprocess.call([system_slapd, '-f', slapd_conf, '-h', ldap_uri]) != 0:
+        fail('slapd failed to start')
+    for i in range(50):
+        if os.path.exists(slapd_pidfile):
+            f = open(slapd_pidfile)
+            pid = f.read().strip()
+            f.close()
+            if pid:
+                return int(pid)
+        time.sleep(0.1)
+    fail('slapd did not write its PID file')
+
+def stop_slapd():
+    global slapd_pid
+    if slapd_pid is None:
+        return
+    os.kill(slapd_pid, signal.SIGTERM)
+    for i in range(50):
+        if not os.path.exists(slapd_pidfile):
+            break
+        time.sleep(0.1)
+    slapd_pid = None
+
+slapd_pid = start_slapd()
+atexit.register(stop_slapd)
+
+# Create the top entry and the two subtrees.
+ldif = ('dn: %s\nobjectClass: krbContainer\ncn: krb5\n\n'
+        'dn: %s\nobjectClass: organizationalUnit\nou: a\n\n'
+        'dn: %s\nobjectClass: organizationalUnit\nou: b\n' %
+        (top_dn, subtree_a, subtree_b))
+proc = subprocess.Popen([system_ldapadd, '-x', '-D', admin_dn, '-w', admin_pw,
+                         '-H', ldap_uri], stdin=subprocess.PIPE,
+                        stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+(out, dummy) = proc.communicate(ldif)
+output(out)
+if proc.returncode != 0:
+    fail('ldapadd failed')
+
+# Give the KDC and kadmin the bind password.
+f = open(ldap_pwfile, 'w')
+f.write('%s#{HEX}%s\n' % (admin_dn, binascii.hexlify(admin_pw)))
+f.close()
+
+ldap_modules = {'ldap': {'db_library': 'kldap',
+                         'ldap_kerberos_container_dn': top_dn,
+                         'ldap_kdc_dn': admin_dn,
+                         'ldap_kadmind_dn': admin_dn,
+                         'ldap_service_password_file': ldap_pwfile,
+                         'ldap_servers': ldap_uri}}
+conf = {'all': {'realms': {'$realm': {'database_module': 'ldap'}},
+                'dbmodules': ldap_modules}}
+realm = K5Realm(create_kdb=False, kdc_conf=conf)
+realm.run_as_master([kdb5_ldap_util, '-D', admin_dn, '-w', admin_pw,
+                     '-H', ldap_uri, 'create', '-subtrees',
+                     '%s:%s' % (subtree_a, subtree_b), '-s', '-P', 'master',
+                     '-r', realm.realm])
+realm.run_kadminl('addprinc -pw pwa -x containerdn=%s usera' % subtree_a)
+realm.run_kadminl('addprinc -pw pwb -x containerdn=%s userb' % subtree_b)
+realm.start_kdc()
+
+# A principal in the first subtree is found without waiting for the search
+# of the second subtree, which is abandoned; a principal in the second
+# subtree is found after the first search comes back empty.
+realm.kinit('usera', 'pwa')
+realm.klist('usera@%s' % realm.realm)
+realm.kinit('userb', 'pwb')
+realm.klist('userb@%s' % realm.realm)
+out = realm.run_as_client([kinit, 'nobody'], input='pw\n', expected_code=1)
+if 'not found in Kerberos database' not in out:
+    fail('Expected error message not seen for nonexistent principal')
+
+# Restart slapd under the running KDC.  The KDC's connection is lost, and
+# lookups must succeed after it reconnects.
+stop_slapd()
+slapd_pid = start_slapd()
+realm.kinit('userb', 'pwb')
+realm.kinit('usera', 'pwa')
+realm.klist('usera@%s' % realm.realm)
+
+success('LDAP KDB module with several subtrees')
@@ -23,30 +23,85 @@
 #!/usr/bin/python
 from k5test import *
 
+def test_lockout(realm):
+    realm.run_kadminl('addpol -maxfailure 2 -failurecountinterval 5m lockout')
+    realm.run_kadminl('modprinc +requires_preauth -policy lockout user')
+
+    # kinit twice with the wrong password.
+    output = realm.run_as_client([kinit, realm.user_princ], input='wrong\n',
+                                 expected_code=1)
+    if 'Password incorrect while getting initial credentials' not in output:
+        fail('Expected error message not seen in kinit output')
+    output = realm.run_as_client([kinit, realm.user_princ], input='wrong\n',
+                                 expected_code=1)
+    if 'Password incorrect while getting initial credentials' not in output:
+        fail('Expected error message not seen in kinit output')
+
+    # Now the account should be locked out.
+    output = realm.run_as_client([kinit, realm.user_princ], expected_code=1)
+    if 'Clients credentials have been revoked while getting initial ' \
+            'credentials' not in output:
+        fail('Expected lockout error message not seen in kinit output')
+
+    # Check that modprinc -unlock allows a further attempt.
+    output = realm.run_kadminl('modprinc -unlock user')
+    realm.kinit(realm.user_princ, password('user'))
+
 realm = K5Realm(create_host=False, start_kadmind=False)
+test_lockout(realm)
+realm.stop()
 
-realm.run_kadminl('addpol -maxfailure 2 -failurecountinterval 5m lockout')
-realm.run_kadminl('modprinc +requires_preauth -policy lockout user')
-
-# kinit twice with the wrong password.
-output = realm.run_as_client([kinit, realm.user_princ], input='wrong\n',
-                             expected_code=1)
-if 'Password incorrect while getting initial credentials' not in output:
-    fail('Expected error message not seen in kinit output')
-output = realm.run_as_client([kinit, realm.user_princ], input='wrong\n',
-                             expected_code=1)
-if 'Password incorrect while getting initial credentials' not in output:
-    fail('Expected error message not seen in kinit output')
-
-# Now the account should be locked out.
-output = realm.run_as_client([kinit, realm.user_princ], expected_code=1)
-if 'Clients credentials have been revoked while getting initial credentials' \
-        not in output:
-    fail('Expected lockout error message not seen in kinit output')
-
-# Check that modprinc -unlock allows a further attempt.
-output = realm.run_kadminl('modprinc -unlock user')
-realm.kinit(realm.user_princ, password('user'))
+# Repeat with the lockout fields kept in a table shared by the KDC
+# processes, and check that the table is flushed to the database when
+# the KDC exits.
+conf = {'all': {'dbmodules': {'foo_db2': {'lockout_table_entries': '100',
+                                          'lockout_flush_interval': '3600'}}}}
+realm = K5Realm(create_host=False, start_kadmind=False, kdc_conf=conf)
+test_lockout(realm)
+realm.run_as_client([kinit, realm.user_princ], input='wrong\n',
+                    expected_code=1)
+output = realm.run_kadminl('getprinc user')
+if 'Failed password attempts: 0' not in output:
+    fail('Lockout table flushed to database too early')
+realm.stop_kdc()
+output = realm.run_kadminl('getprinc user')
+if 'Failed password attempts: 1' not in output:
+    fail('Lockout table not flushed to database')
 
-success('Account lockout')
+# Check that an unlock is not undone by flushing the table entry which
+# was current before it.
+realm.start_kdc()
+realm.run_as_client([kinit, realm.user_princ], input='wrong\n',
+                    expected_code=1)
+realm.run_kadminl('modprinc -unlock user')
+realm.stop_kdc()
+output = realm.run_kadminl('getprinc user')
+if 'Failed password attempts: 0' not in output:
+    fail('Lockout table flush overwrote administrative unlock')
+
+# Shrink the table while the KDC is running.  The entry should be
+# carried over, and should survive an unrelated administrative change.
+# Use a principal which has not been unlocked, since failures in the
+# same second as an unlock do not count.
+realm.run_kadminl('addprinc -pw pw +requires_preauth -policy lockout user2')
+realm.start_kdc()
+realm.run_as_client([kinit, 'user2'], input='wrong\n', expected_code=1)
+conffile = os.path.join(realm.testdir, 'kdc.master.conf')
+f = open(conffile)
+conftext = f.read()
+f.close()
+f = open(conffile, 'w')
+f.write(conftext.replace('lockout_table_entries = 100',
+                         'lockout_table_entries = 50'))
+f.close()
+realm.run_kadminl('modprinc -maxlife "2 days" user2')
+if os.path.getsize(os.path.join(realm.testdir, 'master-db.lockout')) >= \
+        100 * 256:
+    fail('Lockout table not resized')
+realm.run_as_client([kinit, 'user2'], input='wrong\n', expected_code=1)
+realm.stop_kdc()
+output = realm.run_kadminl('getprinc user2')
+if 'Failed password attempts: 2' not in output:
+    fail('Lockout table entry lost when table was resized')
 
+success('Account lockout')
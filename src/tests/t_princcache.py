@@ -0,0 +1,57 @@
+#!/usr/bin/python
+from k5test import *
+import re
+
+conf = {'all': {'kdcdefaults': {'kdc_principal_cache_entries': '100',
+                                'kdc_principal_cache_lifetime': '1h'}}}
+realm = K5Realm(create_host=False, start_kadmind=False, kdc_conf=conf)
+
+# Populate the cache and make sure lookups are still answered from it.
+realm.kinit(realm.user_princ, password('user'))
+realm.run_as_client([kvno, realm.krbtgt_princ])
+realm.kinit(realm.user_princ, password('user'))
+
+# A password change by another process must be noticed despite the
+# long cache lifetime.  The KDC checks the database generation on
+# every lookup, so the very next request must see the new key.
+realm.run_kadminl('cpw -pw newpw user')
+realm.kinit(realm.user_princ, 'newpw')
+output = realm.run_as_client([kinit, realm.user_princ], input='user\n',
+                             expected_code=1)
+if 'Password incorrect' not in output:
+    fail('Old password accepted after password change')
+
+# Lockout counts updated by the KDC itself must not be hidden by the
+# cache.
+realm.run_kadminl('addpol -maxfailure 2 -failurecountinterval 5m lockout')
+realm.run_kadminl('modprinc +requires_preauth -policy lockout user')
+for i in range(2):
+    realm.run_as_client([kinit, realm.user_princ], input='wrong\n',
+                        expected_code=1)
+output = realm.run_as_client([kinit, realm.user_princ], expected_code=1)
+if 'Clients credentials have been revoked' not in output:
+    fail('Expected lockout error message not seen in kinit output')
+
+realm.stop_kdc()
+f = open(os.path.join(realm.testdir, 'kdc.log'))
+log = f.read()
+f.close()
+if 'principal cache for realm' not in log:
+    fail('Principal cache statistics not logged')
+
+# Each request thread has its own copy of the realm and its own cache;
+# their statistics must be reported too.
+realm.run_kadminl('modprinc -unlock -requires_preauth user')
+os.remove(os.path.join(realm.testdir, 'kdc.log'))
+realm.start_kdc(['-t', '2'])
+for i in range(4):
+    realm.kinit(realm.user_princ, 'newpw')
+realm.stop_kdc()
+f = open(os.path.join(realm.testdir, 'kdc.log'))
+log = f.read()
+f.close()
+m = re.search(r'principal cache for realm [^:]*: (\d+) hits', log)
+if not m or int(m.group(1)) == 0:
+    fail('Principal cache hits in request threads not logged')
+
+success('KDC principal cache')